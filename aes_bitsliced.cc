@@ -0,0 +1,513 @@
+#include "aes_bitsliced.h"
+#include "secure_memory.h"
+
+#include <string.h>
+#include <algorithm>
+#include <cstdint>
+
+#define ETTE_ALWAYS_INLINE inline __attribute__((always_inline))
+/* The loops over the planes must be unrolled, or the state is kept in
+ * memory between the operations. */
+#define ETTE_UNROLL _Pragma("GCC unroll 8")
+
+#if defined(__clang__)
+#define ETTE_SHUFFLE_LANES(v, a, b, c, d) \
+    __builtin_shufflevector(v, v, a, b, c, d)
+#else
+#define ETTE_SHUFFLE_LANES(v, a, b, c, d) \
+    __builtin_shuffle(v, U32x4{a, b, c, d})
+#endif
+
+namespace ette {
+namespace {
+
+/* The state of 8 blocks is 8 bit planes, plane b holding bit b of every byte.
+ * A plane is 4 lanes, one per AES column; byte r of a lane is row r of the
+ * column and its bit k belongs to block k. So SubBytes is boolean logic
+ * across the planes, ShiftRows moves lanes and MixColumns rotates bytes
+ * within lanes, all without looking at the data. */
+typedef uint32_t U32x4 __attribute__((vector_size(16)));
+
+/* ================================= S-box ================================= */
+
+/* The S-box circuit of Boyar and Peralta, "A new combinational logic
+ * minimization technique with applications to cryptology"
+ * (https://eprint.iacr.org/2009/191.pdf), written once for vectors of planes
+ * and for plain words. q[b] is bit b of the input byte,
+ * x0/s0 the high bit. */
+template <typename V>
+ETTE_ALWAYS_INLINE void Sbox(V* q) {
+    const V x0 = q[7], x1 = q[6], x2 = q[5], x3 = q[4];
+    const V x4 = q[3], x5 = q[2], x6 = q[1], x7 = q[0];
+
+    // Top linear transformation.
+    const V y14 = x3 ^ x5;
+    const V y13 = x0 ^ x6;
+    const V y9 = x0 ^ x3;
+    const V y8 = x0 ^ x5;
+    const V t0 = x1 ^ x2;
+    const V y1 = t0 ^ x7;
+    const V y4 = y1 ^ x3;
+    const V y12 = y13 ^ y14;
+    const V y2 = y1 ^ x0;
+    const V y5 = y1 ^ x6;
+    const V y3 = y5 ^ y8;
+    const V t1 = x4 ^ y12;
+    const V y15 = t1 ^ x5;
+    const V y20 = t1 ^ x1;
+    const V y6 = y15 ^ x7;
+    const V y10 = y15 ^ t0;
+    const V y11 = y20 ^ y9;
+    const V y7 = x7 ^ y11;
+    const V y17 = y10 ^ y11;
+    const V y19 = y10 ^ y8;
+    const V y16 = t0 ^ y11;
+    const V y21 = y13 ^ y16;
+    const V y18 = x0 ^ y16;
+
+    // Non-linear section: inversion in GF(2^8).
+    const V t2 = y12 & y15;
+    const V t3 = y3 & y6;
+    const V t4 = t3 ^ t2;
+    const V t5 = y4 & x7;
+    const V t6 = t5 ^ t2;
+    const V t7 = y13 & y16;
+    const V t8 = y5 & y1;
+    const V t9 = t8 ^ t7;
+    const V t10 = y2 & y7;
+    const V t11 = t10 ^ t7;
+    const V t12 = y9 & y11;
+    const V t13 = y14 & y17;
+    const V t14 = t13 ^ t12;
+    const V t15 = y8 & y10;
+    const V t16 = t15 ^ t12;
+    const V t17 = t4 ^ t14;
+    const V t18 = t6 ^ t16;
+    const V t19 = t9 ^ t14;
+    const V t20 = t11 ^ t16;
+    const V t21 = t17 ^ y20;
+    const V t22 = t18 ^ y19;
+    const V t23 = t19 ^ y21;
+    const V t24 = t20 ^ y18;
+
+    const V t25 = t21 ^ t22;
+    const V t26 = t21 & t23;
+    const V t27 = t24 ^ t26;
+    const V t28 = t25 & t27;
+    const V t29 = t28 ^ t22;
+    const V t30 = t23 ^ t24;
+    const V t31 = t22 ^ t26;
+    const V t32 = t31 & t30;
+    const V t33 = t32 ^ t24;
+    const V t34 = t23 ^ t33;
+    const V t35 = t27 ^ t33;
+    const V t36 = t24 & t35;
+    const V t37 = t36 ^ t34;
+    const V t38 = t27 ^ t36;
+    const V t39 = t29 & t38;
+    const V t40 = t25 ^ t39;
+
+    const V t41 = t40 ^ t37;
+    const V t42 = t29 ^ t33;
+    const V t43 = t29 ^ t40;
+    const V t44 = t33 ^ t37;
+    const V t45 = t42 ^ t41;
+    const V z0 = t44 & y15;
+    const V z1 = t37 & y6;
+    const V z2 = t33 & x7;
+    const V z3 = t43 & y16;
+    const V z4 = t40 & y1;
+    const V z5 = t29 & y7;
+    const V z6 = t42 & y11;
+    const V z7 = t45 & y17;
+    const V z8 = t41 & y10;
+    const V z9 = t44 & y12;
+    const V z10 = t37 & y3;
+    const V z11 = t33 & y4;
+    const V z12 = t43 & y13;
+    const V z13 = t40 & y5;
+    const V z14 = t29 & y2;
+    const V z15 = t42 & y9;
+    const V z16 = t45 & y14;
+    const V z17 = t41 & y8;
+
+    // Bottom linear transformation, including the affine constant.
+    const V t46 = z15 ^ z16;
+    const V t47 = z10 ^ z11;
+    const V t48 = z5 ^ z13;
+    const V t49 = z9 ^ z10;
+    const V t50 = z2 ^ z12;
+    const V t51 = z2 ^ z5;
+    const V t52 = z7 ^ z8;
+    const V t53 = z0 ^ z3;
+    const V t54 = z6 ^ z7;
+    const V t55 = z16 ^ z17;
+    const V t56 = z12 ^ t48;
+    const V t57 = t50 ^ t53;
+    const V t58 = z4 ^ t46;
+    const V t59 = z3 ^ t54;
+    const V t60 = t46 ^ t57;
+    const V t61 = z14 ^ t57;
+    const V t62 = t52 ^ t58;
+    const V t63 = t49 ^ t58;
+    const V t64 = z4 ^ t59;
+    const V t65 = t61 ^ t62;
+    const V t66 = z1 ^ t63;
+    const V s0 = t59 ^ t63;
+    const V s6 = t56 ^ ~t62;
+    const V s7 = t48 ^ ~t60;
+    const V t67 = t64 ^ t65;
+    const V s3 = t53 ^ t66;
+    const V s4 = t51 ^ t66;
+    const V s5 = t47 ^ t65;
+    const V s1 = t64 ^ ~s3;
+    const V s2 = t55 ^ ~t67;
+
+    q[7] = s0;
+    q[6] = s1;
+    q[5] = s2;
+    q[4] = s3;
+    q[3] = s4;
+    q[2] = s5;
+    q[1] = s6;
+    q[0] = s7;
+}
+
+/* x -> A^-1(x ^ 0x63), the inverse of the S-box's affine step. */
+template <typename V>
+ETTE_ALWAYS_INLINE void InverseAffine(V* q) {
+    const V q0 = ~q[0], q1 = ~q[1], q2 = q[2], q3 = q[3];
+    const V q4 = q[4], q5 = ~q[5], q6 = ~q[6], q7 = q[7];
+    q[7] = q1 ^ q4 ^ q6;
+    q[6] = q0 ^ q3 ^ q5;
+    q[5] = q7 ^ q2 ^ q4;
+    q[4] = q6 ^ q1 ^ q3;
+    q[3] = q5 ^ q0 ^ q2;
+    q[2] = q4 ^ q7 ^ q1;
+    q[1] = q3 ^ q6 ^ q0;
+    q[0] = q2 ^ q5 ^ q7;
+}
+
+/* The S-box is S(x) = A(inv(x)) ^ 0x63, so inv(y) is InverseAffine(S(y)) and
+ * the inverse S-box inv(InverseAffine(x)) reuses the same circuit. */
+template <typename V>
+ETTE_ALWAYS_INLINE void InverseSbox(V* q) {
+    InverseAffine(q);
+    Sbox(q);
+    InverseAffine(q);
+}
+
+/* ============================ Transposition ============================== */
+
+ETTE_ALWAYS_INLINE uint32_t LoadLe32(const unsigned char* p) {
+    return static_cast<uint32_t>(p[0]) | static_cast<uint32_t>(p[1]) << 8 |
+           static_cast<uint32_t>(p[2]) << 16 |
+           static_cast<uint32_t>(p[3]) << 24;
+}
+
+ETTE_ALWAYS_INLINE void StoreLe32(unsigned char* p, uint32_t v) {
+    p[0] = v & 0xFF;
+    p[1] = (v >> 8) & 0xFF;
+    p[2] = (v >> 16) & 0xFF;
+    p[3] = (v >> 24) & 0xFF;
+}
+
+/* Exchanges the bits of 'high' selected by 'mask' with the bits 'kShift'
+ * above them in 'low'. */
+template <int kShift>
+ETTE_ALWAYS_INLINE void SwapMove(U32x4& high, U32x4& low, uint32_t mask) {
+    const U32x4 t = ((low >> kShift) ^ high) & mask;
+    high ^= t;
+    low ^= t << kShift;
+}
+
+/* Transposes the 8x8 bit matrix at every byte position of q[0..7]: bit b of
+ * q[k] becomes bit k of q[b]. Its own inverse. */
+ETTE_ALWAYS_INLINE void Transpose(U32x4* q) {
+    ETTE_UNROLL
+    for (int k = 0; k < 8; k += 2)
+        SwapMove<1>(q[k + 1], q[k], 0x55555555);
+    ETTE_UNROLL
+    for (int k = 0; k < 8; k += 4) {
+        SwapMove<2>(q[k + 2], q[k], 0x33333333);
+        SwapMove<2>(q[k + 3], q[k + 1], 0x33333333);
+    }
+    ETTE_UNROLL
+    for (int k = 0; k < 4; k++)
+        SwapMove<4>(q[k + 4], q[k], 0x0F0F0F0F);
+}
+
+/* Spreads 'count' blocks over the 8 planes; missing blocks are zero. */
+ETTE_ALWAYS_INLINE void Pack(const unsigned char* in, size_t count,
+                             U32x4* q) {
+    for (size_t k = 0; k < 8; k++) {
+        const unsigned char* block = in + 16 * k;
+        q[k] = k < count ? U32x4{LoadLe32(block), LoadLe32(block + 4),
+                                 LoadLe32(block + 8), LoadLe32(block + 12)}
+                         : U32x4{0, 0, 0, 0};
+    }
+    Transpose(q);
+}
+
+ETTE_ALWAYS_INLINE void Unpack(U32x4* q, size_t count, unsigned char* out) {
+    Transpose(q);
+    for (size_t k = 0; k < count; k++) {
+        for (int c = 0; c < 4; c++)
+            StoreLe32(out + 16 * k + 4 * c, q[k][c]);
+    }
+}
+
+/* ================================ Rounds ================================= */
+
+ETTE_ALWAYS_INLINE void AddRoundKey(U32x4* q, const uint32_t key[8][4]) {
+    ETTE_UNROLL
+    for (int b = 0; b < 8; b++) {
+        U32x4 k;
+        memcpy(&k, key[b], sizeof(k));
+        q[b] ^= k;
+    }
+}
+
+ETTE_ALWAYS_INLINE U32x4 RowMask(int row) {
+    const uint32_t mask = 0xFFu << (8 * row);
+    return U32x4{mask, mask, mask, mask};
+}
+
+/* Row r of column c takes row r of column c + r. */
+ETTE_ALWAYS_INLINE void ShiftRows(U32x4* q) {
+    ETTE_UNROLL
+    for (int b = 0; b < 8; b++) {
+        const U32x4 v = q[b];
+        q[b] = (v & RowMask(0)) |
+               (ETTE_SHUFFLE_LANES(v, 1, 2, 3, 0) & RowMask(1)) |
+               (ETTE_SHUFFLE_LANES(v, 2, 3, 0, 1) & RowMask(2)) |
+               (ETTE_SHUFFLE_LANES(v, 3, 0, 1, 2) & RowMask(3));
+    }
+}
+
+ETTE_ALWAYS_INLINE void InverseShiftRows(U32x4* q) {
+    ETTE_UNROLL
+    for (int b = 0; b < 8; b++) {
+        const U32x4 v = q[b];
+        q[b] = (v & RowMask(0)) |
+               (ETTE_SHUFFLE_LANES(v, 3, 0, 1, 2) & RowMask(1)) |
+               (ETTE_SHUFFLE_LANES(v, 2, 3, 0, 1) & RowMask(2)) |
+               (ETTE_SHUFFLE_LANES(v, 1, 2, 3, 0) & RowMask(3));
+    }
+}
+
+/* Moves row r + 1 (rotated by 8) or r + 2 (by 16) of every column into row
+ * r. */
+template <int kBits>
+ETTE_ALWAYS_INLINE U32x4 RotateRows(U32x4 v) {
+    return (v >> kBits) | (v << (32 - kBits));
+}
+
+/* Multiplication by 2 in GF(2^8) modulo x^8 + x^4 + x^3 + x + 1. */
+ETTE_ALWAYS_INLINE void Double(const U32x4* a, U32x4* out) {
+    out[0] = a[7];
+    out[1] = a[0] ^ a[7];
+    out[2] = a[1];
+    out[3] = a[2] ^ a[7];
+    out[4] = a[3] ^ a[7];
+    out[5] = a[4];
+    out[6] = a[5];
+    out[7] = a[6];
+}
+
+/* Row r becomes 2 a[r] ^ 3 a[r+1] ^ a[r+2] ^ a[r+3]
+ *            = 2 (a[r] ^ a[r+1]) ^ a[r+1] ^ (a[r+2] ^ a[r+3]). */
+ETTE_ALWAYS_INLINE void MixColumns(U32x4* q) {
+    U32x4 next[8], sum[8], doubled[8];
+    ETTE_UNROLL
+    for (int b = 0; b < 8; b++) {
+        next[b] = RotateRows<8>(q[b]);
+        sum[b] = q[b] ^ next[b];
+    }
+    Double(sum, doubled);
+    ETTE_UNROLL
+    for (int b = 0; b < 8; b++)
+        q[b] = doubled[b] ^ next[b] ^ RotateRows<16>(sum[b]);
+}
+
+/* The inverse matrix factors into MixColumns after adding
+ * 4 (a[r] ^ a[r+2]) to every row. */
+ETTE_ALWAYS_INLINE void InverseMixColumns(U32x4* q) {
+    U32x4 sum[8], doubled[8], quadrupled[8];
+    ETTE_UNROLL
+    for (int b = 0; b < 8; b++)
+        sum[b] = q[b] ^ RotateRows<16>(q[b]);
+    Double(sum, doubled);
+    Double(doubled, quadrupled);
+    ETTE_UNROLL
+    for (int b = 0; b < 8; b++)
+        q[b] ^= quadrupled[b];
+    MixColumns(q);
+}
+
+/* ============================= Key schedule ============================== */
+
+/* SubWord() through the same circuit, one byte per bit of a word, so the key
+ * never indexes a table either. */
+uint32_t SubWord(uint32_t word) {
+    uint32_t q[8] = {};
+    for (int b = 0; b < 8; b++) {
+        for (int j = 0; j < 4; j++)
+            q[b] |= ((word >> (8 * j + b)) & 1) << j;
+    }
+    Sbox(q);
+    uint32_t result = 0;
+    for (int b = 0; b < 8; b++) {
+        for (int j = 0; j < 4; j++)
+            result |= ((q[b] >> j) & 1) << (8 * j + b);
+    }
+    return result;
+}
+
+/* Adds one to the big-endian 128-bit counter. */
+void IncrementCounter(unsigned char* counter) {
+    for (int i = kAesBlockSize - 1; i >= 0; i--) {
+        if (++counter[i] != 0)
+            break;
+    }
+}
+
+}  // namespace
+
+/* Words hold their bytes little-endian: byte 0 of the key is the low byte of
+ * w[0]. */
+Aes256::Aes256(const unsigned char* key) {
+    constexpr int kWords = 4 * (kRounds + 1);
+    uint32_t w[kWords];
+    for (int i = 0; i < 8; i++) {
+        w[i] = static_cast<uint32_t>(key[4 * i]) |
+               static_cast<uint32_t>(key[4 * i + 1]) << 8 |
+               static_cast<uint32_t>(key[4 * i + 2]) << 16 |
+               static_cast<uint32_t>(key[4 * i + 3]) << 24;
+    }
+    uint32_t rcon = 1;
+    for (int i = 8; i < kWords; i++) {
+        uint32_t temp = w[i - 1];
+        if (i % 8 == 0) {
+            temp = SubWord((temp >> 8) | (temp << 24)) ^ rcon;
+            rcon <<= 1;
+        } else if (i % 8 == 4) {
+            temp = SubWord(temp);
+        }
+        w[i] = w[i - 8] ^ temp;
+    }
+
+    // Bit b of every key byte becomes a whole byte of plane b, one for each
+    // of the 8 blocks.
+    for (int round = 0; round <= kRounds; round++) {
+        for (int b = 0; b < 8; b++) {
+            for (int c = 0; c < 4; c++) {
+                const uint32_t word = w[4 * round + c];
+                uint32_t lane = 0;
+                for (int r = 0; r < 4; r++) {
+                    const uint32_t bit = (word >> (8 * r + b)) & 1;
+                    lane |= ((0u - bit) & 0xFF) << (8 * r);
+                }
+                round_keys_[round][b][c] = lane;
+            }
+        }
+    }
+    WipeMemory(w, sizeof(w));
+}
+
+Aes256::~Aes256() { WipeMemory(round_keys_, sizeof(round_keys_)); }
+
+void Aes256::EncryptBlocks(const unsigned char* in, unsigned char* out,
+                           size_t count) const {
+    U32x4 q[8];
+    Pack(in, count, q);
+    AddRoundKey(q, round_keys_[0]);
+    for (int round = 1; round < kRounds; round++) {
+        Sbox(q);
+        ShiftRows(q);
+        MixColumns(q);
+        AddRoundKey(q, round_keys_[round]);
+    }
+    Sbox(q);
+    ShiftRows(q);
+    AddRoundKey(q, round_keys_[kRounds]);
+    Unpack(q, count, out);
+}
+
+void Aes256::DecryptBlocks(const unsigned char* in, unsigned char* out,
+                           size_t count) const {
+    U32x4 q[8];
+    Pack(in, count, q);
+    AddRoundKey(q, round_keys_[kRounds]);
+    for (int round = kRounds - 1; round > 0; round--) {
+        InverseShiftRows(q);
+        InverseSbox(q);
+        AddRoundKey(q, round_keys_[round]);
+        InverseMixColumns(q);
+    }
+    InverseShiftRows(q);
+    InverseSbox(q);
+    AddRoundKey(q, round_keys_[0]);
+    Unpack(q, count, out);
+}
+
+/* ================================= Modes ================================= */
+
+void Aes256CbcEncrypt(const Aes256& aes, const unsigned char* iv,
+                      const unsigned char* in, unsigned char* out,
+                      size_t size) {
+    unsigned char block[kAesBlockSize];
+    const unsigned char* previous = iv;
+    for (size_t offset = 0; offset < size; offset += kAesBlockSize) {
+        for (size_t i = 0; i < kAesBlockSize; i++)
+            block[i] = in[offset + i] ^ previous[i];
+        aes.EncryptBlocks(block, out + offset, 1);
+        previous = out + offset;
+    }
+    WipeMemory(block, sizeof(block));
+}
+
+/* Every plaintext block only needs its own ciphertext block and the one
+ * before it, so decryption runs kAesParallelBlocks at a time. */
+void Aes256CbcDecrypt(const Aes256& aes, const unsigned char* iv,
+                      const unsigned char* in, unsigned char* out,
+                      size_t size) {
+    constexpr size_t kGroupSize = kAesParallelBlocks * kAesBlockSize;
+    unsigned char previous[kAesBlockSize];
+    unsigned char ciphertext[kGroupSize];
+    memcpy(previous, iv, sizeof(previous));
+    for (size_t offset = 0; offset < size; offset += kGroupSize) {
+        const size_t group = std::min(kGroupSize, size - offset);
+        const size_t count = group / kAesBlockSize;
+        // Keep the ciphertext for chaining, 'out' may overwrite it.
+        memcpy(ciphertext, in + offset, group);
+        aes.DecryptBlocks(ciphertext, out + offset, count);
+        for (size_t i = 0; i < kAesBlockSize; i++)
+            out[offset + i] ^= previous[i];
+        for (size_t i = kAesBlockSize; i < group; i++)
+            out[offset + i] ^= ciphertext[i - kAesBlockSize];
+        memcpy(previous, ciphertext + group - kAesBlockSize, kAesBlockSize);
+    }
+}
+
+void Aes256CtrXor(const Aes256& aes, const unsigned char* counter,
+                  const unsigned char* in, unsigned char* out, size_t size) {
+    constexpr size_t kGroupSize = kAesParallelBlocks * kAesBlockSize;
+    unsigned char next[kAesBlockSize];
+    unsigned char keystream[kGroupSize];
+    memcpy(next, counter, sizeof(next));
+    for (size_t offset = 0; offset < size; offset += kGroupSize) {
+        const size_t group = std::min(kGroupSize, size - offset);
+        const size_t count = (group + kAesBlockSize - 1) / kAesBlockSize;
+        for (size_t k = 0; k < count; k++) {
+            memcpy(keystream + k * kAesBlockSize, next, kAesBlockSize);
+            IncrementCounter(next);
+        }
+        aes.EncryptBlocks(keystream, keystream, count);
+        for (size_t i = 0; i < group; i++)
+            out[offset + i] = in[offset + i] ^ keystream[i];
+    }
+    WipeMemory(keystream, sizeof(keystream));
+}
+
+}  // namespace ette
@@ -0,0 +1,62 @@
+#ifndef __AES_BITSLICED_H__
+#define __AES_BITSLICED_H__
+
+#include <cstddef>
+#include <cstdint>
+
+namespace ette {
+
+/* Constant-time software AES-256. Instead of looking bytes up in S-box
+ * tables, which is slow and leaks the key through the cache, eight blocks
+ * are transposed into bit planes and the rounds are computed with boolean
+ * logic on all of them at once. A single block costs as much as eight, so the
+ * modes below hand it as many independent blocks as they have. */
+
+static constexpr size_t kAesBlockSize = 16;
+static constexpr size_t kAes256KeySize = 32;
+static constexpr size_t kAesParallelBlocks = 8;
+
+class Aes256 {
+   public:
+    explicit Aes256(const unsigned char* key);
+    ~Aes256();
+
+    Aes256(const Aes256&) = delete;
+    Aes256& operator=(const Aes256&) = delete;
+
+    /* 'count' (at most kAesParallelBlocks) consecutive blocks. 'in' and 'out'
+     * may be the same buffer. */
+    void EncryptBlocks(const unsigned char* in, unsigned char* out,
+                       size_t count) const;
+    void DecryptBlocks(const unsigned char* in, unsigned char* out,
+                       size_t count) const;
+
+   private:
+    static constexpr int kRounds = 14;
+
+    /* Every round key as 8 bit planes of 16 bytes, each byte 0x00 or 0xFF,
+     * ready to XOR into the transposed blocks. */
+    alignas(16) uint32_t round_keys_[kRounds + 1][8][4];
+};
+
+/* The modes work on whole blocks, 'size' must be a multiple of kAesBlockSize.
+ * 'in' and 'out' may be the same buffer. */
+
+/* CBC encryption chains every block to the previous one, so it runs one
+ * block at a time; it is here for constant time, not speed. */
+void Aes256CbcEncrypt(const Aes256& aes, const unsigned char* iv,
+                      const unsigned char* in, unsigned char* out,
+                      size_t size);
+
+void Aes256CbcDecrypt(const Aes256& aes, const unsigned char* iv,
+                      const unsigned char* in, unsigned char* out,
+                      size_t size);
+
+/* CTR mode: 'counter' is the first counter block, incremented as a 128-bit
+ * big-endian number. 'size' may be anything. */
+void Aes256CtrXor(const Aes256& aes, const unsigned char* counter,
+                  const unsigned char* in, unsigned char* out, size_t size);
+
+}  // namespace ette
+
+#endif  // __AES_BITSLICED_H__
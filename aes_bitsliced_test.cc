@@ -0,0 +1,137 @@
+#include <algorithm>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "aes_bitsliced.h"
+#include "third_party/plusaes/plusaes.h"
+
+#include "gtest/gtest.h"
+
+using ::ette::Aes256;
+using ::ette::Aes256CbcDecrypt;
+using ::ette::Aes256CbcEncrypt;
+using ::ette::Aes256CtrXor;
+using ::ette::kAesBlockSize;
+using ::ette::kAesParallelBlocks;
+
+typedef std::vector<unsigned char> Bytes;
+
+Bytes FromHex(const std::string& hex) {
+    Bytes bytes;
+    for (size_t i = 0; i + 1 < hex.size(); i += 2)
+        bytes.push_back(std::stoi(hex.substr(i, 2), nullptr, 16));
+    return bytes;
+}
+
+Bytes RandomBytes(std::mt19937& random, size_t size) {
+    Bytes bytes(size);
+    for (unsigned char& byte : bytes)
+        byte = random() & 0xFF;
+    return bytes;
+}
+
+// FIPS-197, C.3.
+TEST(Aes256, Fips197Vector) {
+    const Bytes key = FromHex(
+        "000102030405060708090a0b0c0d0e0f101112131415161718191a1b1c1d1e1f");
+    const Bytes plaintext = FromHex("00112233445566778899aabbccddeeff");
+    const Bytes expected = FromHex("8ea2b7ca516745bfeafc49904b496089");
+
+    const Aes256 aes(key.data());
+    Bytes block(kAesBlockSize);
+    aes.EncryptBlocks(plaintext.data(), block.data(), 1);
+    EXPECT_EQ(block, expected);
+    aes.DecryptBlocks(block.data(), block.data(), 1);
+    EXPECT_EQ(block, plaintext);
+}
+
+// NIST SP 800-38A, F.2.5, F.2.6, F.5.5 and F.5.6.
+TEST(Aes256, Sp800_38aVectors) {
+    const Bytes key = FromHex(
+        "603deb1015ca71be2b73aef0857d77811f352c073b6108d72d9810a30914dff4");
+    const Bytes plaintext = FromHex(
+        "6bc1bee22e409f96e93d7e117393172aae2d8a571e03ac9c9eb76fac45af8e51"
+        "30c81c46a35ce411e5fbc1191a0a52eff69f2445df4f9b17ad2b417be66c3710");
+    const Aes256 aes(key.data());
+
+    const Bytes iv = FromHex("000102030405060708090a0b0c0d0e0f");
+    const Bytes cbc = FromHex(
+        "f58c4c04d6e5f1ba779eabfb5f7bfbd69cfc4e967edb808d679f777bc6702c7d"
+        "39f23369a9d9bacfa530e26304231461b2eb05e2c39be9fcda6c19078c6a9d1b");
+    Bytes out(plaintext.size());
+    Aes256CbcEncrypt(aes, iv.data(), plaintext.data(), out.data(), out.size());
+    EXPECT_EQ(out, cbc);
+    Aes256CbcDecrypt(aes, iv.data(), cbc.data(), out.data(), out.size());
+    EXPECT_EQ(out, plaintext);
+
+    const Bytes counter = FromHex("f0f1f2f3f4f5f6f7f8f9fafbfcfdfeff");
+    const Bytes ctr = FromHex(
+        "601ec313775789a5b7a7f504bbf3d228f443e3ca4d62b59aca84e990cacaf5c5"
+        "2b0930daa23de94ce87017ba2d84988ddfc9c58db67aada613c2dd08457941a6");
+    Aes256CtrXor(aes, counter.data(), plaintext.data(), out.data(), out.size());
+    EXPECT_EQ(out, ctr);
+    Aes256CtrXor(aes, counter.data(), ctr.data(), out.data(), out.size());
+    EXPECT_EQ(out, plaintext);
+}
+
+// Every partial group of blocks, in place, against the table-based
+// implementation.
+TEST(Aes256, CbcMatchesPlusaes) {
+    std::mt19937 random(85);
+    for (size_t blocks = 1; blocks <= 3 * kAesParallelBlocks + 1; blocks++) {
+        const Bytes key = RandomBytes(random, ette::kAes256KeySize);
+        const Bytes plaintext = RandomBytes(random, blocks * kAesBlockSize);
+        unsigned char iv[kAesBlockSize];
+        for (unsigned char& byte : iv)
+            byte = random() & 0xFF;
+
+        Bytes expected(plaintext.size());
+        ASSERT_EQ(plusaes::encrypt_cbc(plaintext.data(), plaintext.size(),
+                                       key.data(), key.size(), &iv,
+                                       expected.data(), expected.size(), false),
+                  plusaes::kErrorOk);
+
+        const Aes256 aes(key.data());
+        Bytes buffer = plaintext;
+        Aes256CbcEncrypt(aes, iv, buffer.data(), buffer.data(), buffer.size());
+        EXPECT_EQ(buffer, expected) << blocks;
+        Aes256CbcDecrypt(aes, iv, buffer.data(), buffer.data(), buffer.size());
+        EXPECT_EQ(buffer, plaintext) << blocks;
+    }
+}
+
+TEST(Aes256, CtrHandlesPartialBlocksAndCarries) {
+    std::mt19937 random(86);
+    const Bytes key = RandomBytes(random, ette::kAes256KeySize);
+    const Aes256 aes(key.data());
+    // The low bytes wrap around within the first group.
+    const Bytes counter = FromHex("00112233445566778899aabbfffffffe");
+    const Bytes plaintext = RandomBytes(random, 300);
+
+    Bytes full(plaintext.size());
+    Aes256CtrXor(aes, counter.data(), plaintext.data(), full.data(),
+                 full.size());
+
+    // Block by block through the single block path.
+    Bytes block = counter;
+    for (size_t offset = 0; offset < plaintext.size();
+         offset += kAesBlockSize) {
+        Bytes keystream(kAesBlockSize);
+        aes.EncryptBlocks(block.data(), keystream.data(), 1);
+        for (size_t i = offset;
+             i < std::min(plaintext.size(), offset + kAesBlockSize); i++) {
+            EXPECT_EQ(full[i], plaintext[i] ^ keystream[i - offset]) << i;
+        }
+        for (int i = kAesBlockSize - 1; i >= 0; i--) {
+            if (++block[i] != 0)
+                break;
+        }
+    }
+
+    for (size_t size : {size_t(0), size_t(1), size_t(17), size_t(129)}) {
+        Bytes buffer(plaintext.begin(), plaintext.begin() + size);
+        Aes256CtrXor(aes, counter.data(), buffer.data(), buffer.data(), size);
+        EXPECT_EQ(buffer, Bytes(full.begin(), full.begin() + size)) << size;
+    }
+}
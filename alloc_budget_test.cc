@@ -0,0 +1,195 @@
+#include <string>
+#include <vector>
+
+#include "alloc_counter.h"
+#include "crypto.h"
+#include "editor.h"
+#include "gtest/gtest.h"
+
+using ::ette::AllocationCounter;
+using ::ette::AllocationStats;
+using ::ette::CryptoAlgorithm;
+using ::ette::CryptoState;
+using ::ette::Decrypt;
+using ::ette::Encrypt;
+using ::ette::GenerateRandomAsciiByteVector;
+using ::ette::ScopedAllocationCounter;
+
+// Budgets for the hot paths. Raising one of these needs a good reason.
+constexpr uint64_t kCursorMoveBudget = 0;
+// RowInsertChar grows chars, UpdateRow rebuilds render and UpdateSyntax
+// resizes hl: one allocation each, independent of the row length.
+constexpr uint64_t kTypingBudget = 3;
+// Frames and the output buffer are reused, so a repaint after the first one
+// is free.
+constexpr uint64_t kRepaintBudget = 0;
+// One buffer for the ciphertext (or plaintext) we produce and one copy of
+// the input kept in the returned CryptoState.
+constexpr uint64_t kCryptoFullSizeBuffersBudget = 2;
+
+class AllocationBudgetFixture : public ::testing::Test {
+   public:
+    void SetUp() {
+        if (!AllocationCounter::InterposesMalloc()) {
+            GTEST_SKIP() << "malloc interposition is not supported here";
+        }
+        state_ = new State();
+        state_->screenrows = 40;
+        state_->screencols = 120;
+    }
+
+    void TearDown() {
+        if (state_ == NULL) {
+            return;
+        }
+        for (int i = 0; i < state_->numrows; i++) {
+            FreeRow(&state_->row[i]);
+        }
+        free(state_->row);
+        delete state_;
+    }
+
+    void AddRows(int count, const std::string& content) {
+        for (int i = 0; i < count; i++) {
+            InsertRow(state_, state_->numrows, content.c_str(),
+                      content.size());
+        }
+    }
+
+    template <typename F>
+    AllocationStats Measure(F&& f, size_t large_threshold = SIZE_MAX) {
+        ScopedAllocationCounter counter(large_threshold);
+        f();
+        return counter.Stop();
+    }
+
+    State* state_ = NULL;
+};
+
+TEST_F(AllocationBudgetFixture, CursorMoveDoesNotAllocate) {
+    AddRows(100, "int main(int argc, char** argv) { return 0; }");
+
+    const AllocationStats stats = Measure([&] {
+        ProcessKeyPress(0, state_, ARROW_DOWN);
+        ProcessKeyPress(0, state_, ARROW_RIGHT);
+        ProcessKeyPress(0, state_, ARROW_RIGHT);
+        ProcessKeyPress(0, state_, ARROW_LEFT);
+        ProcessKeyPress(0, state_, ARROW_UP);
+        ProcessKeyPress(0, state_, PAGE_DOWN);
+        ProcessKeyPress(0, state_, PAGE_UP);
+    });
+
+    EXPECT_EQ(stats.allocations, kCursorMoveBudget);
+}
+
+TEST_F(AllocationBudgetFixture, TypingIntoShortRowIsConstant) {
+    AddRows(1, "short row");
+
+    const AllocationStats stats =
+        Measure([&] { ProcessKeyPress(0, state_, 'a'); });
+
+    EXPECT_LE(stats.allocations, kTypingBudget);
+}
+
+TEST_F(AllocationBudgetFixture, TypingIntoLongRowIsConstant) {
+    AddRows(1, std::string(100000, 'x'));
+
+    const AllocationStats stats =
+        Measure([&] { ProcessKeyPress(0, state_, 'a'); });
+
+    EXPECT_LE(stats.allocations, kTypingBudget);
+}
+
+TEST_F(AllocationBudgetFixture, TypingManyCharactersIsLinear) {
+    AddRows(1, "");
+    const int keystrokes = 200;
+
+    const AllocationStats stats = Measure([&] {
+        for (int i = 0; i < keystrokes; i++) {
+            ProcessKeyPress(0, state_, 'a');
+        }
+    });
+
+    EXPECT_LE(stats.allocations, kTypingBudget * keystrokes);
+}
+
+TEST_F(AllocationBudgetFixture, FullRepaintIsConstant) {
+    AddRows(1000, "for (int i = 0; i < 10; i++) { /* \"colors\" */ x += 42; }");
+    Frame frame = {{NULL, 0, 0}, {}, 0, 0, 0};
+    Buffer out = {NULL, 0, 0};
+
+    // The first frame sizes the buffers.
+    DrawFrame(state_, &frame);
+    RenderFrame(NULL, &frame, &out);
+
+    const AllocationStats stats = Measure([&] {
+        DrawFrame(state_, &frame);
+        out.len = 0;
+        RenderFrame(NULL, &frame, &out);
+    });
+    FreeBuf(&frame.text);
+    FreeBuf(&out);
+
+    EXPECT_EQ(stats.allocations, kRepaintBudget);
+}
+
+TEST_F(AllocationBudgetFixture, FullRepaintDoesNotDependOnScreenContent) {
+    AddRows(1000, std::string(500, 'y'));
+    Frame frames[2] = {{{NULL, 0, 0}, {}, 0, 0, 0},
+                       {{NULL, 0, 0}, {}, 0, 0, 0}};
+    Buffer out = {NULL, 0, 0};
+    DrawFrame(state_, &frames[0]);
+    DrawFrame(state_, &frames[1]);
+    RenderFrame(NULL, &frames[1], &out);
+
+    const AllocationStats stats = Measure([&] {
+        for (int i = 0; i < 10; i++) {
+            ProcessKeyPress(0, state_, ARROW_DOWN);
+            DrawFrame(state_, &frames[i % 2]);
+            out.len = 0;
+            RenderFrame(&frames[(i + 1) % 2], &frames[i % 2], &out);
+        }
+    });
+    FreeBuf(&frames[0].text);
+    FreeBuf(&frames[1].text);
+    FreeBuf(&out);
+
+    EXPECT_EQ(stats.allocations, kRepaintBudget);
+}
+
+TEST(AllocationBudget, EncryptUsesAtMostTwoFullSizeBuffers) {
+    if (!AllocationCounter::InterposesMalloc()) {
+        GTEST_SKIP() << "malloc interposition is not supported here";
+    }
+    const std::string key = "somewhatlongkey";
+    const std::string plaintext(1 << 20, 'p');
+    const std::vector<unsigned char> iv = GenerateRandomAsciiByteVector();
+
+    ScopedAllocationCounter counter(plaintext.size());
+    const CryptoState state =
+        Encrypt(plaintext, key, iv, CryptoAlgorithm::kAES256CBC);
+    const AllocationStats stats = counter.Stop();
+
+    ASSERT_TRUE(state.status.ok());
+    EXPECT_LE(stats.large_allocations, kCryptoFullSizeBuffersBudget);
+}
+
+TEST(AllocationBudget, DecryptUsesAtMostTwoFullSizeBuffers) {
+    if (!AllocationCounter::InterposesMalloc()) {
+        GTEST_SKIP() << "malloc interposition is not supported here";
+    }
+    const std::string key = "somewhatlongkey";
+    const std::string plaintext(1 << 20, 'p');
+    const CryptoState encrypted = Encrypt(
+        plaintext, key, GenerateRandomAsciiByteVector(),
+        CryptoAlgorithm::kAES256CBC);
+
+    ScopedAllocationCounter counter(plaintext.size());
+    const CryptoState state =
+        Decrypt(encrypted.ciphertext, key, CryptoAlgorithm::kAES256CBC);
+    const AllocationStats stats = counter.Stop();
+
+    ASSERT_TRUE(state.status.ok());
+    EXPECT_EQ(state.plaintext, plaintext);
+    EXPECT_LE(stats.large_allocations, kCryptoFullSizeBuffersBudget);
+}
@@ -0,0 +1,117 @@
+#include "alloc_counter.h"
+
+#include <stdlib.h>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <new>
+
+namespace {
+std::atomic<bool> g_counting{false};
+std::atomic<size_t> g_large_threshold{SIZE_MAX};
+std::atomic<uint64_t> g_allocations{0};
+std::atomic<uint64_t> g_bytes{0};
+std::atomic<uint64_t> g_large_allocations{0};
+
+inline void RecordAllocation(size_t size) {
+    if (!g_counting.load(std::memory_order_relaxed)) {
+        return;
+    }
+    g_allocations.fetch_add(1, std::memory_order_relaxed);
+    g_bytes.fetch_add(size, std::memory_order_relaxed);
+    if (size >= g_large_threshold.load(std::memory_order_relaxed)) {
+        g_large_allocations.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+}  // namespace
+
+#ifdef __GLIBC__
+/* glibc exports its allocator under these names, which lets us replace the
+ * public symbols without dlsym() bootstrapping problems. */
+extern "C" {
+void* __libc_malloc(size_t size);
+void* __libc_calloc(size_t nmemb, size_t size);
+void* __libc_realloc(void* ptr, size_t size);
+void __libc_free(void* ptr);
+
+void* malloc(size_t size) noexcept {
+    RecordAllocation(size);
+    return __libc_malloc(size);
+}
+
+void* calloc(size_t nmemb, size_t size) noexcept {
+    RecordAllocation(nmemb * size);
+    return __libc_calloc(nmemb, size);
+}
+
+void* realloc(void* ptr, size_t size) noexcept {
+    RecordAllocation(size);
+    return __libc_realloc(ptr, size);
+}
+
+void free(void* ptr) noexcept {
+    __libc_free(ptr);
+}
+}
+#endif
+
+void* operator new(size_t size) {
+#ifndef __GLIBC__
+    /* With glibc the malloc() below is already counted. */
+    RecordAllocation(size);
+#endif
+    void* p = malloc(size ? size : 1);
+    if (p == NULL) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void* operator new[](size_t size) {
+    return operator new(size);
+}
+
+void operator delete(void* p) noexcept {
+    free(p);
+}
+
+void operator delete[](void* p) noexcept {
+    free(p);
+}
+
+void operator delete(void* p, size_t) noexcept {
+    free(p);
+}
+
+void operator delete[](void* p, size_t) noexcept {
+    free(p);
+}
+
+namespace ette {
+
+bool AllocationCounter::InterposesMalloc() {
+#ifdef __GLIBC__
+    return true;
+#else
+    return false;
+#endif
+}
+
+void AllocationCounter::Start(size_t large_threshold) {
+    g_allocations.store(0);
+    g_bytes.store(0);
+    g_large_allocations.store(0);
+    g_large_threshold.store(large_threshold);
+    g_counting.store(true);
+}
+
+AllocationStats AllocationCounter::Stop() {
+    g_counting.store(false);
+    AllocationStats stats;
+    stats.allocations = g_allocations.load();
+    stats.bytes = g_bytes.load();
+    stats.large_allocations = g_large_allocations.load();
+    return stats;
+}
+
+}  // namespace ette
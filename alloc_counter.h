@@ -0,0 +1,53 @@
+#ifndef __ALLOC_COUNTER_H__
+#define __ALLOC_COUNTER_H__
+
+#include <cstddef>
+#include <cstdint>
+
+namespace ette {
+
+/* Test-only global allocation counter. Linking alloc_counter.cc into a binary
+ * replaces malloc/calloc/realloc (glibc only) and the global operator new, so
+ * that every heap allocation made while counting is enabled is recorded.
+ * Allocations of at least 'large_threshold' bytes are also counted separately,
+ * which lets tests assert how many full-size buffers a code path creates. */
+struct AllocationStats {
+    uint64_t allocations;       /* malloc, calloc, realloc and operator new. */
+    uint64_t bytes;             /* Total bytes requested. */
+    uint64_t large_allocations; /* Allocations >= the large threshold. */
+};
+
+class AllocationCounter {
+   public:
+    /* Returns true when malloc and friends are interposed. Without it only
+     * operator new is counted and realloc based code paths are invisible. */
+    static bool InterposesMalloc();
+
+    static void Start(size_t large_threshold = SIZE_MAX);
+    static AllocationStats Stop();
+};
+
+/* Counts allocations for the lifetime of the object. */
+class ScopedAllocationCounter {
+   public:
+    explicit ScopedAllocationCounter(size_t large_threshold = SIZE_MAX) {
+        AllocationCounter::Start(large_threshold);
+    }
+    ~ScopedAllocationCounter() {
+        if (!stopped_) {
+            AllocationCounter::Stop();
+        }
+    }
+
+    AllocationStats Stop() {
+        stopped_ = true;
+        return AllocationCounter::Stop();
+    }
+
+   private:
+    bool stopped_ = false;
+};
+
+}  // namespace ette
+
+#endif  // __ALLOC_COUNTER_H__
@@ -0,0 +1,576 @@
+#include "chacha20_poly1305.h"
+#include "secure_memory.h"
+
+#include <string.h>
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#define ETTE_ALWAYS_INLINE inline __attribute__((always_inline))
+
+#if defined(__x86_64__) || defined(__i386__)
+#define ETTE_HAVE_AVX2_KERNEL 1
+#endif
+
+namespace ette {
+namespace {
+
+typedef uint32_t U32x4 __attribute__((vector_size(16)));
+typedef uint32_t U32x8 __attribute__((vector_size(32)));
+
+ETTE_ALWAYS_INLINE uint32_t LoadLe32(const unsigned char* p) {
+    return static_cast<uint32_t>(p[0]) | static_cast<uint32_t>(p[1]) << 8 |
+           static_cast<uint32_t>(p[2]) << 16 |
+           static_cast<uint32_t>(p[3]) << 24;
+}
+
+ETTE_ALWAYS_INLINE void StoreLe32(unsigned char* p, uint32_t v) {
+    p[0] = v & 0xFF;
+    p[1] = (v >> 8) & 0xFF;
+    p[2] = (v >> 16) & 0xFF;
+    p[3] = (v >> 24) & 0xFF;
+}
+
+ETTE_ALWAYS_INLINE uint64_t LoadLe64(const unsigned char* p) {
+    return static_cast<uint64_t>(LoadLe32(p)) |
+           static_cast<uint64_t>(LoadLe32(p + 4)) << 32;
+}
+
+ETTE_ALWAYS_INLINE void StoreLe64(unsigned char* p, uint64_t v) {
+    StoreLe32(p, static_cast<uint32_t>(v));
+    StoreLe32(p + 4, static_cast<uint32_t>(v >> 32));
+}
+
+/* ================================ ChaCha20 ================================ */
+
+/* The round function is written once for plain words and for vectors of
+ * words, where every lane belongs to a different block. */
+template <int kBits, typename V>
+ETTE_ALWAYS_INLINE void RotateLeft(V& v) {
+    v = (v << kBits) | (v >> (32 - kBits));
+}
+
+template <typename V>
+ETTE_ALWAYS_INLINE void QuarterRound(V& a, V& b, V& c, V& d) {
+    a += b;
+    d ^= a;
+    RotateLeft<16>(d);
+    c += d;
+    b ^= c;
+    RotateLeft<12>(b);
+    a += b;
+    d ^= a;
+    RotateLeft<8>(d);
+    c += d;
+    b ^= c;
+    RotateLeft<7>(b);
+}
+
+template <typename V>
+ETTE_ALWAYS_INLINE void ChaCha20Rounds(V* x) {
+    for (int i = 0; i < 10; i++) {
+        QuarterRound(x[0], x[4], x[8], x[12]);
+        QuarterRound(x[1], x[5], x[9], x[13]);
+        QuarterRound(x[2], x[6], x[10], x[14]);
+        QuarterRound(x[3], x[7], x[11], x[15]);
+        QuarterRound(x[0], x[5], x[10], x[15]);
+        QuarterRound(x[1], x[6], x[11], x[12]);
+        QuarterRound(x[2], x[7], x[8], x[13]);
+        QuarterRound(x[3], x[4], x[9], x[14]);
+    }
+}
+
+void SetupChaCha20State(const unsigned char* key, const unsigned char* nonce,
+                        uint32_t counter, uint32_t state[16]) {
+    /* "expand 32-byte k" */
+    state[0] = 0x61707865;
+    state[1] = 0x3320646e;
+    state[2] = 0x79622d32;
+    state[3] = 0x6b206574;
+    for (int i = 0; i < 8; i++)
+        state[4 + i] = LoadLe32(key + 4 * i);
+    state[12] = counter;
+    for (int i = 0; i < 3; i++)
+        state[13 + i] = LoadLe32(nonce + 4 * i);
+}
+
+void ChaCha20Block(const uint32_t state[16], unsigned char keystream[64]) {
+    uint32_t x[16];
+    memcpy(x, state, sizeof(x));
+    ChaCha20Rounds(x);
+    for (int i = 0; i < 16; i++)
+        StoreLe32(keystream + 4 * i, x[i] + state[i]);
+}
+
+/* XOR kLanes blocks, from block state[12] on. Lane i of x[w] is word w of
+ * block state[12] + i, so each instruction advances every block. The
+ * keystream left on the stack isn't wiped here, as that would cost more than
+ * computing it; the next group of blocks overwrites it. */
+template <typename V, size_t kLanes>
+ETTE_ALWAYS_INLINE void XorBlocks(const uint32_t state[16],
+                                  const unsigned char* in,
+                                  unsigned char* out) {
+    V initial[16], x[16];
+    for (int w = 0; w < 16; w++) {
+        const V zero = {};
+        initial[w] = zero + state[w];
+    }
+    for (size_t lane = 0; lane < kLanes; lane++)
+        initial[12][lane] += static_cast<uint32_t>(lane);
+    for (int w = 0; w < 16; w++)
+        x[w] = initial[w];
+
+    ChaCha20Rounds(x);
+
+    uint32_t words[16][kLanes];
+    for (int w = 0; w < 16; w++) {
+        x[w] += initial[w];
+        memcpy(words[w], &x[w], sizeof(words[w]));
+    }
+    for (size_t lane = 0; lane < kLanes; lane++) {
+        const unsigned char* block_in = in + lane * kChaCha20BlockSize;
+        unsigned char* block_out = out + lane * kChaCha20BlockSize;
+        for (int w = 0; w < 16; w++) {
+            StoreLe32(block_out + 4 * w,
+                      LoadLe32(block_in + 4 * w) ^ words[w][lane]);
+        }
+    }
+}
+
+typedef void (*XorBlocksFunction)(const uint32_t state[16],
+                                  const unsigned char* in, unsigned char* out);
+
+void XorBlocksVector4(const uint32_t state[16], const unsigned char* in,
+                      unsigned char* out) {
+    XorBlocks<U32x4, 4>(state, in, out);
+}
+
+#ifdef ETTE_HAVE_AVX2_KERNEL
+__attribute__((target("avx2"))) void XorBlocksAvx2(const uint32_t state[16],
+                                                    const unsigned char* in,
+                                                    unsigned char* out) {
+    XorBlocks<U32x8, 8>(state, in, out);
+}
+#endif
+
+bool CpuHasAvx2() {
+#ifdef ETTE_HAVE_AVX2_KERNEL
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+#else
+    return false;
+#endif
+}
+
+}  // namespace
+
+/* ================================ Poly1305 ================================ */
+
+/* 64-bit limb Poly1305 (after poly1305-donna): the accumulator and 'r' are
+ * kept as 44 + 44 + 42 bit limbs, products as 128-bit integers. Outside the
+ * anonymous namespace only so ChaCha20Poly1305Stream can hold one. */
+class Poly1305 {
+   public:
+    explicit Poly1305(const unsigned char* key) : leftover_(0) {
+        const uint64_t t0 = LoadLe64(key);
+        const uint64_t t1 = LoadLe64(key + 8);
+        /* r &= 0xffffffc0ffffffc0ffffffc0fffffff */
+        r_[0] = t0 & 0xffc0fffffff;
+        r_[1] = ((t0 >> 44) | (t1 << 20)) & 0xfffffc0ffff;
+        r_[2] = (t1 >> 24) & 0x00ffffffc0f;
+        h_[0] = h_[1] = h_[2] = 0;
+        pad_[0] = LoadLe64(key + 16);
+        pad_[1] = LoadLe64(key + 24);
+    }
+
+    ~Poly1305() {
+        WipeMemory(r_, sizeof(r_));
+        WipeMemory(h_, sizeof(h_));
+        WipeMemory(pad_, sizeof(pad_));
+        WipeMemory(buffer_, sizeof(buffer_));
+    }
+
+    void Update(const unsigned char* data, size_t size) {
+        if (leftover_) {
+            const size_t take = std::min(kBlock - leftover_, size);
+            memcpy(buffer_ + leftover_, data, take);
+            leftover_ += take;
+            data += take;
+            size -= take;
+            if (leftover_ < kBlock)
+                return;
+            Blocks(buffer_, kBlock, kHighBit);
+            leftover_ = 0;
+        }
+        const size_t whole = size & ~(kBlock - 1);
+        if (whole) {
+            Blocks(data, whole, kHighBit);
+            data += whole;
+            size -= whole;
+        }
+        if (size) {
+            memcpy(buffer_, data, size);
+            leftover_ = size;
+        }
+    }
+
+    /* Zero bytes up to the next 16 byte boundary, as the AEAD construction
+     * pads the additional data and the ciphertext. */
+    void PadToBlock() {
+        static const unsigned char zeros[kBlock] = {};
+        if (leftover_)
+            Update(zeros, kBlock - leftover_);
+    }
+
+    void Finish(unsigned char* tag) {
+        if (leftover_) {
+            buffer_[leftover_] = 1;
+            memset(buffer_ + leftover_ + 1, 0, kBlock - leftover_ - 1);
+            Blocks(buffer_, kBlock, 0);
+            leftover_ = 0;
+        }
+
+        /* Fully carry h. */
+        uint64_t h0 = h_[0], h1 = h_[1], h2 = h_[2];
+        uint64_t c = h1 >> 44;
+        h1 &= kMask44;
+        h2 += c;
+        c = h2 >> 42;
+        h2 &= kMask42;
+        h0 += c * 5;
+        c = h0 >> 44;
+        h0 &= kMask44;
+        h1 += c;
+        c = h1 >> 44;
+        h1 &= kMask44;
+        h2 += c;
+        c = h2 >> 42;
+        h2 &= kMask42;
+        h0 += c * 5;
+        c = h0 >> 44;
+        h0 &= kMask44;
+        h1 += c;
+
+        /* g = h + -p, select h if h < p, else g, without branching. */
+        uint64_t g0 = h0 + 5;
+        c = g0 >> 44;
+        g0 &= kMask44;
+        uint64_t g1 = h1 + c;
+        c = g1 >> 44;
+        g1 &= kMask44;
+        uint64_t g2 = h2 + c - (static_cast<uint64_t>(1) << 42);
+        c = (g2 >> 63) - 1;
+        g0 &= c;
+        g1 &= c;
+        g2 &= c;
+        c = ~c;
+        h0 = (h0 & c) | g0;
+        h1 = (h1 & c) | g1;
+        h2 = (h2 & c) | g2;
+
+        /* h = (h + pad) mod 2^128 */
+        const uint64_t t0 = pad_[0];
+        const uint64_t t1 = pad_[1];
+        h0 += t0 & kMask44;
+        c = h0 >> 44;
+        h0 &= kMask44;
+        h1 += (((t0 >> 44) | (t1 << 20)) & kMask44) + c;
+        c = h1 >> 44;
+        h1 &= kMask44;
+        h2 += ((t1 >> 24) & kMask42) + c;
+        h2 &= kMask42;
+
+        StoreLe64(tag, h0 | (h1 << 44));
+        StoreLe64(tag + 8, (h1 >> 20) | (h2 << 24));
+    }
+
+   private:
+    __extension__ typedef unsigned __int128 uint128_t;
+
+    static constexpr size_t kBlock = 16;
+    static constexpr uint64_t kHighBit = static_cast<uint64_t>(1) << 40;
+    static constexpr uint64_t kMask44 = 0xfffffffffff;
+    static constexpr uint64_t kMask42 = 0x3ffffffffff;
+
+    void Blocks(const unsigned char* m, size_t size, uint64_t high_bit) {
+        const uint64_t r0 = r_[0], r1 = r_[1], r2 = r_[2];
+        const uint64_t s1 = r1 * (5 << 2);
+        const uint64_t s2 = r2 * (5 << 2);
+        uint64_t h0 = h_[0], h1 = h_[1], h2 = h_[2];
+
+        while (size >= kBlock) {
+            const uint64_t t0 = LoadLe64(m);
+            const uint64_t t1 = LoadLe64(m + 8);
+            h0 += t0 & kMask44;
+            h1 += ((t0 >> 44) | (t1 << 20)) & kMask44;
+            h2 += ((t1 >> 24) & kMask42) | high_bit;
+
+            /* h *= r, mod 2^130 - 5 */
+            uint128_t d0 = static_cast<uint128_t>(h0) * r0 +
+                           static_cast<uint128_t>(h1) * s2 +
+                           static_cast<uint128_t>(h2) * s1;
+            uint128_t d1 = static_cast<uint128_t>(h0) * r1 +
+                           static_cast<uint128_t>(h1) * r0 +
+                           static_cast<uint128_t>(h2) * s2;
+            uint128_t d2 = static_cast<uint128_t>(h0) * r2 +
+                           static_cast<uint128_t>(h1) * r1 +
+                           static_cast<uint128_t>(h2) * r0;
+
+            uint64_t c = static_cast<uint64_t>(d0 >> 44);
+            h0 = static_cast<uint64_t>(d0) & kMask44;
+            d1 += c;
+            c = static_cast<uint64_t>(d1 >> 44);
+            h1 = static_cast<uint64_t>(d1) & kMask44;
+            d2 += c;
+            c = static_cast<uint64_t>(d2 >> 42);
+            h2 = static_cast<uint64_t>(d2) & kMask42;
+            h0 += c * 5;
+            c = h0 >> 44;
+            h0 &= kMask44;
+            h1 += c;
+
+            m += kBlock;
+            size -= kBlock;
+        }
+
+        h_[0] = h0;
+        h_[1] = h1;
+        h_[2] = h2;
+    }
+
+    uint64_t r_[3];
+    uint64_t h_[3];
+    uint64_t pad_[2];
+    unsigned char buffer_[kBlock];
+    size_t leftover_;
+};
+
+namespace {
+
+/* The AEAD tag: Poly1305 of the padded additional data and ciphertext,
+ * followed by both lengths, under a key taken from ChaCha20 block 0. */
+void ComputeAeadTagWithPolyKey(const unsigned char* poly_key,
+                               const unsigned char* aad, size_t aad_size,
+                               const unsigned char* ciphertext, size_t size,
+                               unsigned char* tag) {
+    Poly1305 poly(poly_key);
+    poly.Update(aad, aad_size);
+    poly.PadToBlock();
+    poly.Update(ciphertext, size);
+    poly.PadToBlock();
+    unsigned char lengths[16];
+    StoreLe64(lengths, aad_size);
+    StoreLe64(lengths + 8, size);
+    poly.Update(lengths, sizeof(lengths));
+    poly.Finish(tag);
+}
+
+void ComputeAeadTag(const unsigned char* key, const unsigned char* nonce,
+                    const unsigned char* aad, size_t aad_size,
+                    const unsigned char* ciphertext, size_t size,
+                    unsigned char* tag) {
+    unsigned char poly_key[kChaCha20BlockSize] = {};
+    ChaCha20Xor(key, nonce, 0, poly_key, poly_key, sizeof(poly_key));
+    ComputeAeadTagWithPolyKey(poly_key, aad, aad_size, ciphertext, size, tag);
+    WipeMemory(poly_key, sizeof(poly_key));
+}
+
+}  // namespace
+
+std::vector<ChaCha20Kernel> SupportedChaCha20Kernels() {
+    std::vector<ChaCha20Kernel> kernels = {ChaCha20Kernel::kScalar,
+                                           ChaCha20Kernel::kVector4};
+    if (CpuHasAvx2())
+        kernels.push_back(ChaCha20Kernel::kAvx2);
+    return kernels;
+}
+
+ChaCha20Kernel DefaultChaCha20Kernel() {
+    static const ChaCha20Kernel kernel = SupportedChaCha20Kernels().back();
+    return kernel;
+}
+
+const char* ChaCha20KernelName(ChaCha20Kernel kernel) {
+    switch (kernel) {
+        case ChaCha20Kernel::kScalar:
+            return "scalar";
+        case ChaCha20Kernel::kVector4:
+            return "vector4";
+        case ChaCha20Kernel::kAvx2:
+            return "avx2";
+    }
+    return "unknown";
+}
+
+void ChaCha20XorWithKernel(ChaCha20Kernel kernel, const unsigned char* key,
+                           const unsigned char* nonce, uint32_t counter,
+                           const unsigned char* in, unsigned char* out,
+                           size_t size) {
+    uint32_t state[16];
+    SetupChaCha20State(key, nonce, counter, state);
+
+    XorBlocksFunction xor_blocks = nullptr;
+    size_t lanes = 0;
+    switch (kernel) {
+        case ChaCha20Kernel::kScalar:
+            break;
+        case ChaCha20Kernel::kVector4:
+            xor_blocks = XorBlocksVector4;
+            lanes = 4;
+            break;
+        case ChaCha20Kernel::kAvx2:
+#ifdef ETTE_HAVE_AVX2_KERNEL
+            xor_blocks = XorBlocksAvx2;
+            lanes = 8;
+#else
+            xor_blocks = XorBlocksVector4;
+            lanes = 4;
+#endif
+            break;
+    }
+
+    if (xor_blocks) {
+        const size_t stride = lanes * kChaCha20BlockSize;
+        while (size >= stride) {
+            xor_blocks(state, in, out);
+            state[12] += static_cast<uint32_t>(lanes);
+            in += stride;
+            out += stride;
+            size -= stride;
+        }
+    }
+
+    /* What doesn't fill a whole group of blocks, one block at a time. */
+    unsigned char keystream[kChaCha20BlockSize];
+    while (size > 0) {
+        ChaCha20Block(state, keystream);
+        state[12]++;
+        const size_t n = std::min(size, kChaCha20BlockSize);
+        for (size_t i = 0; i < n; i++)
+            out[i] = in[i] ^ keystream[i];
+        in += n;
+        out += n;
+        size -= n;
+    }
+    WipeMemory(keystream, sizeof(keystream));
+    WipeMemory(state, sizeof(state));
+}
+
+void ChaCha20Xor(const unsigned char* key, const unsigned char* nonce,
+                 uint32_t counter, const unsigned char* in, unsigned char* out,
+                 size_t size) {
+    ChaCha20XorWithKernel(DefaultChaCha20Kernel(), key, nonce, counter, in,
+                          out, size);
+}
+
+void Poly1305Mac(const unsigned char* key, const unsigned char* data,
+                 size_t size, unsigned char* tag) {
+    Poly1305 poly(key);
+    poly.Update(data, size);
+    poly.Finish(tag);
+}
+
+void ChaCha20Poly1305Seal(const unsigned char* key, const unsigned char* nonce,
+                          const unsigned char* aad, size_t aad_size,
+                          const unsigned char* in, size_t size,
+                          unsigned char* out, unsigned char* tag) {
+    ChaCha20Xor(key, nonce, 1, in, out, size);
+    ComputeAeadTag(key, nonce, aad, aad_size, out, size, tag);
+}
+
+void ChaCha20Poly1305SealWithKeystream(const unsigned char* keystream,
+                                       const unsigned char* aad,
+                                       size_t aad_size,
+                                       const unsigned char* in, size_t size,
+                                       unsigned char* out, unsigned char* tag) {
+    /* Eight bytes at a time, this is all that is left of the cipher. */
+    const unsigned char* text_keystream = keystream + kChaCha20BlockSize;
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+        uint64_t a, b;
+        memcpy(&a, in + i, 8);
+        memcpy(&b, text_keystream + i, 8);
+        a ^= b;
+        memcpy(out + i, &a, 8);
+    }
+    for (; i < size; i++)
+        out[i] = in[i] ^ text_keystream[i];
+    ComputeAeadTagWithPolyKey(keystream, aad, aad_size, out, size, tag);
+}
+
+bool ChaCha20Poly1305Open(const unsigned char* key, const unsigned char* nonce,
+                          const unsigned char* aad, size_t aad_size,
+                          const unsigned char* in, size_t size,
+                          const unsigned char* tag, unsigned char* out) {
+    unsigned char expected[kPoly1305TagSize];
+    ComputeAeadTag(key, nonce, aad, aad_size, in, size, expected);
+
+    /* Compare in constant time. */
+    unsigned char difference = 0;
+    for (size_t i = 0; i < kPoly1305TagSize; i++)
+        difference |= expected[i] ^ tag[i];
+    if (difference != 0)
+        return false;
+
+    ChaCha20Xor(key, nonce, 1, in, out, size);
+    return true;
+}
+
+ChaCha20Poly1305Stream::ChaCha20Poly1305Stream(const unsigned char* key,
+                                               const unsigned char* nonce,
+                                               const unsigned char* aad,
+                                               size_t aad_size)
+    : aad_size_(aad_size), counter_(1), size_(0) {
+    memcpy(key_, key, sizeof(key_));
+    memcpy(nonce_, nonce, sizeof(nonce_));
+    unsigned char poly_key[kChaCha20BlockSize] = {};
+    ChaCha20Xor(key, nonce, 0, poly_key, poly_key, sizeof(poly_key));
+    poly_ = std::make_unique<Poly1305>(poly_key);
+    WipeMemory(poly_key, sizeof(poly_key));
+    poly_->Update(aad, aad_size);
+    poly_->PadToBlock();
+}
+
+ChaCha20Poly1305Stream::~ChaCha20Poly1305Stream() {
+    WipeMemory(key_, sizeof(key_));
+}
+
+void ChaCha20Poly1305Stream::Seal(const unsigned char* in, size_t size,
+                                  unsigned char* out) {
+    Xor(in, size, out);
+    poly_->Update(out, size);
+}
+
+void ChaCha20Poly1305Stream::Open(const unsigned char* in, size_t size,
+                                  unsigned char* out) {
+    poly_->Update(in, size);
+    Xor(in, size, out);
+}
+
+void ChaCha20Poly1305Stream::Finish(unsigned char* tag) {
+    poly_->PadToBlock();
+    unsigned char lengths[16];
+    StoreLe64(lengths, aad_size_);
+    StoreLe64(lengths + 8, size_);
+    poly_->Update(lengths, sizeof(lengths));
+    poly_->Finish(tag);
+}
+
+bool ChaCha20Poly1305Stream::Verify(const unsigned char* tag) {
+    unsigned char expected[kPoly1305TagSize];
+    Finish(expected);
+    unsigned char difference = 0;
+    for (size_t i = 0; i < kPoly1305TagSize; i++)
+        difference |= expected[i] ^ tag[i];
+    return difference == 0;
+}
+
+void ChaCha20Poly1305Stream::Xor(const unsigned char* in, size_t size,
+                                 unsigned char* out) {
+    ChaCha20Xor(key_, nonce_, counter_, in, out, size);
+    counter_ += static_cast<uint32_t>(size / kChaCha20BlockSize);
+    size_ += size;
+}
+
+}  // namespace ette
@@ -0,0 +1,111 @@
+#ifndef __CHACHA20_POLY1305_H__
+#define __CHACHA20_POLY1305_H__
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+namespace ette {
+
+/* ChaCha20-Poly1305 (RFC 8439), for hosts without AES instructions where
+ * software AES is slow. ChaCha20 only needs 32-bit adds, xors and rotates,
+ * so it runs several blocks side by side in vector registers. */
+
+static constexpr size_t kChaCha20KeySize = 32;
+static constexpr size_t kChaCha20NonceSize = 12;
+static constexpr size_t kChaCha20BlockSize = 64;
+static constexpr size_t kPoly1305KeySize = 32;
+static constexpr size_t kPoly1305TagSize = 16;
+
+/* The ChaCha20 implementations, by number of blocks computed at once:
+ * kVector4 uses the compiler's generic 128-bit vectors (SSE2 on x86-64, NEON
+ * on ARM), kAvx2 256-bit AVX2 vectors when the CPU has them. */
+enum class ChaCha20Kernel { kScalar, kVector4, kAvx2 };
+
+/* Every kernel this CPU can run, the fastest last. */
+std::vector<ChaCha20Kernel> SupportedChaCha20Kernels();
+
+/* The kernel ChaCha20Xor() uses. */
+ChaCha20Kernel DefaultChaCha20Kernel();
+
+const char* ChaCha20KernelName(ChaCha20Kernel kernel);
+
+/* XOR 'size' bytes of 'in' with the keystream starting at block 'counter'
+ * into 'out'. 'in' and 'out' may be the same buffer. */
+void ChaCha20Xor(const unsigned char* key, const unsigned char* nonce,
+                 uint32_t counter, const unsigned char* in, unsigned char* out,
+                 size_t size);
+
+void ChaCha20XorWithKernel(ChaCha20Kernel kernel, const unsigned char* key,
+                           const unsigned char* nonce, uint32_t counter,
+                           const unsigned char* in, unsigned char* out,
+                           size_t size);
+
+/* One-shot Poly1305 MAC of 'size' bytes under the one-time 'key'. */
+void Poly1305Mac(const unsigned char* key, const unsigned char* data,
+                 size_t size, unsigned char* tag);
+
+/* AEAD encryption: 'out' gets 'size' bytes of ciphertext, 'tag' authenticates
+ * it together with the additional data 'aad'. */
+void ChaCha20Poly1305Seal(const unsigned char* key, const unsigned char* nonce,
+                          const unsigned char* aad, size_t aad_size,
+                          const unsigned char* in, size_t size,
+                          unsigned char* out, unsigned char* tag);
+
+/* ChaCha20Poly1305Seal() with the keystream computed ahead of time:
+ * 'keystream' is kChaCha20BlockSize + 'size' bytes of ChaCha20Xor() output
+ * for zeros from block 0, which holds the Poly1305 key. Only the XOR and the
+ * MAC are left to do. */
+void ChaCha20Poly1305SealWithKeystream(const unsigned char* keystream,
+                                       const unsigned char* aad,
+                                       size_t aad_size,
+                                       const unsigned char* in, size_t size,
+                                       unsigned char* out, unsigned char* tag);
+
+/* AEAD decryption. Returns false, without writing 'out', if 'tag' doesn't
+ * match: the key is wrong or the data was modified. */
+bool ChaCha20Poly1305Open(const unsigned char* key, const unsigned char* nonce,
+                          const unsigned char* aad, size_t aad_size,
+                          const unsigned char* in, size_t size,
+                          const unsigned char* tag, unsigned char* out);
+
+class Poly1305;
+
+/* ChaCha20Poly1305Seal() and Open() a piece at a time, for texts too large to
+ * hold at once. Every piece but the last must be a multiple of
+ * kChaCha20BlockSize bytes. Text from Open() can't be trusted until Verify()
+ * has checked the tag. */
+class ChaCha20Poly1305Stream {
+   public:
+    ChaCha20Poly1305Stream(const unsigned char* key, const unsigned char* nonce,
+                           const unsigned char* aad, size_t aad_size);
+    ~ChaCha20Poly1305Stream();
+
+    ChaCha20Poly1305Stream(const ChaCha20Poly1305Stream&) = delete;
+    ChaCha20Poly1305Stream& operator=(const ChaCha20Poly1305Stream&) = delete;
+
+    /* 'size' bytes of 'in' into as many bytes of 'out', which may be the same
+     * buffer. */
+    void Seal(const unsigned char* in, size_t size, unsigned char* out);
+    void Open(const unsigned char* in, size_t size, unsigned char* out);
+
+    /* After the last piece: the tag of everything sealed... */
+    void Finish(unsigned char* tag);
+    /* ...or whether 'tag' is that of everything opened. */
+    bool Verify(const unsigned char* tag);
+
+   private:
+    void Xor(const unsigned char* in, size_t size, unsigned char* out);
+
+    unsigned char key_[kChaCha20KeySize];
+    unsigned char nonce_[kChaCha20NonceSize];
+    size_t aad_size_;
+    uint32_t counter_;
+    uint64_t size_;
+    std::unique_ptr<Poly1305> poly_;
+};
+
+}  // namespace ette
+
+#endif  // __CHACHA20_POLY1305_H__
@@ -0,0 +1,191 @@
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "chacha20_poly1305.h"
+
+#include "gtest/gtest.h"
+
+using ::ette::ChaCha20Kernel;
+using ::ette::ChaCha20KernelName;
+using ::ette::ChaCha20Poly1305Open;
+using ::ette::ChaCha20Poly1305Seal;
+using ::ette::ChaCha20Poly1305Stream;
+using ::ette::ChaCha20XorWithKernel;
+using ::ette::kChaCha20BlockSize;
+using ::ette::kPoly1305TagSize;
+using ::ette::Poly1305Mac;
+using ::ette::SupportedChaCha20Kernels;
+
+typedef std::vector<unsigned char> Bytes;
+
+const std::string kSunscreen =
+    "Ladies and Gentlemen of the class of '99: If I could offer you only one "
+    "tip for the future, sunscreen would be it.";
+
+Bytes FromString(const std::string& s) {
+    return Bytes(s.begin(), s.end());
+}
+
+Bytes Sequence(unsigned char first, size_t size) {
+    Bytes bytes(size);
+    for (size_t i = 0; i < size; i++)
+        bytes[i] = first + i;
+    return bytes;
+}
+
+// RFC 8439, 2.4.2.
+TEST(ChaCha20, Rfc8439EncryptionVector) {
+    const Bytes key = Sequence(0x00, 32);
+    const Bytes nonce = {0, 0, 0, 0, 0, 0, 0, 0x4a, 0, 0, 0, 0};
+    const Bytes plaintext = FromString(kSunscreen);
+    const Bytes expected = {
+        0x6e, 0x2e, 0x35, 0x9a, 0x25, 0x68, 0xf9, 0x80, 0x41, 0xba, 0x07, 0x28,
+        0xdd, 0x0d, 0x69, 0x81, 0xe9, 0x7e, 0x7a, 0xec, 0x1d, 0x43, 0x60, 0xc2,
+        0x0a, 0x27, 0xaf, 0xcc, 0xfd, 0x9f, 0xae, 0x0b, 0xf9, 0x1b, 0x65, 0xc5,
+        0x52, 0x47, 0x33, 0xab, 0x8f, 0x59, 0x3d, 0xab, 0xcd, 0x62, 0xb3, 0x57,
+        0x16, 0x39, 0xd6, 0x24, 0xe6, 0x51, 0x52, 0xab, 0x8f, 0x53, 0x0c, 0x35,
+        0x9f, 0x08, 0x61, 0xd8, 0x07, 0xca, 0x0d, 0xbf, 0x50, 0x0d, 0x6a, 0x61,
+        0x56, 0xa3, 0x8e, 0x08, 0x8a, 0x22, 0xb6, 0x5e, 0x52, 0xbc, 0x51, 0x4d,
+        0x16, 0xcc, 0xf8, 0x06, 0x81, 0x8c, 0xe9, 0x1a, 0xb7, 0x79, 0x37, 0x36,
+        0x5a, 0xf9, 0x0b, 0xbf, 0x74, 0xa3, 0x5b, 0xe6, 0xb4, 0x0b, 0x8e, 0xed,
+        0xf2, 0x78, 0x5e, 0x42, 0x87, 0x4d};
+
+    for (ChaCha20Kernel kernel : SupportedChaCha20Kernels()) {
+        Bytes ciphertext(plaintext.size());
+        ChaCha20XorWithKernel(kernel, key.data(), nonce.data(), 1,
+                              plaintext.data(), ciphertext.data(),
+                              plaintext.size());
+        EXPECT_EQ(ciphertext, expected) << ChaCha20KernelName(kernel);
+    }
+}
+
+TEST(ChaCha20, KernelsAgreeOnEverySize) {
+    const Bytes key = Sequence(0x20, 32);
+    const Bytes nonce = Sequence(0x70, 12);
+    const Bytes plaintext = Sequence(0x01, 1200);
+
+    Bytes reference(plaintext.size());
+    ChaCha20XorWithKernel(ChaCha20Kernel::kScalar, key.data(), nonce.data(), 7,
+                          plaintext.data(), reference.data(), plaintext.size());
+
+    for (ChaCha20Kernel kernel : SupportedChaCha20Kernels()) {
+        for (size_t size = 0; size <= plaintext.size(); size += 37) {
+            // In place, as the file code does.
+            Bytes buffer(plaintext.begin(), plaintext.begin() + size);
+            ChaCha20XorWithKernel(kernel, key.data(), nonce.data(), 7,
+                                  buffer.data(), buffer.data(), size);
+            EXPECT_EQ(buffer, Bytes(reference.begin(), reference.begin() + size))
+                << ChaCha20KernelName(kernel) << " " << size;
+        }
+    }
+}
+
+// RFC 8439, 2.5.2.
+TEST(Poly1305, Rfc8439Vector) {
+    const Bytes key = {0x85, 0xd6, 0xbe, 0x78, 0x57, 0x55, 0x6d, 0x33,
+                       0x7f, 0x44, 0x52, 0xfe, 0x42, 0xd5, 0x06, 0xa8,
+                       0x01, 0x03, 0x80, 0x8a, 0xfb, 0x0d, 0xb2, 0xfd,
+                       0x4a, 0xbf, 0xf6, 0xaf, 0x41, 0x49, 0xf5, 0x1b};
+    const Bytes message = FromString("Cryptographic Forum Research Group");
+    const Bytes expected = {0xa8, 0x06, 0x1d, 0xc1, 0x30, 0x51, 0x36, 0xc6,
+                            0xc2, 0x2b, 0x8b, 0xaf, 0x0c, 0x01, 0x27, 0xa9};
+
+    Bytes tag(kPoly1305TagSize);
+    Poly1305Mac(key.data(), message.data(), message.size(), tag.data());
+    EXPECT_EQ(tag, expected);
+}
+
+// RFC 8439, 2.8.2.
+TEST(ChaCha20Poly1305, Rfc8439AeadVector) {
+    const Bytes key = Sequence(0x80, 32);
+    const Bytes nonce = {0x07, 0x00, 0x00, 0x00, 0x40, 0x41,
+                         0x42, 0x43, 0x44, 0x45, 0x46, 0x47};
+    const Bytes aad = {0x50, 0x51, 0x52, 0x53, 0xc0, 0xc1,
+                       0xc2, 0xc3, 0xc4, 0xc5, 0xc6, 0xc7};
+    const Bytes plaintext = FromString(kSunscreen);
+    const Bytes expected_ciphertext = {
+        0xd3, 0x1a, 0x8d, 0x34, 0x64, 0x8e, 0x60, 0xdb, 0x7b, 0x86, 0xaf, 0xbc,
+        0x53, 0xef, 0x7e, 0xc2, 0xa4, 0xad, 0xed, 0x51, 0x29, 0x6e, 0x08, 0xfe,
+        0xa9, 0xe2, 0xb5, 0xa7, 0x36, 0xee, 0x62, 0xd6, 0x3d, 0xbe, 0xa4, 0x5e,
+        0x8c, 0xa9, 0x67, 0x12, 0x82, 0xfa, 0xfb, 0x69, 0xda, 0x92, 0x72, 0x8b,
+        0x1a, 0x71, 0xde, 0x0a, 0x9e, 0x06, 0x0b, 0x29, 0x05, 0xd6, 0xa5, 0xb6,
+        0x7e, 0xcd, 0x3b, 0x36, 0x92, 0xdd, 0xbd, 0x7f, 0x2d, 0x77, 0x8b, 0x8c,
+        0x98, 0x03, 0xae, 0xe3, 0x28, 0x09, 0x1b, 0x58, 0xfa, 0xb3, 0x24, 0xe4,
+        0xfa, 0xd6, 0x75, 0x94, 0x55, 0x85, 0x80, 0x8b, 0x48, 0x31, 0xd7, 0xbc,
+        0x3f, 0xf4, 0xde, 0xf0, 0x8e, 0x4b, 0x7a, 0x9d, 0xe5, 0x76, 0xd2, 0x65,
+        0x86, 0xce, 0xc6, 0x4b, 0x61, 0x16};
+    const Bytes expected_tag = {0x1a, 0xe1, 0x0b, 0x59, 0x4f, 0x09, 0xe2, 0x6a,
+                                0x7e, 0x90, 0x2e, 0xcb, 0xd0, 0x60, 0x06, 0x91};
+
+    Bytes ciphertext(plaintext.size());
+    Bytes tag(kPoly1305TagSize);
+    ChaCha20Poly1305Seal(key.data(), nonce.data(), aad.data(), aad.size(),
+                         plaintext.data(), plaintext.size(), ciphertext.data(),
+                         tag.data());
+    EXPECT_EQ(ciphertext, expected_ciphertext);
+    EXPECT_EQ(tag, expected_tag);
+
+    Bytes decrypted(ciphertext.size());
+    ASSERT_TRUE(ChaCha20Poly1305Open(key.data(), nonce.data(), aad.data(),
+                                     aad.size(), ciphertext.data(),
+                                     ciphertext.size(), tag.data(),
+                                     decrypted.data()));
+    EXPECT_EQ(decrypted, plaintext);
+
+    // Any change to the additional data or the ciphertext is detected.
+    Bytes modified_aad = aad;
+    modified_aad[0] ^= 1;
+    EXPECT_FALSE(ChaCha20Poly1305Open(key.data(), nonce.data(),
+                                      modified_aad.data(), modified_aad.size(),
+                                      ciphertext.data(), ciphertext.size(),
+                                      tag.data(), decrypted.data()));
+    ciphertext[50] ^= 1;
+    EXPECT_FALSE(ChaCha20Poly1305Open(key.data(), nonce.data(), aad.data(),
+                                      aad.size(), ciphertext.data(),
+                                      ciphertext.size(), tag.data(),
+                                      decrypted.data()));
+}
+
+// Sealing and opening in pieces gives what doing it at once does.
+TEST(ChaCha20Poly1305, StreamMatchesOneShot) {
+    const Bytes key = Sequence(0x80, 32);
+    const Bytes nonce = Sequence(0x40, 12);
+    const Bytes aad = FromString("header");
+    const Bytes plaintext = Sequence(3, 1000);
+    Bytes expected(plaintext.size());
+    Bytes expected_tag(kPoly1305TagSize);
+    ChaCha20Poly1305Seal(key.data(), nonce.data(), aad.data(), aad.size(),
+                         plaintext.data(), plaintext.size(), expected.data(),
+                         expected_tag.data());
+
+    for (size_t piece : {kChaCha20BlockSize, 5 * kChaCha20BlockSize}) {
+        Bytes ciphertext(plaintext.size());
+        Bytes tag(kPoly1305TagSize);
+        ChaCha20Poly1305Stream sealer(key.data(), nonce.data(), aad.data(),
+                                      aad.size());
+        for (size_t i = 0; i < plaintext.size(); i += piece) {
+            const size_t size = std::min(piece, plaintext.size() - i);
+            sealer.Seal(plaintext.data() + i, size, ciphertext.data() + i);
+        }
+        sealer.Finish(tag.data());
+        EXPECT_EQ(ciphertext, expected) << piece;
+        EXPECT_EQ(tag, expected_tag) << piece;
+
+        Bytes decrypted(ciphertext.size());
+        ChaCha20Poly1305Stream opener(key.data(), nonce.data(), aad.data(),
+                                      aad.size());
+        for (size_t i = 0; i < ciphertext.size(); i += piece) {
+            const size_t size = std::min(piece, ciphertext.size() - i);
+            opener.Open(ciphertext.data() + i, size, decrypted.data() + i);
+        }
+        EXPECT_TRUE(opener.Verify(tag.data())) << piece;
+        EXPECT_EQ(decrypted, plaintext) << piece;
+
+        ciphertext[500] ^= 1;
+        ChaCha20Poly1305Stream damaged(key.data(), nonce.data(), aad.data(),
+                                       aad.size());
+        damaged.Open(ciphertext.data(), ciphertext.size(), decrypted.data());
+        EXPECT_FALSE(damaged.Verify(tag.data())) << piece;
+    }
+}
@@ -17,9 +17,15 @@ static constexpr char kVersionStr[] = "0.0.1";
  * 3 bytes:  encoded version
  * 8 bytes:  plaintext size
  * 16 bytes: iv
+ * 16 bytes: key ID, only when the version is kHeaderKeyIdVersion
+ *
+ * ChaCha20-Poly1305 files use the first 12 bytes of the IV as the nonce (the
+ * rest is zero), authenticate the whole header and end with a 16 byte tag.
 */
 static constexpr char kHeaderMagicNumber[] = {0x45, 0x54, 0x54, 0x45};  // ETTE
 static constexpr uint64_t kHeaderCryptoAlgorithmSize = 1;
+static constexpr char kHeaderAlgorithmAES256CBC = '1';
+static constexpr char kHeaderAlgorithmChaCha20Poly1305 = '2';
 static constexpr uint64_t kHeaderPlaintextSize = 8;
 static constexpr uint64_t kHeaderIvSize = 16;
 static constexpr uint64_t kHeaderVersionSize =
@@ -29,5 +35,33 @@ static constexpr uint64_t kHeaderSize =
     sizeof(kHeaderMagicNumber) + kHeaderCryptoAlgorithmSize +
     kHeaderVersionSize + +kHeaderPlaintextSize + kHeaderIvSize;
 
+// Files saved with a key ID (used to look the key up in ette-agent) have this
+// in place of the version, and the ID right after the IV.
+static constexpr char kHeaderKeyIdVersion[] = {'k', '0', '1'};
+static constexpr uint64_t kHeaderKeyIdSize = 16;
+static_assert(sizeof(kHeaderKeyIdVersion) == kHeaderVersionSize,
+              "Key ID marker must fill the version field");
+
+// A file may end with a footer after its text: another record in the format
+// above, under the same key (the editor's line index), then that record's
+// size (8 bytes, little endian) and kFooterMagicNumber. Decrypting the file
+// ignores it.
+static constexpr char kFooterMagicNumber[] = {0x45, 0x54, 0x46, 0x54};  // ETFT
+static constexpr uint64_t kFooterTrailerSize = 8 + sizeof(kFooterMagicNumber);
+
+// AES-256-CBC has no MAC, so the footers of its files start with
+// kFooterDigestMagicNumber and the HMAC-SHA-256 of the file's record (header
+// and ciphertext) under a key derived from the file's, for ette-verify to
+// tell damage; the rest of the footer (the line index) follows. Such files
+// always have a footer, which versions of ette that predate footers can't
+// open.
+static constexpr char kFooterDigestMagicNumber[] = {0x45, 0x54, 0x44,
+                                                    0x47};  // ETDG
+static constexpr uint64_t kFooterDigestSize = 32;
+
+// An encrypted buffer locks itself after this long without a key press.
+// ETTE_IDLE_LOCK_SECONDS overrides it, 0 disables locking.
+static constexpr int kDefaultIdleLockSeconds = 5 * 60;
+
 }  // namespace ette
 #endif  // __CONSTANTS_H__
\ No newline at end of file
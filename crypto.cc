@@ -1,9 +1,13 @@
 #include "crypto.h"
+#include "aes_bitsliced.h"
+#include "chacha20_poly1305.h"
 #include "constants.h"
+#include "crypto_registry.h"
+#include "secure_memory.h"
 #include "third_party/picosha2/picosha2.h"
-#include "third_party/plusaes/plusaes.h"
 
 #include <stdlib.h>
+#include <string.h>
 #include <cstdint>
 #include <fstream>
 #include <iostream>
@@ -121,245 +125,1178 @@ std::string ConstructPlaintextSizeHeaderForCiphertext(
     return header;
 }
 
-CryptoState SetupCryptoStateFromCiphertextAES256CBC(std::string ciphertext,
-                                                    std::string raw_key,
-                                                    CryptoAlgorithm algorithm) {
+/* Magic number, algorithm, version (or key ID marker), plaintext size, IV
+ * and key ID, see constants.h. */
+std::string ConstructHeader(const char algorithm, const uint64_t plaintext_size,
+                            const unsigned char* iv,
+                            const std::string& key_id) {
+    std::string header;
+    header.append(kHeaderMagicNumber, sizeof(kHeaderMagicNumber));
+    header += algorithm;
+    if (key_id.empty()) {
+        header += std::to_string(kVersionMajor);
+        header += std::to_string(kVersionMinor);
+        header += std::to_string(kVersionPatch);
+    } else {
+        header.append(kHeaderKeyIdVersion, sizeof(kHeaderKeyIdVersion));
+    }
+    header += ConstructPlaintextSizeHeaderForCiphertext(plaintext_size);
+    header.append(reinterpret_cast<const char*>(iv), kHeaderIvSize);
+    header += key_id;
+    return header;
+}
+
+bool HasAlgorithm(const std::string& ciphertext, const char algorithm) {
+    return ciphertext.size() > sizeof(kHeaderMagicNumber) &&
+           ciphertext[sizeof(kHeaderMagicNumber)] == algorithm;
+}
+
+bool HasKeyId(const std::string& ciphertext) {
+    return ciphertext.size() >= kHeaderSize + kHeaderKeyIdSize &&
+           memcmp(ciphertext.data() + sizeof(kHeaderMagicNumber) +
+                      kHeaderCryptoAlgorithmSize,
+                  kHeaderKeyIdVersion, sizeof(kHeaderKeyIdVersion)) == 0;
+}
+
+std::string GetKeyIdFromCiphertext(const std::string& ciphertext) {
+    if (!HasKeyId(ciphertext)) {
+        return "";
+    }
+    return ciphertext.substr(kHeaderSize, kHeaderKeyIdSize);
+}
+
+/* The size of the record (header and text) that 'file', 'file_size' bytes
+ * long, starts with; 0 if its header doesn't fit. 'file' may hold just the
+ * header. */
+template <typename Policy>
+static uint64_t RecordSize(const std::string& file, uint64_t file_size) {
+    if (file.size() < kHeaderSize ||
+        !HasAlgorithm(file, Policy::kHeaderByte)) {
+        return 0;
+    }
+    const uint64_t size_offset = sizeof(kHeaderMagicNumber) +
+                                 kHeaderCryptoAlgorithmSize +
+                                 kHeaderVersionSize;
+    const uint64_t plaintext_size = GetPlaintextSizeFromCiphertext(
+        file.substr(size_offset, kHeaderPlaintextSize));
+    if (plaintext_size > file_size) {
+        return 0;
+    }
+    return kHeaderSize + GetKeyIdFromCiphertext(file).size() +
+           Policy::CiphertextSize(plaintext_size);
+}
+
+/* The size of the footer record between the first 'record_size' bytes of a
+ * 'file_size' bytes file and its last kFooterTrailerSize bytes, 'trailer';
+ * 0 if there is none. */
+static uint64_t FooterSize(const char* trailer, uint64_t record_size,
+                           uint64_t file_size) {
+    if (record_size == 0 ||
+        file_size < record_size + kHeaderSize + kFooterTrailerSize ||
+        memcmp(trailer + 8, kFooterMagicNumber, sizeof(kFooterMagicNumber)) !=
+            0) {
+        return 0;
+    }
+    uint64_t size = 0;
+    for (int i = 7; i >= 0; i--) {
+        size = size << 8 | static_cast<unsigned char>(trailer[i]);
+    }
+    return size == file_size - kFooterTrailerSize - record_size ? size : 0;
+}
+
+/* HMAC-SHA-256 under 'key' of what Update() is given. */
+class Hmac {
+   public:
+    explicit Hmac(const std::string& key) {
+        constexpr size_t kBlock = sizeof(outer_pad_);
+        unsigned char block[kBlock] = {};
+        if (key.size() > kBlock) {
+            picosha2::hash256(key.begin(), key.end(), block,
+                              block + picosha2::k_digest_size);
+        } else {
+            memcpy(block, key.data(), key.size());
+        }
+        unsigned char inner_pad[kBlock];
+        for (size_t i = 0; i < kBlock; i++) {
+            inner_pad[i] = block[i] ^ 0x36;
+            outer_pad_[i] = block[i] ^ 0x5c;
+        }
+        inner_.process(inner_pad, inner_pad + kBlock);
+        WipeMemory(block, kBlock);
+        WipeMemory(inner_pad, kBlock);
+    }
+    ~Hmac() { WipeMemory(outer_pad_, sizeof(outer_pad_)); }
+
+    void Update(const char* data, size_t size) {
+        inner_.process(data, data + size);
+    }
+
+    /* The picosha2::k_digest_size bytes MAC. */
+    std::string Finish() {
+        unsigned char inner[picosha2::k_digest_size];
+        inner_.finish();
+        inner_.get_hash_bytes(inner, inner + sizeof(inner));
+        picosha2::hash256_one_by_one outer;
+        outer.process(outer_pad_, outer_pad_ + sizeof(outer_pad_));
+        outer.process(inner, inner + sizeof(inner));
+        outer.finish();
+        std::string mac(picosha2::k_digest_size, '\0');
+        outer.get_hash_bytes(mac.begin(), mac.end());
+        WipeMemory(inner, sizeof(inner));
+        return mac;
+    }
+
+   private:
+    picosha2::hash256_one_by_one inner_;
+    unsigned char outer_pad_[64];
+};
+
+std::string HmacSha256(const std::string& key, const char* data,
+                       size_t size) {
+    Hmac hmac(key);
+    hmac.Update(data, size);
+    return hmac.Finish();
+}
+
+/* The key of the digest in a footer, see constants.h. */
+static std::string DigestKey(const std::string& derived_key) {
+    std::string key(picosha2::k_digest_size, '\0');
+    const std::string input = "ette file digest\n" + derived_key;
+    picosha2::hash256(input.begin(), input.end(), key.begin(), key.end());
+    return key;
+}
+
+/* The start of a footer's text holding 'mac'. */
+static std::string DigestFooterText(const std::string& mac) {
+    return std::string(kFooterDigestMagicNumber,
+                       sizeof(kFooterDigestMagicNumber)) +
+           mac;
+}
+
+std::string FooterDigest(const std::string& record,
+                         const std::string& derived_key) {
+    std::string key = DigestKey(derived_key);
+    const std::string digest =
+        DigestFooterText(HmacSha256(key, record.data(), record.size()));
+    WipeString(&key);
+    return digest;
+}
+
+/* An Hmac for the digest of a record under 'derived_key', given 'header'
+ * already. */
+static Hmac RecordMac(const std::string& derived_key,
+                      const std::string& header) {
+    std::string key = DigestKey(derived_key);
+    Hmac mac(key);
+    WipeString(&key);
+    mac.Update(header.data(), header.size());
+    return mac;
+}
+
+/* The digest at the start of 'footer_text', "" if it has none. */
+static std::string DigestOfFooter(const std::string& footer_text) {
+    if (footer_text.size() <
+            sizeof(kFooterDigestMagicNumber) + kFooterDigestSize ||
+        memcmp(footer_text.data(), kFooterDigestMagicNumber,
+               sizeof(kFooterDigestMagicNumber)) != 0) {
+        return "";
+    }
+    return footer_text.substr(sizeof(kFooterDigestMagicNumber),
+                              kFooterDigestSize);
+}
+
+std::string FooterWithoutDigest(const std::string& footer_text) {
+    return DigestOfFooter(footer_text).empty()
+               ? footer_text
+               : footer_text.substr(sizeof(kFooterDigestMagicNumber) +
+                                    kFooterDigestSize);
+}
+
+bool Aes256CbcPolicy::MakeIv(const std::vector<unsigned char>& raw_iv,
+                             unsigned char* iv) {
+    if (raw_iv.size() < kHeaderIvSize) {
+        return false;
+    }
+    // The last IV byte has always been written as zero.
+    memcpy(iv, raw_iv.data(), kHeaderIvSize);
+    iv[kHeaderIvSize - 1] = '\0';
+    return true;
+}
+
+void Aes256CbcPolicy::Seal(const unsigned char* key, const unsigned char* iv,
+                           const unsigned char* header, size_t header_size,
+                           const unsigned char* in, size_t size,
+                           unsigned char* out) {
+    Sealer(key, iv, header, header_size).Finish(in, size, out);
+}
+
+bool Aes256CbcPolicy::Open(const unsigned char* key, const unsigned char* iv,
+                           const unsigned char* header, size_t header_size,
+                           const unsigned char* in, size_t size,
+                           uint64_t plaintext_size, unsigned char* out) {
+    return Opener(key, iv, header, header_size)
+        .Finish(in, size, plaintext_size, out);
+}
+
+Aes256CbcPolicy::Sealer::Sealer(const unsigned char* key,
+                                const unsigned char* iv,
+                                const unsigned char* /*header*/,
+                                size_t /*header_size*/)
+    : aes_(key) {
+    memcpy(iv_, iv, kBlockSize);
+}
+
+/* Every piece chains on from the last block of the one before. */
+void Aes256CbcPolicy::Sealer::Update(const unsigned char* in, size_t size,
+                                     unsigned char* out) {
+    Aes256CbcEncrypt(aes_, iv_, in, out, size);
+    if (size > 0)
+        memcpy(iv_, out + size - kBlockSize, kBlockSize);
+}
+
+void Aes256CbcPolicy::Sealer::Finish(const unsigned char* in, size_t size,
+                                     unsigned char* out) {
+    // Copy the text and its PKCS padding to 'out', then encrypt in place.
+    const size_t ciphertext_size = CiphertextSize(size);
+    const unsigned char padding =
+        static_cast<unsigned char>(ciphertext_size - size);
+    memmove(out, in, size);
+    memset(out + size, padding, padding);
+    Aes256CbcEncrypt(aes_, iv_, out, out, ciphertext_size);
+}
+
+Aes256CbcPolicy::Opener::Opener(const unsigned char* key,
+                                const unsigned char* iv,
+                                const unsigned char* /*header*/,
+                                size_t /*header_size*/)
+    : aes_(key) {
+    memcpy(iv_, iv, kBlockSize);
+}
+
+void Aes256CbcPolicy::Opener::Update(const unsigned char* in, size_t size,
+                                     unsigned char* out) {
+    if (size == 0)
+        return;
+    unsigned char next_iv[kBlockSize];
+    memcpy(next_iv, in + size - kBlockSize, kBlockSize);
+    Aes256CbcDecrypt(aes_, iv_, in, out, size);
+    memcpy(iv_, next_iv, kBlockSize);
+}
+
+bool Aes256CbcPolicy::Opener::Finish(const unsigned char* in, size_t size,
+                                     uint64_t plaintext_size,
+                                     unsigned char* out) {
+    // Decrypt the padding too, then check it. With a wrong key it is
+    // garbage.
+    Aes256CbcDecrypt(aes_, iv_, in, out, size);
+
+    const unsigned char padding =
+        static_cast<unsigned char>(size - plaintext_size);
+    unsigned char mismatch = 0;
+    for (size_t i = plaintext_size; i < size; i++)
+        mismatch |= out[i] ^ padding;
+    if (mismatch != 0) {
+        WipeMemory(out, size);
+        return false;
+    }
+    return true;
+}
+
+bool ChaCha20Poly1305Policy::MakeIv(const std::vector<unsigned char>& raw_iv,
+                                    unsigned char* iv) {
+    if (raw_iv.size() < kChaCha20NonceSize) {
+        return false;
+    }
+    // The nonce fills the start of the header's IV field.
+    memset(iv, 0, kHeaderIvSize);
+    memcpy(iv, raw_iv.data(), kChaCha20NonceSize);
+    return true;
+}
+
+/* The header is authenticated along with the text, so its sizes, IV and key
+ * ID can't be swapped either. */
+void ChaCha20Poly1305Policy::Seal(const unsigned char* key,
+                                  const unsigned char* iv,
+                                  const unsigned char* header,
+                                  size_t header_size, const unsigned char* in,
+                                  size_t size, unsigned char* out) {
+    ChaCha20Poly1305Seal(key, iv, header, header_size, in, size, out,
+                         out + size);
+}
+
+/* A wrong key shows up as a tag mismatch, before anything is decrypted. */
+bool ChaCha20Poly1305Policy::Open(const unsigned char* key,
+                                  const unsigned char* iv,
+                                  const unsigned char* header,
+                                  size_t header_size, const unsigned char* in,
+                                  size_t /*size*/, uint64_t plaintext_size,
+                                  unsigned char* out) {
+    if (!ChaCha20Poly1305Open(key, iv, header, header_size, in,
+                              plaintext_size, in + plaintext_size, out)) {
+        WipeMemory(out, plaintext_size);
+        return false;
+    }
+    return true;
+}
+
+void ChaCha20Poly1305Policy::Sealer::Finish(const unsigned char* in,
+                                            size_t size, unsigned char* out) {
+    stream_.Seal(in, size, out);
+    stream_.Finish(out + size);
+}
+
+bool ChaCha20Poly1305Policy::Opener::Finish(const unsigned char* in,
+                                            size_t /*size*/,
+                                            uint64_t plaintext_size,
+                                            unsigned char* out) {
+    stream_.Open(in, plaintext_size, out);
+    if (!stream_.Verify(in + plaintext_size)) {
+        WipeMemory(out, plaintext_size);
+        return false;
+    }
+    return true;
+}
+
+static_assert(kKeystreamAlignment % ChaCha20Poly1305Policy::kBlockSize == 0,
+              "Keystream pieces must start on a block");
+
+void ChaCha20Poly1305Policy::Keystream(const unsigned char* key,
+                                       const unsigned char* iv,
+                                       uint64_t offset, unsigned char* out,
+                                       size_t size) {
+    memset(out, 0, size);
+    ChaCha20Xor(key, iv, static_cast<uint32_t>(offset / kBlockSize), out, out,
+                size);
+}
+
+void ChaCha20Poly1305Policy::SealWithKeystream(const unsigned char* keystream,
+                                               const unsigned char* header,
+                                               size_t header_size,
+                                               const unsigned char* in,
+                                               size_t size,
+                                               unsigned char* out) {
+    ChaCha20Poly1305SealWithKeystream(keystream, header, header_size, in, size,
+                                      out, out + size);
+}
+
+template <typename Policy>
+Status<void> CheckKeySize(const std::string& key) {
+    if (key.empty()) {
+        return Status<void>(StatusCode::kInvalidKeySize, "Key is empty");
+    }
+    if (key.size() != Policy::kKeySize) {
+        return Status<void>(
+            StatusCode::kInvalidKeySize,
+            "Key is not " + std::to_string(Policy::kKeySize * 8) + " bits");
+    }
+    return Status<void>(StatusCode::kOk, "");
+}
+
+/* Parses and checks the header of 'ciphertext'. On success the state holds
+ * everything after the header in 'ciphertext'. */
+template <typename Policy>
+CryptoState SetupCryptoStateWithPolicy(const std::string& ciphertext,
+                                       const std::string& raw_key,
+                                       const std::string& hashed_key) {
     if (ciphertext.size() < kHeaderSize) {
         return CreateCryptoStateWithStatus(
             StatusCode::kInvalidDataSize,
             "Ciphertext is too small to contain header");
     }
 
-    if (raw_key.empty()) {
-        return CreateCryptoStateWithStatus(StatusCode::kInvalidKeySize,
-                                           "Key is empty");
+    const Status<void> key_status = CheckKeySize<Policy>(hashed_key);
+    if (!key_status.ok()) {
+        return CreateCryptoStateWithStatus(key_status.error().code(),
+                                           key_status.error().message());
     }
 
-    ciphertext.erase(0, sizeof(kHeaderMagicNumber) +
-                            kHeaderCryptoAlgorithmSize + kHeaderVersionSize);
+    if (!HasAlgorithm(ciphertext, Policy::kHeaderByte)) {
+        return CreateCryptoStateWithStatus(
+            StatusCode::kHeaderInvalidAlgorithm,
+            std::string("Ciphertext is not ") + Policy::kName);
+    }
 
-    // Get plaintext size from first 8 bytes of ciphertext and erase first 8 bytes
-    uint64_t plaintext_size = GetPlaintextSizeFromCiphertext(ciphertext);
-    ciphertext.erase(0, kHeaderPlaintextSize);
+    // Get plaintext size from the 8 bytes following magic, algorithm and
+    // version.
+    const uint64_t size_offset = sizeof(kHeaderMagicNumber) +
+                                 kHeaderCryptoAlgorithmSize +
+                                 kHeaderVersionSize;
+    const uint64_t plaintext_size = GetPlaintextSizeFromCiphertext(
+        ciphertext.substr(size_offset, kHeaderPlaintextSize));
 
-    // Remove first 16 bytes from ciphertext and store as IV
-    std::vector<unsigned char> iv;
-    for (uint32_t i = 0; i < kHeaderIvSize; i++) {
-        iv.push_back(ciphertext[i]);
+    // The next 16 bytes are the IV, optionally followed by the key ID.
+    const uint64_t iv_offset = size_offset + kHeaderPlaintextSize;
+    std::vector<unsigned char> iv(ciphertext.begin() + iv_offset,
+                                  ciphertext.begin() + kHeaderSize);
+    const std::string key_id = GetKeyIdFromCiphertext(ciphertext);
+    const uint64_t header_size = kHeaderSize + key_id.size();
+
+    // Any other size in the header is corrupt (and must not be allocated),
+    // unless a footer follows the text.
+    uint64_t ciphertext_size = ciphertext.size() - header_size;
+    if (!Policy::SizesMatch(plaintext_size, ciphertext_size)) {
+        const uint64_t record_size =
+            RecordSize<Policy>(ciphertext, ciphertext.size());
+        if (FooterSize(ciphertext.data() + ciphertext.size() -
+                           kFooterTrailerSize,
+                       record_size, ciphertext.size()) == 0) {
+            return CreateCryptoStateWithStatus(
+                StatusCode::kHeaderInvalidPlaintextSize,
+                "Plaintext size does not match ciphertext size");
+        }
+        ciphertext_size = record_size - header_size;
     }
-    ciphertext.erase(0, kHeaderIvSize);
 
     CryptoState state;
-    state.ciphertext = ciphertext;
+    state.ciphertext = ciphertext.substr(header_size, ciphertext_size);
     state.raw_key = raw_key;
-    state.hashed_key = HashRawKey(raw_key);
+    state.hashed_key = hashed_key;
+    state.key_id = key_id;
     state.iv = iv;
     state.plaintext_size = plaintext_size;
-    state.ciphertext_size = ciphertext.size();
-    state.algorithm = algorithm;
+    state.ciphertext_size = ciphertext_size;
+    state.algorithm = Policy::kAlgorithm;
     state.status = Status<void>(StatusCode::kOk, "");
     return state;
 }
 
-CryptoState SetupCryptoStateFromCiphertext(std::string ciphertext,
-                                           std::string raw_key,
-                                           CryptoAlgorithm algorithm) {
-    switch (algorithm) {
-        case CryptoAlgorithm::kAES256CBC:
-            return SetupCryptoStateFromCiphertextAES256CBC(ciphertext, raw_key,
-                                                           algorithm);
-        default:
-            return CryptoState();
+template <typename Policy>
+CryptoState EncryptWithPolicy(const std::string& plaintext,
+                              const std::string& raw_key,
+                              const std::string& key,
+                              const std::vector<unsigned char>& raw_iv,
+                              const std::string& key_id,
+                              const unsigned char* keystream = nullptr) {
+    const Status<void> key_status = CheckKeySize<Policy>(key);
+    if (!key_status.ok()) {
+        return CreateCryptoStateWithStatus(key_status.error().code(),
+                                           key_status.error().message());
+    }
+    if (!key_id.empty() && key_id.size() != kHeaderKeyIdSize) {
+        return CreateCryptoStateWithStatus(StatusCode::kInvalidDataSize,
+                                           "Key ID is not 128 bits");
+    }
+    unsigned char iv[kHeaderIvSize];
+    if (!Policy::MakeIv(raw_iv, iv)) {
+        return CreateCryptoStateWithStatus(StatusCode::kInvalidIvSize,
+                                           "IV is too short");
+    }
+
+    // Add header indicating how many bytes of plaintext were encrypted, then
+    // encrypt directly behind it so the ciphertext is only allocated once.
+    const uint64_t plaintext_size = plaintext.size();
+    const uint64_t ciphertext_size = Policy::CiphertextSize(plaintext_size);
+    std::string ciphertext_str =
+        ConstructHeader(Policy::kHeaderByte, plaintext_size, iv, key_id);
+    const uint64_t header_size = ciphertext_str.size();
+    ciphertext_str.resize(header_size + ciphertext_size);
+
+    unsigned char* out = reinterpret_cast<unsigned char*>(&ciphertext_str[0]);
+    const unsigned char* in =
+        reinterpret_cast<const unsigned char*>(plaintext.data());
+    if constexpr (Policy::kPrecomputableKeystream) {
+        if (keystream != nullptr) {
+            Policy::SealWithKeystream(keystream, out, header_size, in,
+                                      plaintext_size, out + header_size);
+        } else {
+            Policy::Seal(reinterpret_cast<const unsigned char*>(key.data()),
+                         iv, out, header_size, in, plaintext_size,
+                         out + header_size);
+        }
+    } else {
+        Policy::Seal(reinterpret_cast<const unsigned char*>(key.data()), iv,
+                     out, header_size, in, plaintext_size, out + header_size);
+    }
+
+    CryptoState state;
+    state.raw_key = raw_key;
+    state.hashed_key = key;
+    state.key_id = key_id;
+    state.plaintext = plaintext;
+    state.ciphertext = std::move(ciphertext_str);
+    state.iv = std::vector<unsigned char>(iv, iv + kHeaderIvSize);
+    state.ciphertext_size = ciphertext_size;
+    state.plaintext_size = plaintext_size;
+    state.algorithm = Policy::kAlgorithm;
+    state.status = Status<void>(StatusCode::kOk, "");
+    return state;
+}
+
+template <typename Policy>
+CryptoState DecryptWithPolicy(const std::string& ciphertext,
+                              const std::string& raw_key,
+                              const std::string& hashed_key) {
+    CryptoState state =
+        SetupCryptoStateWithPolicy<Policy>(ciphertext, raw_key, hashed_key);
+    if (!state.status.ok()) {
+        return state;
     }
+
+    const uint64_t header_size = kHeaderSize + state.key_id.size();
+    state.plaintext.resize(state.ciphertext_size);
+    if (!Policy::Open(
+            reinterpret_cast<const unsigned char*>(state.hashed_key.data()),
+            state.iv.data(),
+            reinterpret_cast<const unsigned char*>(ciphertext.data()),
+            header_size,
+            reinterpret_cast<const unsigned char*>(state.ciphertext.data()),
+            state.ciphertext_size, state.plaintext_size,
+            reinterpret_cast<unsigned char*>(&state.plaintext[0]))) {
+        return CreateCryptoStateWithStatus(StatusCode::kInvalidKey,
+                                           "Key is incorrect");
+    }
+    state.plaintext.resize(state.plaintext_size);
+    return state;
 }
 
-std::vector<unsigned char> GenerateRandomAsciiByteVector() {
-    std::mt19937 gen(std::random_device{}());
-    std::uniform_int_distribution<unsigned char> dist(0, 255);
+template <typename Policy>
+Status<uint64_t> DecryptToWithPolicy(const std::string& ciphertext,
+                                     const std::string& derived_key,
+                                     char* out, size_t out_size) {
+    const CryptoState state =
+        SetupCryptoStateWithPolicy<Policy>(ciphertext, "", derived_key);
+    if (!state.status.ok()) {
+        return Status<uint64_t>(state.status.error().code(),
+                                state.status.error().message());
+    }
+    if (out_size < state.ciphertext_size) {
+        return Status<uint64_t>(StatusCode::kInvalidDataSize,
+                                "Buffer is too small for the text");
+    }
 
-    std::vector<unsigned char> random_ascii;
-    for (uint32_t i = 0; i < kHeaderIvSize; i++) {
-        random_ascii.push_back(dist(gen));
+    const uint64_t header_size = kHeaderSize + state.key_id.size();
+    if (!Policy::Open(
+            reinterpret_cast<const unsigned char*>(derived_key.data()),
+            state.iv.data(),
+            reinterpret_cast<const unsigned char*>(ciphertext.data()),
+            header_size,
+            reinterpret_cast<const unsigned char*>(ciphertext.data()) +
+                header_size,
+            state.ciphertext_size, state.plaintext_size,
+            reinterpret_cast<unsigned char*>(out))) {
+        return Status<uint64_t>(StatusCode::kInvalidKey, "Key is incorrect");
     }
-    return random_ascii;
+    return state.plaintext_size;
 }
 
-CryptoState EncryptAES256CBC(const std::string& plaintext,
-                             const std::string& raw_key,
-                             const std::vector<unsigned char>& raw_iv) {
-    if (raw_key.empty()) {
-        return CreateCryptoStateWithStatus(StatusCode::kInvalidKeySize,
-                                           "Key is empty");
+/* ReadFileLayout(), also returning the header (key ID included) in
+ * 'header'. */
+static Status<FileLayout> ReadFileLayoutAndHeader(std::istream& in,
+                                                  uint64_t file_size,
+                                                  std::string* header) {
+    if (file_size < kHeaderSize) {
+        return Status<FileLayout>(StatusCode::kInvalidDataSize,
+                                  "File is too small to contain a header");
+    }
+    header->assign(
+        std::min<uint64_t>(file_size, kHeaderSize + kHeaderKeyIdSize), '\0');
+    if (!in.read(&(*header)[0], header->size())) {
+        return Status<FileLayout>(StatusCode::kIoError, "Can't read the file");
+    }
+    if (memcmp(header->data(), kHeaderMagicNumber,
+               sizeof(kHeaderMagicNumber)) != 0) {
+        return Status<FileLayout>(StatusCode::kHeaderNoMagicNumber,
+                                  "No magic number");
+    }
+    FileLayout layout;
+    layout.algorithm =
+        CryptoAlgorithmFromHeaderByte((*header)[sizeof(kHeaderMagicNumber)]);
+    if (layout.algorithm == CryptoAlgorithm::kDefaultNone) {
+        return Status<FileLayout>(StatusCode::kHeaderInvalidAlgorithm,
+                                  "Unknown algorithm");
+    }
+    // A version is three digits, or the key ID marker.
+    const char* version = header->data() + sizeof(kHeaderMagicNumber) +
+                          kHeaderCryptoAlgorithmSize;
+    bool digits = true;
+    for (uint64_t i = 0; i < kHeaderVersionSize; i++) {
+        digits = digits && version[i] >= '0' && version[i] <= '9';
+    }
+    if (!digits &&
+        memcmp(version, kHeaderKeyIdVersion, kHeaderVersionSize) != 0) {
+        return Status<FileLayout>(StatusCode::kHeaderNoMagicNumber,
+                                  "Unknown version");
+    }
+    if (!digits && header->size() < kHeaderSize + kHeaderKeyIdSize) {
+        return Status<FileLayout>(StatusCode::kInvalidDataSize,
+                                  "File is too small to contain a key ID");
     }
 
-    const uint64_t plaintext_size = plaintext.size();
+    layout.key_id = GetKeyIdFromCiphertext(*header);
+    layout.header_size = kHeaderSize + layout.key_id.size();
+    header->resize(layout.header_size);
+    const uint64_t size_offset = sizeof(kHeaderMagicNumber) +
+                                 kHeaderCryptoAlgorithmSize +
+                                 kHeaderVersionSize;
+    layout.plaintext_size = GetPlaintextSizeFromCiphertext(
+        header->substr(size_offset, kHeaderPlaintextSize));
+    layout.record_size = CryptoAlgorithms::Dispatch(
+        layout.algorithm,
+        [&](auto policy) {
+            return RecordSize<decltype(policy)>(*header, file_size);
+        },
+        uint64_t(0));
+    layout.footer_size = 0;
+    if (layout.record_size != file_size) {
+        std::string trailer(kFooterTrailerSize, '\0');
+        if (layout.record_size != 0) {
+            in.seekg(file_size - kFooterTrailerSize);
+            in.read(&trailer[0], trailer.size());
+        }
+        layout.footer_size =
+            in ? FooterSize(trailer.data(), layout.record_size, file_size) : 0;
+        if (!in) {
+            return Status<FileLayout>(StatusCode::kIoError,
+                                      "Can't read the file");
+        }
+        if (layout.footer_size == 0) {
+            return Status<FileLayout>(
+                StatusCode::kHeaderInvalidPlaintextSize,
+                "Plaintext size does not match ciphertext size");
+        }
+    }
+    in.seekg(layout.header_size);
+    return layout;
+}
 
-    const std::string key = HashRawKey(raw_key);
+/* Runs the ciphertext of the record 'layout' describes, which 'in' is at,
+ * through 'opener' a piece at a time. Pieces are whole blocks of both
+ * ciphers; the last piece holds the end of the ciphertext (the tag, or the
+ * padding), which only then authenticates everything before it. Every piece
+ * of text but the last goes to on_text(text, size, false) untrusted, the
+ * last to on_text(text, size, true) once it all checks out. The ciphertext
+ * also goes to 'record_mac', if given. */
+template <typename Policy, typename OnText>
+Status<void> OpenPieces(std::istream& in, const FileLayout& layout,
+                        typename Policy::Opener* opener, OnText on_text,
+                        Hmac* record_mac = nullptr) {
+    static_assert(kReencryptPieceSize % Policy::kBlockSize == 0,
+                  "Pieces must be whole blocks");
+    const uint64_t tail_size = Policy::CiphertextSize(0);
+    std::vector<unsigned char> piece(kReencryptPieceSize + tail_size);
+    std::vector<unsigned char> text(piece.size());
+    char* piece_data = reinterpret_cast<char*>(piece.data());
 
-    // Construct a null terminated IV unsigned char array.
-    unsigned char iv[kHeaderIvSize];
-    memcpy(iv, raw_iv.data(), sizeof(iv));
-    iv[kHeaderIvSize - 1] = '\0';
+    uint64_t remaining = layout.record_size - layout.header_size;
+    uint64_t text_remaining = layout.plaintext_size;
+    while (in && remaining >= kReencryptPieceSize + tail_size) {
+        if (!in.read(piece_data, kReencryptPieceSize)) {
+            break;
+        }
+        if (record_mac) {
+            record_mac->Update(piece_data, kReencryptPieceSize);
+        }
+        opener->Update(piece.data(), kReencryptPieceSize, text.data());
+        on_text(text.data(), kReencryptPieceSize, false);
+        remaining -= kReencryptPieceSize;
+        text_remaining -= kReencryptPieceSize;
+    }
+    bool opened = false;
+    if (in && in.read(piece_data, remaining)) {
+        if (record_mac) {
+            record_mac->Update(piece_data, remaining);
+        }
+        opened = opener->Finish(piece.data(), remaining, text_remaining,
+                                text.data());
+        if (opened) {
+            on_text(text.data(), text_remaining, true);
+        }
+    }
+    WipeMemory(text.data(), text.size());
+    if (!in) {
+        return Status<void>(StatusCode::kIoError, "Can't read the file");
+    }
+    if (!opened) {
+        return Status<void>(StatusCode::kInvalidKey, "Key is incorrect");
+    }
+    return Status<void>(StatusCode::kOk, "");
+}
 
-    char key_char[33];
-    memcpy(key_char, key.c_str(), sizeof(key_char));
-    const std::vector<unsigned char> key_vector =
-        plusaes::key_from_string(&key_char);
-
-    const unsigned long ciphertext_size =
-        plusaes::get_padded_encrypted_size(plaintext_size);
-    std::vector<unsigned char> ciphertext(ciphertext_size);
-
-    plusaes::Error status = plusaes::encrypt_cbc(
-        (unsigned char*)plaintext.data(), plaintext_size, &key_vector[0],
-        key_vector.size(), &iv, &ciphertext[0], ciphertext_size, true);
-
-    if (status != plusaes::Error::kErrorOk) {
-        switch (status) {
-            case plusaes::Error::kErrorInvalidKey:
-                return CreateCryptoStateWithStatus(StatusCode::kInvalidKey,
-                                                   "Key is incorrect");
-            case plusaes::Error::kErrorInvalidKeySize:
-                return CreateCryptoStateWithStatus(StatusCode::kInvalidKeySize,
-                                                   "Key is not 256 bits");
-            case plusaes::Error::kErrorInvalidIvSize:
-                return CreateCryptoStateWithStatus(StatusCode::kInvalidIvSize,
-                                                   "IV is not 128 bits");
-            default:
-                return CreateCryptoStateWithStatus(StatusCode::kUnknownError,
-                                                   "Unknown error");
+/* The footer of the file 'layout' describes, read from 'in', decrypted; ""
+ * if it doesn't open. */
+template <typename Policy>
+std::string OpenFooter(std::istream& in, const FileLayout& layout,
+                       const std::string& derived_key) {
+    std::string footer(layout.footer_size, '\0');
+    in.seekg(layout.record_size);
+    if (!in.read(&footer[0], footer.size())) {
+        return "";
+    }
+    CryptoState state = DecryptWithPolicy<Policy>(footer, "", derived_key);
+    return state.status.ok() ? std::move(state.plaintext) : "";
+}
+
+/* The file is read, decrypted, re-encrypted and written a piece at a time. A
+ * footer is small and re-encrypted whole, with a new digest for an
+ * AES-256-CBC file once the old one is checked. */
+template <typename Policy>
+Status<bool> ReencryptWithPolicy(std::istream& in, uint64_t file_size,
+                                 std::ostream& out,
+                                 const std::string& derived_key,
+                                 const std::string& new_derived_key,
+                                 const std::string& new_key_id) {
+    for (const std::string* key : {&derived_key, &new_derived_key}) {
+        const Status<void> key_status = CheckKeySize<Policy>(*key);
+        if (!key_status.ok()) {
+            return Status<bool>(key_status.error().code(),
+                                key_status.error().message());
         }
     }
+    if (!new_key_id.empty() && new_key_id.size() != kHeaderKeyIdSize) {
+        return Status<bool>(StatusCode::kInvalidDataSize,
+                            "Key ID is not 128 bits");
+    }
+    std::string header;
+    const Status<FileLayout> read =
+        ReadFileLayoutAndHeader(in, file_size, &header);
+    if (!read.ok()) {
+        return Status<bool>(read.error().code(), read.error().message());
+    }
+    const FileLayout& layout = read.value();
+    if (layout.algorithm != Policy::kAlgorithm) {
+        return Status<bool>(StatusCode::kHeaderInvalidAlgorithm,
+                            std::string("Ciphertext is not ") + Policy::kName);
+    }
 
-    // Add header indicating how many bytes of plaintext were encrypted.
-    std::string ciphertext_str;
+    unsigned char new_iv[kHeaderIvSize];
+    if (!Policy::MakeIv(GenerateRandomAsciiByteVector(), new_iv)) {
+        return Status<bool>(StatusCode::kInvalidIvSize, "IV is too short");
+    }
+    const std::string new_header =
+        ConstructHeader(Policy::kHeaderByte, layout.plaintext_size, new_iv,
+                        new_key_id);
+    out.write(new_header.data(), new_header.size());
 
-    ciphertext_str += std::string(kHeaderMagicNumber);
-    ciphertext_str += std::string("1");
-    ciphertext_str += std::to_string(kVersionMajor);
-    ciphertext_str += std::to_string(kVersionMinor);
-    ciphertext_str += std::to_string(kVersionPatch);
+    const unsigned char* iv = reinterpret_cast<const unsigned char*>(
+        header.data() + kHeaderSize - kHeaderIvSize);
+    typename Policy::Opener opener(
+        reinterpret_cast<const unsigned char*>(derived_key.data()), iv,
+        reinterpret_cast<const unsigned char*>(header.data()),
+        header.size());
+    typename Policy::Sealer sealer(
+        reinterpret_cast<const unsigned char*>(new_derived_key.data()),
+        new_iv, reinterpret_cast<const unsigned char*>(new_header.data()),
+        new_header.size());
+    std::optional<Hmac> record_mac, new_record_mac;
+    if (!Policy::kAuthenticated) {
+        if (layout.footer_size > 0) {
+            record_mac.emplace(RecordMac(derived_key, header));
+        }
+        new_record_mac.emplace(RecordMac(new_derived_key, new_header));
+    }
+    std::vector<unsigned char> sealed(kReencryptPieceSize +
+                                      Policy::CiphertextSize(0));
+    const Status<void> status = OpenPieces<Policy>(
+        in, layout, &opener,
+        [&](const unsigned char* text, size_t size, bool last) {
+            if (last) {
+                sealer.Finish(text, size, sealed.data());
+                size = Policy::CiphertextSize(size);
+            } else {
+                sealer.Update(text, size, sealed.data());
+            }
+            out.write(reinterpret_cast<const char*>(sealed.data()), size);
+            if (new_record_mac) {
+                new_record_mac->Update(
+                    reinterpret_cast<const char*>(sealed.data()), size);
+            }
+        },
+        record_mac ? &*record_mac : nullptr);
+    if (!status.ok()) {
+        return Status<bool>(status.error().code(), status.error().message());
+    }
 
-    ciphertext_str += ConstructPlaintextSizeHeaderForCiphertext(plaintext_size);
+    // A footer that doesn't open is only a cache, and left out.
+    std::string footer_text =
+        new_record_mac ? DigestFooterText(new_record_mac->Finish()) : "";
+    std::string digest;
+    if (layout.footer_size > 0) {
+        std::string footer = OpenFooter<Policy>(in, layout, derived_key);
+        if (record_mac) {
+            digest = DigestOfFooter(footer);
+        }
+        if (!digest.empty() && digest != record_mac->Finish()) {
+            WipeString(&footer);
+            return Status<bool>(StatusCode::kInvalidKey,
+                                "Digest doesn't match the file");
+        }
+        footer_text += FooterWithoutDigest(footer);
+        WipeString(&footer);
+    }
+    if (!footer_text.empty()) {
+        CryptoState new_state = EncryptWithPolicy<Policy>(
+            footer_text, "", new_derived_key, GenerateRandomAsciiByteVector(),
+            new_key_id);
+        WipeString(&footer_text);
+        WipeString(&new_state.plaintext);
+        if (new_state.status.ok()) {
+            std::string framed;
+            AppendFooter(new_state.ciphertext, &framed);
+            out.write(framed.data(), framed.size());
+        }
+    }
+    if (!out) {
+        return Status<bool>(StatusCode::kIoError, "Can't write the file");
+    }
+    return Policy::kAuthenticated || !digest.empty();
+}
 
-    // Add IV to ciphertext
-    for (uint32_t i = 0; i < kHeaderIvSize; i++) {
-        ciphertext_str += iv[i];
+/* The text is decrypted a piece at a time and thrown away. AES-256-CBC
+ * files are also checked against the digest in their footer, if they have
+ * one. */
+template <typename Policy>
+Status<bool> VerifyWithPolicy(std::istream& in, const FileLayout& layout,
+                              const std::string& header,
+                              const std::string& derived_key) {
+    const Status<void> key_status = CheckKeySize<Policy>(derived_key);
+    if (!key_status.ok()) {
+        return Status<bool>(key_status.error().code(),
+                            key_status.error().message());
+    }
+    const unsigned char* iv = reinterpret_cast<const unsigned char*>(
+        header.data() + kHeaderSize - kHeaderIvSize);
+    typename Policy::Opener opener(
+        reinterpret_cast<const unsigned char*>(derived_key.data()), iv,
+        reinterpret_cast<const unsigned char*>(header.data()),
+        header.size());
+    std::optional<Hmac> record_mac;
+    if (!Policy::kAuthenticated && layout.footer_size > 0) {
+        record_mac.emplace(RecordMac(derived_key, header));
+    }
+    const Status<void> status = OpenPieces<Policy>(
+        in, layout, &opener, [](const unsigned char*, size_t, bool) {},
+        record_mac ? &*record_mac : nullptr);
+    if (!status.ok()) {
+        return Status<bool>(status.error().code(), status.error().message());
+    }
+    if (layout.footer_size == 0) {
+        return Policy::kAuthenticated;
+    }
+    std::string footer = OpenFooter<Policy>(in, layout, derived_key);
+    if (!in) {
+        return Status<bool>(StatusCode::kIoError, "Can't read the file");
+    }
+    if (footer.empty()) {
+        return Status<bool>(StatusCode::kInvalidKey,
+                            "Footer doesn't match the key");
+    }
+    const std::string digest =
+        record_mac ? DigestOfFooter(footer) : std::string();
+    WipeString(&footer);
+    if (!digest.empty() && digest != record_mac->Finish()) {
+        return Status<bool>(StatusCode::kInvalidKey,
+                            "Digest doesn't match the file");
     }
+    return Policy::kAuthenticated || !digest.empty();
+}
+
+CryptoState SetupCryptoStateFromCiphertext(const std::string& ciphertext,
+                                           const std::string& raw_key,
+                                           CryptoAlgorithm algorithm) {
+    return CryptoAlgorithms::Dispatch(
+        algorithm,
+        [&](auto policy) {
+            return SetupCryptoStateWithPolicy<decltype(policy)>(
+                ciphertext, raw_key, raw_key.empty() ? "" : HashRawKey(raw_key));
+        },
+        CryptoState());
+}
 
-    // Add encrypted data to ciphertext
-    for (uint32_t i = 0; i < ciphertext_size; i++) {
-        ciphertext_str += ciphertext[i];
+std::string DeriveKey(const std::string& raw_key) {
+    return HashRawKey(raw_key);
+}
+
+std::string GenerateKeyId() {
+    std::random_device random;
+    std::string key_id;
+    while (key_id.size() < kHeaderKeyIdSize) {
+        key_id += static_cast<char>(random() & 0xFF);
     }
-    CryptoState state;
-    state.raw_key = raw_key;
-    state.hashed_key = key;
-    state.plaintext = plaintext;
-    state.ciphertext = ciphertext_str;
-    state.iv = raw_iv;
-    state.ciphertext_size = ciphertext_size;
-    state.plaintext_size = plaintext_size;
-    state.algorithm = CryptoAlgorithm::kAES256CBC;
-    state.status = Status<void>(StatusCode::kOk, "");
-    return state;
+    return key_id;
+}
+
+/* Every byte comes from the system's random source: a generator seeded
+ * from it would only have 2^32 different IVs, and ChaCha20-Poly1305 nonces
+ * would repeat after some tens of thousands of records under one key. */
+std::vector<unsigned char> GenerateRandomAsciiByteVector() {
+    std::random_device random;
+    std::vector<unsigned char> random_ascii;
+    while (random_ascii.size() < kHeaderIvSize) {
+        const uint32_t bits = random();
+        for (int i = 0; i < 4 && random_ascii.size() < kHeaderIvSize; i++)
+            random_ascii.push_back(static_cast<unsigned char>(bits >> (8 * i)));
+    }
+    return random_ascii;
 }
 
 CryptoState Encrypt(const std::string& plaintext, const std::string& key,
                     const std::vector<unsigned char>& iv,
                     CryptoAlgorithm algorithm) {
-    switch (algorithm) {
-        case CryptoAlgorithm::kAES256CBC:
-            return EncryptAES256CBC(plaintext, key, iv);
-        default:
-            return CryptoState();
-    }
+    return CryptoAlgorithms::Dispatch(
+        algorithm,
+        [&](auto policy) {
+            if (key.empty()) {
+                return CreateCryptoStateWithStatus(StatusCode::kInvalidKeySize,
+                                                   "Key is empty");
+            }
+            return EncryptWithPolicy<decltype(policy)>(
+                plaintext, key, HashRawKey(key), iv, "");
+        },
+        CryptoState());
 }
 
-CryptoState DecryptAES256CBC(std::string ciphertext, std::string raw_key,
-                             CryptoAlgorithm algorithm) {
-    const CryptoState state =
-        SetupCryptoStateFromCiphertextAES256CBC(ciphertext, raw_key, algorithm);
+CryptoState EncryptWithDerivedKey(const std::string& plaintext,
+                                  const std::string& derived_key,
+                                  const std::vector<unsigned char>& iv,
+                                  const std::string& key_id,
+                                  CryptoAlgorithm algorithm) {
+    return CryptoAlgorithms::Dispatch(
+        algorithm,
+        [&](auto policy) {
+            return EncryptWithPolicy<decltype(policy)>(plaintext, "",
+                                                       derived_key, iv, key_id);
+        },
+        CryptoState());
+}
 
-    if (!state.status.ok() &&
-        (state.status.error().code() == StatusCode::kInvalidDataSize ||
-         state.status.error().code() == StatusCode::kInvalidKeySize)) {
-        return state;
-    }
+bool HasPrecomputableKeystream(CryptoAlgorithm algorithm) {
+    return CryptoAlgorithms::Dispatch(
+        algorithm,
+        [](auto policy) { return decltype(policy)::kPrecomputableKeystream; },
+        false);
+}
 
-    unsigned char iv[kHeaderIvSize];
-    memcpy(iv, state.iv.data(), sizeof(iv));
-    iv[kHeaderIvSize - 1] = '\0';
+uint64_t KeystreamSize(CryptoAlgorithm algorithm, uint64_t plaintext_size) {
+    return CryptoAlgorithms::Dispatch(
+        algorithm,
+        [&](auto policy) -> uint64_t {
+            using Policy = decltype(policy);
+            if constexpr (Policy::kPrecomputableKeystream) {
+                return Policy::KeystreamSize(plaintext_size);
+            } else {
+                return 0;
+            }
+        },
+        uint64_t(0));
+}
 
-    unsigned long padded_size = 0;
-    const uint64_t plaintext_size = state.plaintext_size;
-    if (plaintext_size == 0) {
-        CryptoState crypto_state;
-        crypto_state.raw_key = state.raw_key;
-        crypto_state.hashed_key = state.hashed_key;
-        crypto_state.plaintext = std::string("");
-        crypto_state.ciphertext = state.ciphertext;
-        crypto_state.iv = state.iv;
-        crypto_state.ciphertext_size = state.ciphertext_size;
-        crypto_state.plaintext_size = plaintext_size;
-        crypto_state.algorithm = CryptoAlgorithm::kAES256CBC;
-        crypto_state.status = Status<void>(StatusCode::kOk, "");
-        return crypto_state;
-    }
-
-    std::vector<unsigned char> decrypted(plaintext_size);
-    plusaes::Error status = plusaes::decrypt_cbc(
-        reinterpret_cast<const unsigned char*>(state.ciphertext.data()),
-        state.ciphertext_size,
-        reinterpret_cast<const unsigned char*>(state.hashed_key.data()),
-        state.hashed_key.size(), &iv, &decrypted[0], plaintext_size,
-        &padded_size);
-
-    if (status != plusaes::Error::kErrorOk) {
-        switch (status) {
-            case plusaes::Error::kErrorInvalidKey:
-                return CreateCryptoStateWithStatus(StatusCode::kInvalidKey,
-                                                   "Key is incorrect");
-
-            case plusaes::Error::kErrorInvalidKeySize:
-                return CreateCryptoStateWithStatus(StatusCode::kInvalidKeySize,
-                                                   "Key is not 256 bits");
+Status<void> ComputeKeystream(CryptoAlgorithm algorithm,
+                              const std::string& derived_key,
+                              const std::vector<unsigned char>& raw_iv,
+                              uint64_t offset, unsigned char* out,
+                              size_t size) {
+    return CryptoAlgorithms::Dispatch(
+        algorithm,
+        [&](auto policy) {
+            using Policy = decltype(policy);
+            if constexpr (Policy::kPrecomputableKeystream) {
+                const Status<void> key_status =
+                    CheckKeySize<Policy>(derived_key);
+                if (!key_status.ok()) {
+                    return key_status;
+                }
+                if (offset % kKeystreamAlignment != 0) {
+                    return Status<void>(StatusCode::kInvalidDataSize,
+                                        "Keystream offset is not aligned");
+                }
+                unsigned char iv[kHeaderIvSize];
+                if (!Policy::MakeIv(raw_iv, iv)) {
+                    return Status<void>(StatusCode::kInvalidIvSize,
+                                        "IV is too short");
+                }
+                Policy::Keystream(
+                    reinterpret_cast<const unsigned char*>(derived_key.data()),
+                    iv, offset, out, size);
+                return Status<void>(StatusCode::kOk, "");
+            } else {
+                return Status<void>(
+                    StatusCode::kHeaderInvalidAlgorithm,
+                    std::string(Policy::kName) + " has no keystream");
+            }
+        },
+        Status<void>(StatusCode::kHeaderInvalidAlgorithm, "No algorithm"));
+}
 
-            case plusaes::Error::kErrorInvalidIvSize:
-                return CreateCryptoStateWithStatus(StatusCode::kInvalidIvSize,
-                                                   "IV is not 128 bits");
+CryptoState EncryptWithKeystream(const std::string& plaintext,
+                                 const std::string& derived_key,
+                                 const std::vector<unsigned char>& iv,
+                                 const unsigned char* keystream,
+                                 uint64_t keystream_size,
+                                 const std::string& key_id,
+                                 CryptoAlgorithm algorithm) {
+    return CryptoAlgorithms::Dispatch(
+        algorithm,
+        [&](auto policy) {
+            using Policy = decltype(policy);
+            if constexpr (Policy::kPrecomputableKeystream) {
+                if (keystream_size < Policy::KeystreamSize(plaintext.size())) {
+                    return CreateCryptoStateWithStatus(
+                        StatusCode::kInvalidDataSize,
+                        "Keystream is shorter than the plaintext");
+                }
+                return EncryptWithPolicy<Policy>(plaintext, "", derived_key,
+                                                 iv, key_id, keystream);
+            } else {
+                return CreateCryptoStateWithStatus(
+                    StatusCode::kHeaderInvalidAlgorithm,
+                    std::string(Policy::kName) + " has no keystream");
+            }
+        },
+        CryptoState());
+}
 
-            default:
-                return CreateCryptoStateWithStatus(StatusCode::kUnknownError,
-                                                   "Unknown error");
-        }
+CryptoState Decrypt(const std::string& ciphertext, const std::string& raw_key,
+                    CryptoAlgorithm algorithm) {
+    return CryptoAlgorithms::Dispatch(
+        algorithm,
+        [&](auto policy) {
+            return DecryptWithPolicy<decltype(policy)>(
+                ciphertext, raw_key, raw_key.empty() ? "" : HashRawKey(raw_key));
+        },
+        CryptoState());
+}
+
+CryptoState DecryptWithDerivedKey(const std::string& ciphertext,
+                                  const std::string& derived_key,
+                                  CryptoAlgorithm algorithm) {
+    return CryptoAlgorithms::Dispatch(
+        algorithm,
+        [&](auto policy) {
+            return DecryptWithPolicy<decltype(policy)>(ciphertext, "",
+                                                       derived_key);
+        },
+        CryptoState());
+}
+
+std::string GetFooter(const std::string& file, CryptoAlgorithm algorithm) {
+    return CryptoAlgorithms::Dispatch(
+        algorithm,
+        [&](auto policy) -> std::string {
+            if (file.size() < kFooterTrailerSize) {
+                return "";
+            }
+            const uint64_t record_size =
+                RecordSize<decltype(policy)>(file, file.size());
+            const uint64_t footer_size =
+                FooterSize(file.data() + file.size() - kFooterTrailerSize,
+                           record_size, file.size());
+            return footer_size == 0 ? ""
+                                    : file.substr(record_size, footer_size);
+        },
+        std::string());
+}
+
+void AppendFooter(const std::string& footer, std::string* file) {
+    file->reserve(file->size() + footer.size() + kFooterTrailerSize);
+    file->append(footer);
+    uint64_t size = footer.size();
+    for (int i = 0; i < 8; i++, size >>= 8) {
+        file->push_back(static_cast<char>(size & 0xFF));
+    }
+    file->append(kFooterMagicNumber, sizeof(kFooterMagicNumber));
+}
+
+std::string ReadFooter(const std::string& path, CryptoAlgorithm algorithm) {
+    std::ifstream file(path, std::ios::binary | std::ios::ate);
+    if (!file.is_open()) {
+        return "";
+    }
+    const uint64_t file_size = file.tellg();
+    if (file_size < kHeaderSize + kFooterTrailerSize) {
+        return "";
+    }
+    std::string header(kHeaderSize + kHeaderKeyIdSize, '\0');
+    std::string trailer(kFooterTrailerSize, '\0');
+    file.seekg(0);
+    file.read(&header[0], header.size());
+    header.resize(file.gcount());
+    file.clear();
+    file.seekg(file_size - kFooterTrailerSize);
+    if (!file.read(&trailer[0], trailer.size())) {
+        return "";
     }
 
-    const std::string plaintext(decrypted.begin(), decrypted.end());
+    return CryptoAlgorithms::Dispatch(
+        algorithm,
+        [&](auto policy) -> std::string {
+            const uint64_t record_size =
+                RecordSize<decltype(policy)>(header, file_size);
+            const uint64_t footer_size =
+                FooterSize(trailer.data(), record_size, file_size);
+            std::string footer(footer_size, '\0');
+            file.seekg(record_size);
+            if (footer_size == 0 || !file.read(&footer[0], footer_size)) {
+                return "";
+            }
+            return footer;
+        },
+        std::string());
+}
 
-    CryptoState crypto_state;
-    crypto_state.raw_key = state.raw_key;
-    crypto_state.hashed_key = state.hashed_key;
-    crypto_state.plaintext = plaintext;
-    crypto_state.ciphertext = state.ciphertext;
-    crypto_state.iv = state.iv;
-    crypto_state.ciphertext_size = state.ciphertext_size;
-    crypto_state.plaintext_size = plaintext_size;
-    crypto_state.algorithm = CryptoAlgorithm::kAES256CBC;
-    crypto_state.status = Status<void>(StatusCode::kOk, "");
-    return crypto_state;
+std::string EncryptFooter(const std::string& text,
+                          const std::string& derived_key,
+                          const std::string& key_id,
+                          CryptoAlgorithm algorithm) {
+    CryptoState state =
+        EncryptWithDerivedKey(text, derived_key,
+                              GenerateRandomAsciiByteVector(), key_id,
+                              algorithm);
+    WipeString(&state.plaintext);
+    return state.status.ok() ? state.ciphertext : "";
 }
 
-CryptoState Decrypt(std::string ciphertext, std::string raw_key,
-                    CryptoAlgorithm algorithm) {
-    switch (algorithm) {
-        case CryptoAlgorithm::kAES256CBC:
-            return DecryptAES256CBC(ciphertext, raw_key, algorithm);
-        default:
-            return CryptoState();
+Status<uint64_t> DecryptWithDerivedKeyTo(const std::string& ciphertext,
+                                         const std::string& derived_key,
+                                         CryptoAlgorithm algorithm, char* out,
+                                         size_t out_size) {
+    return CryptoAlgorithms::Dispatch(
+        algorithm,
+        [&](auto policy) {
+            return DecryptToWithPolicy<decltype(policy)>(
+                ciphertext, derived_key, out, out_size);
+        },
+        Status<uint64_t>(StatusCode::kHeaderInvalidAlgorithm,
+                         "Unknown algorithm"));
+}
+
+Status<bool> ReencryptWithDerivedKey(std::istream& in, uint64_t size,
+                                     std::ostream& out,
+                                     const std::string& derived_key,
+                                     const std::string& new_derived_key,
+                                     const std::string& new_key_id,
+                                     CryptoAlgorithm algorithm) {
+    return CryptoAlgorithms::Dispatch(
+        algorithm,
+        [&](auto policy) {
+            return ReencryptWithPolicy<decltype(policy)>(
+                in, size, out, derived_key, new_derived_key, new_key_id);
+        },
+        Status<bool>(StatusCode::kHeaderInvalidAlgorithm, "Unknown algorithm"));
+}
+
+Status<FileLayout> ReadFileLayout(std::istream& in, uint64_t size) {
+    std::string header;
+    return ReadFileLayoutAndHeader(in, size, &header);
+}
+
+Status<bool> VerifyWithDerivedKey(std::istream& in, uint64_t size,
+                                  const std::string& derived_key) {
+    std::string header;
+    const Status<FileLayout> layout =
+        ReadFileLayoutAndHeader(in, size, &header);
+    if (!layout.ok()) {
+        return Status<bool>(layout.error().code(), layout.error().message());
     }
+    return CryptoAlgorithms::Dispatch(
+        layout.value().algorithm,
+        [&](auto policy) {
+            return VerifyWithPolicy<decltype(policy)>(in, layout.value(),
+                                                      header, derived_key);
+        },
+        Status<bool>(StatusCode::kHeaderInvalidAlgorithm, "Unknown algorithm"));
 }
 
-std::optional<std::string> ReadFileToString(const std::string& path) {
+static std::optional<std::string> ReadFileToString(const std::string& path) {
     std::ifstream file(path);
     if (!file.is_open()) {
         return std::nullopt;
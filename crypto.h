@@ -1,15 +1,18 @@
 #ifndef __CRYPTO_H__
 #define __CRYPTO_H__
+#include <cstdint>
+#include <iosfwd>
 #include <string>
 #include <vector>
 #include "status.h"
 
 namespace ette {
-enum class CryptoAlgorithm { kDefaultNone, kAES256CBC };
+enum class CryptoAlgorithm { kDefaultNone, kAES256CBC, kChaCha20Poly1305 };
 
 struct CryptoState {
     std::string raw_key;
     std::string hashed_key;
+    std::string key_id; /* Empty for files without a key ID. */
     std::string plaintext;
     std::string ciphertext;
     std::vector<unsigned char> iv;
@@ -23,9 +26,143 @@ CryptoState Encrypt(const std::string& plaintext, const std::string& key,
                     const std::vector<unsigned char>& iv,
                     CryptoAlgorithm algorithm);
 
-CryptoState Decrypt(std::string ciphertext, std::string raw_key,
+CryptoState Decrypt(const std::string& ciphertext, const std::string& raw_key,
                     CryptoAlgorithm algorithm);
 
+/* Variants taking the key returned by DeriveKey() instead of the password,
+ * for callers that cache it (see key_agent.h). Unless 'key_id' is empty,
+ * EncryptWithDerivedKey() records it in the header. */
+CryptoState EncryptWithDerivedKey(const std::string& plaintext,
+                                  const std::string& derived_key,
+                                  const std::vector<unsigned char>& iv,
+                                  const std::string& key_id,
+                                  CryptoAlgorithm algorithm);
+
+CryptoState DecryptWithDerivedKey(const std::string& ciphertext,
+                                  const std::string& derived_key,
+                                  CryptoAlgorithm algorithm);
+
+/* DecryptWithDerivedKey() into 'out_size' bytes at 'out', memory the caller
+ * chose (e.g. locked); ciphertext.size() bytes are always enough. Returns the
+ * size of the text. */
+Status<uint64_t> DecryptWithDerivedKeyTo(const std::string& ciphertext,
+                                         const std::string& derived_key,
+                                         CryptoAlgorithm algorithm, char* out,
+                                         size_t out_size);
+
+/* ReencryptWithDerivedKey() holds this much text at a time. */
+static constexpr uint64_t kReencryptPieceSize = 1 << 20;
+
+/* Copy the encrypted file read from 'in', 'size' bytes long, to 'out',
+ * encrypted again with 'new_derived_key' under 'new_key_id' (and a new IV).
+ * It is done a piece at a time, so a file of any size costs a few pieces of
+ * memory. The old key is only known to be right at the end of the file: on
+ * failure (kInvalidKey if 'derived_key' doesn't open it) whatever was
+ * written to 'out' must be thrown away. The value is whether the old key was
+ * authenticated (see VerifyWithDerivedKey()); false for an AES-256-CBC file
+ * without a digest, which a wrong key opens now and then. */
+Status<bool> ReencryptWithDerivedKey(std::istream& in, uint64_t size,
+                                     std::ostream& out,
+                                     const std::string& derived_key,
+                                     const std::string& new_derived_key,
+                                     const std::string& new_key_id,
+                                     CryptoAlgorithm algorithm);
+
+/* Where the parts of an encrypted file are, from its header and size. */
+struct FileLayout {
+    CryptoAlgorithm algorithm;
+    std::string key_id; /* Empty for files without a key ID. */
+    uint64_t header_size;
+    uint64_t plaintext_size;
+    uint64_t record_size; /* Header and ciphertext. */
+    uint64_t footer_size; /* Of the footer record, 0 if there is none. */
+};
+
+/* The layout of the encrypted file read from 'in', 'size' bytes long, once
+ * everything that can be checked without the key is: the magic number,
+ * algorithm and version, and that the sizes in the header add up to the
+ * file's, footer included. */
+Status<FileLayout> ReadFileLayout(std::istream& in, uint64_t size);
+
+/* Whether the encrypted file read from 'in', 'size' bytes long, is intact:
+ * ReadFileLayout(), then its tag (for AES-256-CBC, which has none, its
+ * padding and the digest in its footer) and its footer check out under
+ * 'derived_key'. It is read a piece at a time. kInvalidKey means they don't:
+ * the key is wrong or the file was modified. The value is whether all of
+ * the file was authenticated; false for an AES-256-CBC file without a
+ * digest, whose padding is all there was to check. */
+Status<bool> VerifyWithDerivedKey(std::istream& in, uint64_t size,
+                                  const std::string& derived_key);
+
+std::string DeriveKey(const std::string& raw_key);
+
+/* Stream ciphers can compute their keystream before the text is known, so a
+ * save only has to XOR it in (see keystream_cache.h). False for the others,
+ * which the functions below then reject. */
+bool HasPrecomputableKeystream(CryptoAlgorithm algorithm);
+
+/* Bytes of keystream EncryptWithKeystream() needs for 'plaintext_size'
+ * bytes, 0 if 'algorithm' has no precomputable keystream. */
+uint64_t KeystreamSize(CryptoAlgorithm algorithm, uint64_t plaintext_size);
+
+static constexpr uint64_t kKeystreamAlignment = 64;
+
+/* 'size' bytes of the keystream for 'derived_key' and 'iv', starting
+ * 'offset' bytes in. 'offset' must be a multiple of kKeystreamAlignment so
+ * the keystream can be computed in pieces. */
+Status<void> ComputeKeystream(CryptoAlgorithm algorithm,
+                              const std::string& derived_key,
+                              const std::vector<unsigned char>& iv,
+                              uint64_t offset, unsigned char* out,
+                              size_t size);
+
+/* EncryptWithDerivedKey() with at least KeystreamSize() bytes of
+ * ComputeKeystream() output for the same key and IV. The keystream is only
+ * read, the caller wipes it and must never use it (or the IV) again. */
+CryptoState EncryptWithKeystream(const std::string& plaintext,
+                                 const std::string& derived_key,
+                                 const std::vector<unsigned char>& iv,
+                                 const unsigned char* keystream,
+                                 uint64_t keystream_size,
+                                 const std::string& key_id,
+                                 CryptoAlgorithm algorithm);
+
+/* The footer record of the encrypted 'file' (see constants.h), which
+ * decrypts like a file, or "" if it has none. */
+std::string GetFooter(const std::string& file, CryptoAlgorithm algorithm);
+
+/* Add 'footer', an encrypted record, to 'file', which has none yet. */
+void AppendFooter(const std::string& footer, std::string* file);
+
+/* GetFooter() of the file at 'path', reading only its header and its end. */
+std::string ReadFooter(const std::string& path, CryptoAlgorithm algorithm);
+
+/* 'text' encrypted as a footer record for AppendFooter(); "" if it can't be
+ * encrypted. */
+std::string EncryptFooter(const std::string& text,
+                          const std::string& derived_key,
+                          const std::string& key_id,
+                          CryptoAlgorithm algorithm);
+
+/* The start of the text of the footer of an AES-256-CBC file whose 'record'
+ * (header and ciphertext, as EncryptWithDerivedKey() makes it) is encrypted
+ * under 'derived_key': its digest, see constants.h. */
+std::string FooterDigest(const std::string& record,
+                         const std::string& derived_key);
+
+/* The decrypted 'footer_text' past its digest, all of it if it has none. */
+std::string FooterWithoutDigest(const std::string& footer_text);
+
+/* HMAC-SHA-256 of 'size' bytes at 'data' under 'key'. */
+std::string HmacSha256(const std::string& key, const char* data, size_t size);
+
+/* A random kHeaderKeyIdSize bytes ID, generated once per file. */
+std::string GenerateKeyId();
+
+/* The key ID in the header of 'ciphertext', or "" if it has none. */
+std::string GetKeyIdFromCiphertext(const std::string& ciphertext);
+
+/* A random kHeaderIvSize bytes IV, new for every encryption. */
 std::vector<unsigned char> GenerateRandomAsciiByteVector();
 
 bool IsKeyCorrect(const std::string& key, const std::string& path,
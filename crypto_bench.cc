@@ -0,0 +1,84 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+#include "chacha20_poly1305.h"
+#include "crypto.h"
+#include "crypto_registry.h"
+#include "perf_counters.h"
+
+using ::ette::ChaCha20KernelName;
+using ::ette::CryptoAlgorithms;
+using ::ette::CryptoState;
+using ::ette::Decrypt;
+using ::ette::DefaultChaCha20Kernel;
+using ::ette::Encrypt;
+using ::ette::GenerateRandomAsciiByteVector;
+using ::ette::PerfCounters;
+using ::ette::PerfSample;
+using ::ette::ReportPerfSample;
+
+/* Throughput of the encryption paths, optionally with hardware counters
+ * (--perf) reported per byte of plaintext. */
+int main(int argc, char* argv[]) {
+    bool perf = false;
+    size_t size_mb = 16;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--perf") == 0) {
+            perf = true;
+        } else if (strcmp(argv[i], "--size") == 0 && i + 1 < argc) {
+            size_mb = strtoul(argv[++i], NULL, 10);
+        } else {
+            fprintf(stderr, "Usage: crypto_bench [--perf] [--size MB]\n");
+            exit(1);
+        }
+    }
+
+    PerfCounters counters(perf);
+    if (perf && !counters.Available()) {
+        fprintf(stderr,
+                "Hardware counters unavailable, reporting wall time only.\n");
+    }
+
+    const std::string key = "benchmarkkey";
+    std::string plaintext(size_mb << 20, '\0');
+    for (size_t i = 0; i < plaintext.size(); i++)
+        plaintext[i] = 'a' + (i * 7 + i / 61) % 26;
+    const std::vector<unsigned char> iv = GenerateRandomAsciiByteVector();
+    const double bytes = (double)plaintext.size();
+
+    printf("chacha20 kernel: %s\n",
+           ChaCha20KernelName(DefaultChaCha20Kernel()));
+
+    CryptoAlgorithms::ForEach([&](auto policy) {
+        using Policy = decltype(policy);
+        char label[64];
+
+        counters.Start();
+        const CryptoState encrypted =
+            Encrypt(plaintext, key, iv, Policy::kAlgorithm);
+        PerfSample sample = counters.Stop();
+        if (!encrypted.status.ok()) {
+            fprintf(stderr, "Encrypt failed: %s\n",
+                    encrypted.status.error().message().c_str());
+            exit(1);
+        }
+        snprintf(label, sizeof(label), "%s encrypt", Policy::kName);
+        ReportPerfSample(stdout, label, sample, bytes, "byte");
+
+        counters.Start();
+        const CryptoState decrypted =
+            Decrypt(encrypted.ciphertext, key, Policy::kAlgorithm);
+        sample = counters.Stop();
+        if (!decrypted.status.ok() || decrypted.plaintext != plaintext) {
+            fprintf(stderr, "Decrypt failed\n");
+            exit(1);
+        }
+        snprintf(label, sizeof(label), "%s decrypt", Policy::kName);
+        ReportPerfSample(stdout, label, sample, bytes, "byte");
+    });
+
+    return 0;
+}
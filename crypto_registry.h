@@ -0,0 +1,276 @@
+#ifndef __CRYPTO_REGISTRY_H__
+#define __CRYPTO_REGISTRY_H__
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "aes_bitsliced.h"
+#include "chacha20_poly1305.h"
+#include "constants.h"
+#include "crypto.h"
+
+namespace ette {
+
+/* Every file format is a policy type: its header byte, file extension and
+ * sizes are compile time constants, and Seal()/Open() (in crypto.cc) do the
+ * actual encryption. The drivers in crypto.cc are templates instantiated once
+ * per policy, so nothing switches on the algorithm past the dispatch below.
+ *
+ * To add an algorithm (or a CPU-specific backend with its own header byte),
+ * add a CryptoAlgorithm value and a policy, and list it in CryptoAlgorithms.
+ *
+ * A policy provides:
+ *   kAlgorithm, kHeaderByte, kExtension, kName
+ *   kKeySize, kBlockSize     in bytes
+ *   kParallelBlocks          blocks the implementation computes at once
+ *   kAuthenticated           whether Open() checks a MAC, rather than only
+ *                            what the format happens to (e.g. padding)
+ *   CiphertextSize(n)        bytes after the header for n bytes of text
+ *   SizesMatch(n, c)         whether a header size n fits c bytes
+ *   MakeIv(raw_iv, iv)       the header IV, false if 'raw_iv' is too short
+ *   Seal(...), Open(...)     see Aes256CbcPolicy
+ *   Sealer, Opener           Seal() and Open() a piece at a time, see
+ *                            Aes256CbcPolicy
+ *   kPrecomputableKeystream  whether the cipher is a keystream XORed into the
+ *                            text, which can be computed before the text is
+ *                            known; if so also KeystreamSize(n), Keystream()
+ *                            and SealWithKeystream(), see
+ *                            ChaCha20Poly1305Policy */
+
+struct Aes256CbcPolicy {
+    static constexpr CryptoAlgorithm kAlgorithm = CryptoAlgorithm::kAES256CBC;
+    static constexpr char kHeaderByte = kHeaderAlgorithmAES256CBC;
+    static constexpr const char* kExtension = ".aes256cbc";
+    static constexpr const char* kName = "AES-256-CBC";
+    static constexpr size_t kKeySize = kAes256KeySize;
+    static constexpr size_t kBlockSize = kAesBlockSize;
+    static constexpr size_t kParallelBlocks = kAesParallelBlocks;
+    static constexpr bool kAuthenticated = false;
+    /* CBC chains every block to the text before it. */
+    static constexpr bool kPrecomputableKeystream = false;
+
+    /* PKCS padding always adds 1 to kBlockSize bytes. */
+    static constexpr uint64_t CiphertextSize(uint64_t plaintext_size) {
+        return (plaintext_size / kBlockSize + 1) * kBlockSize;
+    }
+    static constexpr bool SizesMatch(uint64_t plaintext_size,
+                                     uint64_t ciphertext_size) {
+        return ciphertext_size % kBlockSize == 0 &&
+               plaintext_size < ciphertext_size &&
+               ciphertext_size - plaintext_size <= kBlockSize;
+    }
+    static bool MakeIv(const std::vector<unsigned char>& raw_iv,
+                       unsigned char* iv);
+
+    /* Encrypts 'size' bytes of 'in' into CiphertextSize(size) bytes of 'out'.
+     * 'header' is the file header, for authenticated formats. */
+    static void Seal(const unsigned char* key, const unsigned char* iv,
+                     const unsigned char* header, size_t header_size,
+                     const unsigned char* in, size_t size, unsigned char* out);
+
+    /* Decrypts the 'size' bytes after the header into 'out', which has room
+     * for 'size' bytes and gets 'plaintext_size' bytes of text. False, with
+     * 'out' wiped, if the key is wrong (as far as the format can tell) or
+     * the data was modified. */
+    static bool Open(const unsigned char* key, const unsigned char* iv,
+                     const unsigned char* header, size_t header_size,
+                     const unsigned char* in, size_t size,
+                     uint64_t plaintext_size, unsigned char* out);
+
+    /* Seal() and Open() a piece at a time, for texts too large to hold at
+     * once. Update() takes every piece but the last, each a multiple of
+     * kBlockSize bytes, into as many bytes of 'out'. */
+    class Sealer {
+       public:
+        Sealer(const unsigned char* key, const unsigned char* iv,
+               const unsigned char* header, size_t header_size);
+        void Update(const unsigned char* in, size_t size, unsigned char* out);
+        /* The last 'size' bytes of text into the CiphertextSize(size) bytes
+         * that end the ciphertext. */
+        void Finish(const unsigned char* in, size_t size, unsigned char* out);
+
+       private:
+        Aes256 aes_;
+        unsigned char iv_[kBlockSize];
+    };
+    class Opener {
+       public:
+        Opener(const unsigned char* key, const unsigned char* iv,
+               const unsigned char* header, size_t header_size);
+        /* Text that can't be trusted until Finish() succeeds. */
+        void Update(const unsigned char* in, size_t size, unsigned char* out);
+        /* The last 'size' bytes of ciphertext into the 'plaintext_size'
+         * bytes that end the text, as Open(). */
+        bool Finish(const unsigned char* in, size_t size,
+                    uint64_t plaintext_size, unsigned char* out);
+
+       private:
+        Aes256 aes_;
+        unsigned char iv_[kBlockSize];
+    };
+};
+
+struct ChaCha20Poly1305Policy {
+    static constexpr CryptoAlgorithm kAlgorithm =
+        CryptoAlgorithm::kChaCha20Poly1305;
+    static constexpr char kHeaderByte = kHeaderAlgorithmChaCha20Poly1305;
+    static constexpr const char* kExtension = ".chacha20";
+    static constexpr const char* kName = "ChaCha20-Poly1305";
+    static constexpr size_t kKeySize = kChaCha20KeySize;
+    static constexpr size_t kBlockSize = kChaCha20BlockSize;
+    /* With the AVX2 kernel. */
+    static constexpr size_t kParallelBlocks = 8;
+    static constexpr bool kAuthenticated = true;
+    static constexpr bool kPrecomputableKeystream = true;
+
+    /* A stream cipher: the text, then the tag. */
+    static constexpr uint64_t CiphertextSize(uint64_t plaintext_size) {
+        return plaintext_size + kPoly1305TagSize;
+    }
+    static constexpr bool SizesMatch(uint64_t plaintext_size,
+                                     uint64_t ciphertext_size) {
+        return ciphertext_size >= kPoly1305TagSize &&
+               plaintext_size == ciphertext_size - kPoly1305TagSize;
+    }
+    static bool MakeIv(const std::vector<unsigned char>& raw_iv,
+                       unsigned char* iv);
+    static void Seal(const unsigned char* key, const unsigned char* iv,
+                     const unsigned char* header, size_t header_size,
+                     const unsigned char* in, size_t size, unsigned char* out);
+    static bool Open(const unsigned char* key, const unsigned char* iv,
+                     const unsigned char* header, size_t header_size,
+                     const unsigned char* in, size_t size,
+                     uint64_t plaintext_size, unsigned char* out);
+
+    class Sealer {
+       public:
+        Sealer(const unsigned char* key, const unsigned char* iv,
+               const unsigned char* header, size_t header_size)
+            : stream_(key, iv, header, header_size) {}
+        void Update(const unsigned char* in, size_t size, unsigned char* out) {
+            stream_.Seal(in, size, out);
+        }
+        void Finish(const unsigned char* in, size_t size, unsigned char* out);
+
+       private:
+        ChaCha20Poly1305Stream stream_;
+    };
+    class Opener {
+       public:
+        Opener(const unsigned char* key, const unsigned char* iv,
+               const unsigned char* header, size_t header_size)
+            : stream_(key, iv, header, header_size) {}
+        void Update(const unsigned char* in, size_t size, unsigned char* out) {
+            stream_.Open(in, size, out);
+        }
+        bool Finish(const unsigned char* in, size_t size,
+                    uint64_t plaintext_size, unsigned char* out);
+
+       private:
+        ChaCha20Poly1305Stream stream_;
+    };
+
+    /* Block 0 of the keystream is the Poly1305 key, the text starts at
+     * block 1. */
+    static constexpr uint64_t KeystreamSize(uint64_t plaintext_size) {
+        return kBlockSize + plaintext_size;
+    }
+    /* 'size' bytes of keystream from 'offset', a multiple of kBlockSize. */
+    static void Keystream(const unsigned char* key, const unsigned char* iv,
+                          uint64_t offset, unsigned char* out, size_t size);
+    /* Seal() with KeystreamSize(size) bytes of Keystream() from offset 0. */
+    static void SealWithKeystream(const unsigned char* keystream,
+                                  const unsigned char* header,
+                                  size_t header_size, const unsigned char* in,
+                                  size_t size, unsigned char* out);
+};
+
+template <typename... Policies>
+struct CryptoPolicyList {
+    /* f(Policy{}) for the policy of 'algorithm', 'fallback' if there is
+     * none. */
+    template <typename Result, typename F>
+    static Result Dispatch(CryptoAlgorithm algorithm, F&& f,
+                           Result fallback) {
+        Result result = std::move(fallback);
+        (void)((Policies::kAlgorithm == algorithm
+                    ? (result = f(Policies{}), true)
+                    : false) ||
+               ...);
+        return result;
+    }
+
+    template <typename F>
+    static void ForEach(F&& f) {
+        (f(Policies{}), ...);
+    }
+
+    static constexpr bool HeaderBytesUnique() {
+        constexpr char bytes[] = {Policies::kHeaderByte...};
+        for (size_t i = 0; i < sizeof(bytes); i++) {
+            for (size_t j = i + 1; j < sizeof(bytes); j++) {
+                if (bytes[i] == bytes[j])
+                    return false;
+            }
+        }
+        return true;
+    }
+};
+
+using CryptoAlgorithms =
+    CryptoPolicyList<Aes256CbcPolicy, ChaCha20Poly1305Policy>;
+
+static_assert(CryptoAlgorithms::HeaderBytesUnique(),
+              "Two algorithms share a header byte");
+
+/* The algorithm whose extension appears in 'filename', kDefaultNone if
+ * none does. */
+inline CryptoAlgorithm CryptoAlgorithmFromFilename(
+    const std::string& filename) {
+    CryptoAlgorithm algorithm = CryptoAlgorithm::kDefaultNone;
+    CryptoAlgorithms::ForEach([&](auto policy) {
+        using Policy = decltype(policy);
+        if (algorithm == CryptoAlgorithm::kDefaultNone &&
+            filename.find(Policy::kExtension) != std::string::npos) {
+            algorithm = Policy::kAlgorithm;
+        }
+    });
+    return algorithm;
+}
+
+/* "" for kDefaultNone. */
+inline const char* CryptoAlgorithmName(CryptoAlgorithm algorithm) {
+    return CryptoAlgorithms::Dispatch(
+        algorithm, [](auto policy) { return decltype(policy)::kName; }, "");
+}
+
+/* Whether files in 'algorithm' carry a MAC. */
+inline bool CryptoAlgorithmIsAuthenticated(CryptoAlgorithm algorithm) {
+    return CryptoAlgorithms::Dispatch(
+        algorithm,
+        [](auto policy) { return decltype(policy)::kAuthenticated; }, false);
+}
+
+/* The header byte of 'algorithm', '\0' for kDefaultNone. */
+inline char CryptoAlgorithmHeaderByte(CryptoAlgorithm algorithm) {
+    return CryptoAlgorithms::Dispatch(
+        algorithm, [](auto policy) { return decltype(policy)::kHeaderByte; },
+        '\0');
+}
+
+/* The algorithm whose header byte is 'header_byte', kDefaultNone if none. */
+inline CryptoAlgorithm CryptoAlgorithmFromHeaderByte(char header_byte) {
+    CryptoAlgorithm algorithm = CryptoAlgorithm::kDefaultNone;
+    CryptoAlgorithms::ForEach([&](auto policy) {
+        if (decltype(policy)::kHeaderByte == header_byte)
+            algorithm = decltype(policy)::kAlgorithm;
+    });
+    return algorithm;
+}
+
+}  // namespace ette
+
+#endif  // __CRYPTO_REGISTRY_H__
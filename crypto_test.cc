@@ -1,16 +1,31 @@
+#include <algorithm>
 #include <fstream>
+#include <sstream>
 
+#include "constants.h"
 #include "crypto.h"
+#include "crypto_registry.h"
 #include "third_party/picosha2/picosha2.h"
 
 #include "gtest/gtest.h"
 
 using ::ette::CryptoAlgorithm;
+using ::ette::CryptoAlgorithmFromFilename;
+using ::ette::CryptoAlgorithms;
 using ::ette::CryptoState;
 using ::ette::Decrypt;
+using ::ette::DecryptWithDerivedKey;
+using ::ette::DecryptWithDerivedKeyTo;
+using ::ette::DeriveKey;
+using ::ette::FileLayout;
 using ::ette::Encrypt;
+using ::ette::EncryptWithDerivedKey;
+using ::ette::GenerateKeyId;
 using ::ette::GenerateRandomAsciiByteVector;
+using ::ette::GetKeyIdFromCiphertext;
 using ::ette::IsKeyCorrect;
+using ::ette::ReadFileLayout;
+using ::ette::ReencryptWithDerivedKey;
 
 TEST(Crypto, AES256CBC_Encrypt_Decrypt) {
     const std::string key = "somewhatlongkey";
@@ -228,4 +243,452 @@ TEST(Crypto, AES256CBC_IsKeyCorrect_Malformed) {
 
     EXPECT_FALSE(IsKeyCorrect(key, test_file, CryptoAlgorithm::kAES256CBC));
     std::remove(test_file.data());
-}
\ No newline at end of file
+}
+TEST(Crypto, AES256CBC_KeyId_RoundTrip) {
+    const std::string key = "somewhatlongkey";
+    const std::string key_id = GenerateKeyId();
+    const std::string expected_plaintext =
+        "The quick brown fox jumps over the lazy dog";
+    ASSERT_EQ(key_id.size(), ette::kHeaderKeyIdSize);
+
+    const CryptoState encrypted_state = EncryptWithDerivedKey(
+        expected_plaintext, DeriveKey(key), GenerateRandomAsciiByteVector(),
+        key_id, CryptoAlgorithm::kAES256CBC);
+    ASSERT_TRUE(encrypted_state.status.ok());
+    EXPECT_EQ(GetKeyIdFromCiphertext(encrypted_state.ciphertext), key_id);
+
+    // Both the password and the derived key open it.
+    const CryptoState with_password =
+        Decrypt(encrypted_state.ciphertext, key, CryptoAlgorithm::kAES256CBC);
+    EXPECT_EQ(with_password.plaintext, expected_plaintext);
+    EXPECT_EQ(with_password.key_id, key_id);
+    EXPECT_EQ(with_password.hashed_key, DeriveKey(key));
+
+    const CryptoState with_derived_key = DecryptWithDerivedKey(
+        encrypted_state.ciphertext, DeriveKey(key),
+        CryptoAlgorithm::kAES256CBC);
+    EXPECT_EQ(with_derived_key.plaintext, expected_plaintext);
+
+    const CryptoState with_wrong_key = DecryptWithDerivedKey(
+        encrypted_state.ciphertext, DeriveKey("nope"),
+        CryptoAlgorithm::kAES256CBC);
+    EXPECT_FALSE(with_wrong_key.status.ok());
+}
+
+TEST(Crypto, AES256CBC_KeyId_AbsentFromLegacyHeader) {
+    const CryptoState encrypted_state =
+        Encrypt("hello", "key", GenerateRandomAsciiByteVector(),
+                CryptoAlgorithm::kAES256CBC);
+    EXPECT_EQ(GetKeyIdFromCiphertext(encrypted_state.ciphertext), "");
+    EXPECT_EQ(encrypted_state.ciphertext.size(), ette::kHeaderSize + 16);
+
+    const CryptoState bad_key_id = EncryptWithDerivedKey(
+        "hello", DeriveKey("key"), GenerateRandomAsciiByteVector(), "short",
+        CryptoAlgorithm::kAES256CBC);
+    EXPECT_FALSE(bad_key_id.status.ok());
+}
+
+TEST(Crypto, ChaCha20Poly1305_Encrypt_Decrypt) {
+    const std::string key = "somewhatlongkey";
+    for (size_t size : {0, 1, 63, 64, 65, 511, 512, 513, 100000}) {
+        std::string expected_plaintext(size, '\0');
+        for (size_t i = 0; i < size; i++)
+            expected_plaintext[i] = 'a' + i % 26;
+
+        const CryptoState encrypted_state =
+            Encrypt(expected_plaintext, key, GenerateRandomAsciiByteVector(),
+                    CryptoAlgorithm::kChaCha20Poly1305);
+        ASSERT_TRUE(encrypted_state.status.ok());
+        // Header, then as many bytes as the plaintext, then the tag.
+        EXPECT_EQ(encrypted_state.ciphertext.size(),
+                  ette::kHeaderSize + size + 16);
+        EXPECT_EQ(encrypted_state.ciphertext[4],
+                  ette::kHeaderAlgorithmChaCha20Poly1305);
+
+        const CryptoState decrypted_state =
+            Decrypt(encrypted_state.ciphertext, key,
+                    CryptoAlgorithm::kChaCha20Poly1305);
+        ASSERT_TRUE(decrypted_state.status.ok()) << size;
+        EXPECT_EQ(decrypted_state.plaintext, expected_plaintext);
+    }
+}
+
+TEST(Crypto, ChaCha20Poly1305_KeyIncorrect) {
+    const CryptoState encrypted_state =
+        Encrypt("The quick brown fox jumps over the lazy dog", "foo",
+                GenerateRandomAsciiByteVector(),
+                CryptoAlgorithm::kChaCha20Poly1305);
+
+    const CryptoState decrypted_state = Decrypt(
+        encrypted_state.ciphertext, "bar", CryptoAlgorithm::kChaCha20Poly1305);
+    EXPECT_EQ(decrypted_state.status.error().code(),
+              ette::StatusCode::kInvalidKey);
+}
+
+TEST(Crypto, ChaCha20Poly1305_TamperingDetected) {
+    const std::string key = "foo";
+    const CryptoState encrypted_state = EncryptWithDerivedKey(
+        "The quick brown fox jumps over the lazy dog", DeriveKey(key),
+        GenerateRandomAsciiByteVector(), GenerateKeyId(),
+        CryptoAlgorithm::kChaCha20Poly1305);
+    ASSERT_TRUE(encrypted_state.status.ok());
+
+    // A flipped bit anywhere, header and key ID included, fails the tag.
+    for (size_t offset : {size_t(20), ette::kHeaderSize + 3,
+                          ette::kHeaderSize + 20,
+                          encrypted_state.ciphertext.size() - 1}) {
+        std::string tampered = encrypted_state.ciphertext;
+        tampered[offset] ^= 1;
+        EXPECT_FALSE(
+            Decrypt(tampered, key, CryptoAlgorithm::kChaCha20Poly1305)
+                .status.ok())
+            << offset;
+    }
+
+    // Nor does either algorithm accept the other's files.
+    EXPECT_EQ(Decrypt(encrypted_state.ciphertext, key,
+                      CryptoAlgorithm::kAES256CBC)
+                  .status.error()
+                  .code(),
+              ette::StatusCode::kHeaderInvalidAlgorithm);
+    const CryptoState aes_state =
+        Encrypt("hello", key, GenerateRandomAsciiByteVector(),
+                CryptoAlgorithm::kAES256CBC);
+    EXPECT_EQ(Decrypt(aes_state.ciphertext, key,
+                      CryptoAlgorithm::kChaCha20Poly1305)
+                  .status.error()
+                  .code(),
+              ette::StatusCode::kHeaderInvalidAlgorithm);
+}
+
+TEST(Crypto, ChaCha20Poly1305_NoncesDontRepeat) {
+    // Every record under one password shares a key, so the nonces, the
+    // start of the IVs, must never repeat. IVs from a generator with a
+    // 32-bit seed would repeat among 300000 with a chance of 1 - e^-10, while
+    // even their first 8 bytes collide with a chance of 2e-9 if random.
+    std::vector<uint64_t> prefixes;
+    for (int i = 0; i < 300000; i++) {
+        const std::vector<unsigned char> iv = GenerateRandomAsciiByteVector();
+        ASSERT_EQ(iv.size(), ette::kHeaderIvSize);
+        uint64_t prefix = 0;
+        for (int b = 0; b < 8; b++)
+            prefix = prefix << 8 | iv[b];
+        prefixes.push_back(prefix);
+    }
+    std::sort(prefixes.begin(), prefixes.end());
+    EXPECT_TRUE(std::adjacent_find(prefixes.begin(), prefixes.end()) ==
+                prefixes.end())
+        << "An IV repeated";
+}
+
+TEST(CryptoRegistry, AlgorithmFromFilename) {
+    EXPECT_EQ(CryptoAlgorithmFromFilename("notes.aes256cbc"),
+              CryptoAlgorithm::kAES256CBC);
+    EXPECT_EQ(CryptoAlgorithmFromFilename("dir/notes.chacha20"),
+              CryptoAlgorithm::kChaCha20Poly1305);
+    EXPECT_EQ(CryptoAlgorithmFromFilename("notes.txt"),
+              CryptoAlgorithm::kDefaultNone);
+}
+
+// Every registered algorithm writes its own header byte and the size its
+// policy promises, and reads it back.
+TEST(CryptoRegistry, EveryPolicyRoundTrips) {
+    const std::string key = "somewhatlongkey";
+    CryptoAlgorithms::ForEach([&](auto policy) {
+        using Policy = decltype(policy);
+        for (const std::string& plaintext :
+             {std::string(""), std::string(100, 'x')}) {
+            const CryptoState encrypted =
+                Encrypt(plaintext, key, GenerateRandomAsciiByteVector(),
+                        Policy::kAlgorithm);
+            ASSERT_TRUE(encrypted.status.ok()) << Policy::kName;
+            EXPECT_EQ(encrypted.ciphertext[sizeof(ette::kHeaderMagicNumber)],
+                      Policy::kHeaderByte);
+            EXPECT_EQ(encrypted.ciphertext.size(),
+                      ette::kHeaderSize +
+                          Policy::CiphertextSize(plaintext.size()));
+
+            const CryptoState decrypted =
+                Decrypt(encrypted.ciphertext, key, Policy::kAlgorithm);
+            ASSERT_TRUE(decrypted.status.ok()) << Policy::kName;
+            EXPECT_EQ(decrypted.plaintext, plaintext);
+            EXPECT_FALSE(Decrypt(encrypted.ciphertext, "otherkey",
+                                 Policy::kAlgorithm)
+                             .status.ok())
+                << Policy::kName;
+        }
+    });
+}
+
+// Decrypting into the caller's memory gives the same text, and leaves nothing
+// there when the key is wrong.
+TEST(CryptoRegistry, EveryPolicyDecryptsToCallerMemory) {
+    const std::string key = DeriveKey("somewhatlongkey");
+    CryptoAlgorithms::ForEach([&](auto policy) {
+        using Policy = decltype(policy);
+        const std::string plaintext(1000, 'x');
+        const CryptoState encrypted = EncryptWithDerivedKey(
+            plaintext, key, GenerateRandomAsciiByteVector(), GenerateKeyId(),
+            Policy::kAlgorithm);
+        ASSERT_TRUE(encrypted.status.ok()) << Policy::kName;
+
+        std::string out(encrypted.ciphertext.size(), '\0');
+        const ette::Status<uint64_t> size = DecryptWithDerivedKeyTo(
+            encrypted.ciphertext, key, Policy::kAlgorithm, &out[0], out.size());
+        ASSERT_TRUE(size.ok()) << Policy::kName;
+        EXPECT_EQ(out.substr(0, *size), plaintext);
+
+        out.assign(out.size(), '\0');
+        const ette::Status<uint64_t> wrong = DecryptWithDerivedKeyTo(
+            encrypted.ciphertext, DeriveKey("otherkey"), Policy::kAlgorithm,
+            &out[0], out.size());
+        EXPECT_EQ(wrong.error().code(), ette::StatusCode::kInvalidKey)
+            << Policy::kName;
+        EXPECT_EQ(out, std::string(out.size(), '\0')) << Policy::kName;
+
+        EXPECT_EQ(DecryptWithDerivedKeyTo(encrypted.ciphertext, key,
+                                          Policy::kAlgorithm, &out[0], 10)
+                      .error()
+                      .code(),
+                  ette::StatusCode::kInvalidDataSize)
+            << Policy::kName;
+    });
+}
+
+// Re-encrypting goes a piece at a time: texts ending on either side of a
+// piece boundary come out whole, under the new key only.
+TEST(CryptoRegistry, EveryPolicyReencrypts) {
+    const std::string key = DeriveKey("old");
+    const std::string new_key = DeriveKey("new");
+    const std::string new_key_id = GenerateKeyId();
+    const size_t piece = ette::kReencryptPieceSize;
+    CryptoAlgorithms::ForEach([&](auto policy) {
+        using Policy = decltype(policy);
+        for (size_t size : {size_t(0), size_t(1), piece - 1, piece, piece + 1,
+                            piece + 16, 2 * piece + 100}) {
+            std::string plaintext(size, '\0');
+            for (size_t i = 0; i < size; i++)
+                plaintext[i] = static_cast<char>(i * 7 + i / 1000);
+            const CryptoState encrypted = EncryptWithDerivedKey(
+                plaintext, key, GenerateRandomAsciiByteVector(),
+                GenerateKeyId(), Policy::kAlgorithm);
+            ASSERT_TRUE(encrypted.status.ok());
+
+            std::istringstream in(encrypted.ciphertext);
+            std::ostringstream out;
+            ASSERT_TRUE(ReencryptWithDerivedKey(
+                            in, encrypted.ciphertext.size(), out, key,
+                            new_key, new_key_id, Policy::kAlgorithm)
+                            .ok())
+                << Policy::kName << " " << size;
+            const std::string reencrypted = out.str();
+            EXPECT_EQ(GetKeyIdFromCiphertext(reencrypted), new_key_id);
+            const CryptoState decrypted =
+                DecryptWithDerivedKey(reencrypted, new_key, Policy::kAlgorithm);
+            ASSERT_TRUE(decrypted.status.ok()) << Policy::kName << " " << size;
+            EXPECT_TRUE(decrypted.plaintext == plaintext)
+                << Policy::kName << " " << size;
+            EXPECT_FALSE(
+                DecryptWithDerivedKey(reencrypted, key, Policy::kAlgorithm)
+                    .status.ok());
+        }
+
+        // A wrong key is only caught at the end, but it is caught, as is a
+        // file cut short.
+        const std::string plaintext(piece + 5000, 'x');
+        CryptoState encrypted = EncryptWithDerivedKey(
+            plaintext, key, GenerateRandomAsciiByteVector(), "",
+            Policy::kAlgorithm);
+        std::istringstream wrong_key_in(encrypted.ciphertext);
+        std::ostringstream wrong_key_out;
+        EXPECT_EQ(ReencryptWithDerivedKey(
+                      wrong_key_in, encrypted.ciphertext.size(), wrong_key_out,
+                      new_key, key, "", Policy::kAlgorithm)
+                      .error()
+                      .code(),
+                  ette::StatusCode::kInvalidKey)
+            << Policy::kName;
+        std::istringstream truncated_in(encrypted.ciphertext);
+        std::ostringstream truncated_out;
+        EXPECT_FALSE(ReencryptWithDerivedKey(
+                         truncated_in, encrypted.ciphertext.size() - 16,
+                         truncated_out, key, new_key, "", Policy::kAlgorithm)
+                         .ok())
+            << Policy::kName;
+    });
+}
+
+ette::StatusCode LayoutError(const std::string& file) {
+    std::istringstream in(file);
+    const ette::Status<FileLayout> layout = ReadFileLayout(in, file.size());
+    return layout.ok() ? ette::StatusCode::kOk : layout.error().code();
+}
+
+ette::StatusCode VerifyError(const std::string& file, const std::string& key) {
+    std::istringstream in(file);
+    const ette::Status<bool> status =
+        ette::VerifyWithDerivedKey(in, file.size(), key);
+    return status.ok() ? ette::StatusCode::kOk : status.error().code();
+}
+
+// Whether the file verifies under 'key' with all of it authenticated.
+bool VerifiesWhole(const std::string& file, const std::string& key) {
+    std::istringstream in(file);
+    const ette::Status<bool> status =
+        ette::VerifyWithDerivedKey(in, file.size(), key);
+    return status.ok() && status.value();
+}
+
+// Without the key, a file's header is checked against its size.
+TEST(CryptoRegistry, ReadFileLayout) {
+    const std::string key = DeriveKey("key");
+    const std::string key_id = GenerateKeyId();
+    const CryptoState state = EncryptWithDerivedKey(
+        std::string(1000, 'x'), key, GenerateRandomAsciiByteVector(), key_id,
+        CryptoAlgorithm::kAES256CBC);
+    std::istringstream in(state.ciphertext);
+    const ette::Status<FileLayout> layout =
+        ReadFileLayout(in, state.ciphertext.size());
+    ASSERT_TRUE(layout.ok());
+    EXPECT_EQ(layout.value().algorithm, CryptoAlgorithm::kAES256CBC);
+    EXPECT_EQ(layout.value().key_id, key_id);
+    EXPECT_EQ(layout.value().plaintext_size, 1000u);
+    EXPECT_EQ(layout.value().record_size, state.ciphertext.size());
+    EXPECT_EQ(layout.value().footer_size, 0u);
+
+    std::string file = state.ciphertext;
+    ette::AppendFooter(state.ciphertext, &file);
+    EXPECT_EQ(LayoutError(file), ette::StatusCode::kOk);
+
+    EXPECT_EQ(LayoutError(state.ciphertext.substr(0, 20)),
+              ette::StatusCode::kInvalidDataSize);
+    EXPECT_EQ(LayoutError(state.ciphertext.substr(0, 500)),
+              ette::StatusCode::kHeaderInvalidPlaintextSize);
+    EXPECT_EQ(LayoutError(state.ciphertext + "x"),
+              ette::StatusCode::kHeaderInvalidPlaintextSize);
+    for (size_t offset : {size_t(0), size_t(4), size_t(6)}) {
+        std::string damaged = state.ciphertext;
+        damaged[offset] = '!';
+        EXPECT_NE(LayoutError(damaged), ette::StatusCode::kOk) << offset;
+    }
+}
+
+// With the key, the tag, or the padding, is checked too.
+TEST(CryptoRegistry, VerifyWithDerivedKey) {
+    const std::string key = DeriveKey("key");
+    CryptoAlgorithms::ForEach([&](auto policy) {
+        using Policy = decltype(policy);
+        const CryptoState state = EncryptWithDerivedKey(
+            std::string(ette::kReencryptPieceSize + 100, 'x'), key,
+            GenerateRandomAsciiByteVector(), GenerateKeyId(),
+            Policy::kAlgorithm);
+        std::string file = state.ciphertext;
+        EXPECT_EQ(VerifyError(file, key), ette::StatusCode::kOk)
+            << Policy::kName;
+        EXPECT_EQ(VerifyError(file, DeriveKey("other")),
+                  ette::StatusCode::kInvalidKey)
+            << Policy::kName;
+
+        // The last byte before the final block: for CBC it lands in the
+        // padding.
+        file[file.size() - 17] ^= 1;
+        EXPECT_EQ(VerifyError(file, key), ette::StatusCode::kInvalidKey)
+            << Policy::kName;
+
+        // A footer under another key doesn't verify either.
+        file = state.ciphertext;
+        const CryptoState footer = EncryptWithDerivedKey(
+            "index", DeriveKey("other"), GenerateRandomAsciiByteVector(), "",
+            Policy::kAlgorithm);
+        ette::AppendFooter(footer.ciphertext, &file);
+        EXPECT_EQ(VerifyError(file, key), ette::StatusCode::kInvalidKey)
+            << Policy::kName;
+    });
+}
+
+// An AES-256-CBC file as ette saves it: its record, then a footer with the
+// digest of the record and 'rest'.
+std::string CbcFileWithDigest(const std::string& text, const std::string& key,
+                              const std::string& rest) {
+    const CryptoState state = EncryptWithDerivedKey(
+        text, key, GenerateRandomAsciiByteVector(), "",
+        CryptoAlgorithm::kAES256CBC);
+    std::string file = state.ciphertext;
+    ette::AppendFooter(
+        ette::EncryptFooter(ette::FooterDigest(state.ciphertext, key) + rest,
+                            key, "", CryptoAlgorithm::kAES256CBC),
+        &file);
+    return file;
+}
+
+// Padding alone misses damage in the middle of an AES-256-CBC file, the
+// digest in its footer doesn't.
+TEST(CryptoRegistry, VerifyChecksTheCbcDigest) {
+    const std::string key = DeriveKey("key");
+    const std::string text(3 * ette::kReencryptPieceSize / 2, 'x');
+    const CryptoState bare = EncryptWithDerivedKey(
+        text, key, GenerateRandomAsciiByteVector(), "",
+        CryptoAlgorithm::kAES256CBC);
+    std::string file = bare.ciphertext;
+    EXPECT_EQ(VerifyError(file, key), ette::StatusCode::kOk);
+    EXPECT_FALSE(VerifiesWhole(file, key));
+    file[file.size() / 2] ^= 1;
+    EXPECT_EQ(VerifyError(file, key), ette::StatusCode::kOk);
+
+    file = CbcFileWithDigest(text, key, "index");
+    EXPECT_TRUE(VerifiesWhole(file, key));
+    EXPECT_EQ(VerifyError(file, DeriveKey("other")),
+              ette::StatusCode::kInvalidKey);
+    file[bare.ciphertext.size() / 2] ^= 1;
+    EXPECT_EQ(VerifyError(file, key), ette::StatusCode::kInvalidKey);
+
+    const CryptoState chacha = EncryptWithDerivedKey(
+        text, key, GenerateRandomAsciiByteVector(), "",
+        CryptoAlgorithm::kChaCha20Poly1305);
+    EXPECT_TRUE(VerifiesWhole(chacha.ciphertext, key));
+}
+
+// Re-encrypting checks the old digest and writes one for the new record,
+// keeping the rest of the footer.
+TEST(CryptoRegistry, ReencryptKeepsTheCbcDigest) {
+    const std::string key = DeriveKey("old");
+    const std::string new_key = DeriveKey("new");
+    const std::string file =
+        CbcFileWithDigest(std::string(100000, 'y'), key, "index");
+
+    std::istringstream in(file);
+    std::ostringstream out;
+    ASSERT_TRUE(ReencryptWithDerivedKey(in, file.size(), out, key, new_key,
+                                        "", CryptoAlgorithm::kAES256CBC)
+                    .ok());
+    const std::string reencrypted = out.str();
+    EXPECT_TRUE(VerifiesWhole(reencrypted, new_key));
+    const CryptoState footer = DecryptWithDerivedKey(
+        ette::GetFooter(reencrypted, CryptoAlgorithm::kAES256CBC), new_key,
+        CryptoAlgorithm::kAES256CBC);
+    ASSERT_TRUE(footer.status.ok());
+    EXPECT_EQ(ette::FooterWithoutDigest(footer.plaintext), "index");
+
+    // A file without one gets one.
+    const CryptoState bare = EncryptWithDerivedKey(
+        "text", key, GenerateRandomAsciiByteVector(), "",
+        CryptoAlgorithm::kAES256CBC);
+    std::istringstream bare_in(bare.ciphertext);
+    std::ostringstream bare_out;
+    ASSERT_TRUE(ReencryptWithDerivedKey(bare_in, bare.ciphertext.size(),
+                                        bare_out, key, new_key, "",
+                                        CryptoAlgorithm::kAES256CBC)
+                    .ok());
+    EXPECT_TRUE(VerifiesWhole(bare_out.str(), new_key));
+
+    std::string damaged = file;
+    damaged[damaged.size() / 3] ^= 1;
+    std::istringstream damaged_in(damaged);
+    std::ostringstream damaged_out;
+    EXPECT_EQ(ReencryptWithDerivedKey(damaged_in, damaged.size(), damaged_out,
+                                      key, new_key, "",
+                                      CryptoAlgorithm::kAES256CBC)
+                  .error()
+                  .code(),
+              ette::StatusCode::kInvalidKey);
+}
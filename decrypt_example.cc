@@ -1,4 +1,5 @@
 #include "crypto.h"
+#include "crypto_registry.h"
 #include "status.h"
 
 #include <stdlib.h>
@@ -9,6 +10,7 @@
 #include <vector>
 
 using ::ette::CryptoAlgorithm;
+using ::ette::CryptoAlgorithmFromFilename;
 using ::ette::CryptoState;
 using ::ette::Decrypt;
 using ::ette::StatusCode;
@@ -42,8 +44,11 @@ int main(int argc, char* argv[]) {
     std::string password = argv[2];
 
     // Decrypt file contents.
-    const CryptoState state =
-        Decrypt(*file_contents, password, CryptoAlgorithm::kAES256CBC);
+    CryptoAlgorithm algorithm = CryptoAlgorithmFromFilename(argv[1]);
+    if (algorithm == CryptoAlgorithm::kDefaultNone) {
+        algorithm = CryptoAlgorithm::kAES256CBC;
+    }
+    const CryptoState state = Decrypt(*file_contents, password, algorithm);
 
     if (!state.status.ok()) {
         std::cerr << "Could not decrypt file: " << argv[1] << std::endl;
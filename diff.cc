@@ -0,0 +1,237 @@
+#include "diff.h"
+
+#include <algorithm>
+#include <cstring>
+#include <functional>
+
+namespace ette {
+
+namespace {
+
+/* Edits a middle snake search looks for before settling for the furthest
+ * point it reached. Two very different texts are then diffed in time
+ * proportional to their size rather than to its square, with a few more
+ * lines added and removed than needed. */
+constexpr ptrdiff_t kMaxEditCost = 256;
+
+/* Marks the lines of the old and the new text that aren't common to both,
+ * see DiffLines(). */
+class Differ {
+   public:
+    Differ(const std::vector<std::string_view>& old_lines,
+           const std::vector<std::string_view>& new_lines, size_t prefix,
+           size_t suffix)
+        : old_lines_(old_lines),
+          new_lines_(new_lines),
+          old_hashes_(old_lines.size()),
+          new_hashes_(new_lines.size()),
+          removed_(old_lines.size()),
+          added_(new_lines.size()) {
+        const std::hash<std::string_view> hash;
+        for (size_t i = prefix; i + suffix < old_lines.size(); i++)
+            old_hashes_[i] = hash(old_lines[i]);
+        for (size_t j = prefix; j + suffix < new_lines.size(); j++)
+            new_hashes_[j] = hash(new_lines[j]);
+    }
+
+    /* Mark the differences between old lines 'a0'..'a1' and new lines
+     * 'b0'..'b1'. */
+    void Compare(size_t a0, size_t a1, size_t b0, size_t b1);
+
+    const std::vector<bool>& removed() const { return removed_; }
+    const std::vector<bool>& added() const { return added_; }
+
+   private:
+    bool Equal(size_t i, size_t j) const {
+        return old_hashes_[i] == new_hashes_[j] &&
+               old_lines_[i] == new_lines_[j];
+    }
+
+    /* Find where an edit path between the 'n' old lines from 'a0' and the
+     * 'm' new lines from 'b0' crosses its middle, as offsets into them. */
+    bool Bisect(size_t a0, ptrdiff_t n, size_t b0, ptrdiff_t m,
+                ptrdiff_t* split_x, ptrdiff_t* split_y);
+
+    const std::vector<std::string_view>& old_lines_;
+    const std::vector<std::string_view>& new_lines_;
+    std::vector<size_t> old_hashes_;
+    std::vector<size_t> new_hashes_;
+    std::vector<bool> removed_;
+    std::vector<bool> added_;
+    /* Furthest x reached on each diagonal, forward and backward. */
+    std::vector<ptrdiff_t> forward_;
+    std::vector<ptrdiff_t> backward_;
+};
+
+void Differ::Compare(size_t a0, size_t a1, size_t b0, size_t b1) {
+    /* The second half is compared in this loop rather than recursively, so
+     * the stack stays shallow when the halves are lopsided. */
+    while (true) {
+        while (a0 < a1 && b0 < b1 && Equal(a0, b0)) {
+            a0++;
+            b0++;
+        }
+        while (a0 < a1 && b0 < b1 && Equal(a1 - 1, b1 - 1)) {
+            a1--;
+            b1--;
+        }
+        ptrdiff_t x, y;
+        const ptrdiff_t n = a1 - a0, m = b1 - b0;
+        if (n == 0 || m == 0 || !Bisect(a0, n, b0, m, &x, &y) ||
+            (x == 0 && y == 0) || (x == n && y == m)) {
+            std::fill(removed_.begin() + a0, removed_.begin() + a1, true);
+            std::fill(added_.begin() + b0, added_.begin() + b1, true);
+            return;
+        }
+        Compare(a0, a0 + x, b0, b0 + y);
+        a0 += x;
+        b0 += y;
+    }
+}
+
+bool Differ::Bisect(size_t a0, ptrdiff_t n, size_t b0, ptrdiff_t m,
+                    ptrdiff_t* split_x, ptrdiff_t* split_y) {
+    const ptrdiff_t max_d = std::min((n + m + 1) / 2, kMaxEditCost);
+    const ptrdiff_t offset = max_d;
+    const ptrdiff_t length = 2 * max_d + 2;
+    forward_.assign(length, -1);
+    backward_.assign(length, -1);
+    forward_[offset + 1] = 0;
+    backward_[offset + 1] = 0;
+    /* With an odd difference in lengths the paths meet going forward. */
+    const ptrdiff_t delta = n - m;
+    const bool front = delta % 2 != 0;
+    /* Diagonals that ran off the edges aren't followed any more. */
+    ptrdiff_t k1_start = 0, k1_end = 0, k2_start = 0, k2_end = 0;
+
+    for (ptrdiff_t d = 0; d < max_d; d++) {
+        for (ptrdiff_t k1 = -d + k1_start; k1 <= d - k1_end; k1 += 2) {
+            const ptrdiff_t k1_offset = offset + k1;
+            const bool down =
+                k1 == -d ||
+                (k1 != d && forward_[k1_offset - 1] < forward_[k1_offset + 1]);
+            ptrdiff_t x1 = down ? forward_[k1_offset + 1]
+                                : forward_[k1_offset - 1] + 1;
+            ptrdiff_t y1 = x1 - k1;
+            while (x1 < n && y1 < m && Equal(a0 + x1, b0 + y1)) {
+                x1++;
+                y1++;
+            }
+            forward_[k1_offset] = x1;
+            if (x1 > n) {
+                k1_end += 2;
+            } else if (y1 > m) {
+                k1_start += 2;
+            } else if (front) {
+                const ptrdiff_t k2_offset = offset + delta - k1;
+                if (k2_offset >= 0 && k2_offset < length &&
+                    backward_[k2_offset] != -1 &&
+                    x1 >= n - backward_[k2_offset]) {
+                    *split_x = x1;
+                    *split_y = y1;
+                    return true;
+                }
+            }
+        }
+
+        for (ptrdiff_t k2 = -d + k2_start; k2 <= d - k2_end; k2 += 2) {
+            const ptrdiff_t k2_offset = offset + k2;
+            const bool up = k2 == -d || (k2 != d && backward_[k2_offset - 1] <
+                                                      backward_[k2_offset + 1]);
+            ptrdiff_t x2 = up ? backward_[k2_offset + 1]
+                              : backward_[k2_offset - 1] + 1;
+            ptrdiff_t y2 = x2 - k2;
+            while (x2 < n && y2 < m &&
+                   Equal(a0 + n - x2 - 1, b0 + m - y2 - 1)) {
+                x2++;
+                y2++;
+            }
+            backward_[k2_offset] = x2;
+            if (x2 > n) {
+                k2_end += 2;
+            } else if (y2 > m) {
+                k2_start += 2;
+            } else if (!front) {
+                const ptrdiff_t k1_offset = offset + delta - k2;
+                if (k1_offset >= 0 && k1_offset < length &&
+                    forward_[k1_offset] != -1 &&
+                    forward_[k1_offset] >= n - x2) {
+                    *split_x = forward_[k1_offset];
+                    *split_y = offset + forward_[k1_offset] - k1_offset;
+                    return true;
+                }
+            }
+        }
+    }
+
+    /* Too many edits to find the middle: split at the forward path that got
+     * furthest instead. */
+    ptrdiff_t best = -1;
+    for (ptrdiff_t k1 = -max_d + 1; k1 < max_d; k1++) {
+        const ptrdiff_t x1 = forward_[offset + k1];
+        if (x1 < 0 || x1 > n || x1 - k1 < 0 || x1 - k1 > m)
+            continue;
+        if (best == -1 || 2 * x1 - k1 > best) {
+            best = 2 * x1 - k1;
+            *split_x = x1;
+            *split_y = x1 - k1;
+        }
+    }
+    return best != -1;
+}
+
+}  // namespace
+
+std::vector<std::string_view> SplitLines(std::string_view text) {
+    std::vector<std::string_view> lines;
+    size_t start = 0;
+    while (start < text.size()) {
+        const char* newline = static_cast<const char*>(
+            memchr(text.data() + start, '\n', text.size() - start));
+        const size_t end = newline ? newline - text.data() : text.size();
+        lines.push_back(text.substr(start, end - start));
+        start = end + 1;
+    }
+    return lines;
+}
+
+std::vector<DiffHunk> DiffLines(
+    const std::vector<std::string_view>& old_lines,
+    const std::vector<std::string_view>& new_lines) {
+    const size_t n = old_lines.size(), m = new_lines.size();
+    /* Most edits leave the start and the end alone, they cost no hashing. */
+    size_t prefix = 0, suffix = 0;
+    while (prefix < n && prefix < m && old_lines[prefix] == new_lines[prefix])
+        prefix++;
+    while (suffix < n - prefix && suffix < m - prefix &&
+           old_lines[n - 1 - suffix] == new_lines[m - 1 - suffix])
+        suffix++;
+
+    std::vector<DiffHunk> hunks;
+    if (prefix + suffix == n && prefix + suffix == m)
+        return hunks;
+    Differ differ(old_lines, new_lines, prefix, suffix);
+    differ.Compare(prefix, n - suffix, prefix, m - suffix);
+
+    const std::vector<bool>& removed = differ.removed();
+    const std::vector<bool>& added = differ.added();
+    size_t i = prefix, j = prefix;
+    while (i < n || j < m) {
+        if (i < n && j < m && !removed[i] && !added[j]) {
+            i++;
+            j++;
+            continue;
+        }
+        DiffHunk hunk = {i, 0, j, 0};
+        for (; i < n && removed[i]; i++)
+            hunk.old_count++;
+        for (; j < m && added[j]; j++)
+            hunk.new_count++;
+        if (hunk.old_count == 0 && hunk.new_count == 0)
+            break;
+        hunks.push_back(hunk);
+    }
+    return hunks;
+}
+
+}  // namespace ette
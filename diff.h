@@ -0,0 +1,38 @@
+#ifndef __DIFF_H__
+#define __DIFF_H__
+
+#include <cstddef>
+#include <string_view>
+#include <vector>
+
+namespace ette {
+
+/* Lines 'old_begin'..'old_begin + old_count' of the old text were replaced
+ * by lines 'new_begin'..'new_begin + new_count' of the new one. Either count
+ * may be 0, for lines only added or only removed. */
+struct DiffHunk {
+    size_t old_begin, old_count;
+    size_t new_begin, new_count;
+};
+
+/* The lines of 'text', split as the editor splits a file into rows: a
+ * trailing newline doesn't start an extra empty line. The views point into
+ * 'text'. */
+std::vector<std::string_view> SplitLines(std::string_view text);
+
+/* The hunks that turn 'old_lines' into 'new_lines', in order, with as few
+ * lines added and removed as possible.
+ *
+ * This is Myers' O(ND) algorithm in its linear space form: each step finds
+ * the middle snake of an edit path from both ends at once and recurses on
+ * the two halves, so memory stays proportional to the number of lines
+ * whatever the number of differences D. Lines the two sides start and end
+ * with are skipped before any of that, at every step, and lines are compared
+ * by a hash first, so two long texts that differ in a few places are diffed
+ * about as fast as they are hashed. */
+std::vector<DiffHunk> DiffLines(const std::vector<std::string_view>& old_lines,
+                                const std::vector<std::string_view>& new_lines);
+
+}  // namespace ette
+
+#endif  // __DIFF_H__
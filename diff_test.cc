@@ -0,0 +1,143 @@
+#include <stdlib.h>
+#include <algorithm>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "diff.h"
+
+#include "gtest/gtest.h"
+
+using ::ette::DiffHunk;
+using ::ette::DiffLines;
+using ::ette::SplitLines;
+
+using Lines = std::vector<std::string_view>;
+
+/* The new text, from the old one and the hunks: lines outside hunks must be
+ * equal on both sides. Returns the number of lines added and removed. */
+size_t ExpectHunksTurnInto(const Lines& old_lines, const Lines& new_lines,
+                           const std::vector<DiffHunk>& hunks) {
+    size_t i = 0, j = 0, edits = 0;
+    for (const DiffHunk& hunk : hunks) {
+        EXPECT_GT(hunk.old_count + hunk.new_count, 0u);
+        EXPECT_EQ(hunk.old_begin - i, hunk.new_begin - j);
+        for (; i < hunk.old_begin; i++, j++)
+            EXPECT_EQ(old_lines[i], new_lines[j]);
+        i += hunk.old_count;
+        j += hunk.new_count;
+        edits += hunk.old_count + hunk.new_count;
+    }
+    EXPECT_EQ(old_lines.size() - i, new_lines.size() - j);
+    for (; i < old_lines.size() && j < new_lines.size(); i++, j++)
+        EXPECT_EQ(old_lines[i], new_lines[j]);
+    return edits;
+}
+
+/* Lines added and removed by a shortest edit script, the hard way. */
+size_t ShortestEdit(const Lines& a, const Lines& b) {
+    std::vector<std::vector<size_t>> lcs(a.size() + 1,
+                                         std::vector<size_t>(b.size() + 1));
+    for (size_t i = 1; i <= a.size(); i++) {
+        for (size_t j = 1; j <= b.size(); j++) {
+            lcs[i][j] = a[i - 1] == b[j - 1]
+                            ? lcs[i - 1][j - 1] + 1
+                            : std::max(lcs[i - 1][j], lcs[i][j - 1]);
+        }
+    }
+    return a.size() + b.size() - 2 * lcs[a.size()][b.size()];
+}
+
+Lines Letters(const std::string& letters) {
+    static const std::string kAlphabet = "ABCDEFGHIJKLMNOPQRSTUVWXYZ";
+    Lines lines;
+    for (char c : letters)
+        lines.push_back(std::string_view(&kAlphabet[c - 'A'], 1));
+    return lines;
+}
+
+TEST(Diff, SplitLines) {
+    EXPECT_EQ(SplitLines(""), Lines{});
+    EXPECT_EQ(SplitLines("a\n\nc\nno newline"),
+              (Lines{"a", "", "c", "no newline"}));
+    EXPECT_EQ(SplitLines("a\n"), Lines{"a"});
+    EXPECT_EQ(SplitLines("\n"), Lines{""});
+}
+
+TEST(Diff, SmallEdits) {
+    EXPECT_TRUE(DiffLines(Letters("ABC"), Letters("ABC")).empty());
+    EXPECT_TRUE(DiffLines({}, {}).empty());
+
+    std::vector<DiffHunk> hunks = DiffLines({}, Letters("AB"));
+    ASSERT_EQ(hunks.size(), 1u);
+    EXPECT_EQ(hunks[0].old_count, 0u);
+    EXPECT_EQ(hunks[0].new_count, 2u);
+
+    hunks = DiffLines(Letters("ABCDE"), Letters("ABXDE"));
+    ASSERT_EQ(hunks.size(), 1u);
+    EXPECT_EQ(hunks[0].old_begin, 2u);
+    EXPECT_EQ(hunks[0].old_count, 1u);
+    EXPECT_EQ(hunks[0].new_begin, 2u);
+    EXPECT_EQ(hunks[0].new_count, 1u);
+
+    // The example of Myers' paper.
+    const Lines a = Letters("ABCABBA"), b = Letters("CBABAC");
+    EXPECT_EQ(ExpectHunksTurnInto(a, b, DiffLines(a, b)), 5u);
+}
+
+// Edit scripts are as short as they can be.
+TEST(Diff, RandomTextsAreShortest) {
+    srand(94);
+    for (int round = 0; round < 500; round++) {
+        std::string a(rand() % 40, 'A'), b;
+        for (char& c : a)
+            c = 'A' + rand() % 4;
+        for (char c : a) {
+            if (rand() % 4 == 0)
+                continue;
+            if (rand() % 4 == 0)
+                b += 'A' + rand() % 4;
+            b += c;
+        }
+        const Lines old_lines = Letters(a), new_lines = Letters(b);
+        EXPECT_EQ(ExpectHunksTurnInto(old_lines, new_lines,
+                                      DiffLines(old_lines, new_lines)),
+                  ShortestEdit(old_lines, new_lines))
+            << a << " " << b;
+    }
+}
+
+// A million lines changed in a few places far apart come out as those
+// places; two unrelated texts still give a valid script.
+TEST(Diff, LargeTexts) {
+    std::vector<std::string> text(1000000);
+    for (size_t i = 0; i < text.size(); i++)
+        text[i] = "line " + std::to_string(i);
+    std::vector<std::string> edited = text;
+    edited[10] = "changed";
+    edited.insert(edited.begin() + 500000, "inserted");
+    edited.erase(edited.end() - 20);
+
+    const Lines old_lines(text.begin(), text.end());
+    const Lines new_lines(edited.begin(), edited.end());
+    const std::vector<DiffHunk> hunks = DiffLines(old_lines, new_lines);
+    ASSERT_EQ(hunks.size(), 3u);
+    EXPECT_EQ(hunks[0].old_begin, 10u);
+    EXPECT_EQ(hunks[1].new_begin, 500000u);
+    EXPECT_EQ(hunks[1].new_count, 1u);
+    EXPECT_EQ(hunks[2].old_begin, text.size() - 20);
+    EXPECT_EQ(hunks[2].old_count, 1u);
+    EXPECT_EQ(ExpectHunksTurnInto(old_lines, new_lines, hunks), 4u);
+
+    std::vector<std::string> other(20000);
+    for (size_t i = 0; i < other.size(); i++)
+        other[i] = std::to_string(rand() % 50);
+    const Lines other_lines(other.begin(), other.end());
+    const Lines some_lines(old_lines.begin(), old_lines.begin() + 20000);
+    ExpectHunksTurnInto(some_lines, other_lines,
+                        DiffLines(some_lines, other_lines));
+    ExpectHunksTurnInto(other_lines, Lines(other_lines.rbegin(),
+                                           other_lines.rend()),
+                        DiffLines(other_lines, Lines(other_lines.rbegin(),
+                                                     other_lines.rend())));
+}
@@ -65,6 +65,9 @@
 #include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <regex.h>
 #include <signal.h>
 #include <stdarg.h>
 #include <stdint.h>
@@ -72,27 +75,63 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <termios.h>
 #include <time.h>
 #include <unistd.h>
+#include <algorithm>
 #include <filesystem>
 #include <fstream>
 #include <iostream>
+#include <mutex>
 #include <optional>
 #include <sstream>
 
 #include "crypto.h"
+#include "crypto_registry.h"
+#include "diff.h"
 #include "editor.h"
+#include "filter.h"
+#include "history.h"
+#include "key_agent.h"
+#include "line_index.h"
+#include "secure_memory.h"
 #include "status.h"
+#include "thread_pool.h"
+#include "vault.h"
 
+using ::ette::AgentGetKey;
+using ::ette::AgentPutKey;
+using ::ette::AppendFooter;
 using ::ette::CryptoAlgorithm;
+using ::ette::CryptoAlgorithmFromFilename;
+using ::ette::CryptoAlgorithmIsAuthenticated;
 using ::ette::CryptoState;
 using ::ette::Decrypt;
-using ::ette::Encrypt;
+using ::ette::DecryptWithDerivedKey;
+using ::ette::DeriveKey;
+using ::ette::EncodeLineIndex;
+using ::ette::EncryptFooter;
+using ::ette::EncryptWithDerivedKey;
+using ::ette::FooterDigest;
+using ::ette::GenerateKeyId;
 using ::ette::GenerateRandomAsciiByteVector;
-using ::ette::IsKeyCorrect;
+using ::ette::GetKeyIdFromCiphertext;
+using ::ette::HasHistory;
+using ::ette::History;
+using ::ette::HistoryTimeNow;
+using ::ette::LineCheckpoint;
+using ::ette::LineIndex;
+using ::ette::ParallelFor;
+using ::ette::ParseVaultSpec;
+using ::ette::ReadLineIndex;
+using ::ette::TaskPriority;
+using ::ette::ThreadPool;
+using ::ette::Vault;
+using ::ette::WipeMemory;
+using ::ette::WipeString;
 
 // Syntax highlight types
 constexpr int32_t HL_NORMAL = 0;
@@ -111,7 +150,7 @@ constexpr int32_t HL_HIGHLIGHT_NUMBERS = 1 << 1;
 constexpr int32_t QUERY_LEN = 256;
 
 #define ABUF_INIT \
-    { NULL, 0 }
+    { NULL, 0, 0 }
 
 static struct State* E;
 static struct termios orig_termios;  // In order to restore at exit.
@@ -234,14 +273,63 @@ fatal:
     return -1;
 }
 
+/* Self-pipe the SIGWINCH handler writes to. The handler does nothing else,
+ * the resize itself is applied by the editor loop as a WINDOW_RESIZE key. */
+static int resize_pipe[2] = {-1, -1};
+
+// SIDE EFFECTS
+void HandleWindowChangeSignal(int unused __attribute__((unused))) {
+    int saved_errno = errno;
+    if (resize_pipe[1] != -1) {
+        /* If the pipe is full a resize is already pending. */
+        if (write(resize_pipe[1], "w", 1) == -1) {
+        }
+    }
+    errno = saved_errno;
+}
+
+// SIDE EFFECTS
+/* Drain the resize pipe. Returns 1 if at least one SIGWINCH arrived since
+ * the last call, however many there were. */
+int ConsumeResizeSignal() {
+    char buf[64];
+    int resized = 0;
+    if (resize_pipe[0] == -1)
+        return 0;
+    while (read(resize_pipe[0], buf, sizeof(buf)) > 0)
+        resized = 1;
+    return resized;
+}
+
+// SIDE EFFECTS
+/* Block until 'fd' is readable or a resize is pending. Returns 1 if 'fd' is
+ * readable. */
+static int WaitForInput(int fd) {
+    struct pollfd fds[2];
+    fds[0].fd = fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = resize_pipe[0];
+    fds[1].events = POLLIN;
+    int nfds = resize_pipe[0] == -1 ? 1 : 2;
+    if (poll(fds, nfds, -1) == -1)
+        return 0; /* EINTR: most likely the resize signal itself. */
+    return (fds[0].revents & (POLLIN | POLLHUP | POLLERR)) != 0;
+}
+
 // SIDE EFFECTS
 /* Read a key from the terminal put in raw mode, trying to handle
  * escape sequences. */
 int ReadKey(int fd) {
     int nread;
     char c, seq[3];
-    while ((nread = read(fd, &c, 1)) == 0)
-        ;
+    while (1) {
+        if (ConsumeResizeSignal())
+            return WINDOW_RESIZE;
+        if (!WaitForInput(fd))
+            continue;
+        if ((nread = read(fd, &c, 1)) != 0)
+            break;
+    }
     if (nread == -1)
         exit(1);
 
@@ -334,14 +422,25 @@ int GetCursorPos(int ifd, int ofd, int* rows, int* cols) {
     return 0;
 }
 
+// SIDE EFFECTS
+/* Get the size of the terminal with ioctl(). Returns 0 on success, -1 on
+ * error. */
+int QueryWindowSize(int* rows, int* cols) {
+    struct winsize ws;
+
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == -1 || ws.ws_col == 0)
+        return -1;
+    *cols = ws.ws_col;
+    *rows = ws.ws_row;
+    return 0;
+}
+
 // SIDE EFFECTS
 /* Try to get the number of columns in the current terminal. If the ioctl()
  * call fails the function will try to query the terminal itself.
  * Returns 0 on success, -1 on error. */
 int GetWindowSize(int ifd, int ofd, int* rows, int* cols) {
-    struct winsize ws;
-
-    if (ioctl(1, TIOCGWINSZ, &ws) == -1 || ws.ws_col == 0) {
+    if (QueryWindowSize(rows, cols) == -1) {
         /* ioctl() failed. Try to query the terminal itself. */
         int orig_row, orig_col, retval;
 
@@ -363,12 +462,8 @@ int GetWindowSize(int ifd, int ofd, int* rows, int* cols) {
         if (write(ofd, seq, strlen(seq)) == -1) {
             /* Can't recover... */
         }
-        return 0;
-    } else {
-        *cols = ws.ws_col;
-        *rows = ws.ws_row;
-        return 0;
     }
+    return 0;
 
 failed:
     return -1;
@@ -393,15 +488,43 @@ int RowHasOpenComment(Row* row) {
     return 0;
 }
 
+// PURE
+/* Whether it is known if the row 'at' starts inside a multi line comment,
+ * without highlighting the rows before it. */
+static bool RowStartKnown(State* state, int at) {
+    return at == 0 || !state->row[at - 1].hl_stale ||
+           state->row[at].hl_start != -1;
+}
+
+// PURE
+/* Whether the row 'at' starts inside a multi line comment, if known. */
+static int RowStartsInComment(State* state, int at) {
+    if (at == 0)
+        return 0;
+    if (!state->row[at - 1].hl_stale)
+        return RowHasOpenComment(&state->row[at - 1]);
+    return state->row[at].hl_start == 1;
+}
+
 // PURE
 /* Set every byte of row->hl (that corresponds to every character in the line)
- * to the right syntax highlight type (HL_* defines). */
-void UpdateSyntax(State* state, Row* row) {
+ * to the right syntax highlight type (HL_* defines). Returns true if the open
+ * comment state at the end of the row changed, so the next row needs to be
+ * highlighted again. */
+static bool UpdateRowSyntax(State* state, Row* row) {
+    /* The rows before are highlighted first if that's the only way to know
+     * how this one starts. */
+    if (state->syntax != NULL && !RowStartKnown(state, row->idx))
+        HighlightRows(state, row->idx - 1, row->idx);
+    const bool was_stale = row->hl_stale;
+    row->hl_stale = 0;
     row->hl = (unsigned char*)realloc(row->hl, row->rsize);
     memset(row->hl, HL_NORMAL, row->rsize);
 
-    if (state->syntax == NULL)
-        return; /* No syntax, everything is HL_NORMAL. */
+    if (state->syntax == NULL) {
+        row->hl_start = 0;
+        return false; /* No syntax, everything is HL_NORMAL. */
+    }
 
     int i, prev_sep, in_string, in_comment;
     char* p;
@@ -423,15 +546,15 @@ void UpdateSyntax(State* state, Row* row) {
 
     /* If the previous line has an open comment, this line starts
      * with an open comment state. */
-    if (row->idx > 0 && RowHasOpenComment(&state->row[row->idx - 1]))
-        in_comment = 1;
+    in_comment = RowStartsInComment(state, row->idx);
+    row->hl_start = in_comment;
 
     while (*p) {
         /* Handle // comments. */
         if (prev_sep && *p == scs[0] && *(p + 1) == scs[1]) {
             /* From here to end is a comment */
             memset(row->hl + i, HL_COMMENT, row->size - i);
-            return;
+            break;
         }
 
         /* Handle multi line comments. */
@@ -514,7 +637,7 @@ void UpdateSyntax(State* state, Row* row) {
                 if (kw2)
                     klen--;
 
-                if (!memcmp(p, keywords[j], klen) && IsSeparator(*(p + klen))) {
+                if (!strncmp(p, keywords[j], klen) && IsSeparator(*(p + klen))) {
                     /* Keyword */
                     memset(row->hl + i, kw2 ? HL_KEYWORD2 : HL_KEYWORD1, klen);
                     p += klen;
@@ -534,13 +657,76 @@ void UpdateSyntax(State* state, Row* row) {
         i++;
     }
 
-    /* Propagate syntax change to the next row if the open commen
-     * state changed. This may recursively affect all the following rows
-     * in the file. */
     int oc = RowHasOpenComment(row);
-    if (row->hl_oc != oc && row->idx + 1 < state->numrows)
-        UpdateSyntax(state, &state->row[row->idx + 1]);
+    bool changed = was_stale || row->hl_oc != oc;
     row->hl_oc = oc;
+    return changed;
+}
+
+// PURE
+/* Forget the highlighting of the rows from 'from' on, and how they start. */
+static void MarkRowsStale(State* state, int from) {
+    for (int j = from; j < state->numrows; j++) {
+        state->row[j].hl_stale = 1;
+        state->row[j].hl_start = -1;
+    }
+    if (from < state->hl_frontier)
+        state->hl_frontier = from;
+}
+
+// PURE
+/* Highlight a row, then propagate the syntax change to the next rows while
+ * the open comment state keeps changing. This may affect all the following
+ * rows in the file, so it's a loop rather than a recursion. It stops at a row
+ * that isn't highlighted yet: the rows from there on are left for
+ * HighlightRows(), forgetting how they start unless that is unchanged. */
+void UpdateSyntax(State* state, Row* row) {
+    while (UpdateRowSyntax(state, row) && row->idx + 1 < state->numrows) {
+        Row* next = &state->row[row->idx + 1];
+        if (next->hl_stale) {
+            if (next->hl_start != RowHasOpenComment(row))
+                MarkRowsStale(state, next->idx);
+            return;
+        }
+        row = next;
+    }
+}
+
+// PURE
+/* Highlight the rows in [from, to) that aren't yet, starting as far back as
+ * it takes to know how the first one starts: at a highlighted row or a
+ * checkpoint of the line index (see line_index.h). Opening a file highlights
+ * nothing, so only the rows shown pay for it. */
+void HighlightRows(State* state, int from, int to) {
+    if (to > state->numrows)
+        to = state->numrows;
+    if (from < 0)
+        from = 0;
+    int start = from;
+    if (state->syntax != NULL) {
+        while (start < to && !RowStartKnown(state, start))
+            start--;
+    }
+    for (int j = start; j < to; j++) {
+        if (state->row[j].hl_stale)
+            UpdateRowSyntax(state, &state->row[j]);
+    }
+}
+
+// PURE
+/* Highlight up to 'count' more of the rows that aren't yet, from the top, so
+ * that the highlighting of a large file is done by the time it is scrolled
+ * through. Returns true while there are more. */
+bool HighlightNextRows(State* state, int count) {
+    if (state->locked)
+        return false;
+    int& frontier = state->hl_frontier;
+    while (frontier < state->numrows && !state->row[frontier].hl_stale)
+        frontier++;
+    HighlightRows(state, frontier, frontier + count);
+    while (frontier < state->numrows && !state->row[frontier].hl_stale)
+        frontier++;
+    return frontier < state->numrows;
 }
 
 // PURE
@@ -566,16 +752,25 @@ int SyntaxToColor(int hl) {
 }
 
 // PURE
-/* Select the syntax highlight scheme depending on the filename,
+/* Select the syntax highlight scheme depending on the filename, without
+ * the extension of an encryption algorithm ("notes.c.chacha20" is C),
  * setting it in the global state state->syntax. */
 void SelectSyntaxHighlight(State* state, char* filename) {
+    std::string name = filename;
+    ette::CryptoAlgorithms::ForEach([&](auto policy) {
+        const size_t extension_size = strlen(decltype(policy)::kExtension);
+        if (name.size() > extension_size &&
+            name.compare(name.size() - extension_size, extension_size,
+                         decltype(policy)::kExtension) == 0)
+            name.resize(name.size() - extension_size);
+    });
     for (unsigned int j = 0; j < HLDB_ENTRIES; j++) {
         struct Syntax* s = HLDB + j;
         unsigned int i = 0;
         while (s->filematch[i]) {
-            char* p;
+            const char* p;
             int patlen = strlen(s->filematch[i]);
-            if ((p = strstr(filename, s->filematch[i])) != NULL) {
+            if ((p = strstr(name.c_str(), s->filematch[i])) != NULL) {
                 if (s->filematch[i][0] != '.' || p[patlen] == '\0') {
                     state->syntax = s;
                     return;
@@ -589,8 +784,8 @@ void SelectSyntaxHighlight(State* state, char* filename) {
 /* ======================= Editor rows implementation ======================= */
 
 // Somewhat PURE but also SIDE EFFECTS -- Can remove the printf though and just return the error code.
-/* Update the rendered version and the syntax highlight of a row. */
-void UpdateRow(State* state, Row* row) {
+/* Update the rendered version of a row. */
+static void RenderRow(Row* row) {
     unsigned int tabs = 0, nonprint = 0;
     int j, idx;
 
@@ -621,17 +816,39 @@ void UpdateRow(State* state, Row* row) {
     }
     row->rsize = idx;
     row->render[idx] = '\0';
+}
+
+// Somewhat PURE but also SIDE EFFECTS
+/* Update the rendered version and the syntax highlight of a row. */
+void UpdateRow(State* state, Row* row) {
+    RenderRow(row);
 
     /* Update the syntax highlighting attributes of the row. */
     UpdateSyntax(state, row);
 }
 
 // PURE -- minor exception that it prints and exits
-/* Insert a row at the specified position, shifting the other rows on the bottom
- * if required. */
-void InsertRow(State* state, int at, const char* s, size_t len) {
-    if (at > state->numrows)
-        return;
+/* Fill 'row' with 'len' bytes of 's', rendered but not highlighted yet. */
+static void InitRow(Row* row, int at, const char* s, size_t len) {
+    row->size = len;
+    row->chars = (char*)malloc(len + 1);
+    memcpy(row->chars, s, len);
+    row->chars[len] = '\0';
+    row->hl = NULL;
+    row->hl_oc = 0;
+    row->hl_stale = 1;
+    row->hl_start = -1;
+    row->render = NULL;
+    row->rsize = 0;
+    row->idx = at;
+    RenderRow(row);
+}
+
+// PURE -- minor exception that it prints and exits
+/* Insert a rendered row that isn't highlighted yet at the specified position,
+ * shifting the other rows on the bottom if required. */
+static Row* InsertUnhighlightedRow(State* state, int at, const char* s,
+                                   size_t len) {
     state->row = (Row*)realloc(state->row, sizeof(Row) * (state->numrows + 1));
     if (at != state->numrows) {
         memmove(state->row + at + 1, state->row + at,
@@ -639,17 +856,19 @@ void InsertRow(State* state, int at, const char* s, size_t len) {
         for (int j = at + 1; j <= state->numrows; j++)
             state->row[j].idx++;
     }
-    state->row[at].size = len;
-    state->row[at].chars = (char*)malloc(len + 1);
-    memcpy(state->row[at].chars, s, len + 1);
-    state->row[at].hl = NULL;
-    state->row[at].hl_oc = 0;
-    state->row[at].render = NULL;
-    state->row[at].rsize = 0;
-    state->row[at].idx = at;
-    UpdateRow(state, state->row + at);
+    InitRow(state->row + at, at, s, len);
     state->numrows++;
     state->dirty++;
+    return state->row + at;
+}
+
+// PURE -- minor exception that it prints and exits
+/* Insert a row at the specified position, shifting the other rows on the bottom
+ * if required. */
+void InsertRow(State* state, int at, const char* s, size_t len) {
+    if (at > state->numrows)
+        return;
+    UpdateSyntax(state, InsertUnhighlightedRow(state, at, s, len));
 }
 
 // PURE
@@ -660,6 +879,16 @@ void FreeRow(Row* row) {
     free(row->hl);
 }
 
+// PURE
+/* Wipe a row's text, which may be decrypted, then free it. */
+static void WipeRow(Row* row) {
+    WipeMemory(row->chars, row->size);
+    WipeMemory(row->render, row->rsize);
+    if (row->hl)
+        WipeMemory(row->hl, row->rsize);
+    FreeRow(row);
+}
+
 // PURE
 /* Remove the row at the specified position, shifting the remaining on the
  * top. */
@@ -673,11 +902,30 @@ void DeleteRow(State* state, int at) {
     memmove(state->row + at, state->row + at + 1,
             sizeof(state->row[0]) * (state->numrows - at - 1));
     for (int j = at; j < state->numrows - 1; j++)
-        state->row[j].idx++;
+        state->row[j].idx--;
+    if (at < state->hl_frontier)
+        state->hl_frontier--;
     state->numrows--;
     state->dirty++;
 }
 
+// PURE
+/* Wipe and free every row, so no plaintext stays behind in the heap. */
+void WipeRows(State* state) {
+    for (int j = 0; j < state->numrows; j++) {
+        Row* row = state->row + j;
+        WipeMemory(row->chars, row->size);
+        WipeMemory(row->render, row->rsize);
+        if (row->hl)
+            WipeMemory(row->hl, row->rsize);
+        FreeRow(row);
+    }
+    free(state->row);
+    state->row = NULL;
+    state->numrows = 0;
+    state->hl_frontier = 0;
+}
+
 // PURE
 /* Turn the editor rows into a single heap-allocated string.
  * Returns the pointer to the heap-allocated string and populate the
@@ -878,35 +1126,204 @@ void DeleteChar(State* state) {
 }
 
 std::optional<std::string> ReadFileToString(const std::string& path) {
-    std::ifstream file(path);
+    std::ifstream file(path, std::ios::binary | std::ios::ate);
     if (!file.is_open()) {
         return std::nullopt;
     }
 
-    std::string content((std::istreambuf_iterator<char>(file)),
-                        std::istreambuf_iterator<char>());
+    /* One read of the whole file rather than a character at a time. */
+    const std::streamoff size = file.tellg();
+    if (size < 0) {
+        return std::nullopt;
+    }
+    std::string content(static_cast<size_t>(size), '\0');
+    file.seekg(0);
+    if (!file.read(&content[0], size)) {
+        return std::nullopt;
+    }
     return content;
 }
 
-int OpenEncryptedFile(State* state, char* filename) {
-    std::optional<std::string> content = ReadFileToString(filename);
-    if (!content) {
-        return 1;
+// SIDE EFFECTS
+/* Append a row for every line of 'buf'. A trailing newline doesn't start an
+ * extra empty row. The rows are highlighted as they are shown, see
+ * HighlightRows(). */
+void InsertRows(State* state, const char* buf, size_t len) {
+    const char* end = buf + len;
+    while (buf < end) {
+        const char* newline = (const char*)memchr(buf, '\n', end - buf);
+        const char* line_end = newline ? newline : end;
+        InsertUnhighlightedRow(state, state->numrows, buf, line_end - buf);
+        buf = newline ? newline + 1 : end;
     }
+}
 
-    const CryptoState crypto_state =
-        Decrypt(*content, state->password, state->crypto_algorithm);
+// PURE
+/* The order of State::cursors: by row, then by column. */
+static bool CursorBefore(const Cursor& a, const Cursor& b) {
+    return a.row < b.row || (a.row == b.row && a.col < b.col);
+}
 
-    if (!crypto_state.status.ok()) {
-        return 1;
+// PURE
+static bool SameCursor(const Cursor& a, const Cursor& b) {
+    return a.row == b.row && a.col == b.col;
+}
+
+// PURE
+/* Forget the cursors from row 'at' on, when those rows are replaced or move.
+ * One cursor left is just the cursor. */
+static void DropCursorsFrom(State* state, int at) {
+    std::vector<Cursor>& cursors = state->cursors;
+    while (!cursors.empty() && cursors.back().row >= at)
+        cursors.pop_back();
+    if (cursors.size() < 2)
+        cursors.clear();
+}
+
+// SIDE EFFECTS
+/* Replace the 'count' rows from 'at' with a row for every line of 'buf', in
+ * one splice: the rows after them are moved once, whatever the number of
+ * lines. The old rows are wiped. The new ones, and those after them, are
+ * highlighted as they are shown. */
+void ReplaceRows(State* state, int at, int count, const char* buf,
+                 size_t len) {
+    const char* end = buf + len;
+    int lines = 0;
+    for (const char* p = buf; p < end; lines++) {
+        const char* newline = (const char*)memchr(p, '\n', end - p);
+        p = newline ? newline + 1 : end;
+    }
+
+    DropCursorsFrom(state, at);
+    for (int j = at; j < at + count; j++)
+        WipeRow(state->row + j);
+    const int numrows = state->numrows - count + lines;
+    if (lines > count)
+        state->row = (Row*)realloc(state->row, sizeof(Row) * numrows);
+    memmove(state->row + at + lines, state->row + at + count,
+            sizeof(state->row[0]) * (state->numrows - at - count));
+    for (int j = at; j < at + lines; j++) {
+        const char* newline = (const char*)memchr(buf, '\n', end - buf);
+        const char* line_end = newline ? newline : end;
+        InitRow(state->row + j, j, buf, line_end - buf);
+        buf = newline ? newline + 1 : end;
+    }
+    for (int j = at + lines; j < numrows; j++)
+        state->row[j].idx = j;
+    state->numrows = numrows;
+    MarkRowsStale(state, at);
+    state->dirty++;
+}
+
+static void ClampCursorToScreen(State* state);
+
+// PURE
+/* The syntax highlight as saved in a line index. */
+static int64_t SyntaxId(State* state) {
+    return state->syntax ? state->syntax - HLDB : -1;
+}
+
+// PURE
+/* The line index of the rows (see line_index.h), with a checkpoint about
+ * every kLineIndexInterval rows, at rows whose start is known. */
+LineIndex BuildLineIndex(State* state) {
+    LineIndex index;
+    index.line_count = state->numrows;
+    index.syntax = SyntaxId(state);
+    index.cursor_x = state->cx;
+    index.cursor_y = state->cy;
+    index.row_offset = state->rowoff;
+    index.column_offset = state->coloff;
+    uint64_t offset = 0;
+    int last = 0;
+    for (int j = 0; j < state->numrows; j++) {
+        if (j - last >= (int)ette::kLineIndexInterval &&
+            RowStartKnown(state, j)) {
+            index.checkpoints.push_back(
+                {(uint64_t)j, offset, RowStartsInComment(state, j) == 1});
+            last = j;
+        }
+        offset += state->row[j].size + 1; /* As RowsToString() joins them. */
+    }
+    index.text_size = offset;
+    return index;
+}
+
+// PURE
+/* Take how the checkpoint rows start from the line index saved with the
+ * file, if every checkpoint is where the rows put its line, and the cursor
+ * from it. */
+void ApplyLineIndex(State* state, const LineIndex& index) {
+    if (index.line_count != (uint64_t)state->numrows)
+        return;
+    uint64_t offset = 0;
+    size_t matched = 0;
+    const std::vector<LineCheckpoint>& checkpoints = index.checkpoints;
+    for (int j = 0; j < state->numrows; j++) {
+        if (matched < checkpoints.size() &&
+            checkpoints[matched].line == (uint64_t)j &&
+            checkpoints[matched].offset == offset)
+            matched++;
+        offset += state->row[j].size + 1;
     }
+    if (offset != index.text_size)
+        return;
+
+    if (matched == checkpoints.size() && index.syntax == SyntaxId(state)) {
+        for (const LineCheckpoint& checkpoint : checkpoints)
+            state->row[checkpoint.line].hl_start = checkpoint.in_comment;
+    }
+    /* AES-CBC footers aren't authenticated: every field is checked on its
+     * own, so none of them can wrap the others around. */
+    const uint64_t numrows = state->numrows;
+    if (index.row_offset < numrows &&
+        index.cursor_y < numrows - index.row_offset &&
+        index.column_offset <= INT_MAX && index.cursor_x <= INT_MAX) {
+        state->rowoff = index.row_offset;
+        state->cy = index.cursor_y;
+        const uint64_t size = state->row[state->rowoff + state->cy].size;
+        const uint64_t column =
+            std::min(index.column_offset + index.cursor_x, size);
+        state->coloff = std::min(index.column_offset, column);
+        state->cx = column - state->coloff;
+        ClampCursorToScreen(state);
+    }
+}
+
+int OpenEncryptedFile(State* state, char* filename) {
+    std::string plaintext;
+    if (state->unlocked_plaintext) {
+        /* Already decrypted when the password was checked. */
+        plaintext = std::move(*state->unlocked_plaintext);
+        state->unlocked_plaintext.reset();
+    } else if (state->vault) {
+        ette::Status<std::string> text =
+            state->vault->Read(state->vault_entry, state->derived_key);
+        if (!text.ok()) {
+            return text.error().code() == ette::StatusCode::kNotFound ? 0 : 1;
+        }
+        plaintext = *text;
+    } else {
+        std::optional<std::string> content = ReadFileToString(filename);
+        if (!content) {
+            return 1;
+        }
+
+        CryptoState crypto_state = DecryptWithDerivedKey(
+            *content, state->derived_key, state->crypto_algorithm);
 
-    const std::string plaintext = crypto_state.plaintext;
+        if (!crypto_state.status.ok()) {
+            return 1;
+        }
+        plaintext = std::move(crypto_state.plaintext);
+    }
 
-    std::string line;
-    std::istringstream iss(plaintext);
-    while (std::getline(iss, line)) {
-        InsertRow(state, state->numrows, line.c_str(), line.length());
+    InsertRows(state, plaintext.data(), plaintext.size());
+    if (!state->vault) {
+        std::optional<LineIndex> index = ReadLineIndex(
+            filename, state->derived_key, state->crypto_algorithm);
+        if (index)
+            ApplyLineIndex(state, *index);
     }
 
     state->dirty = 0;
@@ -914,18 +1331,35 @@ int OpenEncryptedFile(State* state, char* filename) {
     return 0;
 }
 
+// PURE
+/* How the file at 'path' is now, none if there is none. */
+static std::optional<FileStamp> StampFile(const char* path) {
+    struct stat st;
+    if (stat(path, &st) == -1)
+        return std::nullopt;
+    return FileStamp{st.st_dev, st.st_ino, st.st_size, st.st_mtim};
+}
+
+// PURE
+/* Make 'filename' the one saves go to. */
+static void SetFilename(State* state, const char* filename) {
+    free(state->filename);
+    size_t fnlen = strlen(filename) + 1;
+    state->filename = (char*)malloc(fnlen);
+    memcpy(state->filename, filename, fnlen);
+}
+
 // SIDE EFFECTS
 /* Load the specified program in the editor memory and returns 0 on success
  * or 1 on error. */
 int Open(State* state, char* filename) {
     FILE* fp;
     state->dirty = 0;
-    free(state->filename);
-    size_t fnlen = strlen(filename) + 1;
-    state->filename = (char*)malloc(fnlen);
-    memcpy(state->filename, filename, fnlen);
+    SetFilename(state, filename);
+    /* Taken first: a change made while reading is noticed too. */
+    state->disk_stamp = StampFile(filename);
 
-    if (!state->password.empty()) {
+    if (!state->derived_key.empty()) {
         return OpenEncryptedFile(state, filename);
     }
 
@@ -953,6 +1387,174 @@ int Open(State* state, char* filename) {
     return 0;
 }
 
+static void MoveCursorToRow(State* state, int row);
+
+// SIDE EFFECTS
+/* Load 'filename' in follow mode: rather than once, it is read as it grows,
+ * see FollowFile(). Only unencrypted files can be followed. Returns 0 on
+ * success or 1 on error, with a status message. */
+int Follow(State* state, char* filename) {
+    SetFilename(state, filename);
+    if (!state->derived_key.empty() || state->vault) {
+        SetStatusMessage(state, "Only unencrypted files can be followed");
+        return 1;
+    }
+    state->follower.emplace();
+    const ette::Status<void> status = state->follower->Start(filename);
+    if (!status.ok()) {
+        SetStatusMessage(state, "Can't follow the file! %s",
+                         status.error().message().c_str());
+        return 1;
+    }
+    state->following = true;
+    while (FollowFile(state)) {
+    }
+    state->dirty = 0;
+    return 0;
+}
+
+// SIDE EFFECTS
+/* Show what was written to the followed file since it was last read. New
+ * lines are added at the end, the first one completing the last row if its
+ * newline wasn't there yet; a file that was truncated or replaced is loaded
+ * again, unless that would lose unsaved edits, which stops following it.
+ * The rows are split as ReplaceRows() does and highlighted lazily. When the
+ * cursor was on the last row, it stays there and the view scrolls along.
+ * Returns true if there is more to read already. */
+bool FollowFile(State* state) {
+    if (!state->following)
+        return false;
+    std::string data;
+    const ette::Status<ette::FileChange> change =
+        state->follower->Read(&data);
+    if (!change.ok()) {
+        SetStatusMessage(state, "Can't follow the file! %s",
+                         change.error().message().c_str());
+        return false;
+    }
+    if (*change == ette::FileChange::kNone)
+        return false;
+    const char* what =
+        *change == ette::FileChange::kTruncated ? "truncated" : "replaced";
+    if (*change != ette::FileChange::kAppended && state->dirty) {
+        state->following = false;
+        SetStatusMessage(state, "The file was %s, no longer following it",
+                         what);
+        return false;
+    }
+
+    const int filerow = state->rowoff + state->cy;
+    const bool at_end = filerow >= state->numrows - 1;
+    const int dirty = state->dirty;
+    if (*change == ette::FileChange::kAppended) {
+        int at = state->numrows, count = 0;
+        if (state->follow_partial_row && at > 0) {
+            const Row& last = state->row[at - 1];
+            data.insert(0, last.chars, last.size);
+            at--;
+            count = 1;
+        }
+        ReplaceRows(state, at, count, data.data(), data.size());
+    } else {
+        ReplaceRows(state, 0, state->numrows, data.data(), data.size());
+        SetStatusMessage(state, "The file was %s, reloaded", what);
+    }
+    state->follow_partial_row = !data.empty() && data.back() != '\n';
+    /* The rows are still what the file holds. */
+    state->dirty = dirty;
+
+    if (at_end) {
+        const int last = std::max(0, state->numrows - 1);
+        if (last < state->rowoff || last >= state->rowoff + state->screenrows)
+            state->rowoff = std::max(0, last - state->screenrows + 1);
+        state->cy = last - state->rowoff;
+        state->cx = 0;
+        state->coloff = 0;
+    } else if (filerow >= state->numrows) {
+        MoveCursorToRow(state, state->numrows);
+    }
+    return state->follower->more();
+}
+
+// SIDE EFFECTS
+/* Rewrite the vault without the versions saves left behind, on a background
+ * worker. Saves meanwhile wait for it on the vault's lock. */
+void CompactVaultInBackground(State* state) {
+    ThreadPool::Global().Submit(
+        [path = state->vault->path(), key = state->derived_key]() mutable {
+            ette::Status<Vault> vault = Vault::Open(path);
+            if (vault.ok()) {
+                Vault compacted = *vault;
+                compacted.Compact(key);
+            }
+            WipeString(&key);
+        },
+        TaskPriority::kBackground);
+}
+
+// SIDE EFFECTS
+/* Append the encrypted 'record' to the vault as the newest version of the
+ * entry. Return 0 on success, 1 on error. */
+int SaveToVault(State* state, const std::string& record, bool new_key_id) {
+    const ette::Status<void> status = state->vault->WriteRecord(
+        state->vault_entry, record, state->derived_key);
+    if (!status.ok()) {
+        SetStatusMessage(state, "Can't save! %s",
+                         status.error().message().c_str());
+        return 1;
+    }
+    state->dirty = 0;
+    if (new_key_id)
+        AgentPutKey(state->key_id, state->derived_key);
+    SetStatusMessage(state, "%d bytes written to %s", (int)record.size(),
+                     state->vault_entry.c_str());
+    if (state->vault->NeedsCompaction())
+        CompactVaultInBackground(state);
+    return 0;
+}
+
+/* Why the last history record failed, if it did, until the editor thread
+ * shows it (see CheckHistoryRecorded()). */
+static std::mutex history_error_mutex;
+static std::string history_error;
+
+// SIDE EFFECTS
+/* Add the saved 'plaintext' to the file's history (see history.h), on a
+ * background worker: chunks it already has cost a hash each, new ones an
+ * encryption and a write. */
+void RecordHistoryInBackground(State* state, const std::string& plaintext) {
+    ThreadPool::Global().Submit(
+        [path = std::string(state->filename), key = state->derived_key,
+         key_id = state->key_id, algorithm = state->crypto_algorithm,
+         text = plaintext, saved_ns = HistoryTimeNow()]() mutable {
+            {
+                History history(path, key, key_id, algorithm);
+                const ette::Status<ette::HistoryVersion> status =
+                    history.Record(text, saved_ns);
+                if (!status.ok()) {
+                    std::lock_guard<std::mutex> lock(history_error_mutex);
+                    history_error = status.error().message();
+                }
+            }
+            WipeString(&text);
+            WipeString(&key);
+        },
+        TaskPriority::kBackground);
+}
+
+// SIDE EFFECTS
+/* Tell in the status bar when recording a save in the history failed, so
+ * versions don't stop being kept unnoticed. */
+void CheckHistoryRecorded(State* state) {
+    std::string error;
+    {
+        std::lock_guard<std::mutex> lock(history_error_mutex);
+        error.swap(history_error);
+    }
+    if (!error.empty())
+        SetStatusMessage(state, "History not recorded! %s", error.c_str());
+}
+
 // SIDE EFFECTS
 /* Save the current file on disk. Return 0 on success, 1 on error. */
 int Save(State* state) {
@@ -962,28 +1564,67 @@ int Save(State* state) {
     std::string buffer_str = plaintext;
     free(buf);
 
-    int fd = open(state->filename, O_RDWR | O_CREAT, 0644);
-    if (fd == -1) {
-        if (fd != -1)
-            close(fd);
-        SetStatusMessage(state, "Can't save! I/O error: %s", strerror(errno));
-        return 1;
+    int fd = -1;
+    if (!state->vault) {
+        fd = open(state->filename, O_RDWR | O_CREAT, 0644);
+        if (fd == -1) {
+            SetStatusMessage(state, "Can't save! I/O error: %s",
+                             strerror(errno));
+            return 1;
+        }
     }
 
-    if (state->password.length() > 0) {
+    /* Files get a key ID on their first save, so the agent can serve their
+     * key from then on. */
+    const bool new_key_id =
+        !state->derived_key.empty() && state->key_id.empty();
+    if (new_key_id)
+        state->key_id = GenerateKeyId();
+
+    if (!state->derived_key.empty()) {
+        /* With a keystream computed while idle only the XOR and the tag are
+         * left to do. */
+        std::optional<CryptoState> precomputed =
+            state->keystream_cache.Encrypt(plaintext, state->derived_key,
+                                           state->key_id,
+                                           state->crypto_algorithm);
         const CryptoState encrypted_state =
-            Encrypt(plaintext, state->password, GenerateRandomAsciiByteVector(),
-                    state->crypto_algorithm);
+            precomputed ? std::move(*precomputed)
+                        : EncryptWithDerivedKey(
+                              plaintext, state->derived_key,
+                              GenerateRandomAsciiByteVector(), state->key_id,
+                              state->crypto_algorithm);
 
         if (encrypted_state.status.ok()) {
             buffer_str = encrypted_state.ciphertext;
+            /* AES-256-CBC files carry a digest to tell damage by, and large
+             * files keep where their lines start, to reopen fast. */
+            std::string footer_text;
+            if (!state->vault) {
+                if (!CryptoAlgorithmIsAuthenticated(state->crypto_algorithm))
+                    footer_text = FooterDigest(buffer_str, state->derived_key);
+                if (state->numrows >= (int)ette::kLineIndexMinLines)
+                    footer_text += EncodeLineIndex(BuildLineIndex(state));
+            }
+            if (!footer_text.empty()) {
+                const std::string footer =
+                    EncryptFooter(footer_text, state->derived_key,
+                                  state->key_id, state->crypto_algorithm);
+                if (!footer.empty())
+                    AppendFooter(footer, &buffer_str);
+            }
             len = buffer_str.length();
         } else {
+            if (fd != -1)
+                close(fd);
             SetStatusMessage(state, "ERROR! Failed to encrypt");
             return 1;
         }
     }
 
+    if (state->vault)
+        return SaveToVault(state, buffer_str, new_key_id);
+
     /* Use truncate + a single write(2) call in order to make saving
      * a bit safer, under the limits of what we can do in a small editor. */
     if (ftruncate(fd, len) == -1) {
@@ -1002,20 +1643,54 @@ int Save(State* state) {
 
     close(fd);
     state->dirty = 0;
+    state->disk_stamp = StampFile(state->filename);
+    state->disk_change_shown = false;
+    /* The file now ends where the rows do, see FollowFile(). */
+    if (state->following) {
+        state->follower->SkipToEnd();
+        state->follow_partial_row = false;
+    }
+    if (new_key_id)
+        AgentPutKey(state->key_id, state->derived_key);
+    if (!state->derived_key.empty() && HasHistory(state->filename))
+        RecordHistoryInBackground(state, plaintext);
     SetStatusMessage(state, "%d bytes written on disk", len);
     return 0;
 }
 
+// SIDE EFFECTS
+/* Compute up to 'max_bytes' of the keystream the next Save() will use, for
+ * an encrypted buffer whose algorithm has one and when enabled. Returns true
+ * while there is more to compute, so the caller can go on while idle. */
+bool PrepareNextSave(State* state, size_t max_bytes) {
+    if (!state->precompute_keystream || state->locked ||
+        state->derived_key.empty())
+        return false;
+
+    uint64_t size = 0;
+    for (int j = 0; j < state->numrows; j++)
+        size += state->row[j].size + 1; /* As RowsToString() joins them. */
+    if (!state->keystream_cache.Prepare(state->crypto_algorithm,
+                                        state->derived_key, size))
+        return false;
+    return state->keystream_cache.Step(max_bytes);
+}
+
 /* ============================= Terminal update ============================ */
 
 // PURE
 void Append(Buffer* ab, const char* s, int len) {
-    char* new_buffer = (char*)realloc(ab->b, ab->len + len);
-
-    if (new_buffer == NULL)
-        return;
-    memcpy(new_buffer + ab->len, s, len);
-    ab->b = new_buffer;
+    if (ab->len + len > ab->cap) {
+        int cap = ab->cap ? ab->cap * 2 : 1024;
+        while (cap < ab->len + len)
+            cap *= 2;
+        char* new_buffer = (char*)realloc(ab->b, cap);
+        if (new_buffer == NULL)
+            return;
+        ab->b = new_buffer;
+        ab->cap = cap;
+    }
+    memcpy(ab->b + ab->len, s, len);
     ab->len += len;
 }
 
@@ -1024,68 +1699,252 @@ void FreeBuf(Buffer* ab) {
     free(ab->b);
 }
 
-// SIDE EFFECTS
-/* This function writes the whole screen using VT100 escape characters
- * starting from the logical state of the editor in the global state 'E'. */
-void RefreshScreen() {
-    int y;
-    Row* r;
-    char buf[32];
-    struct Buffer ab = ABUF_INIT;
+// PURE
+/* Close the current line of the frame, which goes to terminal line 'y' and
+ * column 'x' (0-based). */
+static void EndFrameLine(Frame* frame, int y, int x) {
+    frame->line_ends.push_back(frame->text.len);
+    frame->line_y.push_back(y + 1);
+    frame->line_x.push_back(x + 1);
+}
 
-    Append(&ab, "\x1b[?25l", 6); /* Hide cursor. */
-    Append(&ab, "\x1b[H", 3);    /* Go home. */
-    for (y = 0; y < E->screenrows; y++) {
-        int filerow = E->rowoff + y;
+/* Where a view is drawn on the terminal: its 0-based top line and left
+ * column, and whether it reaches the right edge, or is the left one of a
+ * side by side split. */
+struct Pane {
+    int top, left;
+    bool right_edge;
+};
 
-        if (filerow >= E->numrows) {
-            if (E->numrows == 0 && y == E->screenrows / 3) {
-                char welcome[80];
-                int welcomelen =
-                    snprintf(welcome, sizeof(welcome),
-                             "ette (Encrypted Terminal Text Editor) "
-                             "-- version %s\x1b[0K\r\n",
-                             ::ette::kVersionStr);
-                int padding = (E->screencols - welcomelen) / 2;
-                if (padding) {
-                    Append(&ab, "~", 1);
-                    padding--;
-                }
-                while (padding--)
-                    Append(&ab, " ", 1);
-                Append(&ab, welcome, welcomelen);
-            } else {
-                Append(&ab, "~\x1b[0K\r\n", 7);
-            }
-            continue;
+// PURE
+/* Close line 'y' of 'pane', of which 'used' columns out of 'cols' were
+ * drawn: the rest is cleared, or in a left view padded up to the separator,
+ * so that the view next to it is left alone. */
+static void EndPaneLine(Frame* frame, const Pane& pane, int y, int used,
+                        int cols) {
+    Buffer* ab = &frame->text;
+    if (pane.right_edge) {
+        Append(ab, "\x1b[0K", 4);
+    } else {
+        for (; used < cols; used++)
+            Append(ab, " ", 1);
+        Append(ab, "|", 1);
+    }
+    EndFrameLine(frame, pane.top + y, pane.left);
+}
+
+// PURE
+/* Draw a status bar on terminal line 'y': 'status' on the left and
+ * 'rstatus' on the right, in reverse video across the frame. */
+static void DrawStatusBar(Frame* frame, int y, const char* status, int len,
+                          const char* rstatus, int rlen) {
+    Buffer* ab = &frame->text;
+    Append(ab, "\x1b[0K", 4);
+    Append(ab, "\x1b[7m", 4);
+    if (len > frame->cols)
+        len = frame->cols;
+    Append(ab, status, len);
+    while (len < frame->cols) {
+        if (frame->cols - len == rlen) {
+            Append(ab, rstatus, rlen);
+            break;
+        } else {
+            Append(ab, " ", 1);
+            len++;
         }
+    }
+    Append(ab, "\x1b[0m", 4);
+    EndFrameLine(frame, y, 0);
+}
 
-        r = &E->row[filerow];
+// PURE
+/* Draw the two status rows from terminal line 'y': 'status' on the left of
+ * the first one and 'rstatus' on its right, then the status message. */
+static void DrawStatusRows(State* state, Frame* frame, int y,
+                           const char* status, int len, const char* rstatus,
+                           int rlen) {
+    DrawStatusBar(frame, y, status, len, rstatus, rlen);
 
-        int len = r->rsize - E->coloff;
-        int current_color = -1;
-        if (len > 0) {
-            if (len > E->screencols)
-                len = E->screencols;
-            char* c = r->render + E->coloff;
-            unsigned char* hl = r->hl + E->coloff;
-            int j;
-            for (j = 0; j < len; j++) {
-                if (hl[j] == HL_NONPRINT) {
-                    char sym;
-                    Append(&ab, "\x1b[7m", 4);
-                    if (c[j] <= 26)
-                        sym = '@' + c[j];
+    /* Second row depends on state->statusmsg and the status message update time. */
+    Buffer* ab = &frame->text;
+    Append(ab, "\x1b[0K", 4);
+    int msglen = strlen(state->statusmsg);
+    if (msglen && time(NULL) - state->statusmsg_time < 5)
+        Append(ab, state->statusmsg,
+               msglen <= frame->cols ? msglen : frame->cols);
+    EndFrameLine(frame, y + 1, 0);
+}
+
+// PURE
+/* Append at most 'cols' screen columns of the 'len' bytes at 's', with TABs
+ * expanded and nonprintable characters shown as DrawFrame() shows them.
+ * Returns the number of columns appended. */
+static int AppendDiffText(Buffer* ab, const char* s, int len, int cols) {
+    int col = 0;
+    for (int j = 0; j < len && col < cols; j++) {
+        if (s[j] == TAB) {
+            do {
+                Append(ab, " ", 1);
+                col++;
+            } while (col % 8 != 0 && col < cols);
+        } else if (!isprint((unsigned char)s[j])) {
+            const char sym = (unsigned char)s[j] <= 26 ? '@' + s[j] : '?';
+            Append(ab, "\x1b[7m", 4);
+            Append(ab, &sym, 1);
+            Append(ab, "\x1b[27m", 5);
+            col++;
+        } else {
+            Append(ab, s + j, 1);
+            col++;
+        }
+    }
+    return col;
+}
+
+// PURE
+/* Draw state->diff_view in place of the rows of the view being edited, see
+ * ShowDiff(). */
+static void DrawDiffView(State* state, const Pane& pane, Frame* frame) {
+    const DiffView* view = state->diff_view;
+    Buffer* ab = &frame->text;
+    for (int y = 0; y < state->screenrows; y++) {
+        const size_t at = view->offset + y;
+        if (at >= view->lines.size()) {
+            Append(ab, "~", 1);
+            EndPaneLine(frame, pane, y, 1, state->screencols);
+            continue;
+        }
+        const DiffViewLine& line = view->lines[at];
+        int used;
+        if (line.kind == '@') {
+            const std::string& header = view->headers[line.line];
+            Append(ab, "\x1b[36m", 5);
+            used = AppendDiffText(ab, header.data(), header.size(),
+                                  state->screencols);
+        } else {
+            const char* text;
+            int len;
+            if (line.kind == '-') {
+                text = view->saved_lines[line.line].data();
+                len = view->saved_lines[line.line].size();
+            } else {
+                text = state->row[line.line].chars;
+                len = state->row[line.line].size;
+            }
+            if (line.kind != ' ')
+                Append(ab, line.kind == '-' ? "\x1b[31m" : "\x1b[32m", 5);
+            Append(ab, &line.kind, 1);
+            used = 1 + AppendDiffText(ab, text, len, state->screencols - 1);
+        }
+        Append(ab, "\x1b[39m", 5);
+        EndPaneLine(frame, pane, y, used, state->screencols);
+    }
+}
+
+// PURE
+/* Where the cursors on row 'filerow' other than the one at column 'skip'
+ * are drawn, as columns of the rendered row, in order. */
+static void CursorColumns(State* state, int filerow, int skip,
+                          std::vector<int>* cols) {
+    cols->clear();
+    const std::vector<Cursor>& cursors = state->cursors;
+    const Row* row = &state->row[filerow];
+    int j = 0, rx = 0;
+    for (auto it = std::lower_bound(cursors.begin(), cursors.end(),
+                                    Cursor{filerow, 0}, CursorBefore);
+         it != cursors.end() && it->row == filerow; ++it) {
+        /* As RenderRow() expands tabs. */
+        for (; j < it->col && j < row->size; j++) {
+            rx++;
+            if (row->chars[j] == TAB)
+                while ((rx + 1) % 8 != 0)
+                    rx++;
+        }
+        if (it->col != skip)
+            cols->push_back(rx);
+    }
+}
+
+// PURE
+/* Draw the rows 'view' shows into 'pane'. The cursors, but the one on the
+ * screen in the view being edited, are shown in reverse video. */
+static void DrawRows(State* state, const View& view, const Pane& pane,
+                     bool editing, Frame* frame) {
+    int y;
+    Row* r;
+    Buffer* ab = &frame->text;
+
+    HighlightRows(state, view.rowoff, view.rowoff + view.screenrows);
+    std::vector<int> cursor_cols; /* The other cursors, in reverse video. */
+    for (y = 0; y < view.screenrows; y++) {
+        int filerow = view.rowoff + y;
+
+        if (filerow >= state->numrows) {
+            if (state->numrows == 0 && y == view.screenrows / 3 &&
+                pane.right_edge) {
+                char welcome[80];
+                int welcomelen =
+                    snprintf(welcome, sizeof(welcome),
+                             "ette (Encrypted Terminal Text Editor) "
+                             "-- version %s\x1b[0K",
+                             ::ette::kVersionStr);
+                int padding = (view.screencols - welcomelen) / 2;
+                if (padding) {
+                    Append(ab, "~", 1);
+                    padding--;
+                }
+                while (padding-- > 0)
+                    Append(ab, " ", 1);
+                Append(ab, welcome, welcomelen);
+            } else {
+                Append(ab, "~", 1);
+            }
+            EndPaneLine(frame, pane, y, 1, view.screencols);
+            continue;
+        }
+
+        r = &state->row[filerow];
+        const bool on_cursor = editing && filerow == view.rowoff + view.cy;
+        CursorColumns(state, filerow, on_cursor ? view.coloff + view.cx : -1,
+                      &cursor_cols);
+        size_t next_cursor =
+            std::lower_bound(cursor_cols.begin(), cursor_cols.end(),
+                             view.coloff) -
+            cursor_cols.begin();
+
+        int len = r->rsize - view.coloff;
+        int used = 0;
+        int current_color = -1;
+        if (len > 0) {
+            if (len > view.screencols)
+                len = view.screencols;
+            used = len;
+            char* c = r->render + view.coloff;
+            unsigned char* hl = r->hl + view.coloff;
+            int j;
+            for (j = 0; j < len; j++) {
+                const bool at_cursor =
+                    next_cursor < cursor_cols.size() &&
+                    cursor_cols[next_cursor] == view.coloff + j;
+                if (at_cursor) {
+                    Append(ab, "\x1b[7m", 4);
+                    next_cursor++;
+                }
+                if (hl[j] == HL_NONPRINT) {
+                    char sym;
+                    Append(ab, "\x1b[7m", 4);
+                    if (c[j] <= 26)
+                        sym = '@' + c[j];
                     else
                         sym = '?';
-                    Append(&ab, &sym, 1);
-                    Append(&ab, "\x1b[0m", 4);
+                    Append(ab, &sym, 1);
+                    Append(ab, "\x1b[0m", 4);
                 } else if (hl[j] == HL_NORMAL) {
                     if (current_color != -1) {
-                        Append(&ab, "\x1b[39m", 5);
+                        Append(ab, "\x1b[39m", 5);
                         current_color = -1;
                     }
-                    Append(&ab, c + j, 1);
+                    Append(ab, c + j, 1);
                 } else {
                     int color = SyntaxToColor(hl[j]);
                     if (color != current_color) {
@@ -1094,65 +1953,287 @@ void RefreshScreen() {
                             snprintf(syntax_color_buf, sizeof(syntax_color_buf),
                                      "\x1b[%dm", color);
                         current_color = color;
-                        Append(&ab, syntax_color_buf, clen);
+                        Append(ab, syntax_color_buf, clen);
                     }
-                    Append(&ab, c + j, 1);
+                    Append(ab, c + j, 1);
                 }
+                if (at_cursor)
+                    Append(ab, "\x1b[27m", 5);
             }
         }
-        Append(&ab, "\x1b[39m", 5);
-        Append(&ab, "\x1b[0K", 4);
-        Append(&ab, "\r\n", 2);
+        Append(ab, "\x1b[39m", 5);
+        /* A cursor after the end of the row. */
+        if (next_cursor < cursor_cols.size() &&
+            cursor_cols[next_cursor] == r->rsize &&
+            r->rsize - view.coloff < view.screencols) {
+            Append(ab, "\x1b[7m \x1b[27m", 10);
+            used++;
+        }
+        EndPaneLine(frame, pane, y, used, view.screencols);
     }
+}
 
-    /* Create a two rows status. First row: */
-    Append(&ab, "\x1b[0K", 4);
-    Append(&ab, "\x1b[7m", 4);
-    char status[80], rstatus[80];
-    int len = snprintf(status, sizeof(status), "%.20s - %d lines %s",
-                       E->filename, E->numrows, E->dirty ? "(modified)" : "");
-    int rlen = snprintf(rstatus, sizeof(rstatus), "%d/%d",
-                        E->rowoff + E->cy + 1, E->numrows);
-    if (len > E->screencols)
-        len = E->screencols;
-    Append(&ab, status, len);
-    while (len < E->screencols) {
-        if (E->screencols - len == rlen) {
-            Append(&ab, rstatus, rlen);
-            break;
+// PURE
+/* The view being edited, as its fields in 'state'. */
+static View CurrentView(State* state) {
+    return {state->cx,     state->cy,         state->rowoff,
+            state->coloff, state->screenrows, state->screencols};
+}
+
+// PURE
+/* Render the screen as VT100 escape sequences into 'frame', one entry per
+ * line of a view, starting from the logical state of the editor. Split
+ * views are drawn from the same rows, one after the other; each of their
+ * lines is an entry of its own, so the views are updated independently.
+ * The frame's buffers are reused, so drawing into a recycled frame doesn't
+ * allocate. */
+void DrawFrame(State* state, Frame* frame) {
+    Buffer* ab = &frame->text;
+
+    ab->len = 0;
+    frame->line_ends.clear();
+    frame->line_y.clear();
+    frame->line_x.clear();
+    frame->cols = state->screencols;
+    int text_rows = state->screenrows;
+    const View editing = CurrentView(state);
+    Pane editing_pane = {0, 0, true};
+    /* The view being edited shows the diff instead of the rows if open. */
+    auto draw_editing = [&]() {
+        if (state->diff_view)
+            DrawDiffView(state, editing_pane, frame);
+        else
+            DrawRows(state, editing, editing_pane, true, frame);
+    };
+    if (!state->split) {
+        draw_editing();
+    } else {
+        const Split& split = *state->split;
+        frame->cols = split.cols;
+        text_rows = split.rows;
+        Pane other_pane = {0, 0, true};
+        Pane& first = split.other_first ? other_pane : editing_pane;
+        Pane& second = split.other_first ? editing_pane : other_pane;
+        const View& first_view = split.other_first ? split.other : editing;
+        if (split.vertical) {
+            first.right_edge = false;
+            second.left = first_view.screencols + 1;
         } else {
-            Append(&ab, " ", 1);
-            len++;
+            second.top = first_view.screenrows + 1;
+        }
+        /* In order down the screen, so switching views keeps the layout. */
+        if (split.other_first)
+            DrawRows(state, split.other, other_pane, false, frame);
+        else
+            draw_editing();
+        if (!split.vertical) {
+            /* The top view's position, between the two. */
+            char status[80], rstatus[80];
+            int len =
+                snprintf(status, sizeof(status), "%.20s", state->filename);
+            int rlen = snprintf(rstatus, sizeof(rstatus), "%d/%d",
+                                first_view.rowoff + first_view.cy + 1,
+                                state->numrows);
+            DrawStatusBar(frame, first_view.screenrows, status, len, rstatus,
+                          rlen);
         }
+        if (split.other_first)
+            draw_editing();
+        else
+            DrawRows(state, split.other, other_pane, false, frame);
     }
-    Append(&ab, "\x1b[0m\r\n", 6);
 
-    /* Second row depends on state->statusmsg and the status message update time. */
-    Append(&ab, "\x1b[0K", 4);
-    int msglen = strlen(E->statusmsg);
-    if (msglen && time(NULL) - E->statusmsg_time < 5)
-        Append(&ab, E->statusmsg,
-               msglen <= E->screencols ? msglen : E->screencols);
+    /* Create a two rows status. */
+    char status[80], rstatus[80];
+    int len, rlen;
+    if (state->diff_view) {
+        const DiffView* view = state->diff_view;
+        len = snprintf(status, sizeof(status),
+                       "%.20s - diff: %d change%s, +%d -%d lines",
+                       state->filename, (int)view->hunks.size(),
+                       view->hunks.size() == 1 ? "" : "s", view->added,
+                       view->removed);
+        rlen = snprintf(rstatus, sizeof(rstatus), "%d/%d", view->offset + 1,
+                        (int)view->lines.size());
+        DrawStatusRows(state, frame, text_rows, status, len, rstatus, rlen);
+        frame->cursor_y = editing_pane.top + 1;
+        frame->cursor_x = editing_pane.left + 1;
+        return;
+    }
+    len = snprintf(status, sizeof(status), "%.20s - %d lines %s",
+                   state->filename, state->numrows,
+                   state->dirty ? "(modified)" : "");
+    rlen = snprintf(rstatus, sizeof(rstatus), "%d/%d",
+                    state->rowoff + state->cy + 1, state->numrows);
+    if (!state->cursors.empty())
+        rlen = snprintf(rstatus, sizeof(rstatus), "%d cursors %d/%d",
+                        (int)state->cursors.size(),
+                        state->rowoff + state->cy + 1, state->numrows);
+    DrawStatusRows(state, frame, text_rows, status, len, rstatus, rlen);
 
     /* Put cursor at its current position. Note that the horizontal position
      * at which the cursor is displayed may be different compared to 'state->cx'
      * because of TABs. */
     int j;
     int cx = 1;
-    int filerow = E->rowoff + E->cy;
-    Row* row = (filerow >= E->numrows) ? NULL : &E->row[filerow];
+    int filerow = state->rowoff + state->cy;
+    Row* row = (filerow >= state->numrows) ? NULL : &state->row[filerow];
     if (row) {
-        for (j = E->coloff; j < (E->cx + E->coloff); j++) {
+        for (j = state->coloff; j < (state->cx + state->coloff); j++) {
             if (j < row->size && row->chars[j] == TAB)
                 cx += 7 - ((cx) % 8);
             cx++;
         }
     }
-    snprintf(buf, sizeof(buf), "\x1b[%d;%dH", E->cy + 1, cx);
-    Append(&ab, buf, strlen(buf));
-    Append(&ab, "\x1b[?25h", 6); /* Show cursor. */
-    write(STDOUT_FILENO, ab.b, ab.len);
-    FreeBuf(&ab);
+    frame->cursor_y = editing_pane.top + state->cy + 1;
+    frame->cursor_x = editing_pane.left + cx;
+}
+
+// PURE
+/* Append to 'out' the escape sequences that turn the terminal from showing
+ * 'prev' into showing 'next': only lines that changed are rewritten, each
+ * where the frame puts it, so a line of one split view is rewritten without
+ * the other. With no previous frame, or after a resize or a change of the
+ * layout, every line is written. */
+void RenderFrame(const Frame* prev, const Frame* next, Buffer* out) {
+    char buf[32];
+    const bool full = prev == NULL || prev->cols != next->cols ||
+                      prev->line_ends.size() != next->line_ends.size() ||
+                      prev->line_y != next->line_y ||
+                      prev->line_x != next->line_x;
+    bool cursor_hidden = false;
+
+    for (size_t y = 0; y < next->line_ends.size(); y++) {
+        const int start = y ? next->line_ends[y - 1] : 0;
+        const int len = next->line_ends[y] - start;
+        if (!full) {
+            const int prev_start = y ? prev->line_ends[y - 1] : 0;
+            const int prev_len = prev->line_ends[y] - prev_start;
+            if (prev_len == len &&
+                memcmp(prev->text.b + prev_start, next->text.b + start,
+                       len) == 0)
+                continue;
+        }
+        if (!cursor_hidden) {
+            Append(out, "\x1b[?25l", 6); /* Hide cursor. */
+            cursor_hidden = true;
+        }
+        int blen = snprintf(buf, sizeof(buf), "\x1b[%d;%dH", next->line_y[y],
+                            next->line_x[y]);
+        Append(out, buf, blen);
+        Append(out, next->text.b + start, len);
+    }
+
+    if (cursor_hidden || prev->cursor_y != next->cursor_y ||
+        prev->cursor_x != next->cursor_x) {
+        int blen = snprintf(buf, sizeof(buf), "\x1b[%d;%dH", next->cursor_y,
+                            next->cursor_x);
+        Append(out, buf, blen);
+        Append(out, "\x1b[?25h", 6); /* Show cursor. */
+    }
+}
+
+// SIDE EFFECTS
+/* Write all of 'len' bytes, retrying on short writes. */
+int WriteAll(int fd, const char* buf, int len) {
+    while (len > 0) {
+        ssize_t written = write(fd, buf, len);
+        if (written == -1) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        buf += written;
+        len -= written;
+    }
+    return 0;
+}
+
+// SIDE EFFECTS
+/* When set, RefreshScreen() hands the screen to the presenter instead of
+ * writing it itself, and keys are read with the key reader. This is how the
+ * event loop moves terminal I/O to its own threads. */
+static void (*screen_presenter)(State* state) = NULL;
+static void (*screen_presenter_stop)() = NULL;
+static int (*key_reader)(int fd) = NULL;
+static int (*key_poller)(int fd) = NULL;
+static bool screen_invalidated = false;
+/* The key reader said IDLE_LOCK: every prompt is left as with ESC, then
+ * ProcessKeyPress() locks the editor. */
+static bool idle_lock_pending = false;
+
+void SetScreenPresenter(void (*presenter)(State* state), void (*stop)()) {
+    screen_presenter = presenter;
+    screen_presenter_stop = stop;
+}
+
+void StopScreenPresenter() {
+    if (screen_presenter_stop)
+        screen_presenter_stop();
+}
+
+void SetKeyReader(int (*reader)(int fd)) {
+    key_reader = reader;
+}
+
+void SetKeyPoller(int (*poller)(int fd)) {
+    key_poller = poller;
+}
+
+int NextKey(int fd) {
+    if (!idle_lock_pending) {
+        const int c = key_reader ? key_reader(fd) : ReadKey(fd);
+        if (c != IDLE_LOCK)
+            return c;
+        idle_lock_pending = true;
+    }
+    return ESC;
+}
+
+/* The next key if one was typed, without waiting: KEY_NULL if none was, or
+ * there is no key poller (only the event loop has one). */
+int PollKey(int fd) {
+    return key_poller ? key_poller(fd) : KEY_NULL;
+}
+
+void InvalidateScreen() {
+    screen_invalidated = true;
+}
+
+bool ConsumeScreenInvalidation() {
+    bool invalidated = screen_invalidated;
+    screen_invalidated = false;
+    return invalidated;
+}
+
+// SIDE EFFECTS
+/* This function writes the screen using VT100 escape characters starting
+ * from the logical state of the editor in the global state 'E'. Only lines
+ * that changed since the last refresh are written. The frames and the
+ * output buffer are kept around so steady state repaints don't allocate. */
+void RefreshScreen() {
+    if (screen_presenter) {
+        screen_presenter(E);
+        return;
+    }
+
+    static Frame frames[2];
+    static int current = 0;
+    static bool has_prev = false;
+    static struct Buffer ab = ABUF_INIT;
+
+    Frame* prev = &frames[current];
+    Frame* next = &frames[current ^ 1];
+    if (ConsumeScreenInvalidation())
+        has_prev = false;
+
+    DrawFrame(E, next);
+    ab.len = 0;
+    RenderFrame(has_prev ? prev : NULL, next, &ab);
+    if (ab.len)
+        WriteAll(STDOUT_FILENO, ab.b, ab.len);
+    current ^= 1;
+    has_prev = true;
 }
 
 /* =============================== Find mode ================================ */
@@ -1179,83 +2260,1332 @@ void Find(int fd, State* state) {
     int saved_cx = state->cx, saved_cy = state->cy;
     int saved_coloff = state->coloff, saved_rowoff = state->rowoff;
 
-    while (1) {
-        SetStatusMessage(state, "Search: %s (Use ESC/Arrows/Enter)", query);
-        RefreshScreen();
+    while (1) {
+        SetStatusMessage(state, "Search: %s (Use ESC/Arrows/Enter)", query);
+        RefreshScreen();
+
+        int c = NextKey(fd);
+        if (c == DEL_KEY || c == CTRL_H || c == BACKSPACE) {
+            if (qlen != 0)
+                query[--qlen] = '\0';
+            last_match = -1;
+        } else if (c == ESC || c == ENTER) {
+            if (c == ESC) {
+                state->cx = saved_cx;
+                state->cy = saved_cy;
+                state->coloff = saved_coloff;
+                state->rowoff = saved_rowoff;
+            }
+            FIND_RESTORE_HL;
+            SetStatusMessage(state, "");
+            return;
+        } else if (c == ARROW_RIGHT || c == ARROW_DOWN) {
+            find_next = 1;
+        } else if (c == ARROW_LEFT || c == ARROW_UP) {
+            find_next = -1;
+        } else if (c == WINDOW_RESIZE) {
+            ApplyWindowResize(state);
+        } else if (isprint(c)) {
+            if (qlen < QUERY_LEN) {
+                query[qlen++] = c;
+                query[qlen] = '\0';
+                last_match = -1;
+            }
+        }
+
+        /* Search occurrence. */
+        if (last_match == -1)
+            find_next = 1;
+        if (find_next) {
+            char* match = NULL;
+            int match_offset = 0;
+            int i, current = last_match;
+
+            for (i = 0; i < state->numrows; i++) {
+                current += find_next;
+                if (current == -1)
+                    current = state->numrows - 1;
+                else if (current == state->numrows)
+                    current = 0;
+                match = strstr(state->row[current].render, query);
+                if (match) {
+                    match_offset = match - state->row[current].render;
+                    break;
+                }
+            }
+            find_next = 0;
+
+            /* Highlight */
+            FIND_RESTORE_HL;
+
+            if (match) {
+                HighlightRows(state, current, current + 1);
+                Row* row = &state->row[current];
+                last_match = current;
+                if (row->hl) {
+                    saved_hl_line = current;
+                    saved_hl = (char*)malloc(row->rsize);
+                    memcpy(saved_hl, row->hl, row->rsize);
+                    memset(row->hl + match_offset, HL_MATCH, qlen);
+                }
+                state->cy = 0;
+                state->cx = match_offset;
+                state->rowoff = current;
+                state->coloff = 0;
+                /* Scroll horizontally as needed. */
+                if (state->cx > state->screencols) {
+                    int diff = state->cx - state->screencols;
+                    state->cx -= diff;
+                    state->coloff += diff;
+                }
+            }
+        }
+    }
+}
+
+/* =============================== Diff view ================================ */
+/* Unchanged rows shown before and after each change. */
+constexpr int kDiffContextRows = 3;
+
+// PURE
+/* The text as last saved: the file decrypted again (or the vault entry read
+ * again), empty if it was never saved, std::nullopt if it can't be read. */
+static std::optional<std::string> ReadSavedText(State* state) {
+    if (state->vault) {
+        ette::Status<std::string> text =
+            state->vault->Read(state->vault_entry, state->derived_key);
+        if (!text.ok()) {
+            if (text.error().code() == ette::StatusCode::kNotFound)
+                return std::string();
+            return std::nullopt;
+        }
+        return text.value();
+    }
+    std::error_code error;
+    if (!std::filesystem::exists(state->filename, error))
+        return error ? std::nullopt : std::optional<std::string>("");
+    std::optional<std::string> content = ReadFileToString(state->filename);
+    if (!content || state->derived_key.empty())
+        return content;
+    CryptoState crypto_state = DecryptWithDerivedKey(
+        *content, state->derived_key, state->crypto_algorithm);
+    if (!crypto_state.status.ok())
+        return std::nullopt;
+    return std::move(crypto_state.plaintext);
+}
+
+// PURE
+/* Diff view->saved_text against the rows into 'view', grouping changes
+ * whose context rows would touch under one header. */
+void BuildDiffView(State* state, DiffView* view) {
+    view->saved_lines = ette::SplitLines(view->saved_text);
+    std::vector<std::string_view> rows(state->numrows);
+    for (int j = 0; j < state->numrows; j++)
+        rows[j] = std::string_view(state->row[j].chars, state->row[j].size);
+    view->hunks = ette::DiffLines(view->saved_lines, rows);
+    view->headers.clear();
+    view->lines.clear();
+    view->added = view->removed = view->offset = 0;
+
+    const std::vector<ette::DiffHunk>& hunks = view->hunks;
+    for (size_t first = 0; first < hunks.size();) {
+        size_t last = first;
+        while (last + 1 < hunks.size() &&
+               hunks[last + 1].new_begin -
+                       (hunks[last].new_begin + hunks[last].new_count) <=
+                   2 * kDiffContextRows)
+            last++;
+        /* Lines outside hunks are the same on both sides, so is the context
+         * around them. */
+        const size_t before =
+            std::min<size_t>(kDiffContextRows, hunks[first].new_begin);
+        const size_t new_end = hunks[last].new_begin + hunks[last].new_count;
+        const size_t after =
+            std::min<size_t>(kDiffContextRows, state->numrows - new_end);
+        const size_t old_begin = hunks[first].old_begin - before;
+        const size_t old_count =
+            hunks[last].old_begin + hunks[last].old_count + after - old_begin;
+        const size_t new_begin = hunks[first].new_begin - before;
+        const size_t new_count = new_end + after - new_begin;
+        char header[80];
+        snprintf(header, sizeof(header), "@@ -%zu,%zu +%zu,%zu @@",
+                 old_begin + (old_count ? 1 : 0), old_count,
+                 new_begin + (new_count ? 1 : 0), new_count);
+        view->lines.push_back({'@', (int)view->headers.size(),
+                               (int)hunks[first].new_begin});
+        view->headers.push_back(header);
+
+        size_t row = new_begin;
+        for (size_t h = first; h <= last; h++) {
+            const ette::DiffHunk& hunk = hunks[h];
+            for (; row < hunk.new_begin; row++)
+                view->lines.push_back({' ', (int)row, (int)row});
+            for (size_t i = 0; i < hunk.old_count; i++)
+                view->lines.push_back({'-', (int)(hunk.old_begin + i),
+                                       (int)hunk.new_begin});
+            for (; row < hunk.new_begin + hunk.new_count; row++)
+                view->lines.push_back({'+', (int)row, (int)row});
+            view->added += hunk.new_count;
+            view->removed += hunk.old_count;
+        }
+        for (; row < new_end + after; row++)
+            view->lines.push_back({' ', (int)row, (int)row});
+        first = last + 1;
+    }
+}
+
+// SIDE EFFECTS
+/* Show what changed since the last save, in place of the rows, until ESC.
+ * The saved text is read again (decrypted for an encrypted buffer), diffed
+ * against the rows and wiped when the view closes. Enter closes it on the
+ * row of the line at the top. */
+void ShowDiff(int fd, State* state) {
+    std::optional<std::string> saved = ReadSavedText(state);
+    if (!saved) {
+        SetStatusMessage(state, "Can't read the saved file");
+        return;
+    }
+    DiffView view;
+    view.saved_text = std::move(*saved);
+    BuildDiffView(state, &view);
+    if (view.hunks.empty()) {
+        WipeString(&view.saved_text);
+        SetStatusMessage(state, "No changes since the last save");
+        return;
+    }
+
+    state->diff_view = &view;
+    const int count = view.lines.size();
+    while (1) {
+        SetStatusMessage(state,
+                         "Diff: Arrows/PgUp/PgDn scroll, n/p next/previous "
+                         "change, Enter go to, ESC");
+        RefreshScreen();
+
+        int c = NextKey(fd);
+        if (c == ESC || c == CTRL_D || c == 'q') {
+            break;
+        } else if (c == ENTER) {
+            MoveCursorToRow(state, std::min(view.lines[view.offset].row,
+                                            state->numrows - 1));
+            break;
+        } else if (c == ARROW_UP) {
+            view.offset--;
+        } else if (c == ARROW_DOWN) {
+            view.offset++;
+        } else if (c == PAGE_UP) {
+            view.offset -= state->screenrows;
+        } else if (c == PAGE_DOWN) {
+            view.offset += state->screenrows;
+        } else if (c == 'n' || c == ARROW_RIGHT) {
+            int at = view.offset + 1;
+            while (at < count && view.lines[at].kind != '@')
+                at++;
+            if (at < count)
+                view.offset = at;
+        } else if (c == 'p' || c == ARROW_LEFT) {
+            int at = view.offset - 1;
+            while (at > 0 && view.lines[at].kind != '@')
+                at--;
+            view.offset = std::max(at, 0);
+        } else if (c == WINDOW_RESIZE) {
+            ApplyWindowResize(state);
+        }
+        view.offset = std::max(0, std::min(view.offset, count - 1));
+    }
+    state->diff_view = NULL;
+    WipeString(&view.saved_text);
+    SetStatusMessage(state, "");
+}
+
+/* ============================= Command prompt ============================= */
+// PURE
+/* Put the cursor at the start of 'row', scrolling only if it is off the
+ * screen. */
+static void MoveCursorToRow(State* state, int row) {
+    row = std::max(0, std::min(row, state->numrows));
+    if (row < state->rowoff || row >= state->rowoff + state->screenrows) {
+        state->rowoff = row;
+        state->cy = 0;
+    } else {
+        state->cy = row - state->rowoff;
+    }
+    state->cx = 0;
+    state->coloff = 0;
+}
+
+// PURE
+/* Put the cursor on 'at', scrolling only if it is off the screen. */
+static void MoveCursorTo(State* state, Cursor at) {
+    const int coloff = state->coloff;
+    MoveCursorToRow(state, at.row);
+    if (at.col >= coloff && at.col < coloff + state->screencols)
+        state->coloff = coloff;
+    state->cx = at.col - state->coloff;
+    ClampCursorToScreen(state);
+}
+
+// SIDE EFFECTS
+/* Read a line typed after 'prompt' in the status bar into 'line'. Returns
+ * false if it was cancelled with ESC. */
+static bool PromptLine(int fd, State* state, const char* prompt,
+                       std::string* line) {
+    line->clear();
+    while (1) {
+        SetStatusMessage(state, "%s%s", prompt, line->c_str());
+        RefreshScreen();
+
+        int c = NextKey(fd);
+        if (c == DEL_KEY || c == CTRL_H || c == BACKSPACE) {
+            if (!line->empty())
+                line->pop_back();
+        } else if (c == ESC) {
+            SetStatusMessage(state, "");
+            return false;
+        } else if (c == ENTER) {
+            SetStatusMessage(state, "");
+            return true;
+        } else if (c == WINDOW_RESIZE) {
+            ApplyWindowResize(state);
+        } else if (c < 256 && isprint(c) && line->size() < QUERY_LEN) {
+            *line += c;
+        }
+    }
+}
+
+// PURE
+/* Parse a line address at '*p' ("12", "." for the cursor's row, "$" for the
+ * last one) into a 0-based row. Without one, 'row' is left alone. Returns
+ * false if the address is malformed. */
+static bool ParseLineAddress(State* state, const char** p, int* row) {
+    if (**p == '.') {
+        *row = std::min(state->rowoff + state->cy, state->numrows - 1);
+        (*p)++;
+    } else if (**p == '$') {
+        *row = state->numrows - 1;
+        (*p)++;
+    } else if (isdigit((unsigned char)**p)) {
+        char* end;
+        const long line = strtol(*p, &end, 10);
+        if (line < 1 || line > state->numrows)
+            return false;
+        *row = line - 1;
+        *p = end;
+    }
+    return true;
+}
+
+// PURE
+/* Parse the range a command starts with into rows ['*begin', '*end'): "%"
+ * for the whole buffer, one address or two separated by ',', or nothing for
+ * the cursor's row. Returns false if the range is malformed or empty. */
+static bool ParseLineRange(State* state, const char** p, int* begin,
+                           int* end) {
+    while (**p == ' ')
+        (*p)++;
+    if (**p == '%') {
+        (*p)++;
+        *begin = 0;
+        *end = state->numrows;
+        return true;
+    }
+    int first = std::min(state->rowoff + state->cy, state->numrows - 1);
+    if (!ParseLineAddress(state, p, &first))
+        return false;
+    int last = first;
+    if (**p == ',') {
+        (*p)++;
+        if (!ParseLineAddress(state, p, &last))
+            return false;
+    }
+    *begin = first;
+    *end = last + 1;
+    return first >= 0 && first <= last;
+}
+
+// SIDE EFFECTS
+/* The answer to 'question' in the status bar: the key pressed if it is one
+ * of 'choices' (lowercase), 0 for any other. */
+static int Choose(int fd, State* state, const char* question,
+                  const char* choices) {
+    while (1) {
+        SetStatusMessage(state, "%s", question);
+        RefreshScreen();
+        int c = NextKey(fd);
+        if (c == WINDOW_RESIZE) {
+            ApplyWindowResize(state);
+        } else {
+            SetStatusMessage(state, "");
+            c = c < 256 ? tolower(c) : 0;
+            return c != 0 && strchr(choices, c) ? c : 0;
+        }
+    }
+}
+
+// SIDE EFFECTS
+/* Whether the user agrees to 'question' (y/n) in the status bar. */
+static bool Confirm(int fd, State* state, const char* question) {
+    const std::string yes_or_no = std::string(question) + " (y/n)";
+    return Choose(fd, state, yes_or_no.c_str(), "y") == 'y';
+}
+
+// SIDE EFFECTS
+/* Replace rows ['begin', 'end') with what 'command' outputs given them as
+ * input (see filter.h). The rows are streamed to it straight from the
+ * buffer, and its output spliced in at once when it succeeds. A command
+ * that fails leaves the rows as they were. */
+static void FilterRows(int fd, State* state, int begin, int end,
+                       const std::string& command) {
+    if (!state->derived_key.empty() &&
+        !Confirm(fd, state,
+                 "The command sees these lines unencrypted. Run it anyway?"))
+        return;
+
+    int row = begin;
+    size_t offset = 0; /* In the row, the newline being at its size. */
+    ette::FilterInput input = [&](char* buffer, size_t size) {
+        size_t filled = 0;
+        while (filled < size && row < end) {
+            const Row& r = state->row[row];
+            if (offset < (size_t)r.size) {
+                const size_t n = std::min(size - filled, r.size - offset);
+                memcpy(buffer + filled, r.chars + offset, n);
+                filled += n;
+                offset += n;
+            } else {
+                buffer[filled++] = '\n';
+                row++;
+                offset = 0;
+            }
+        }
+        return filled;
+    };
+    /* Keys typed meanwhile are dropped, but for those that stop it. */
+    ette::FilterCancelled cancelled = [&] {
+        const int c = PollKey(fd);
+        if (c == WINDOW_RESIZE)
+            ApplyWindowResize(state);
+        return c == ESC || c == CTRL_C;
+    };
+    SetStatusMessage(state, "Running the command, ESC stops it");
+    RefreshScreen();
+    std::string output, error;
+    const ette::Status<int> status =
+        ette::RunFilter(command, input, &output, &error, cancelled);
+    if (!status.ok()) {
+        const ette::StatusCode code = status.error().code();
+        if (code == ette::StatusCode::kCancelled)
+            SetStatusMessage(state, "Command stopped");
+        else if (code == ette::StatusCode::kInvalidDataSize)
+            SetStatusMessage(state, "Command stopped: over %d MB of output",
+                             (int)(ette::kFilterOutputLimit >> 20));
+        else
+            SetStatusMessage(state, "Can't run the command! %s",
+                             status.error().message().c_str());
+    } else if (status.value() != 0) {
+        const size_t newline = error.find('\n');
+        SetStatusMessage(state, "Command failed (%d): %s", status.value(),
+                         error.substr(0, newline).c_str());
+    } else {
+        ReplaceRows(state, begin, end - begin, output.data(), output.size());
+        MoveCursorToRow(state, begin);
+        SetStatusMessage(state, "%d lines replaced by %d", end - begin,
+                         (int)ette::SplitLines(output).size());
+    }
+    WipeString(&output);
+    WipeString(&error);
+}
+
+/* Rows a line operation hands to a thread at least. */
+constexpr size_t kLineOpGrain = 64 * 1024;
+
+/* A row being sorted, with the key it sorts by: a number, or the first 8
+ * bytes of the row, big-endian, so most comparisons don't touch the row.
+ * Keys are inverted to sort in reverse. */
+struct RowSortEntry {
+    uint64_t key;
+    Row* row;
+};
+
+// PURE
+/* The first 8 bytes of 'row' as a number that orders like them. */
+static uint64_t LexicalSortKey(const Row* row) {
+    unsigned char bytes[8] = {0};
+    memcpy(bytes, row->chars, std::min(row->size, 8));
+    uint64_t key = 0;
+    for (unsigned char byte : bytes)
+        key = key << 8 | byte;
+    return key;
+}
+
+// PURE
+/* The number 'row' starts with, after blanks (0 if none), as an unsigned
+ * number that orders like it. */
+static uint64_t NumericSortKey(const Row* row) {
+    const char* p = row->chars;
+    while (*p == ' ' || *p == '\t')
+        p++;
+    double value = 0;
+    if (isdigit((unsigned char)*p) || *p == '-' || *p == '+' || *p == '.')
+        value = strtod(p, NULL);
+    if (value != value) /* NaN */
+        value = 0;
+    value += 0.0; /* -0 is 0. */
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    return bits >> 63 ? ~bits : bits | 1ull << 63;
+}
+
+// PURE
+/* Whether 'a' sorts before 'b'. Only a lexical sort looks past the keys:
+ * rows with the same number stay in their order. */
+static bool RowSortsBefore(const RowSortEntry& a, const RowSortEntry& b,
+                           bool lexical, bool reverse) {
+    if (a.key != b.key || !lexical)
+        return a.key < b.key;
+    const int c = memcmp(a.row->chars, b.row->chars,
+                         std::min(a.row->size, b.row->size));
+    const int order = c != 0 ? c : a.row->size - b.row->size;
+    return reverse ? order > 0 : order < 0;
+}
+
+// PURE
+/* Sort the 'n' entries at 'entries' stably by their keys, a byte at a time
+ * from the lowest, skipping the bytes all the keys share. 'scratch' holds
+ * 'n' more. */
+static void RadixSortByKey(RowSortEntry* entries, RowSortEntry* scratch,
+                           size_t n) {
+    if (n == 0)
+        return;
+    std::vector<size_t> counts(8 * 256);
+    for (size_t i = 0; i < n; i++) {
+        for (int byte = 0; byte < 8; byte++)
+            counts[byte * 256 + (entries[i].key >> (8 * byte) & 0xff)]++;
+    }
+    RowSortEntry* from = entries;
+    RowSortEntry* to = scratch;
+    for (int byte = 0; byte < 8; byte++) {
+        size_t* count = &counts[byte * 256];
+        if (count[entries[0].key >> (8 * byte) & 0xff] == n)
+            continue;
+        size_t offset = 0;
+        for (int digit = 0; digit < 256; digit++) {
+            const size_t c = count[digit];
+            count[digit] = offset;
+            offset += c;
+        }
+        for (size_t i = 0; i < n; i++)
+            to[count[from[i].key >> (8 * byte) & 0xff]++] = from[i];
+        std::swap(from, to);
+    }
+    if (from != entries)
+        std::copy(from, from + n, entries);
+}
+
+// PURE
+/* Sort 'entries' stably (see RowSortsBefore()): chunks of them on the
+ * thread pool, then merging pairs of chunks a round at a time. */
+static void SortRowEntries(std::vector<RowSortEntry>* entries, bool lexical,
+                           bool reverse) {
+    std::vector<RowSortEntry>& sorted = *entries;
+    const size_t n = sorted.size();
+    auto less = [lexical, reverse](const RowSortEntry& a,
+                                   const RowSortEntry& b) {
+        return RowSortsBefore(a, b, lexical, reverse);
+    };
+    std::vector<RowSortEntry> scratch(n);
+    const size_t chunks =
+        std::max<size_t>(1, std::min(ThreadPool::Global().WorkerCount() + 1,
+                                     n / kLineOpGrain));
+    const size_t chunk_size = (n + chunks - 1) / chunks;
+    ParallelFor(chunks, 1, [&](size_t first, size_t last) {
+        for (size_t c = first; c < last; c++) {
+            const size_t begin = c * chunk_size;
+            const size_t end = std::min(n, begin + chunk_size);
+            RadixSortByKey(&sorted[begin], &scratch[begin], end - begin);
+            for (size_t i = begin; lexical && i < end;) {
+                size_t j = i + 1;
+                while (j < end && sorted[j].key == sorted[i].key)
+                    j++;
+                if (j - i > 1)
+                    std::stable_sort(&sorted[i], &sorted[j], less);
+                i = j;
+            }
+        }
+    });
+
+    for (size_t width = chunk_size; width < n; width *= 2) {
+        const size_t pairs = (n + 2 * width - 1) / (2 * width);
+        ParallelFor(pairs, 1, [&](size_t first, size_t last) {
+            for (size_t i = first; i < last; i++) {
+                const size_t begin = i * 2 * width;
+                const size_t middle = std::min(n, begin + width);
+                const size_t end = std::min(n, begin + 2 * width);
+                std::merge(sorted.begin() + begin, sorted.begin() + middle,
+                           sorted.begin() + middle, sorted.begin() + end,
+                           scratch.begin() + begin, less);
+            }
+        });
+        sorted.swap(scratch);
+    }
+    WipeMemory(scratch.data(), scratch.size() * sizeof(scratch[0]));
+}
+
+// PURE
+/* Number the rows from 'from' on again after they moved, and leave their
+ * highlighting to be redone when they are shown. */
+static void RowsMoved(State* state, int from) {
+    for (int j = from; j < state->numrows; j++)
+        state->row[j].idx = j;
+    MarkRowsStale(state, from);
+    state->dirty++;
+}
+
+// PURE
+/* Remove the rows in ['begin', 'end') whose 'keep' flag (indexed from
+ * 'begin') isn't set, all at once. Returns how many were removed. */
+static int RemoveRows(State* state, int begin, int end,
+                      const std::vector<char>& keep) {
+    int to = begin;
+    for (int j = begin; j < end; j++) {
+        if (keep[j - begin])
+            state->row[to++] = state->row[j];
+        else
+            WipeRow(state->row + j);
+    }
+    const int removed = end - to;
+    if (removed == 0)
+        return 0;
+    memmove(state->row + to, state->row + end,
+            sizeof(state->row[0]) * (state->numrows - end));
+    state->numrows -= removed;
+    RowsMoved(state, begin);
+    return removed;
+}
+
+// PURE
+/* Remove the rows in ['begin', 'end') that repeat the row before them.
+ * Returns how many were removed. */
+static int UniqueRows(State* state, int begin, int end) {
+    std::vector<char> keep(end - begin);
+    ParallelFor(keep.size(), kLineOpGrain, [&](size_t first, size_t last) {
+        for (size_t i = first; i < last; i++) {
+            const Row* row = state->row + begin + i;
+            keep[i] = i == 0 || row->size != row[-1].size ||
+                      memcmp(row->chars, row[-1].chars, row->size) != 0;
+        }
+    });
+    return RemoveRows(state, begin, end, keep);
+}
+
+// PURE
+/* Keep only the rows in ['begin', 'end') that match 'pattern' (POSIX
+ * extended), or with 'drop' only those that don't. Each thread compiles the
+ * pattern for itself, as regexec() locks a shared one. Returns false if the
+ * pattern doesn't compile. */
+static bool KeepMatchingRows(State* state, int begin, int end,
+                             const char* pattern, bool drop) {
+    regex_t regex;
+    const int error = regcomp(&regex, pattern, REG_EXTENDED | REG_NOSUB);
+    if (error != 0) {
+        char message[128];
+        regerror(error, &regex, message, sizeof(message));
+        SetStatusMessage(state, "Bad pattern: %s", message);
+        return false;
+    }
+    regfree(&regex);
+
+    std::vector<char> keep(end - begin);
+    ParallelFor(keep.size(), kLineOpGrain, [&](size_t first, size_t last) {
+        regex_t chunk_regex;
+        regcomp(&chunk_regex, pattern, REG_EXTENDED | REG_NOSUB);
+        for (size_t i = first; i < last; i++) {
+            const bool match = regexec(&chunk_regex,
+                                       state->row[begin + i].chars, 0, NULL,
+                                       0) == 0;
+            keep[i] = match != drop;
+        }
+        regfree(&chunk_regex);
+    });
+    SetStatusMessage(state, "%d lines removed",
+                     RemoveRows(state, begin, end, keep));
+    return true;
+}
+
+// PURE
+/* Sort rows ['begin', 'end') as the "sort" command does with 'options':
+ * "-n" by the number they start with, "-r" in reverse, "-u" without the
+ * repeated ones. Only the Row structs move, the text and its rendering stay
+ * where they are. Returns false if an option is unknown. */
+static bool SortRows(State* state, int begin, int end, const char* options) {
+    bool numeric = false, reverse = false, unique = false;
+    for (const char* p = options; *p; p++) {
+        if (*p == ' ' || *p == '-')
+            continue;
+        if (*p == 'n') {
+            numeric = true;
+        } else if (*p == 'r') {
+            reverse = true;
+        } else if (*p == 'u') {
+            unique = true;
+        } else {
+            SetStatusMessage(state, "Unknown sort option: %c", *p);
+            return false;
+        }
+    }
+    if (end == begin) {
+        SetStatusMessage(state, "0 lines sorted");
+        return true;
+    }
+
+    std::vector<RowSortEntry> entries(end - begin);
+    ParallelFor(entries.size(), kLineOpGrain, [&](size_t first, size_t last) {
+        for (size_t i = first; i < last; i++) {
+            Row* row = state->row + begin + i;
+            const uint64_t key =
+                numeric ? NumericSortKey(row) : LexicalSortKey(row);
+            entries[i] = {reverse ? ~key : key, row};
+        }
+    });
+    SortRowEntries(&entries, !numeric, reverse);
+
+    bool moved = false;
+    for (size_t i = 0; i < entries.size() && !moved; i++)
+        moved = entries[i].row != state->row + begin + i;
+    if (moved) {
+        std::vector<Row> rows(entries.size());
+        ParallelFor(rows.size(), kLineOpGrain, [&](size_t first, size_t last) {
+            for (size_t i = first; i < last; i++)
+                rows[i] = *entries[i].row;
+        });
+        std::copy(rows.begin(), rows.end(), state->row + begin);
+        RowsMoved(state, begin);
+    }
+    WipeMemory(entries.data(), entries.size() * sizeof(entries[0]));
+    if (unique)
+        UniqueRows(state, begin, end);
+    SetStatusMessage(state, "%d lines sorted", end - begin);
+    return true;
+}
+
+// PURE
+/* Reverse the order of rows ['begin', 'end'). */
+static void ReverseRows(State* state, int begin, int end) {
+    std::reverse(state->row + begin, state->row + end);
+    RowsMoved(state, begin);
+    SetStatusMessage(state, "%d lines reversed", end - begin);
+}
+
+// PURE
+/* Type at all of 'cursors' from now on, the cursor going to the first. */
+static void SetCursors(State* state, std::vector<Cursor> cursors) {
+    const int count = cursors.size();
+    MoveCursorTo(state, cursors.front());
+    state->cursors.clear();
+    if (count > 1)
+        state->cursors = std::move(cursors);
+    SetStatusMessage(state, "%d cursors, ESC leaves one", count);
+}
+
+// PURE
+/* A cursor on each of the rows ['begin', 'end'), in the cursor's column or
+ * at the end of the rows shorter than that. */
+static void AddColumnCursors(State* state, int begin, int end) {
+    const int col = state->coloff + state->cx;
+    std::vector<Cursor> cursors(end - begin);
+    for (int j = begin; j < end; j++)
+        cursors[j - begin] = {j, std::min(col, state->row[j].size)};
+    if (!cursors.empty())
+        SetCursors(state, std::move(cursors));
+}
+
+// PURE
+/* A cursor at the start of every match of 'pattern' (POSIX extended) in the
+ * rows ['begin', 'end'), searched in chunks on the thread pool as
+ * KeepMatchingRows() does. Returns false if the pattern doesn't compile. */
+static bool AddMatchCursors(State* state, int begin, int end,
+                            const char* pattern) {
+    regex_t regex;
+    const int error = regcomp(&regex, pattern, REG_EXTENDED);
+    if (error != 0) {
+        char message[128];
+        regerror(error, &regex, message, sizeof(message));
+        SetStatusMessage(state, "Bad pattern: %s", message);
+        return false;
+    }
+    regfree(&regex);
+
+    std::mutex mutex;
+    std::vector<std::pair<size_t, std::vector<Cursor>>> chunks;
+    ParallelFor(end - begin, kLineOpGrain, [&](size_t first, size_t last) {
+        regex_t chunk_regex;
+        regcomp(&chunk_regex, pattern, REG_EXTENDED);
+        std::vector<Cursor> found;
+        regmatch_t match;
+        for (size_t i = first; i < last; i++) {
+            const Row& row = state->row[begin + i];
+            for (int from = 0;
+                 from <= row.size &&
+                 regexec(&chunk_regex, row.chars + from, 1, &match,
+                         from > 0 ? REG_NOTBOL : 0) == 0;
+                 from += std::max(match.rm_eo, match.rm_so + 1)) {
+                found.push_back({(int)(begin + i), from + (int)match.rm_so});
+            }
+        }
+        regfree(&chunk_regex);
+        std::lock_guard<std::mutex> lock(mutex);
+        chunks.emplace_back(first, std::move(found));
+    });
+    std::sort(chunks.begin(), chunks.end(),
+              [](const auto& a, const auto& b) { return a.first < b.first; });
+    std::vector<Cursor> cursors;
+    for (const auto& chunk : chunks)
+        cursors.insert(cursors.end(), chunk.second.begin(),
+                       chunk.second.end());
+    if (cursors.empty())
+        SetStatusMessage(state, "No matches");
+    else
+        SetCursors(state, std::move(cursors));
+    return true;
+}
+
+// PURE
+/* Whether the command at '*p' is 'name', alone or followed by a space. If
+ * so '*p' is moved to its arguments. */
+static bool ParseCommandName(const char** p, const char* name) {
+    const size_t len = strlen(name);
+    if (strncmp(*p, name, len) != 0 || ((*p)[len] != '\0' && (*p)[len] != ' '))
+        return false;
+    *p += len;
+    while (**p == ' ')
+        (*p)++;
+    return true;
+}
+
+// SIDE EFFECTS
+/* Run 'command', as typed at the Ctrl-E prompt, on a range of rows (the
+ * cursor's row by default): "[range]!<shell command>" filters them through
+ * the shell command, "sort [-nru]", "uniq", "reverse", "keep <pattern>" and
+ * "drop <pattern>" do the same as the shell tools in the editor itself, so
+ * the text never leaves it. "cursors [pattern]" puts a cursor at every match
+ * of the pattern, or on every row in the cursor's column, see
+ * InsertCharAtCursors(). */
+void RunCommand(int fd, State* state, const std::string& command) {
+    const char* p = command.c_str();
+    int begin, end;
+    if (!ParseLineRange(state, &p, &begin, &end)) {
+        SetStatusMessage(state, "Bad line range: %s", command.c_str());
+        return;
+    }
+    while (*p == ' ')
+        p++;
+    state->cursors.clear();
+    bool drop = false;
+    if (ParseCommandName(&p, "cursors")) {
+        if (*p == '\0')
+            AddColumnCursors(state, begin, end);
+        else
+            AddMatchCursors(state, begin, end, p);
+        return;
+    } else if (*p == '!' && p[1] != '\0') {
+        FilterRows(fd, state, begin, end, p + 1);
+        return;
+    } else if (ParseCommandName(&p, "sort")) {
+        if (!SortRows(state, begin, end, p))
+            return;
+    } else if (ParseCommandName(&p, "uniq")) {
+        SetStatusMessage(state, "%d repeated lines removed",
+                         UniqueRows(state, begin, end));
+    } else if (ParseCommandName(&p, "reverse")) {
+        ReverseRows(state, begin, end);
+    } else if (ParseCommandName(&p, "keep") ||
+               (drop = ParseCommandName(&p, "drop"))) {
+        if (*p == '\0') {
+            SetStatusMessage(state, "%s needs a pattern",
+                             drop ? "drop" : "keep");
+            return;
+        }
+        if (!KeepMatchingRows(state, begin, end, p, drop))
+            return;
+    } else {
+        SetStatusMessage(state, "Unknown command: %s", p);
+        return;
+    }
+    MoveCursorToRow(state, begin);
+}
+
+// SIDE EFFECTS
+/* Prompt for a command (see RunCommand()) and run it. */
+void CommandPrompt(int fd, State* state) {
+    std::string command;
+    if (PromptLine(fd, state, "Command: ", &command) && !command.empty())
+        RunCommand(fd, state, command);
+    WipeString(&command);
+}
+
+/* ============================ External changes ============================ */
+// PURE
+/* Whether another program changed the file, or created it, since it was
+ * last opened or saved here. A removed file isn't a change: saving just
+ * writes it again. Vault entries and followed files aren't checked. */
+bool FileChangedOnDisk(State* state) {
+    if (state->vault || state->following || !state->filename)
+        return false;
+    const std::optional<FileStamp> now = StampFile(state->filename);
+    const std::optional<FileStamp>& then = state->disk_stamp;
+    if (!now)
+        return false;
+    return !then || now->dev != then->dev || now->ino != then->ino ||
+           now->size != then->size ||
+           now->mtime.tv_sec != then->mtime.tv_sec ||
+           now->mtime.tv_nsec != then->mtime.tv_nsec;
+}
+
+// SIDE EFFECTS
+/* Tell once in the status bar when the file changed on disk, see
+ * FileChangedOnDisk(). It costs a stat(), so it's done while idle. */
+void CheckFileOnDisk(State* state) {
+    if (state->locked || state->disk_change_shown ||
+        !FileChangedOnDisk(state))
+        return;
+    state->disk_change_shown = true;
+    SetStatusMessage(state, "The file changed on disk, Ctrl-R reloads it");
+}
+
+// PURE
+/* Where 'row' is once 'hunks' are applied: moved by the rows added and
+ * removed before it, or at the start of the change it is in. */
+static int RowAfterHunks(const std::vector<ette::DiffHunk>& hunks, int row) {
+    int moved = 0;
+    for (const ette::DiffHunk& hunk : hunks) {
+        if ((size_t)row < hunk.old_begin)
+            break;
+        if ((size_t)row < hunk.old_begin + hunk.old_count)
+            return hunk.new_begin;
+        moved = (hunk.new_begin + hunk.new_count) -
+                (hunk.old_begin + hunk.old_count);
+    }
+    return row + moved;
+}
+
+// PURE
+/* Make the rows the lines of 'text', replacing only the ones that differ
+ * (see DiffLines()). The others keep their text, rendering and highlighting;
+ * the row array is only rebuilt if rows are added or removed. The new rows
+ * are highlighted at once, and the rows after a change only when a multi
+ * line comment now starts or ends differently there. The cursor and the
+ * view stay on the same text. Returns how many changes there were. */
+int ReloadRows(State* state, std::string_view text) {
+    const std::vector<std::string_view> lines = ette::SplitLines(text);
+    std::vector<std::string_view> rows(state->numrows);
+    for (int j = 0; j < state->numrows; j++)
+        rows[j] = std::string_view(state->row[j].chars, state->row[j].size);
+    const std::vector<ette::DiffHunk> hunks = ette::DiffLines(rows, lines);
+    if (hunks.empty())
+        return 0;
+
+    /* How a multi line comment stood at the end of each change, if known. */
+    std::vector<int> old_open(hunks.size());
+    bool same_count = true;
+    for (size_t h = 0; h < hunks.size(); h++) {
+        const int last = hunks[h].old_begin + hunks[h].old_count - 1;
+        old_open[h] = last < 0                       ? 0
+                      : state->row[last].hl_stale ? -1
+                                                  : RowHasOpenComment(
+                                                        &state->row[last]);
+        same_count = same_count && hunks[h].old_count == hunks[h].new_count;
+    }
+    const int filerow = RowAfterHunks(hunks, state->rowoff + state->cy);
+    const int rowoff = RowAfterHunks(hunks, state->rowoff);
+    DropCursorsFrom(state, hunks[0].old_begin);
+
+    /* Unchanged rows are moved as they are, changed ones built again. */
+    const int numrows = lines.size();
+    Row* row = same_count ? state->row
+                          : (Row*)malloc(sizeof(Row) * std::max(numrows, 1));
+    size_t from = 0, to = 0;
+    for (const ette::DiffHunk& hunk : hunks) {
+        if (row != state->row)
+            memcpy(row + to, state->row + from,
+                   sizeof(Row) * (hunk.old_begin - from));
+        to += hunk.old_begin - from;
+        for (size_t j = 0; j < hunk.old_count; j++)
+            WipeRow(state->row + hunk.old_begin + j);
+        for (size_t j = 0; j < hunk.new_count; j++, to++) {
+            const std::string_view line = lines[hunk.new_begin + j];
+            InitRow(row + to, to, line.data(), line.size());
+        }
+        from = hunk.old_begin + hunk.old_count;
+    }
+    if (row != state->row) {
+        memcpy(row + to, state->row + from,
+               sizeof(Row) * (state->numrows - from));
+        free(state->row);
+        state->row = row;
+        for (int j = hunks[0].new_begin; j < numrows; j++)
+            state->row[j].idx = j;
+    }
+    state->numrows = numrows;
+
+    for (size_t h = 0; h < hunks.size(); h++) {
+        const int begin = hunks[h].new_begin;
+        const int end = begin + hunks[h].new_count;
+        for (int j = begin; j < end; j++)
+            UpdateRowSyntax(state, &state->row[j]);
+        if (end >= numrows)
+            continue;
+        if (end > 0 && state->row[end - 1].hl_stale)
+            UpdateRowSyntax(state, &state->row[end - 1]);
+        const int open = end > 0 ? RowHasOpenComment(&state->row[end - 1]) : 0;
+        if (open == old_open[h])
+            continue;
+        /* As UpdateSyntax() does from an edited row. */
+        Row* next = &state->row[end];
+        if (next->hl_stale && next->hl_start != open)
+            MarkRowsStale(state, end);
+        else if (!next->hl_stale && next->hl_start != open)
+            UpdateSyntax(state, next);
+    }
+
+    state->rowoff = rowoff;
+    state->cy = filerow - rowoff;
+    if (state->cy < 0 || state->cy >= state->screenrows)
+        MoveCursorToRow(state, filerow);
+    const int size = filerow < numrows ? state->row[filerow].size : 0;
+    if (state->coloff + state->cx > size) {
+        state->coloff = 0;
+        state->cx = size;
+        ClampCursorToScreen(state);
+    }
+    return hunks.size();
+}
+
+// SIDE EFFECTS
+/* Load the file again as it is on disk, asking first if that loses unsaved
+ * edits. Only the rows that differ are replaced, see ReloadRows(). */
+void ReloadFile(int fd, State* state) {
+    if (state->dirty &&
+        !Confirm(fd, state, "Reloading loses your unsaved changes. Go on?"))
+        return;
+    /* Taken first: a change made while reading is noticed too. */
+    const std::optional<FileStamp> stamp =
+        state->filename ? StampFile(state->filename) : std::nullopt;
+    std::optional<std::string> text = ReadSavedText(state);
+    if (!text) {
+        SetStatusMessage(state, "Can't read the file");
+        return;
+    }
+    const int changes = ReloadRows(state, *text);
+    WipeString(&*text);
+    state->disk_stamp = stamp;
+    state->disk_change_shown = false;
+    state->dirty = 0;
+    if (changes == 0)
+        SetStatusMessage(state, "Reloaded, no changes");
+    else
+        SetStatusMessage(state, "Reloaded, %d change%s", changes,
+                         changes == 1 ? "" : "s");
+}
+
+// SIDE EFFECTS
+/* Save, unless another program changed the file since it was opened or
+ * saved: then ask whether to overwrite its changes, reload it or neither. */
+void SaveOrReload(int fd, State* state) {
+    if (FileChangedOnDisk(state)) {
+        const int choice = Choose(
+            fd, state,
+            "The file changed on disk: (o)verwrite, (r)eload or (c)ancel?",
+            "orc");
+        if (choice == 'r') {
+            ReloadFile(fd, state);
+            return;
+        }
+        if (choice != 'o') {
+            SetStatusMessage(state, "Not saved");
+            return;
+        }
+    }
+    Save(state);
+}
+
+/* ============================ Multiple cursors ============================ */
+// PURE
+/* Which of the cursors the one on the screen is. */
+static size_t MainCursor(State* state) {
+    const std::vector<Cursor>& cursors = state->cursors;
+    const Cursor at = {state->rowoff + state->cy, state->coloff + state->cx};
+    const size_t i =
+        std::lower_bound(cursors.begin(), cursors.end(), at, CursorBefore) -
+        cursors.begin();
+    return std::min(i, cursors.size() - 1);
+}
+
+// PURE
+/* Once the cursors moved: merge the ones that met and bring the cursor on
+ * the screen to where the 'main' one went. */
+static void CursorsMoved(State* state, size_t main) {
+    std::vector<Cursor>& cursors = state->cursors;
+    const Cursor at = cursors[main];
+    cursors.erase(std::unique(cursors.begin(), cursors.end(), SameCursor),
+                  cursors.end());
+    MoveCursorTo(state, at);
+    if (cursors.size() < 2)
+        cursors.clear();
+}
+
+// PURE
+/* Make an edit at all the cursors as one batch: 'edit' is called once for
+ * each row with cursors on it, with those cursors, to rebuild its text and
+ * move them, and returns whether the row changed. Each changed row is then
+ * rendered once. Those down to the end of the screen are highlighted once,
+ * in order, so a comment opened or closed is carried to the next rows once
+ * for the whole batch; from the first one below, the rows are highlighted
+ * as they are shown, as after ReplaceRows(), so thousands of rows cost no
+ * more than their text. */
+template <typename Edit>
+static void EditAtCursors(State* state, Edit edit) {
+    std::vector<Cursor>& cursors = state->cursors;
+    const size_t main = MainCursor(state);
+    std::vector<int> edited;
+    for (size_t i = 0, j; i < cursors.size(); i = j) {
+        const int at = cursors[i].row;
+        for (j = i + 1; j < cursors.size() && cursors[j].row == at; j++) {
+        }
+        if (at < state->numrows && edit(&state->row[at], &cursors[i], j - i))
+            edited.push_back(at);
+    }
+    for (int at : edited)
+        RenderRow(&state->row[at]);
+    if (!edited.empty()) {
+        state->hl_frontier = std::min(state->hl_frontier, edited.front());
+        state->dirty++;
+    }
+    const int shown_end = state->rowoff + state->screenrows;
+    size_t shown = 0;
+    for (; shown < edited.size() && edited[shown] < shown_end; shown++)
+        state->row[edited[shown]].hl_stale = 1;
+    for (size_t i = 0; i < shown; i++) {
+        if (state->row[edited[i]].hl_stale && RowStartKnown(state, edited[i]))
+            UpdateSyntax(state, &state->row[edited[i]]);
+    }
+    if (shown < edited.size())
+        MarkRowsStale(state, edited[shown]);
+    CursorsMoved(state, main);
+}
+
+// PURE
+/* Insert 'c' at every cursor, each row being rebuilt once whatever the
+ * number of cursors on it. With a single cursor, as InsertChar(). */
+void InsertCharAtCursors(State* state, int c) {
+    if (state->cursors.empty()) {
+        InsertChar(state, c);
+        return;
+    }
+    EditAtCursors(state, [c](Row* row, Cursor* cursors, size_t count) {
+        char* chars = (char*)malloc(row->size + count + 1);
+        int from = 0, to = 0;
+        for (size_t i = 0; i < count; i++) {
+            const int col = std::min(cursors[i].col, row->size);
+            memcpy(chars + to, row->chars + from, col - from);
+            to += col - from;
+            chars[to++] = c;
+            from = col;
+            cursors[i].col = to;
+        }
+        memcpy(chars + to, row->chars + from, row->size - from + 1);
+        WipeMemory(row->chars, row->size);
+        free(row->chars);
+        row->chars = chars;
+        row->size += count;
+        return true;
+    });
+}
 
-        int c = ReadKey(fd);
-        if (c == DEL_KEY || c == CTRL_H || c == BACKSPACE) {
-            if (qlen != 0)
-                query[--qlen] = '\0';
-            last_match = -1;
-        } else if (c == ESC || c == ENTER) {
-            if (c == ESC) {
-                state->cx = saved_cx;
-                state->cy = saved_cy;
-                state->coloff = saved_coloff;
-                state->rowoff = saved_rowoff;
-            }
-            FIND_RESTORE_HL;
-            SetStatusMessage(state, "");
-            return;
-        } else if (c == ARROW_RIGHT || c == ARROW_DOWN) {
-            find_next = 1;
-        } else if (c == ARROW_LEFT || c == ARROW_UP) {
-            find_next = -1;
-        } else if (isprint(c)) {
-            if (qlen < QUERY_LEN) {
-                query[qlen++] = c;
-                query[qlen] = '\0';
-                last_match = -1;
+// PURE
+/* Delete the character before every cursor, once when several cursors are
+ * on either side of it. Cursors at the start of a row stay there: rows are
+ * only joined with a single cursor, see DeleteChar(). */
+void DeleteCharAtCursors(State* state) {
+    if (state->cursors.empty()) {
+        DeleteChar(state);
+        return;
+    }
+    EditAtCursors(state, [](Row* row, Cursor* cursors, size_t count) {
+        int from = 0, to = 0;
+        for (size_t i = 0; i < count; i++) {
+            const int col = std::min(cursors[i].col, row->size);
+            if (col > from) {
+                memmove(row->chars + to, row->chars + from, col - 1 - from);
+                to += col - 1 - from;
+                from = col;
             }
+            cursors[i].col = to;
         }
+        const int removed = from - to;
+        memmove(row->chars + to, row->chars + from, row->size - from + 1);
+        row->size -= removed;
+        WipeMemory(row->chars + row->size + 1, removed);
+        return removed > 0;
+    });
+}
 
-        /* Search occurrence. */
-        if (last_match == -1)
-            find_next = 1;
-        if (find_next) {
-            char* match = NULL;
-            int match_offset = 0;
-            int i, current = last_match;
+// PURE
+/* Move every cursor a character left or right within its row. With a single
+ * cursor, as MoveCursor(). */
+void MoveCursors(State* state, int key) {
+    if (state->cursors.empty()) {
+        MoveCursor(state, key);
+        return;
+    }
+    const size_t main = MainCursor(state);
+    for (Cursor& cursor : state->cursors) {
+        const int size = state->row[cursor.row].size;
+        cursor.col += key == ARROW_LEFT ? -1 : 1;
+        cursor.col = std::max(0, std::min(cursor.col, size));
+    }
+    CursorsMoved(state, main);
+}
 
-            for (i = 0; i < state->numrows; i++) {
-                current += find_next;
-                if (current == -1)
-                    current = state->numrows - 1;
-                else if (current == state->numrows)
-                    current = 0;
-                match = strstr(state->row[current].render, query);
-                if (match) {
-                    match_offset = match - state->row[current].render;
-                    break;
-                }
+// SIDE EFFECTS
+/* Handle 'c' with several cursors: typing, deleting and moving along rows
+ * happen at all of them. Returns false to handle it as with one cursor;
+ * other keys that move the cursor or change rows leave just that one. */
+static bool ProcessKeyAtCursors(State* state, int c) {
+    switch (c) {
+        case BACKSPACE:
+        case CTRL_H:
+        case DEL_KEY:
+            DeleteCharAtCursors(state);
+            return true;
+        case ARROW_LEFT:
+        case ARROW_RIGHT:
+            MoveCursors(state, c);
+            return true;
+        case ESC:
+            state->cursors.clear();
+            SetStatusMessage(state, "");
+            return true;
+        case CTRL_C:
+        case CTRL_L:
+        case CTRL_Q:
+        case CTRL_S:
+        case WINDOW_RESIZE:
+            return false;
+        default:
+            if (c == TAB || (c >= ' ' && c < 256)) {
+                InsertCharAtCursors(state, c);
+                return true;
             }
-            find_next = 0;
+            state->cursors.clear();
+            return false;
+    }
+}
 
-            /* Highlight */
-            FIND_RESTORE_HL;
+/* ============================== Split views =============================== */
+// PURE
+/* Make 'view' the one being edited. */
+static void SetCurrentView(State* state, const View& view) {
+    state->cx = view.cx;
+    state->cy = view.cy;
+    state->rowoff = view.rowoff;
+    state->coloff = view.coloff;
+    state->screenrows = view.screenrows;
+    state->screencols = view.screencols;
+}
 
-            if (match) {
-                Row* row = &state->row[current];
-                last_match = current;
-                if (row->hl) {
-                    saved_hl_line = current;
-                    saved_hl = (char*)malloc(row->rsize);
-                    memcpy(saved_hl, row->hl, row->rsize);
-                    memset(row->hl + match_offset, HL_MATCH, qlen);
-                }
-                state->cy = 0;
-                state->cx = match_offset;
-                state->rowoff = current;
-                state->coloff = 0;
-                /* Scroll horizontally as needed. */
-                if (state->cx > state->screencols) {
-                    int diff = state->cx - state->screencols;
-                    state->cx -= diff;
-                    state->coloff += diff;
-                }
-            }
-        }
+// PURE
+/* Share the text area between the two views: in halves, less a line or a
+ * column between them. Both keep their cursor on the same character. */
+static void LayoutViews(State* state) {
+    Split& split = *state->split;
+    View editing = CurrentView(state);
+    View& first = split.other_first ? split.other : editing;
+    View& second = split.other_first ? editing : split.other;
+    if (split.vertical) {
+        first.screenrows = second.screenrows = split.rows;
+        first.screencols = std::max(1, (split.cols - 1) / 2);
+        second.screencols = std::max(1, split.cols - 1 - first.screencols);
+    } else {
+        first.screencols = second.screencols = split.cols;
+        first.screenrows = std::max(1, (split.rows - 1) / 2);
+        second.screenrows = std::max(1, split.rows - 1 - first.screenrows);
+    }
+    SetCurrentView(state, split.other);
+    ClampCursorToScreen(state);
+    split.other = CurrentView(state);
+    SetCurrentView(state, editing);
+    ClampCursorToScreen(state);
+    InvalidateScreen();
+}
+
+// PURE
+/* Split the screen in two views of the rows, one above the other or side
+ * by side, both at the cursor to start with; the top or left one is edited.
+ * A split screen is split the other way instead. The views share the rows
+ * and their rendering and highlighting, so a second one costs no memory. */
+void SplitScreen(State* state, bool vertical) {
+    if (!state->split)
+        state->split = Split{vertical, state->screenrows, state->screencols,
+                             false, CurrentView(state)};
+    state->split->vertical = vertical;
+    LayoutViews(state);
+}
+
+// PURE
+/* Edit in the other view. Its cursor is brought back into the rows if they
+ * changed under it. */
+void SwitchView(State* state) {
+    if (!state->split)
+        return;
+    Split& split = *state->split;
+    const View other = split.other;
+    split.other = CurrentView(state);
+    split.other_first = !split.other_first;
+    SetCurrentView(state, other);
+    const int filerow = state->rowoff + state->cy;
+    if (filerow > state->numrows) {
+        MoveCursorToRow(state, state->numrows);
+        return;
+    }
+    const int size = filerow < state->numrows ? state->row[filerow].size : 0;
+    if (state->coloff + state->cx > size) {
+        state->coloff = 0;
+        state->cx = size;
+        ClampCursorToScreen(state);
+    }
+}
+
+// PURE
+/* Give the whole screen back to the view being edited. */
+void CloseOtherView(State* state) {
+    if (!state->split)
+        return;
+    state->screenrows = state->split->rows;
+    state->screencols = state->split->cols;
+    state->split.reset();
+    ClampCursorToScreen(state);
+    InvalidateScreen();
+}
+
+// SIDE EFFECTS
+/* Ctrl-W: ask what to do with the views and do it. */
+void ViewCommand(int fd, State* state) {
+    switch (Choose(fd, state,
+                   "Views: (s)plit, (v)ertical split, (w) other view, "
+                   "(o)nly this one?",
+                   "svwo")) {
+        case 's':
+            SplitScreen(state, false);
+            break;
+        case 'v':
+            SplitScreen(state, true);
+            break;
+        case 'w':
+            SwitchView(state);
+            break;
+        case 'o':
+            CloseOtherView(state);
+            break;
     }
 }
 
@@ -1337,6 +3667,8 @@ void MoveCursor(State* state, int key) {
 }
 
 void ProcessKeyPressUnlocked(int fd, State* state, int c) {
+    if (!state->cursors.empty() && ProcessKeyAtCursors(state, c))
+        return;
     switch (c) {
         case ENTER: /* Enter */
             InsertNewLine(state);
@@ -1355,15 +3687,28 @@ void ProcessKeyPressUnlocked(int fd, State* state, int c) {
                 state->quit_times = state->quit_times - 1;
                 return;
             }
+            StopScreenPresenter();
             write(fd, "\033c", 3);
             exit(0);
             break;
         case CTRL_S: /* Ctrl-s */
-            Save(state);
+            SaveOrReload(fd, state);
+            break;
+        case CTRL_R:
+            ReloadFile(fd, state);
+            break;
+        case CTRL_W:
+            ViewCommand(fd, state);
             break;
         case CTRL_F:
             Find(fd, state);
             break;
+        case CTRL_D:
+            ShowDiff(fd, state);
+            break;
+        case CTRL_E:
+            CommandPrompt(fd, state);
+            break;
         case BACKSPACE: /* Backspace */
         case CTRL_H:    /* Ctrl-h */
         case DEL_KEY:
@@ -1389,7 +3734,11 @@ void ProcessKeyPressUnlocked(int fd, State* state, int c) {
             MoveCursor(state, c);
             break;
         case CTRL_L: /* ctrl+l, clear screen */
-            /* Just refresh the line as side effect. */
+            /* Repaint every line on the next refresh. */
+            InvalidateScreen();
+            break;
+        case WINDOW_RESIZE:
+            ApplyWindowResize(state);
             break;
         case ESC:
             /* Nothing to do for ESC in this mode. */
@@ -1401,12 +3750,13 @@ void ProcessKeyPressUnlocked(int fd, State* state, int c) {
 }
 
 bool ProcessKeyPressPasswordMode(int fd, State* state, int provided_key) {
-    int c = provided_key ? provided_key : ReadKey(fd);
+    int c = provided_key ? provided_key : NextKey(fd);
 
     switch (c) {
         case ENTER: /* Enter */
             return true;
         case CTRL_Q: /* Ctrl-q */
+            StopScreenPresenter();
             write(fd, "\033c", 3);
             exit(0);
             break;
@@ -1420,6 +3770,10 @@ bool ProcessKeyPressPasswordMode(int fd, State* state, int provided_key) {
             break;
         case CTRL_S:
         case CTRL_C:
+        case CTRL_D:
+        case CTRL_E:
+        case CTRL_R:
+        case CTRL_W:
         case CTRL_F:
         case PAGE_UP:
         case PAGE_DOWN:
@@ -1430,6 +3784,9 @@ bool ProcessKeyPressPasswordMode(int fd, State* state, int provided_key) {
         case CTRL_L:
         case ESC:
             break;
+        case WINDOW_RESIZE:
+            ApplyWindowResize(state);
+            break;
         default:
             // Insert the actual character
             // Show the user an asterisk
@@ -1444,8 +3801,12 @@ bool ProcessKeyPressPasswordMode(int fd, State* state, int provided_key) {
 void ProcessKeyPress(int fd, State* state, int provided_key) {
     /* When the file is modified, requires Ctrl-q to be pressed N times
      * before actually quitting. */
-    int c = provided_key ? provided_key : ReadKey(fd);
+    int c = provided_key ? provided_key : NextKey(fd);
     ProcessKeyPressUnlocked(fd, state, c);
+    if (idle_lock_pending) {
+        idle_lock_pending = false;
+        HandleLockedEditor(state, {});
+    }
 }
 
 // SIDE EFFECTS
@@ -1457,15 +3818,46 @@ void UpdateWindowSize() {
     E->screenrows -= 2; /* Get room for status bar. */
 }
 
+// PURE
+/* Scroll so the cursor, kept on the same character, fits the screen. */
+static void ClampCursorToScreen(State* state) {
+    if (state->cy >= state->screenrows) {
+        state->rowoff += state->cy - (state->screenrows - 1);
+        state->cy = state->screenrows - 1;
+    }
+    if (state->cx >= state->screencols) {
+        state->coloff += state->cx - (state->screencols - 1);
+        state->cx = state->screencols - 1;
+    }
+}
+
 // SIDE EFFECTS
-void HandleWindowChangeSignal(int unused __attribute__((unused))) {
-    UpdateWindowSize();
-    if (E->cy > E->screenrows)
-        if (E->cy > E->screenrows)
-            E->cy = E->screenrows - 1;
-    if (E->cx > E->screencols)
-        E->cx = E->screencols - 1;
-    RefreshScreen();
+/* Handle WINDOW_RESIZE: query the new size once and keep the cursor on the
+ * same character. Unlike at startup, there's no fallback to querying the
+ * terminal with escape sequences: if ioctl() fails we keep the old size.
+ * The next refresh repaints the whole screen. */
+void ApplyWindowResize(State* state) {
+    int rows, cols;
+    if (QueryWindowSize(&rows, &cols) == -1)
+        return;
+    rows -= 2; /* Get room for status bar. */
+    if (rows < 1)
+        rows = 1;
+    if (state->split) {
+        if (rows == state->split->rows && cols == state->split->cols)
+            return;
+        state->split->rows = rows;
+        state->split->cols = cols;
+        LayoutViews(state);
+        return;
+    }
+    if (rows == state->screenrows && cols == state->screencols)
+        return;
+
+    state->screenrows = rows;
+    state->screencols = cols;
+    ClampCursorToScreen(state);
+    InvalidateScreen();
 }
 
 // SIDE EFFECTS
@@ -1481,7 +3873,17 @@ void Init(State* state) {
     state->filename = NULL;
     state->syntax = NULL;
     UpdateWindowSize();
+    if (resize_pipe[0] == -1 &&
+        pipe2(resize_pipe, O_NONBLOCK | O_CLOEXEC) == -1) {
+        resize_pipe[0] = resize_pipe[1] = -1;
+    }
     signal(SIGWINCH, HandleWindowChangeSignal);
+    const char* idle_lock_seconds = getenv("ETTE_IDLE_LOCK_SECONDS");
+    if (idle_lock_seconds)
+        state->idle_lock_seconds = atoi(idle_lock_seconds);
+    const char* precompute_keystream = getenv("ETTE_PRECOMPUTE_KEYSTREAM");
+    state->precompute_keystream =
+        precompute_keystream && atoi(precompute_keystream) != 0;
 }
 
 void InsertString(State* state, std::string& s) {
@@ -1490,15 +3892,6 @@ void InsertString(State* state, std::string& s) {
     }
 }
 
-CryptoAlgorithm GetCryptoAlgorithmFromFilename(std::string& filename) {
-    std::string aes256cbc = ".aes256cbc";
-    if (filename.find(aes256cbc) != std::string::npos) {
-        return CryptoAlgorithm::kAES256CBC;
-    }
-
-    return CryptoAlgorithm::kDefaultNone;
-}
-
 bool FileExists(const std::string& filename) {
     return std::filesystem::exists(filename);
 }
@@ -1508,10 +3901,9 @@ void ClearScreen(State* state) {
     state->cy = 0;
     state->rowoff = 0;
     state->coloff = 0;
-    state->numrows = 0;
-    state->row = NULL;
+    WipeRows(state);
     state->dirty = 0;
-    state->entry_password = "";
+    WipeString(&state->entry_password);
 }
 
 std::string GetPasswordFromState(State* state) {
@@ -1588,6 +3980,7 @@ void HandleNewFileEncryption(State* state,
             case NewFilePasswordState::kConfirmPasswordNeedsCheck: {
                 if (password == confirm_password) {
                     state->password = password;
+                    state->derived_key = DeriveKey(password);
                     ClearScreen(state);
                     state->indelible_msg = "";
                     return;
@@ -1631,6 +4024,31 @@ void HandleExistingFileEncryption(State* state, std::string& filename,
     int current_provided_key_idx = 0;
     const bool has_provided_keys = provided_keys.size() > 0;
 
+    /* Read the file once: every attempt decrypts these bytes, and the
+     * plaintext of the right password is handed to Open(). A vault entry is
+     * unlocked with the vault's index. */
+    const std::optional<std::string> ciphertext =
+        state->vault ? std::optional<std::string>(state->vault->IndexRecord())
+                     : ReadFileToString(filename);
+
+    /* A running ette-agent may still hold the key of this file. */
+    if (ciphertext) {
+        const std::string key_id = GetKeyIdFromCiphertext(*ciphertext);
+        std::optional<std::string> cached_key =
+            key_id.empty() ? std::nullopt : AgentGetKey(key_id);
+        if (cached_key) {
+            CryptoState crypto_state = DecryptWithDerivedKey(
+                *ciphertext, *cached_key, state->crypto_algorithm);
+            if (crypto_state.status.ok()) {
+                state->derived_key = *cached_key;
+                state->key_id = key_id;
+                state->unlocked_plaintext = std::move(crypto_state.plaintext);
+                SetStatusMessage(state, "Unlocked by ette-agent.");
+                return;
+            }
+        }
+    }
+
     while (true) {
         switch (state->existing_file_password_state) {
             case ExistingFilePasswordState::kShowEnterPassword: {
@@ -1661,8 +4079,19 @@ void HandleExistingFileEncryption(State* state, std::string& filename,
             }
 
             case ExistingFilePasswordState::kEnterPasswordNeedsCheck: {
-                if (IsKeyCorrect(password, filename, state->crypto_algorithm)) {
+                CryptoState crypto_state;
+                if (ciphertext) {
+                    crypto_state = Decrypt(*ciphertext, password,
+                                           state->crypto_algorithm);
+                }
+                if (crypto_state.status.ok()) {
                     state->password = password;
+                    state->derived_key = crypto_state.hashed_key;
+                    state->key_id = crypto_state.key_id;
+                    if (!state->key_id.empty())
+                        AgentPutKey(state->key_id, state->derived_key);
+                    state->unlocked_plaintext =
+                        std::move(crypto_state.plaintext);
                     ClearScreen(state);
                     state->indelible_msg = "";
                     SetStatusMessage(state, "Password correct.");
@@ -1695,11 +4124,65 @@ void HandleExistingFileEncryption(State* state, std::string& filename,
     }
 }
 
+// SIDE EFFECTS
+/* Like a file, an existing vault asks for its password and a new one for a
+ * new password. Once unlocked, Open() gets the entry's text, or an empty
+ * buffer for a new entry. */
+void HandleVaultEncryption(State* state, std::string& filename,
+                           const std::string& vault_path,
+                           const std::string& entry,
+                           const std::vector<int>& provided_keys) {
+    state->vault_entry = entry;
+    if (!FileExists(vault_path)) {
+        state->crypto_algorithm = ette::NewVaultAlgorithm(vault_path);
+        state->vault = Vault::Create(vault_path, state->crypto_algorithm);
+        HandleNewFileEncryption(state, provided_keys);
+        return;
+    }
+
+    ette::Status<Vault> vault = Vault::Open(vault_path);
+    if (!vault.ok()) {
+        DisableRawMode(STDIN_FILENO);
+        fprintf(stderr, "%s\n", vault.error().message().c_str());
+        exit(1);
+    }
+    state->vault = *vault;
+    state->crypto_algorithm = state->vault->algorithm();
+    HandleExistingFileEncryption(state, filename, provided_keys);
+
+    /* What was decrypted is the index. */
+    if (state->unlocked_plaintext)
+        WipeString(&*state->unlocked_plaintext);
+    state->unlocked_plaintext.reset();
+    ette::Status<void> unlocked = state->vault->Unlock(state->derived_key);
+    ette::Status<std::string> text =
+        unlocked.ok() ? state->vault->Read(entry, state->derived_key)
+                      : ette::Status<std::string>(unlocked.error().code(),
+                                                  unlocked.error().message());
+    if (text.ok()) {
+        state->unlocked_plaintext = *text;
+    } else if (text.error().code() == ette::StatusCode::kNotFound) {
+        state->unlocked_plaintext = std::string();
+        SetStatusMessage(state, "New entry %s.", entry.c_str());
+    } else {
+        /* Never let a save replace an entry that failed to decrypt. */
+        DisableRawMode(STDIN_FILENO);
+        fprintf(stderr, "%s\n", text.error().message().c_str());
+        exit(1);
+    }
+}
+
 void HandleEncryption(State* state, char* filename,
                       const std::vector<int>& provided_keys) {
     std::string filename_str = std::string(filename);
+    std::string vault_path, entry;
+    if (ParseVaultSpec(filename_str, &vault_path, &entry)) {
+        HandleVaultEncryption(state, filename_str, vault_path, entry,
+                              provided_keys);
+        return;
+    }
     const CryptoAlgorithm crypto_algorithm =
-        GetCryptoAlgorithmFromFilename(filename_str);
+        CryptoAlgorithmFromFilename(filename_str);
     if (crypto_algorithm == CryptoAlgorithm::kDefaultNone) {
         return;
     }
@@ -1711,4 +4194,153 @@ void HandleEncryption(State* state, char* filename,
     } else {
         HandleNewFileEncryption(state, provided_keys);
     }
-}
\ No newline at end of file
+}
+
+/* ============================== Idle lock ================================= */
+
+// SIDE EFFECTS
+/* Seal the text, unsaved edits included, under the file's key and wipe the
+ * rows, the password and the key. Only the password unlocks the editor
+ * again, see UnlockEditor(). Returns false, changing nothing, when the buffer
+ * isn't encrypted. */
+bool LockEditor(State* state) {
+    if (state->locked || state->derived_key.empty())
+        return false;
+
+    int len;
+    char* buf = RowsToString(state, &len);
+    const auto status =
+        state->locked_session.text.Seal(buf, len, state->derived_key);
+    WipeMemory(buf, len);
+    free(buf);
+    if (!status.ok())
+        return false;
+
+    LockedSession& session = state->locked_session;
+    session.cx = state->cx;
+    session.cy = state->cy;
+    session.rowoff = state->rowoff;
+    session.coloff = state->coloff;
+    session.dirty = state->dirty;
+
+    ClearScreen(state);
+    WipeString(&state->password);
+    WipeString(&state->derived_key);
+    state->keystream_cache.Discard();
+    state->locked = true;
+    InvalidateScreen();
+    return true;
+}
+
+// SIDE EFFECTS
+/* Restore what LockEditor() sealed if 'password' is the file's password.
+ * The text is decrypted in memory, in parallel: the file isn't read again. */
+bool UnlockEditor(State* state, const std::string& password) {
+    if (!state->locked)
+        return false;
+
+    std::string derived_key = DeriveKey(password);
+    std::string plaintext;
+    if (!state->locked_session.text.Unseal(derived_key, &plaintext).ok()) {
+        WipeString(&derived_key);
+        return false;
+    }
+
+    WipeRows(state); /* The password prompt. */
+    InsertRows(state, plaintext.data(), plaintext.size());
+    WipeString(&plaintext);
+
+    const LockedSession& session = state->locked_session;
+    state->cx = session.cx;
+    state->cy = session.cy;
+    state->rowoff = session.rowoff;
+    state->coloff = session.coloff;
+    state->dirty = session.dirty;
+    ClampCursorToScreen(state); /* The terminal may have been resized. */
+
+    state->password = password;
+    state->derived_key = std::move(derived_key);
+    state->locked_session.text.Clear();
+    state->locked = false;
+    InvalidateScreen();
+    return true;
+}
+
+// SIDE EFFECTS
+/* Lock the editor and ask for the password until it is right. */
+void HandleLockedEditor(State* state, const std::vector<int>& provided_keys) {
+    if (!LockEditor(state))
+        return;
+
+    const ExistingFilePasswordState previous_password_state =
+        state->existing_file_password_state;
+    state->existing_file_password_state =
+        ExistingFilePasswordState::kShowEnterPassword;
+
+    std::string password;
+    int current_provided_key_idx = 0;
+    const bool has_provided_keys = provided_keys.size() > 0;
+
+    while (true) {
+        switch (state->existing_file_password_state) {
+            case ExistingFilePasswordState::kShowEnterPassword: {
+                std::string enter_password = "Locked. Enter password: ";
+                InsertString(state, enter_password);
+
+                state->indelible_msg = enter_password;
+                state->existing_file_password_state =
+                    ExistingFilePasswordState::kTyping;
+                break;
+            }
+
+            case ExistingFilePasswordState::kTyping: {
+                const int provided_key =
+                    has_provided_keys ? provided_keys[current_provided_key_idx]
+                                      : 0;
+                const bool enter_pressed = ProcessKeyPressPasswordMode(
+                    STDIN_FILENO, state, provided_key);
+
+                current_provided_key_idx++;
+
+                if (enter_pressed) {
+                    password = GetPasswordFromState(state);
+                    state->existing_file_password_state =
+                        ExistingFilePasswordState::kEnterPasswordNeedsCheck;
+                }
+                break;
+            }
+
+            case ExistingFilePasswordState::kEnterPasswordNeedsCheck: {
+                const bool unlocked = UnlockEditor(state, password);
+                WipeString(&password);
+                WipeString(&state->entry_password);
+                if (unlocked) {
+                    state->indelible_msg = "";
+                    state->existing_file_password_state =
+                        previous_password_state;
+                    SetStatusMessage(state, "Unlocked.");
+                    return;
+                }
+
+                state->existing_file_password_state =
+                    ExistingFilePasswordState::kShowRetryPassword;
+                break;
+            }
+
+            case ExistingFilePasswordState::kShowRetryPassword: {
+                ClearScreen(state);
+                std::string retry_password = "Incorrect password. Try again: ";
+                InsertString(state, retry_password);
+
+                state->indelible_msg = retry_password;
+                state->existing_file_password_state =
+                    ExistingFilePasswordState::kTyping;
+                break;
+            }
+        }
+
+        if (!has_provided_keys) {
+            RefreshScreen();
+        }
+    }
+}
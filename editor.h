@@ -17,6 +17,7 @@
 #include <time.h>
 #include <unistd.h>
 #include <cstdint>
+#include <optional>
 #include <sstream>
 #include <string>
 #include <string_view>
@@ -24,14 +25,35 @@
 
 #include "constants.h"
 #include "crypto.h"
+#include "diff.h"
+#include "file_follower.h"
+#include "keystream_cache.h"
+#include "line_index.h"
+#include "sealed_buffer.h"
+#include "vault.h"
 
 /* We define a very simple "append buffer" structure, that is an heap
  * allocated string where we can append to. This is useful in order to
  * write all the escape sequences in a buffer and flush them to the standard
- * output in a single call, to avoid flickering effects. */
+ * output in a single call, to avoid flickering effects. The buffer grows
+ * geometrically, so it can be reused across frames without reallocating. */
 struct Buffer {
     char* b;
     int len;
+    int cap;
+};
+
+/* A rendered screen, built by DrawFrame() and written by RenderFrame(): the
+ * bytes of every terminal line back to back, and where the cursor goes.
+ * Frames are reused from one repaint to the next. */
+struct Frame {
+    Buffer text;                /* Escape sequences and text of all lines. */
+    std::vector<int> line_ends; /* Offset in 'text' where each line ends. */
+    int cursor_y, cursor_x;     /* 1-based terminal cursor position. */
+    int cols;                   /* Screen width the frame was drawn for. */
+    /* 1-based terminal line and column where each line starts: a line is
+     * only as wide as its view when the screen is split side by side. */
+    std::vector<int> line_y{}, line_x{};
 };
 
 struct Syntax {
@@ -53,6 +75,11 @@ typedef struct Row {
     unsigned char* hl; /* Syntax highlight type for each character in render.*/
     int hl_oc;         /* Row had open comment at end in last syntax highlight
                           check. */
+    int hl_stale;      /* hl is out of date: the row gets highlighted when it
+                          is shown, see HighlightRows(). */
+    int hl_start;      /* Row starts in a multi line comment (1) or not (0),
+                          as last highlighted or from a line index; -1 if
+                          unknown. */
 } Row;
 
 typedef struct HLColor {
@@ -78,6 +105,35 @@ enum class NewFilePasswordState {
 
 enum class UnlockState { kUnlocked, kNewFile, kExistingFile };
 
+/* What LockEditor() keeps of an encrypted buffer while the editor is locked:
+ * the text, unsaved edits included, sealed under the file's key, and where
+ * the cursor was. */
+struct LockedSession {
+    ette::SealedBuffer text;
+    int cx, cy, rowoff, coloff;
+    int dirty;
+};
+
+/* A line of the diff view: a header before each group of nearby changes,
+ * or a line of the saved text or of the buffer. */
+struct DiffViewLine {
+    char kind; /* '@' header, ' ' unchanged, '-' removed or '+' added. */
+    int line;  /* The header for '@', the saved line for '-', else the row. */
+    int row;   /* The row Enter goes to. */
+};
+
+/* What ShowDiff() shows in place of the rows: the changes since the last
+ * save, in unified diff form with a few rows of context around them. */
+struct DiffView {
+    std::string saved_text; /* Plaintext of the file as saved. */
+    std::vector<std::string_view> saved_lines;
+    std::vector<ette::DiffHunk> hunks;
+    std::vector<std::string> headers; /* "@@ -1,4 +1,5 @@" */
+    std::vector<DiffViewLine> lines;
+    int added, removed; /* Lines, over all the hunks. */
+    int offset;         /* First line on the screen. */
+};
+
 enum class PasswordStatus {
     kDefaultPasswordStatusNone,
     kPasswordVerified,
@@ -85,6 +141,39 @@ enum class PasswordStatus {
     kConfirmPasswordMismatch
 };
 
+/* A file as it was last read or written, to tell when another program
+ * changes it. */
+struct FileStamp {
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+};
+
+/* A place in the text: a row, and a byte offset in it. */
+struct Cursor {
+    int row;
+    int col;
+};
+
+/* What a view of the rows shows: the same as the fields of State that hold
+ * the view being edited. */
+struct View {
+    int cx, cy;
+    int rowoff, coloff;
+    int screenrows, screencols;
+};
+
+/* The screen split in two views of the rows, see SplitScreen(). A view is
+ * only a position: both share the rows, with their rendering and
+ * highlighting. */
+struct Split {
+    bool vertical;    /* Side by side rather than one above the other. */
+    int rows, cols;   /* The whole text area. */
+    bool other_first; /* The other view is the top or left one. */
+    View other;       /* The view not being edited. */
+};
+
 struct State {
     int cx, cy;     /* Cursor x and y position in characters */
     int rowoff;     /* Offset of row displayed. */
@@ -94,17 +183,51 @@ struct State {
     int numrows;    /* Number of rows */
     int rawmode;    /* Is terminal raw mode enabled? */
     Row* row;       /* Rows */
+    int hl_frontier{0}; /* Rows before it are all highlighted. */
     int dirty;      /* File modified but not saved. */
     char* filename; /* Currently open filename */
     int quit_times{3};
     std::string indelible_msg;
     std::string password;
     std::string entry_password;
+    std::string derived_key; /* DeriveKey(password), set once unlocked. */
+    std::string key_id;      /* ette-agent key ID, see key_agent.h. */
     ette::CryptoAlgorithm crypto_algorithm;
+    /* Set when editing "<vault>.ettevault:<entry>", see vault.h. */
+    std::optional<ette::Vault> vault;
+    std::string vault_entry;
     UnlockState unlock_state;
     ExistingFilePasswordState existing_file_password_state;
     NewFilePasswordState new_file_password_state;
     PasswordStatus password_status;
+    /* Plaintext decrypted while checking the password, for Open(). */
+    std::optional<std::string> unlocked_plaintext;
+    /* Seconds without a key press before an encrypted buffer locks itself,
+     * 0 to never lock. */
+    int idle_lock_seconds{ette::kDefaultIdleLockSeconds};
+    bool locked{false};
+    LockedSession locked_session;
+    /* Keystream for the next save, computed while idle when
+     * $ETTE_PRECOMPUTE_KEYSTREAM is set, see PrepareNextSave(). */
+    bool precompute_keystream{false};
+    ette::KeystreamCache keystream_cache;
+    /* Shown instead of the rows while ShowDiff() runs. */
+    DiffView* diff_view{nullptr};
+    /* Set in follow mode, see Follow(). 'following' is cleared to stop. */
+    std::optional<ette::FileFollower> follower;
+    bool following{false};
+    bool follow_partial_row{false}; /* The last row's newline isn't read yet. */
+    /* The file as last opened or saved, none if it didn't exist; see
+     * FileChangedOnDisk(). */
+    std::optional<FileStamp> disk_stamp;
+    bool disk_change_shown{false}; /* The change was told already. */
+    /* Where typing goes when there are several cursors, sorted by row then
+     * column, the cursor itself being one of them; empty otherwise. See
+     * InsertCharAtCursors(). */
+    std::vector<Cursor> cursors;
+    /* Set while the screen is split. cx, cy, rowoff, coloff, screenrows
+     * and screencols are then those of the view being edited. */
+    std::optional<Split> split;
     char statusmsg[80];
     time_t statusmsg_time;
     struct Syntax* syntax; /* Current syntax highlight, or NULL. */
@@ -114,14 +237,17 @@ enum KEY_ACTION {
     KEY_NULL = 0,    /* NULL */
     CTRL_C = 3,      /* Ctrl-c */
     CTRL_D = 4,      /* Ctrl-d */
+    CTRL_E = 5,      /* Ctrl-e */
     CTRL_F = 6,      /* Ctrl-f */
     CTRL_H = 8,      /* Ctrl-h */
     TAB = 9,         /* Tab */
     CTRL_L = 12,     /* Ctrl+l */
     ENTER = 13,      /* Enter */
     CTRL_Q = 17,     /* Ctrl-q */
+    CTRL_R = 18,     /* Ctrl-r */
     CTRL_S = 19,     /* Ctrl-s */
     CTRL_U = 21,     /* Ctrl-u */
+    CTRL_W = 23,     /* Ctrl-w */
     ESC = 27,        /* Escape */
     BACKSPACE = 127, /* Backspace */
     /* The following are just soft codes, not really reported by the
@@ -134,7 +260,10 @@ enum KEY_ACTION {
     HOME_KEY,
     END_KEY,
     PAGE_UP,
-    PAGE_DOWN
+    PAGE_DOWN,
+    WINDOW_RESIZE, /* The terminal was resized (SIGWINCH). */
+    IDLE_LOCK      /* Nothing was typed for the idle lock time while a
+                      prompt waited for a key. */
 };
 
 void SetStatusMessage(State* state, const char* fmt, ...);
@@ -145,8 +274,12 @@ int EnableRawMode(int fd);
 
 int ReadKey(int fd);
 
+int ConsumeResizeSignal();
+
 int GetCursorPos(int ifd, int ofd, int* rows, int* cols);
 
+int QueryWindowSize(int* rows, int* cols);
+
 int GetWindowSize(int ifd, int ofd, int* rows, int* cols);
 
 int IsSeparator(int c);
@@ -155,6 +288,14 @@ int RowHasOpenComment(Row* row);
 
 void UpdateSyntax(State* state, Row* row);
 
+void HighlightRows(State* state, int from, int to);
+
+bool HighlightNextRows(State* state, int count);
+
+ette::LineIndex BuildLineIndex(State* state);
+
+void ApplyLineIndex(State* state, const ette::LineIndex& index);
+
 int SyntaxToColor(int hl);
 
 void SelectSyntaxHighlight(State* state, char* filename);
@@ -163,6 +304,11 @@ void UpdateRow(State* state, Row* row);
 
 void InsertRow(State* state, int at, const char* s, size_t len);
 
+void InsertRows(State* state, const char* buf, size_t len);
+
+void ReplaceRows(State* state, int at, int count, const char* buf,
+                 size_t len);
+
 void FreeRow(Row* row);
 
 void DeleteRow(State* state, int at);
@@ -185,16 +331,78 @@ void DeleteChar(State* state);
 
 int Open(State* state, char* filename);
 
+int Follow(State* state, char* filename);
+
+bool FollowFile(State* state);
+
 int Save(State* state);
 
+bool PrepareNextSave(State* state, size_t max_bytes);
+
 void Append(Buffer* ab, const char* s, int len);
 
 void FreeBuf(Buffer* ab);
 
+void DrawFrame(State* state, Frame* frame);
+
+void RenderFrame(const Frame* prev, const Frame* next, Buffer* out);
+
+int WriteAll(int fd, const char* buf, int len);
+
+void SetScreenPresenter(void (*presenter)(State* state), void (*stop)());
+
+void StopScreenPresenter();
+
+void SetKeyReader(int (*reader)(int fd));
+
+void SetKeyPoller(int (*poller)(int fd));
+
+int NextKey(int fd);
+
+int PollKey(int fd);
+
+void InvalidateScreen();
+
+bool ConsumeScreenInvalidation();
+
 void RefreshScreen();
 
 void Find(int fd, State* state);
 
+void BuildDiffView(State* state, DiffView* view);
+
+void ShowDiff(int fd, State* state);
+
+void RunCommand(int fd, State* state, const std::string& command);
+
+void CommandPrompt(int fd, State* state);
+
+bool FileChangedOnDisk(State* state);
+
+void CheckFileOnDisk(State* state);
+
+void CheckHistoryRecorded(State* state);
+
+int ReloadRows(State* state, std::string_view text);
+
+void ReloadFile(int fd, State* state);
+
+void SaveOrReload(int fd, State* state);
+
+void InsertCharAtCursors(State* state, int c);
+
+void DeleteCharAtCursors(State* state);
+
+void MoveCursors(State* state, int key);
+
+void SplitScreen(State* state, bool vertical);
+
+void SwitchView(State* state);
+
+void CloseOtherView(State* state);
+
+void ViewCommand(int fd, State* state);
+
 void MoveCursor(State* state, int key);
 
 void ProcessKeyPress(int fd, State* state, int provided_key);
@@ -203,9 +411,19 @@ void UpdateWindowSize();
 
 void HandleWindowChangeSignal(int unused __attribute__((unused)));
 
+void ApplyWindowResize(State* state);
+
 void Init(State* state);
 
 void HandleEncryption(State* state, char* filename,
                       const std::vector<int>& provided_keys);
 
+void WipeRows(State* state);
+
+bool LockEditor(State* state);
+
+bool UnlockEditor(State* state, const std::string& password);
+
+void HandleLockedEditor(State* state, const std::vector<int>& provided_keys);
+
 #endif
\ No newline at end of file
@@ -0,0 +1,137 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+
+#include "editor.h"
+#include "perf_counters.h"
+
+using ::ette::PerfCounters;
+using ::ette::PerfSample;
+using ::ette::ReportPerfSample;
+
+constexpr char kSourceLine[] =
+    "    for (int i = 0; i < 42; i++) { total += value[i] * 3.5; } \"str\"";
+
+void LoadRows(State* state, int rows) {
+    for (int i = 0; i < rows; i++) {
+        InsertRow(state, state->numrows, kSourceLine, strlen(kSourceLine));
+    }
+    state->dirty = 0;
+}
+
+void FreeRows(State* state) {
+    for (int i = 0; i < state->numrows; i++)
+        FreeRow(&state->row[i]);
+    free(state->row);
+    state->row = NULL;
+    state->numrows = 0;
+}
+
+/* Editor hot paths (highlighting, typing and repaint), optionally with
+ * hardware counters (--perf) reported per byte, keystroke or frame. */
+int main(int argc, char* argv[]) {
+    bool perf = false;
+    int rows = 100000;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--perf") == 0) {
+            perf = true;
+        } else if (strcmp(argv[i], "--rows") == 0 && i + 1 < argc) {
+            rows = atoi(argv[++i]);
+        } else {
+            fprintf(stderr, "Usage: editor_bench [--perf] [--rows N]\n");
+            exit(1);
+        }
+    }
+
+    PerfCounters counters(perf);
+    if (perf && !counters.Available()) {
+        fprintf(stderr,
+                "Hardware counters unavailable, reporting wall time only.\n");
+    }
+
+    State* state = new State();
+    state->screenrows = 50;
+    state->screencols = 160;
+    char filename[] = "bench.cc";
+    SelectSyntaxHighlight(state, filename);
+    LoadRows(state, rows);
+
+    /* Highlight every row again, as after a change of the syntax. */
+    double bytes = 0;
+    for (int i = 0; i < state->numrows; i++)
+        bytes += state->row[i].rsize;
+    counters.Start();
+    for (int i = 0; i < state->numrows; i++)
+        UpdateSyntax(state, &state->row[i]);
+    PerfSample sample = counters.Stop();
+    ReportPerfSample(stdout, "highlight", sample, bytes, "byte");
+
+    /* Open a multi-line comment on the first row: the change cascades
+     * through the whole file. */
+    bytes = 0;
+    for (int i = 0; i < state->numrows; i++)
+        bytes += state->row[i].rsize;
+    std::string opener = "/*";
+    counters.Start();
+    RowAppendString(state, &state->row[0], &opener[0], opener.size());
+    sample = counters.Stop();
+    ReportPerfSample(stdout, "highlight cascade", sample, bytes, "byte");
+
+    /* Typing in the middle of a row. */
+    const int keystrokes = 20000;
+    state->cy = 10;
+    state->cx = 20;
+    counters.Start();
+    for (int i = 0; i < keystrokes; i++) {
+        ProcessKeyPress(0, state, 'a' + i % 26);
+        if (state->cx > 100) {
+            state->cx = 20;
+            state->coloff = 0;
+        }
+    }
+    sample = counters.Stop();
+    ReportPerfSample(stdout, "typing", sample, keystrokes, "keystroke");
+
+    /* Cursor movement. */
+    const int moves = 200000;
+    counters.Start();
+    for (int i = 0; i < moves; i++)
+        ProcessKeyPress(0, state, i % 1000 < 500 ? ARROW_DOWN : ARROW_UP);
+    sample = counters.Stop();
+    ReportPerfSample(stdout, "cursor move", sample, moves, "keystroke");
+
+    /* Full repaints into a reused frame buffer. */
+    const int frames = 2000;
+    Frame frame = {{NULL, 0, 0}, {}, 0, 0, 0};
+    Buffer out = {NULL, 0, 0};
+    counters.Start();
+    for (int i = 0; i < frames; i++) {
+        DrawFrame(state, &frame);
+        out.len = 0;
+        RenderFrame(NULL, &frame, &out);
+    }
+    sample = counters.Stop();
+    ReportPerfSample(stdout, "repaint", sample, frames, "frame");
+
+    /* Scrolling by one row: every line changes but the status bar. */
+    Frame prev = {{NULL, 0, 0}, {}, 0, 0, 0};
+    state->cy = 0;
+    state->rowoff = 0;
+    counters.Start();
+    for (int i = 0; i < frames; i++) {
+        state->rowoff = i % 1000;
+        DrawFrame(state, i % 2 ? &frame : &prev);
+        out.len = 0;
+        RenderFrame(i % 2 ? &prev : &frame, i % 2 ? &frame : &prev, &out);
+    }
+    sample = counters.Stop();
+    ReportPerfSample(stdout, "repaint diff", sample, frames, "frame");
+    FreeBuf(&frame.text);
+    FreeBuf(&prev.text);
+    FreeBuf(&out);
+
+    FreeRows(state);
+    delete state;
+    return 0;
+}
@@ -1,9 +1,13 @@
 #include "editor.h"
 #include <stdlib.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <atomic>
 #include <fstream>
 #include <string>
+#include <thread>
 #include "gtest/gtest.h"
+#include "key_agent.h"
 
 constexpr char kMultilineTestContent[] = R"(first row
 second row
@@ -333,6 +337,120 @@ TEST(Editor, E2E_Encryption_SingleLine) {
     CleanupTestFile(test_filename);
 }
 
+TEST(Editor, E2E_Encryption_ChaCha20Poly1305) {
+    std::string test_filename = "/tmp/E2E_Encryption_ChaCha20.chacha20";
+    std::string content = "hello";
+    CleanupTestFile(test_filename);
+
+    State* state = new State();
+    SetupState(state);
+
+    // test [ENTER] test [ENTER]
+    const std::vector<int> new_file_keys = {116, 101, 115, 116, 13,
+                                            116, 101, 115, 116, 13};
+    // nope [ENTER] (wrong) test [ENTER]
+    const std::vector<int> existing_file_keys = {110, 111, 112, 101, 13,
+                                                 116, 101, 115, 116, 13};
+
+    HandleEncryption(state, test_filename.data(), new_file_keys);
+    EXPECT_EQ(state->crypto_algorithm,
+              ette::CryptoAlgorithm::kChaCha20Poly1305);
+    Open(state, test_filename.data());
+    InsertString(state, content);
+    Save(state);
+
+    state = new State();
+    SetupState(state);
+    HandleEncryption(state, test_filename.data(), existing_file_keys);
+    EXPECT_EQ(state->password, std::string("test"));
+    Open(state, test_filename.data());
+
+    ASSERT_EQ(state->numrows, 1);
+    EXPECT_EQ(state->row[0].chars, std::string("hello"));
+    CleanupTestFile(test_filename);
+}
+
+TEST(Editor, E2E_Encryption_HistoryFailureShown) {
+    std::string test_filename = "/tmp/E2E_Encryption_HistoryFailure.chacha20";
+    const std::string history_directory = test_filename + ".history";
+    std::string content = "hello";
+    CleanupTestFile(test_filename);
+    rmdir(history_directory.c_str());
+    // A history directory without its chunks and versions can't record.
+    ASSERT_EQ(mkdir(history_directory.c_str(), 0700), 0);
+
+    State* state = new State();
+    SetupState(state);
+    // test [ENTER] test [ENTER]
+    const std::vector<int> new_file_keys = {116, 101, 115, 116, 13,
+                                            116, 101, 115, 116, 13};
+    HandleEncryption(state, test_filename.data(), new_file_keys);
+    Open(state, test_filename.data());
+    InsertString(state, content);
+    ASSERT_EQ(Save(state), 0);
+
+    // The history is recorded in the background, the editor told after.
+    const std::string expected = "History not recorded!";
+    for (int i = 0; i < 500; i++) {
+        CheckHistoryRecorded(state);
+        if (std::string(state->statusmsg).rfind(expected, 0) == 0)
+            break;
+        usleep(10000);
+    }
+    EXPECT_EQ(std::string(state->statusmsg).rfind(expected, 0), 0u)
+        << state->statusmsg;
+    CleanupTestFile(test_filename);
+    rmdir(history_directory.c_str());
+}
+
+TEST(Editor, E2E_Encryption_VaultEntries) {
+    const std::string vault_path = "/tmp/E2E_Encryption_Vault.ettevault";
+    std::string first = vault_path + ":first";
+    std::string second = vault_path + ":second";
+    CleanupTestFile(vault_path);
+
+    // test [ENTER] test [ENTER]
+    const std::vector<int> new_file_keys = {116, 101, 115, 116, 13,
+                                            116, 101, 115, 116, 13};
+    // nope [ENTER] (wrong) test [ENTER]
+    const std::vector<int> existing_file_keys = {110, 111, 112, 101, 13,
+                                                 116, 101, 115, 116, 13};
+
+    State* state = new State();
+    SetupState(state);
+    HandleEncryption(state, first.data(), new_file_keys);
+    EXPECT_EQ(state->crypto_algorithm,
+              ette::CryptoAlgorithm::kChaCha20Poly1305);
+    Open(state, first.data());
+    std::string content = "one";
+    InsertString(state, content);
+    EXPECT_EQ(Save(state), 0);
+    EXPECT_FALSE(std::ifstream(first).good());
+
+    // A new entry in the existing vault takes the vault's password.
+    state = new State();
+    SetupState(state);
+    HandleEncryption(state, second.data(), existing_file_keys);
+    Open(state, second.data());
+    EXPECT_EQ(state->numrows, 0);
+    content = "two";
+    InsertString(state, content);
+    EXPECT_EQ(Save(state), 0);
+
+    state = new State();
+    SetupState(state);
+    HandleEncryption(state, first.data(), existing_file_keys);
+    Open(state, first.data());
+    ASSERT_EQ(state->numrows, 1);
+    EXPECT_EQ(state->row[0].chars, std::string("one"));
+
+    ette::Vault vault = *ette::Vault::Open(vault_path);
+    ASSERT_TRUE(vault.Unlock(state->derived_key).ok());
+    ASSERT_EQ(vault.Entries().size(), 2u);
+    EXPECT_EQ(*vault.Read("second", state->derived_key), "two\n");
+    CleanupTestFile(vault_path);
+}
+
 TEST(Editor, E2E_Encryption_MultiLine) {
     std::string test_filename = "/tmp/E2E_Encryption_SingleLine.aes256cbc";
     std::string first_line = "hello";
@@ -421,3 +539,799 @@ TEST(Editor, E2E_Encryption_SingleLine_Edit) {
     EXPECT_EQ(state->row[0].chars, std::string("helloworld"));
     CleanupTestFile(test_filename);
 }
+
+TEST_F(EditorFixture, RenderFrame_OnlyChangedLines) {
+    state_->screenrows = 10;
+    state_->screencols = 40;
+    Frame prev = {{NULL, 0, 0}, {}, 0, 0, 0};
+    Frame next = {{NULL, 0, 0}, {}, 0, 0, 0};
+    Buffer out = {NULL, 0, 0};
+
+    DrawFrame(state_, &prev);
+    EXPECT_EQ(prev.line_ends.size(), 12u);
+
+    // An unchanged screen writes nothing.
+    DrawFrame(state_, &next);
+    RenderFrame(&prev, &next, &out);
+    EXPECT_EQ(out.len, 0);
+
+    // Editing the second row rewrites it and the status bar only.
+    state_->cy = 1;
+    ProcessKeyPress(test_fd_, state_, 'x');
+    DrawFrame(state_, &next);
+    RenderFrame(&prev, &next, &out);
+    const std::string written(out.b, out.len);
+    EXPECT_EQ(written.find("\x1b[1;1H"), std::string::npos);
+    EXPECT_NE(written.find("\x1b[2;1Hxsecond row"), std::string::npos);
+    EXPECT_EQ(written.find("\x1b[3;1H"), std::string::npos);
+    EXPECT_NE(written.find("\x1b[11;1H"), std::string::npos);
+
+    FreeBuf(&prev.text);
+    FreeBuf(&next.text);
+    FreeBuf(&out);
+}
+
+TEST_F(EditorFixture, RenderFrame_FullRepaintWithoutPreviousFrame) {
+    state_->screenrows = 10;
+    state_->screencols = 40;
+    Frame frame = {{NULL, 0, 0}, {}, 0, 0, 0};
+    Buffer out = {NULL, 0, 0};
+
+    DrawFrame(state_, &frame);
+    RenderFrame(NULL, &frame, &out);
+    const std::string written(out.b, out.len);
+    for (int y = 1; y <= 12; y++) {
+        const std::string move = "\x1b[" + std::to_string(y) + ";1H";
+        EXPECT_NE(written.find(move), std::string::npos) << y;
+    }
+
+    FreeBuf(&frame.text);
+    FreeBuf(&out);
+}
+
+// Each view of a split screen is its own set of lines, rewritten only when
+// what it shows changes.
+TEST_F(EditorFixture, RenderFrame_SplitViewsUpdateIndependently) {
+    state_->screenrows = 10;
+    state_->screencols = 41;
+    std::string text;
+    for (int j = 0; j < 30; j++)
+        text += "row " + std::to_string(j) + "\n";
+    ReplaceRows(state_, 0, state_->numrows, text.data(), text.size());
+    Frame prev = {{NULL, 0, 0}, {}, 0, 0, 0};
+    Frame next = {{NULL, 0, 0}, {}, 0, 0, 0};
+    Buffer out = {NULL, 0, 0};
+
+    SplitScreen(state_, true);
+    EXPECT_EQ(state_->screencols, 20);
+    EXPECT_EQ(state_->split->other.screencols, 20);
+    SwitchView(state_);
+    state_->rowoff = 15;
+    SwitchView(state_);
+    DrawFrame(state_, &prev);
+    EXPECT_EQ(prev.line_ends.size(), 22u);
+
+    ProcessKeyPress(test_fd_, state_, 'x');
+    DrawFrame(state_, &next);
+    RenderFrame(&prev, &next, &out);
+    std::string written(out.b, out.len);
+    EXPECT_NE(written.find("\x1b[1;1Hxrow 0"), std::string::npos);
+    EXPECT_EQ(written.find(";22H"), std::string::npos);
+
+    // Switching views only moves the cursor and changes the status bar.
+    SwitchView(state_);
+    DrawFrame(state_, &prev);
+    out.len = 0;
+    RenderFrame(&next, &prev, &out);
+    written.assign(out.b, out.len);
+    EXPECT_EQ(written.find("\x1b[1;1Hxrow"), std::string::npos);
+    EXPECT_EQ(written.find(";22Hrow"), std::string::npos);
+    EXPECT_NE(written.find("\x1b[1;22H\x1b[?25h"), std::string::npos);
+
+    ProcessKeyPress(test_fd_, state_, 'y');
+    DrawFrame(state_, &next);
+    out.len = 0;
+    RenderFrame(&prev, &next, &out);
+    written.assign(out.b, out.len);
+    EXPECT_NE(written.find("\x1b[1;22Hyrow 15"), std::string::npos);
+    for (int y = 1; y <= 10; y++) {
+        const std::string move = "\x1b[" + std::to_string(y) + ";1H";
+        EXPECT_EQ(written.find(move), std::string::npos) << y;
+    }
+
+    // The other way, with a status bar between the views.
+    SplitScreen(state_, false);
+    EXPECT_EQ(state_->screencols, 41);
+    EXPECT_EQ(state_->screenrows + state_->split->other.screenrows, 9);
+    CloseOtherView(state_);
+    EXPECT_FALSE(state_->split);
+    EXPECT_EQ(state_->screenrows, 10);
+    EXPECT_EQ(state_->rowoff + state_->cy, 15);
+
+    FreeBuf(&prev.text);
+    FreeBuf(&next.text);
+    FreeBuf(&out);
+}
+
+TEST(Editor, InsertRows_SplitsLines) {
+    State* state = new State();
+    SetupState(state);
+    const std::string content = "first\n\nthird\nno newline";
+
+    InsertRows(state, content.data(), content.size());
+
+    ASSERT_EQ(state->numrows, 4);
+    EXPECT_EQ(state->row[0].chars, std::string("first"));
+    EXPECT_EQ(state->row[1].chars, std::string(""));
+    EXPECT_EQ(state->row[2].chars, std::string("third"));
+    EXPECT_EQ(state->row[3].chars, std::string("no newline"));
+
+    InsertRows(state, "tail\n", 5);
+    EXPECT_EQ(state->numrows, 5);
+    EXPECT_EQ(state->row[4].chars, std::string("tail"));
+}
+
+// Lines written to a followed file are added as they come, the view
+// following the end, and a truncated file is loaded again.
+TEST(Editor, Follow_AppendsRows) {
+    std::string test_filename = "/tmp/Editor_Follow_AppendsRows.log";
+    WriteTestFile(test_filename, "first\nsecond\nthi");
+    State* state = new State();
+    SetupState(state);
+    state->screenrows = 3;
+    ASSERT_EQ(Follow(state, test_filename.data()), 0);
+    ASSERT_EQ(state->numrows, 3);
+    EXPECT_EQ(state->row[2].chars, std::string("thi"));
+    EXPECT_EQ(state->rowoff + state->cy, 2);
+    EXPECT_FALSE(FollowFile(state));
+
+    std::ofstream(test_filename, std::ios::app) << "rd\nfourth\nfifth\n";
+    FollowFile(state);
+    ASSERT_EQ(state->numrows, 5);
+    EXPECT_EQ(state->row[2].chars, std::string("third"));
+    EXPECT_EQ(state->row[4].chars, std::string("fifth"));
+    EXPECT_EQ(state->row[4].idx, 4);
+    EXPECT_EQ(state->dirty, 0);
+    EXPECT_EQ(state->rowoff, 2);
+    EXPECT_EQ(state->cy, 2);
+
+    // Away from the end, the view stays put.
+    state->rowoff = 0;
+    state->cy = 0;
+    std::ofstream(test_filename, std::ios::app) << "sixth\n";
+    FollowFile(state);
+    EXPECT_EQ(state->numrows, 6);
+    EXPECT_EQ(state->rowoff + state->cy, 0);
+
+    WriteTestFile(test_filename, "again\n");
+    FollowFile(state);
+    ASSERT_EQ(state->numrows, 1);
+    EXPECT_EQ(state->row[0].chars, std::string("again"));
+    EXPECT_EQ(std::string(state->statusmsg),
+              "The file was truncated, reloaded");
+
+    // Saving doesn't read the file back.
+    InsertChar(state, 'x');
+    ASSERT_EQ(Save(state), 0);
+    EXPECT_FALSE(FollowFile(state));
+    EXPECT_EQ(state->numrows, 1);
+    EXPECT_EQ(state->row[0].chars, std::string("xagain"));
+    CleanupTestFile(test_filename);
+}
+
+// Large files reopen at the saved cursor, highlighting only from the line
+// index checkpoint before the screen on.
+TEST(Editor, E2E_Encryption_LineIndex) {
+    std::string test_filename = "/tmp/E2E_Encryption_LineIndex.c.chacha20";
+    CleanupTestFile(test_filename);
+    std::string content;
+    for (int i = 0; i < 20000; i++) {
+        content += "int v" + std::to_string(i) + " = " + std::to_string(i);
+        content += i == 100 ? "; /* open\n" : i == 15000 ? " */;\n" : ";\n";
+    }
+
+    State* state = new State();
+    SetupState(state);
+    state->screenrows = 20;
+    state->screencols = 80;
+    SelectSyntaxHighlight(state, test_filename.data());
+    ASSERT_NE(state->syntax, nullptr);
+    // test [ENTER] test [ENTER]
+    const std::vector<int> new_file_keys = {116, 101, 115, 116, 13,
+                                            116, 101, 115, 116, 13};
+    HandleEncryption(state, test_filename.data(), new_file_keys);
+    Open(state, test_filename.data());
+    InsertRows(state, content.data(), content.size());
+    HighlightRows(state, 0, state->numrows);
+    state->rowoff = 12345;
+    state->cy = 5;
+    state->cx = 3;
+    ASSERT_EQ(Save(state), 0);
+    const State* saved = state;
+
+    // test [ENTER]
+    state = new State();
+    SetupState(state);
+    state->screenrows = 20;
+    state->screencols = 80;
+    SelectSyntaxHighlight(state, test_filename.data());
+    HandleEncryption(state, test_filename.data(), {116, 101, 115, 116, 13});
+    ASSERT_EQ(Open(state, test_filename.data()), 0);
+    ASSERT_EQ(state->numrows, 20000);
+    EXPECT_EQ(state->rowoff, 12345);
+    EXPECT_EQ(state->cy, 5);
+    EXPECT_EQ(state->cx, 3);
+
+    HighlightRows(state, state->rowoff, state->rowoff + state->screenrows);
+    for (int j = state->rowoff; j < state->rowoff + state->screenrows; j++) {
+        ASSERT_EQ(std::string((char*)state->row[j].hl, state->row[j].rsize),
+                  std::string((char*)saved->row[j].hl, saved->row[j].rsize))
+            << j;
+    }
+    const int kCommentColor = 36; /* cyan */
+    EXPECT_EQ(SyntaxToColor(state->row[12345].hl[0]), kCommentColor);
+    EXPECT_TRUE(state->row[0].hl_stale);
+    EXPECT_TRUE(state->row[12345 - ette::kLineIndexInterval].hl_stale);
+
+    // Closing the comment early is seen by every row after it.
+    state->row[101].chars[0] = '*';
+    state->row[101].chars[1] = '/';
+    UpdateRow(state, &state->row[101]);
+    HighlightRows(state, state->rowoff, state->rowoff + 1);
+    EXPECT_NE(SyntaxToColor(state->row[12345].hl[0]), kCommentColor);
+    while (HighlightNextRows(state, 1000)) {
+    }
+    EXPECT_FALSE(state->row[0].hl_stale);
+    EXPECT_NE(SyntaxToColor(state->row[14000].hl[0]), kCommentColor);
+    CleanupTestFile(test_filename);
+}
+
+// The position in an AES-CBC footer isn't authenticated: whatever it says,
+// the cursor stays inside the rows.
+TEST_F(EditorFixture, ApplyLineIndex_KeepsCursorInRows) {
+    state_->screenrows = 2;
+    state_->screencols = 80;
+    ette::LineIndex index = BuildLineIndex(state_);
+    const uint64_t kHuge = UINT64_MAX;
+    const std::vector<std::vector<uint64_t>> positions = {
+        {kHuge, 1, 0, 0},       {1, kHuge, 0, 0},
+        {0, 0, 0x80000000u, 0}, {0, 0, 0, 0x80000000u},
+        {0, 0, kHuge, 1},       {(uint64_t)state_->numrows, 0, 0, 0}};
+    for (const std::vector<uint64_t>& position : positions) {
+        index.row_offset = position[0];
+        index.cursor_y = position[1];
+        index.column_offset = position[2];
+        index.cursor_x = position[3];
+        ApplyLineIndex(state_, index);
+        EXPECT_EQ(state_->rowoff + state_->cy, 0) << position[0];
+        EXPECT_EQ(state_->coloff + state_->cx, 0) << position[2];
+    }
+
+    // A column past the end of its row goes to the end of the row.
+    index.row_offset = 1;
+    index.cursor_y = 1;
+    index.column_offset = 2;
+    index.cursor_x = 1000;
+    ApplyLineIndex(state_, index);
+    const int filerow = state_->rowoff + state_->cy;
+    ASSERT_EQ(filerow, 2);
+    EXPECT_EQ(state_->coloff, 2);
+    EXPECT_EQ(state_->coloff + state_->cx, state_->row[filerow].size);
+}
+
+TEST(Editor, E2E_Encryption_UnlockDecryptsOnce) {
+    std::string test_filename = "/tmp/E2E_Encryption_UnlockOnce.aes256cbc";
+    CleanupTestFile(test_filename);
+
+    State* state = new State();
+    SetupState(state);
+    // test [ENTER] test [ENTER]
+    const std::vector<int> new_file_keys = {116, 101, 115, 116, 13,
+                                            116, 101, 115, 116, 13};
+    HandleEncryption(state, test_filename.data(), new_file_keys);
+    Open(state, test_filename.data());
+    std::string content = "hello";
+    InsertString(state, content);
+    Save(state);
+
+    // nope [ENTER] (wrong) test [ENTER]
+    const std::vector<int> existing_file_keys = {110, 111, 112, 101, 13,
+                                                 116, 101, 115, 116, 13};
+    state = new State();
+    SetupState(state);
+    HandleEncryption(state, test_filename.data(), existing_file_keys);
+    EXPECT_EQ(state->password, std::string("test"));
+
+    // Open() uses the plaintext of the password check, not the file.
+    CleanupTestFile(test_filename);
+    EXPECT_EQ(Open(state, test_filename.data()), 0);
+    ASSERT_EQ(state->numrows, 1);
+    EXPECT_EQ(state->row[0].chars, std::string("hello"));
+    EXPECT_FALSE(state->unlocked_plaintext.has_value());
+}
+
+TEST(Editor, E2E_Encryption_UnlockFromAgent) {
+    std::string test_filename = "/tmp/E2E_Encryption_Agent.aes256cbc";
+    CleanupTestFile(test_filename);
+    char dir_template[] = "/tmp/ette-agent-test-XXXXXX";
+    ASSERT_NE(mkdtemp(dir_template), nullptr);
+    const std::string socket_path = std::string(dir_template) + "/socket";
+    setenv("ETTE_AGENT_SOCK", socket_path.c_str(), 1);
+
+    std::string error;
+    const int fd = ette::ListenAgentSocket(socket_path, &error);
+    ASSERT_NE(fd, -1) << error;
+    std::atomic<bool> stop(false);
+    std::thread server([fd, &stop] { ette::ServeKeyAgent(fd, 60, stop); });
+
+    State* state = new State();
+    SetupState(state);
+    // test [ENTER] test [ENTER]
+    const std::vector<int> new_file_keys = {116, 101, 115, 116, 13,
+                                            116, 101, 115, 116, 13};
+    HandleEncryption(state, test_filename.data(), new_file_keys);
+    Open(state, test_filename.data());
+    std::string content = "hello";
+    InsertString(state, content);
+    Save(state);
+    const std::string key_id = state->key_id;
+    EXPECT_EQ(key_id.size(), ette::kHeaderKeyIdSize);
+
+    if (ette::AgentGetKey(key_id)) {
+        // No password this time: the key comes from the agent.
+        state = new State();
+        SetupState(state);
+        HandleEncryption(state, test_filename.data(), {});
+        EXPECT_EQ(state->password, std::string(""));
+        EXPECT_EQ(state->key_id, key_id);
+        Open(state, test_filename.data());
+        ASSERT_EQ(state->numrows, 1);
+        EXPECT_EQ(state->row[0].chars, std::string("hello"));
+
+        // Saving keeps the key ID.
+        InsertString(state, content);
+        Save(state);
+        EXPECT_EQ(state->key_id, key_id);
+    }
+
+    stop = true;
+    server.join();
+    close(fd);
+    unlink(socket_path.c_str());
+    rmdir(dir_template);
+    unsetenv("ETTE_AGENT_SOCK");
+    CleanupTestFile(test_filename);
+}
+
+TEST(Editor, E2E_Encryption_IdleLockKeepsUnsavedEdits) {
+    std::string test_filename = "/tmp/E2E_Encryption_IdleLock.aes256cbc";
+    CleanupTestFile(test_filename);
+
+    State* state = new State();
+    SetupState(state);
+    state->screenrows = 24;
+    state->screencols = 80;
+    // test [ENTER] test [ENTER]
+    const std::vector<int> new_file_keys = {116, 101, 115, 116, 13,
+                                            116, 101, 115, 116, 13};
+    HandleEncryption(state, test_filename.data(), new_file_keys);
+    Open(state, test_filename.data());
+    std::string saved = "hello";
+    InsertString(state, saved);
+    Save(state);
+    std::string unsaved = " world";
+    InsertString(state, unsaved);
+    const int dirty = state->dirty;
+    const int cx = state->cx;
+
+    ASSERT_TRUE(LockEditor(state));
+    EXPECT_TRUE(state->locked);
+    EXPECT_EQ(state->numrows, 0);
+    EXPECT_TRUE(state->derived_key.empty());
+    EXPECT_TRUE(state->password.empty());
+    EXPECT_FALSE(UnlockEditor(state, "nope"));
+    EXPECT_TRUE(state->locked);
+
+    // The file isn't read to unlock.
+    CleanupTestFile(test_filename);
+    ASSERT_TRUE(UnlockEditor(state, "test"));
+    EXPECT_FALSE(state->locked);
+    ASSERT_EQ(state->numrows, 1);
+    EXPECT_EQ(state->row[0].chars, std::string("hello world"));
+    EXPECT_EQ(state->dirty, dirty);
+    EXPECT_EQ(state->cx, cx);
+    EXPECT_EQ(state->derived_key, ette::DeriveKey("test"));
+
+    // Through the prompt: nope [ENTER] (wrong) test [ENTER]
+    const std::vector<int> unlock_keys = {110, 111, 112, 101, 13,
+                                          116, 101, 115, 116, 13};
+    HandleLockedEditor(state, unlock_keys);
+    EXPECT_FALSE(state->locked);
+    ASSERT_EQ(state->numrows, 1);
+    EXPECT_EQ(state->row[0].chars, std::string("hello world"));
+    EXPECT_TRUE(state->entry_password.empty());
+}
+
+TEST_F(EditorFixture, BuildDiffView_GroupsChanges) {
+    state_->cy = 1;
+    ProcessKeyPress(test_fd_, state_, 'x');
+    DiffView view;
+    view.saved_text = kMultilineTestContent;
+
+    BuildDiffView(state_, &view);
+
+    ASSERT_EQ(view.hunks.size(), 1u);
+    EXPECT_EQ(view.added, 1);
+    EXPECT_EQ(view.removed, 1);
+    ASSERT_EQ(view.headers.size(), 1u);
+    EXPECT_EQ(view.headers[0], "@@ -1,3 +1,3 @@");
+    std::string kinds;
+    for (const DiffViewLine& line : view.lines)
+        kinds += line.kind;
+    EXPECT_EQ(kinds, "@ -+ ");
+    EXPECT_EQ(view.saved_lines[view.lines[2].line], "second row");
+    EXPECT_EQ(state_->row[view.lines[3].line].chars,
+              std::string("xsecond row"));
+    EXPECT_EQ(view.lines[2].row, 1);
+}
+
+/* What ShowDiff() last drew of 'diff_state' (the presenter is given the
+ * editor's global state, which tests don't set), and the keys it is given. */
+static State* diff_state;
+static std::string shown_screen;
+static std::vector<int> diff_keys;
+
+static void CaptureScreen(State* state __attribute__((unused))) {
+    Frame frame = {{NULL, 0, 0}, {}, 0, 0, 0};
+    DrawFrame(diff_state, &frame);
+    shown_screen.assign(frame.text.b, frame.text.len);
+    FreeBuf(&frame.text);
+}
+
+static int NextDiffKey(int fd __attribute__((unused))) {
+    const int c = diff_keys.front();
+    diff_keys.erase(diff_keys.begin());
+    return c;
+}
+
+// The saved file is decrypted again and shown against the edited rows; Enter
+// closes the view on the row of the change.
+TEST(Editor, E2E_Encryption_ShowDiff) {
+    std::string test_filename = "/tmp/E2E_Encryption_ShowDiff.chacha20";
+    CleanupTestFile(test_filename);
+    State* state = new State();
+    SetupState(state);
+    state->screenrows = 10;
+    state->screencols = 80;
+    // test [ENTER] test [ENTER]
+    const std::vector<int> new_file_keys = {116, 101, 115, 116, 13,
+                                            116, 101, 115, 116, 13};
+    HandleEncryption(state, test_filename.data(), new_file_keys);
+    Open(state, test_filename.data());
+    const std::string text = "hello\nfoo\nbar\n";
+    InsertRows(state, text.data(), text.size());
+    Save(state);
+    state->cy = 1;
+    state->cx = 3;
+    ProcessKeyPress(0, state, 'd');
+
+    diff_state = state;
+    SetScreenPresenter(CaptureScreen, NULL);
+    SetKeyReader(NextDiffKey);
+    diff_keys = {ARROW_DOWN, ARROW_DOWN, ENTER};
+    ShowDiff(0, state);
+    EXPECT_EQ(state->diff_view, nullptr);
+    EXPECT_NE(shown_screen.find("-foo"), std::string::npos);
+    EXPECT_NE(shown_screen.find("+food"), std::string::npos);
+    EXPECT_NE(shown_screen.find("diff: 1 change, +1 -1 lines"),
+              std::string::npos);
+    EXPECT_EQ(state->rowoff + state->cy, 1);
+
+    // Nothing to show once saved.
+    Save(state);
+    diff_keys = {ESC};
+    ShowDiff(0, state);
+    EXPECT_EQ(diff_keys.size(), 1u);
+    EXPECT_EQ(std::string(state->statusmsg), "No changes since the last save");
+    SetScreenPresenter(NULL, NULL);
+    SetKeyReader(NULL);
+    CleanupTestFile(test_filename);
+}
+
+// The idle lock fires while a prompt or the diff view waits for a key: they
+// are left as with ESC, the editor locks and the password unlocks it.
+TEST(Editor, E2E_Encryption_IdleLockDuringPrompt) {
+    std::string test_filename = "/tmp/E2E_Encryption_IdleLockPrompt.chacha20";
+    CleanupTestFile(test_filename);
+    State* state = new State();
+    SetupState(state);
+    state->screenrows = 10;
+    state->screencols = 80;
+    // test [ENTER] test [ENTER]
+    const std::vector<int> new_file_keys = {116, 101, 115, 116, 13,
+                                            116, 101, 115, 116, 13};
+    HandleEncryption(state, test_filename.data(), new_file_keys);
+    Open(state, test_filename.data());
+    const std::string text = "hello\nfoo\n";
+    InsertRows(state, text.data(), text.size());
+    Save(state);
+    std::string edit = "x";
+    InsertString(state, edit);
+
+    diff_state = state;
+    SetScreenPresenter(CaptureScreen, NULL);
+    SetKeyReader(NextDiffKey);
+    for (int key : {CTRL_D, CTRL_F, CTRL_E}) {
+        // [idle] test [ENTER]
+        diff_keys = {IDLE_LOCK, 116, 101, 115, 116, 13};
+        ProcessKeyPress(0, state, key);
+        EXPECT_TRUE(diff_keys.empty()) << key;
+        EXPECT_FALSE(state->locked) << key;
+        EXPECT_EQ(state->diff_view, nullptr) << key;
+        EXPECT_EQ(std::string(state->statusmsg), "Unlocked.") << key;
+        ASSERT_EQ(state->numrows, 2);
+        EXPECT_EQ(state->row[0].chars, std::string("xhello"));
+    }
+    SetScreenPresenter(NULL, NULL);
+    SetKeyReader(NULL);
+    CleanupTestFile(test_filename);
+}
+
+TEST_F(EditorFixture, RunCommand_FiltersRange) {
+    state_->screenrows = 10;
+    state_->screencols = 80;
+    diff_state = state_;
+    SetScreenPresenter(CaptureScreen, NULL);
+    RunCommand(test_fd_, state_, "2,3!sort -r");
+    ASSERT_EQ(state_->numrows, 3);
+    EXPECT_EQ(state_->row[0].chars, std::string("first row"));
+    EXPECT_EQ(state_->row[1].chars, std::string("third row"));
+    EXPECT_EQ(state_->row[2].chars, std::string("second row"));
+    EXPECT_EQ(state_->row[2].idx, 2);
+
+    // The output can have more or fewer lines than the range.
+    RunCommand(test_fd_, state_, "%!tr a-z A-Z; echo end");
+    ASSERT_EQ(state_->numrows, 4);
+    EXPECT_EQ(state_->row[1].chars, std::string("THIRD ROW"));
+    EXPECT_EQ(state_->row[3].chars, std::string("end"));
+    RunCommand(test_fd_, state_, "1,$!head -n 1");
+    ASSERT_EQ(state_->numrows, 1);
+    EXPECT_EQ(state_->row[0].chars, std::string("FIRST ROW"));
+
+    // A failing command or a bad range changes nothing.
+    RunCommand(test_fd_, state_, ".!echo no >&2; exit 1");
+    EXPECT_EQ(std::string(state_->statusmsg), "Command failed (1): no");
+    RunCommand(test_fd_, state_, "1,5!cat");
+    EXPECT_EQ(std::string(state_->statusmsg), "Bad line range: 1,5!cat");
+    ASSERT_EQ(state_->numrows, 1);
+    EXPECT_EQ(state_->row[0].chars, std::string("FIRST ROW"));
+
+    // Nor does a command stopped with ESC.
+    SetKeyPoller([](int fd __attribute__((unused))) { return (int)ESC; });
+    RunCommand(test_fd_, state_, ".!sleep 600");
+    SetKeyPoller(NULL);
+    SetScreenPresenter(NULL, NULL);
+    EXPECT_NE(shown_screen.find("Running the command, ESC stops it"),
+              std::string::npos);
+    EXPECT_EQ(std::string(state_->statusmsg), "Command stopped");
+    ASSERT_EQ(state_->numrows, 1);
+    EXPECT_EQ(state_->row[0].chars, std::string("FIRST ROW"));
+}
+
+TEST_F(EditorFixture, RunCommand_SortsRows) {
+    const std::string text =
+        "10 b\n9\n-1.5\nb\n10 a\nab\n\na\nabcdefgh2\nabcdefgh10\n";
+    ReplaceRows(state_, 0, state_->numrows, text.data(), text.size());
+    RunCommand(test_fd_, state_, "%sort");
+    ASSERT_EQ(state_->numrows, 10);
+    const char* lexical[] = {"",  "-1.5", "10 a",       "10 b",      "9",
+                             "a", "ab",   "abcdefgh10", "abcdefgh2", "b"};
+    for (int j = 0; j < 10; j++) {
+        EXPECT_EQ(state_->row[j].chars, std::string(lexical[j]));
+        EXPECT_EQ(state_->row[j].idx, j);
+    }
+    EXPECT_EQ(std::string(state_->statusmsg), "10 lines sorted");
+    RunCommand(test_fd_, state_, "%sort -r");
+    for (int j = 0; j < 10; j++)
+        EXPECT_EQ(state_->row[j].chars, std::string(lexical[9 - j]));
+
+    // Lines with the same number stay in their order, also in reverse.
+    ReplaceRows(state_, 0, state_->numrows, text.data(), text.size());
+    RunCommand(test_fd_, state_, "%sort -n");
+    const char* numeric[] = {"-1.5",       "b", "ab",   "",    "a", "abcdefgh2",
+                             "abcdefgh10", "9", "10 b", "10 a"};
+    for (int j = 0; j < 10; j++)
+        EXPECT_EQ(state_->row[j].chars, std::string(numeric[j]));
+    RunCommand(test_fd_, state_, "%sort -rn");
+    EXPECT_EQ(state_->row[0].chars, std::string("10 b"));
+    EXPECT_EQ(state_->row[1].chars, std::string("10 a"));
+    EXPECT_EQ(state_->row[3].chars, std::string("b"));
+    EXPECT_EQ(state_->row[9].chars, std::string("-1.5"));
+
+    RunCommand(test_fd_, state_, "2,3reverse");
+    EXPECT_EQ(state_->row[1].chars, std::string("9"));
+    EXPECT_EQ(state_->row[2].chars, std::string("10 a"));
+    RunCommand(test_fd_, state_, "%sort -x");
+    EXPECT_EQ(std::string(state_->statusmsg), "Unknown sort option: x");
+
+    // Enough rows to be sorted in chunks and merged, with many ties.
+    std::string many;
+    for (int i = 0; i < 300000; i++)
+        many += std::to_string(i % 1000) + " " + std::to_string(i) + "\n";
+    ReplaceRows(state_, 0, state_->numrows, many.data(), many.size());
+    RunCommand(test_fd_, state_, "%sort -n");
+    ASSERT_EQ(state_->numrows, 300000);
+    for (int j = 1; j < state_->numrows; j++) {
+        const long a = atol(state_->row[j - 1].chars);
+        const long b = atol(state_->row[j].chars);
+        const long ai = atol(strchr(state_->row[j - 1].chars, ' '));
+        const long bi = atol(strchr(state_->row[j].chars, ' '));
+        ASSERT_TRUE(a < b || (a == b && ai < bi)) << j;
+        ASSERT_EQ(state_->row[j].idx, j);
+    }
+
+    // Nor does an empty buffer trip it up.
+    ReplaceRows(state_, 0, state_->numrows, "", 0);
+    ASSERT_EQ(state_->numrows, 0);
+    for (const char* command :
+         {"%sort", "%sort -nu", "%uniq", "%keep a", "%reverse"}) {
+        RunCommand(test_fd_, state_, command);
+        EXPECT_EQ(state_->numrows, 0) << command;
+    }
+    EXPECT_EQ(std::string(state_->statusmsg), "0 lines reversed");
+}
+
+TEST_F(EditorFixture, RunCommand_RemovesRows) {
+    const std::string text = "apple\napple\npear\napple\nfig\nfig\n";
+    ReplaceRows(state_, 0, state_->numrows, text.data(), text.size());
+    RunCommand(test_fd_, state_, "%uniq");
+    ASSERT_EQ(state_->numrows, 4);
+    EXPECT_EQ(std::string(state_->statusmsg), "2 repeated lines removed");
+    EXPECT_EQ(state_->row[2].chars, std::string("apple"));
+    EXPECT_EQ(state_->row[3].chars, std::string("fig"));
+    EXPECT_EQ(state_->row[3].idx, 3);
+
+    RunCommand(test_fd_, state_, "%sort -u");
+    ASSERT_EQ(state_->numrows, 3);
+    EXPECT_EQ(state_->row[0].chars, std::string("apple"));
+
+    RunCommand(test_fd_, state_, "2,$drop ^p");
+    ASSERT_EQ(state_->numrows, 2);
+    EXPECT_EQ(std::string(state_->statusmsg), "1 lines removed");
+    EXPECT_EQ(state_->row[1].chars, std::string("fig"));
+    RunCommand(test_fd_, state_, "%keep i");
+    ASSERT_EQ(state_->numrows, 1);
+    EXPECT_EQ(state_->row[0].chars, std::string("fig"));
+
+    // A bad pattern changes nothing.
+    RunCommand(test_fd_, state_, "%keep (");
+    EXPECT_EQ(state_->numrows, 1);
+    EXPECT_EQ(std::string(state_->statusmsg).rfind("Bad pattern: ", 0), 0u);
+    RunCommand(test_fd_, state_, "%drop");
+    EXPECT_EQ(std::string(state_->statusmsg), "drop needs a pattern");
+}
+
+// Only the rows that changed on disk are replaced, and the cursor stays on
+// the same text.
+TEST(Editor, Reload_ReplacesChangedRows) {
+    std::string test_filename = "/tmp/Editor_Reload_ReplacesChangedRows.c";
+    WriteTestFile(test_filename, "one\ntwo\n/* three\nfour */\nfive\n");
+    State* state = new State();
+    SetupState(state);
+    state->screenrows = 10;
+    state->screencols = 80;
+    SelectSyntaxHighlight(state, test_filename.data());
+    ASSERT_EQ(Open(state, test_filename.data()), 0);
+    EXPECT_FALSE(FileChangedOnDisk(state));
+    state->cy = 4;
+    state->cx = 2;
+    const char* five = state->row[4].chars;
+
+    WriteTestFile(test_filename, "zero\none\n/* three\nfour */\nfive\n");
+    EXPECT_TRUE(FileChangedOnDisk(state));
+    CheckFileOnDisk(state);
+    EXPECT_EQ(std::string(state->statusmsg),
+              "The file changed on disk, Ctrl-R reloads it");
+    ReloadFile(0, state);
+    EXPECT_EQ(std::string(state->statusmsg), "Reloaded, 2 changes");
+    ASSERT_EQ(state->numrows, 5);
+    EXPECT_EQ(state->row[0].chars, std::string("zero"));
+    EXPECT_EQ(state->row[1].chars, std::string("one"));
+    EXPECT_EQ(state->row[4].idx, 4);
+    EXPECT_EQ(state->row[4].chars, five);
+    EXPECT_EQ(state->rowoff + state->cy, 4);
+    EXPECT_EQ(state->cx, 2);
+    EXPECT_FALSE(FileChangedOnDisk(state));
+    EXPECT_EQ(state->row[3].hl_start, 1);
+
+    // Ending the comment sooner highlights the rows after it again.
+    EXPECT_EQ(ReloadRows(state, "zero\none\n/* three */\nfour */\nfive\n"),
+              1);
+    EXPECT_FALSE(RowHasOpenComment(&state->row[2]));
+    EXPECT_EQ(state->row[3].hl_start, 0);
+    EXPECT_EQ(ReloadRows(state, "zero\nfive\nsix\n"), 2);
+    ASSERT_EQ(state->numrows, 3);
+    EXPECT_EQ(state->row[1].chars, five);
+    EXPECT_EQ(state->row[1].idx, 1);
+    EXPECT_EQ(state->row[2].chars, std::string("six"));
+    EXPECT_EQ(state->rowoff + state->cy, 1);
+
+    // Saving over a changed file asks first.
+    diff_state = state;
+    SetScreenPresenter(CaptureScreen, NULL);
+    SetKeyReader(NextDiffKey);
+    InsertChar(state, 'x');
+    WriteTestFile(test_filename, "changed elsewhere\n");
+    diff_keys = {'c'};
+    SaveOrReload(0, state);
+    EXPECT_EQ(std::string(state->statusmsg), "Not saved");
+    EXPECT_NE(shown_screen.find("(o)verwrite"), std::string::npos);
+    diff_keys = {'O'};
+    SaveOrReload(0, state);
+    EXPECT_EQ(state->dirty, 0);
+    EXPECT_FALSE(FileChangedOnDisk(state));
+    SetScreenPresenter(NULL, NULL);
+    SetKeyReader(NULL);
+    CleanupTestFile(test_filename);
+}
+
+TEST_F(EditorFixture, Cursors_EditAllAtOnce) {
+    state_->screenrows = 10;
+    state_->screencols = 80;
+    const std::string text = "int a;\nint b;\n\tint c;\nint ab;\n";
+    ReplaceRows(state_, 0, state_->numrows, text.data(), text.size());
+    RunCommand(test_fd_, state_, "%cursors");
+    ASSERT_EQ(state_->cursors.size(), 4u);
+    EXPECT_EQ(std::string(state_->statusmsg), "4 cursors, ESC leaves one");
+    ProcessKeyPress(test_fd_, state_, '/');
+    ProcessKeyPress(test_fd_, state_, '/');
+    EXPECT_EQ(state_->row[0].chars, std::string("//int a;"));
+    EXPECT_EQ(state_->row[2].chars, std::string("//\tint c;"));
+    EXPECT_EQ(state_->row[3].chars, std::string("//int ab;"));
+    EXPECT_EQ(state_->cx, 2);
+
+    // Cursors on the same row stay apart as text goes in and out.
+    RunCommand(test_fd_, state_, "%cursors [ab]");
+    ASSERT_EQ(state_->cursors.size(), 4u);
+    EXPECT_EQ(state_->rowoff + state_->cy, 0);
+    EXPECT_EQ(state_->cx, 6);
+    ProcessKeyPress(test_fd_, state_, 'x');
+    EXPECT_EQ(state_->row[0].chars, std::string("//int xa;"));
+    EXPECT_EQ(state_->row[3].chars, std::string("//int xaxb;"));
+    EXPECT_EQ(state_->cx, 7);
+    ProcessKeyPress(test_fd_, state_, BACKSPACE);
+    EXPECT_EQ(state_->row[3].chars, std::string("//int ab;"));
+    ProcessKeyPress(test_fd_, state_, BACKSPACE);
+    EXPECT_EQ(state_->row[1].chars, std::string("//intb;"));
+    EXPECT_EQ(state_->row[2].chars, std::string("//\tint c;"));
+    EXPECT_EQ(state_->row[3].chars, std::string("//intb;"));
+    EXPECT_EQ(state_->cursors.size(), 3u); /* Two met on the last row. */
+    ProcessKeyPress(test_fd_, state_, ARROW_RIGHT);
+    EXPECT_EQ(state_->cursors[2].col, 6);
+    Frame frame = {{NULL, 0, 0}, {}, 0, 0, 0};
+    DrawFrame(state_, &frame);
+    const std::string screen(frame.text.b, frame.text.len);
+    EXPECT_NE(screen.find("//intb\x1b[7m;\x1b[27m"), std::string::npos);
+    EXPECT_NE(screen.find("3 cursors"), std::string::npos);
+    FreeBuf(&frame.text);
+    ProcessKeyPress(test_fd_, state_, ESC);
+    EXPECT_TRUE(state_->cursors.empty());
+
+    RunCommand(test_fd_, state_, "%cursors zzz");
+    EXPECT_EQ(std::string(state_->statusmsg), "No matches");
+    EXPECT_TRUE(state_->cursors.empty());
+
+    // Opening a comment on the rows carries it to the rows after them.
+    std::string c_file = "cursors.c";
+    SelectSyntaxHighlight(state_, c_file.data());
+    HighlightRows(state_, 0, state_->numrows);
+    state_->cx = 0;
+    RunCommand(test_fd_, state_, "1,2cursors");
+    ProcessKeyPress(test_fd_, state_, '/');
+    ProcessKeyPress(test_fd_, state_, '*');
+    ProcessKeyPress(test_fd_, state_, ' ');
+    EXPECT_EQ(state_->row[1].chars, std::string("/* //intb;"));
+    HighlightRows(state_, 0, state_->numrows);
+    EXPECT_EQ(state_->row[2].hl_start, 1);
+    EXPECT_GT(state_->dirty, 0);
+}
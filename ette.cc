@@ -4,13 +4,18 @@
 #include <unistd.h>
 
 #include "constants.h"
+#include "crypto_registry.h"
 #include "editor.h"
+#include "event_loop.h"
 
 int main(int argc, char** argv) {
-    if (argc != 2) {
-        fprintf(stderr, "Usage: ette <filename>\n");
+    /* -f follows the file as it grows, as "tail -f" does. */
+    const bool follow = argc == 3 && std::string(argv[1]) == "-f";
+    if (argc != 2 && !follow) {
+        fprintf(stderr, "Usage: ette [-f] <filename>\n");
         exit(1);
     }
+    char* filename = argv[argc - 1];
 
     if (std::string(argv[1]) == std::string("--version")) {
         printf("ette version %d.%d.%d\n", ::ette::kVersionMajor,
@@ -18,20 +23,26 @@ int main(int argc, char** argv) {
         exit(0);
     }
 
+    std::string vault_path, entry;
+    if (follow && (::ette::CryptoAlgorithmFromFilename(filename) !=
+                       ::ette::CryptoAlgorithm::kDefaultNone ||
+                   ::ette::ParseVaultSpec(filename, &vault_path, &entry))) {
+        fprintf(stderr, "ette: only unencrypted files can be followed\n");
+        exit(1);
+    }
+
     State* state = new State();
 
     Init(state);
-    SelectSyntaxHighlight(state, argv[1]);
+    SelectSyntaxHighlight(state, filename);
     EnableRawMode(STDIN_FILENO);
-    HandleEncryption(state, argv[1], {});
-    Open(state, argv[1]);
+    HandleEncryption(state, filename, {});
+    if (follow)
+        Follow(state, filename);
+    else
+        Open(state, filename);
     SetStatusMessage(state,
-                     "HELP: Ctrl-S = save | Ctrl-Q = quit | Ctrl-F = find");
-    while (1) {
-        RefreshScreen();
-        ProcessKeyPress(STDIN_FILENO, state, 0);
-    }
-
-    delete state;
-    return 0;
+                     "HELP: Ctrl-S save | Ctrl-Q quit | Ctrl-F find | Ctrl-D "
+                     "diff | Ctrl-E command");
+    RunEventLoop(state);
 }
\ No newline at end of file
@@ -0,0 +1,98 @@
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <atomic>
+#include <string>
+
+#include "key_agent.h"
+
+using ::ette::AgentClearKeys;
+using ::ette::GetAgentSocketPath;
+using ::ette::kAgentDefaultTtlSeconds;
+using ::ette::ListenAgentSocket;
+using ::ette::ServeKeyAgent;
+
+static std::atomic<bool> stop(false);
+
+static void HandleStopSignal(int unused __attribute__((unused))) {
+    stop = true;
+}
+
+static void Usage() {
+    fprintf(stderr,
+            "Usage: ette-agent [--ttl SECONDS] [--socket PATH] [--foreground]\n"
+            "       ette-agent --clear\n");
+    exit(1);
+}
+
+/* Caches derived keys for ette, see key_agent.h. Runs in the background
+ * unless --foreground is given; --clear makes a running agent forget every
+ * key. */
+int main(int argc, char* argv[]) {
+    int ttl = kAgentDefaultTtlSeconds;
+    std::string socket_path = GetAgentSocketPath();
+    bool foreground = false;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--ttl") == 0 && i + 1 < argc) {
+            ttl = atoi(argv[++i]);
+            if (ttl <= 0)
+                Usage();
+        } else if (strcmp(argv[i], "--socket") == 0 && i + 1 < argc) {
+            socket_path = argv[++i];
+        } else if (strcmp(argv[i], "--foreground") == 0) {
+            foreground = true;
+        } else if (strcmp(argv[i], "--clear") == 0) {
+            if (!AgentClearKeys()) {
+                fprintf(stderr, "ette-agent: no agent running\n");
+                exit(1);
+            }
+            exit(0);
+        } else {
+            Usage();
+        }
+    }
+
+    std::string error;
+    const int fd = ListenAgentSocket(socket_path, &error);
+    if (fd == -1) {
+        fprintf(stderr, "ette-agent: %s\n", error.c_str());
+        exit(1);
+    }
+
+    if (!foreground) {
+        const pid_t pid = fork();
+        if (pid == -1) {
+            perror("fork");
+            exit(1);
+        }
+        if (pid > 0) {
+            printf("ETTE_AGENT_SOCK=%s; export ETTE_AGENT_SOCK;\n",
+                   socket_path.c_str());
+            exit(0);
+        }
+        setsid();
+        if (chdir("/") == -1) {
+        }
+        const int null_fd = open("/dev/null", O_RDWR);
+        if (null_fd != -1) {
+            dup2(null_fd, STDIN_FILENO);
+            dup2(null_fd, STDOUT_FILENO);
+            dup2(null_fd, STDERR_FILENO);
+            if (null_fd > STDERR_FILENO)
+                close(null_fd);
+        }
+    }
+
+    signal(SIGTERM, HandleStopSignal);
+    signal(SIGINT, HandleStopSignal);
+    signal(SIGHUP, HandleStopSignal);
+    signal(SIGPIPE, SIG_IGN);
+
+    ServeKeyAgent(fd, ttl, stop);
+    close(fd);
+    unlink(socket_path.c_str());
+    return 0;
+}
@@ -0,0 +1,356 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <unistd.h>
+#include <algorithm>
+#include <map>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "constants.h"
+#include "crypto.h"
+#include "crypto_registry.h"
+#include "key_agent.h"
+#include "password_prompt.h"
+#include "secure_memory.h"
+#include "text_search.h"
+#include "thread_pool.h"
+#include "tool_files.h"
+
+using ::ette::AgentGetKey;
+using ::ette::AgentPutKey;
+using ::ette::CryptoAlgorithm;
+using ::ette::CryptoAlgorithmFromFilename;
+using ::ette::CryptoAlgorithmFromHeaderByte;
+using ::ette::DecryptWithDerivedKeyTo;
+using ::ette::DeriveKey;
+using ::ette::GetKeyIdFromCiphertext;
+using ::ette::ListFiles;
+using ::ette::ParallelFor;
+using ::ette::ReadFileToString;
+using ::ette::ReadHeader;
+using ::ette::ReadPassword;
+using ::ette::StatusCode;
+using ::ette::TextSearch;
+using ::ette::ThreadPool;
+using ::ette::WipeMemory;
+using ::ette::WipeString;
+
+namespace {
+
+constexpr int kPasswordTries = 3;
+
+struct Options {
+    bool regex = false;
+    bool ignore_case = false;
+    bool files_only = false;
+    bool recursive = false;
+    /* Print matching lines even when stdout isn't a terminal. */
+    bool text = false;
+};
+
+/* What searching one file found. 'output' holds matching lines, so it is
+ * wiped once printed. */
+struct FileResult {
+    bool opened = false;
+    std::string error;
+    uint64_t matches = 0;
+    std::string output;
+    std::string key_id;
+    /* Opened with a typed password rather than ette-agent's key. */
+    bool typed = false;
+};
+
+void Usage() {
+    fprintf(stderr,
+            "Usage: ette-grep [-E] [-i] [-l] [-r] [--text] <pattern> "
+            "<file>...\n"
+            "  -E      the pattern is a POSIX extended regular expression\n"
+            "  -i      ignore case\n"
+            "  -l      only print the names of files with a match\n"
+            "  -r      search the encrypted files in directories\n"
+            "  --text  print matching lines even into a pipe or a file\n");
+    exit(2);
+}
+
+void Fail(const std::string& message) {
+    fprintf(stderr, "ette-grep: %s\n", message.c_str());
+    exit(2);
+}
+
+/* Memory for the text of one file: locked, so it is never swapped out, and
+ * left out of core dumps. Wiped and unmapped when done. */
+class LockedBuffer {
+   public:
+    explicit LockedBuffer(size_t size) : data_(nullptr), size_(size) {
+        const size_t page = sysconf(_SC_PAGESIZE);
+        mapped_size_ = std::max<size_t>((size + page - 1) / page * page, page);
+        void* memory = mmap(NULL, mapped_size_, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (memory == MAP_FAILED)
+            return;
+#ifdef MADV_DONTDUMP
+        madvise(memory, mapped_size_, MADV_DONTDUMP);
+#endif
+        if (mlock(memory, mapped_size_) != 0) {
+            munmap(memory, mapped_size_);
+            return;
+        }
+        data_ = static_cast<char*>(memory);
+    }
+    ~LockedBuffer() {
+        if (data_ == nullptr)
+            return;
+        WipeMemory(data_, size_);
+        munlock(data_, mapped_size_);
+        munmap(data_, mapped_size_);
+    }
+
+    LockedBuffer(const LockedBuffer&) = delete;
+    LockedBuffer& operator=(const LockedBuffer&) = delete;
+
+    bool ok() const { return data_ != nullptr; }
+    char* data() { return data_; }
+    size_t size() const { return size_; }
+
+   private:
+    char* data_;
+    size_t size_;
+    size_t mapped_size_;
+};
+
+/* Decrypt 'path' into locked memory with the first of its agent key and
+ * 'typed_keys' that opens it, and search the text. */
+FileResult SearchFile(const std::string& path,
+                      const std::optional<std::string>& agent_key,
+                      const std::vector<const std::string*>& typed_keys,
+                      const TextSearch& search, const Options& options,
+                      bool print_text) {
+    FileResult result;
+    std::optional<std::string> ciphertext = ReadFileToString(path);
+    if (!ciphertext) {
+        result.error = strerror(errno);
+        return result;
+    }
+    if (ciphertext->size() <= sizeof(ette::kHeaderMagicNumber) ||
+        memcmp(ciphertext->data(), ette::kHeaderMagicNumber,
+               sizeof(ette::kHeaderMagicNumber)) != 0) {
+        result.error = "not an encrypted file";
+        return result;
+    }
+    const CryptoAlgorithm algorithm = CryptoAlgorithmFromHeaderByte(
+        (*ciphertext)[sizeof(ette::kHeaderMagicNumber)]);
+    result.key_id = GetKeyIdFromCiphertext(*ciphertext);
+
+    LockedBuffer text(ciphertext->size());
+    if (!text.ok()) {
+        result.error = "can't lock memory for the text (see ulimit -l)";
+        return result;
+    }
+    uint64_t text_size = 0;
+    for (int i = agent_key ? -1 : 0; i < (int)typed_keys.size(); i++) {
+        const ette::Status<uint64_t> decrypted = DecryptWithDerivedKeyTo(
+            *ciphertext, i == -1 ? *agent_key : *typed_keys[i], algorithm,
+            text.data(), text.size());
+        if (decrypted.ok()) {
+            result.opened = true;
+            result.typed = i >= 0;
+            text_size = *decrypted;
+            break;
+        }
+        if (decrypted.error().code() != StatusCode::kInvalidKey) {
+            result.error = decrypted.error().message();
+            return result;
+        }
+    }
+    if (!result.opened)
+        return result;
+
+    result.matches = search.ForEachMatchingLine(
+        text.data(), text_size,
+        [&](uint64_t number, const char* line, size_t size) {
+            if (options.files_only)
+                return;
+            result.output += path + ":" + std::to_string(number);
+            if (print_text) {
+                result.output += ':';
+                result.output.append(line, size);
+            }
+            result.output += '\n';
+        });
+    if (options.files_only && result.matches > 0)
+        result.output = path + "\n";
+    return result;
+}
+
+void WriteAll(const std::string& data) {
+    for (size_t written = 0; written < data.size();) {
+        const ssize_t n =
+            write(STDOUT_FILENO, data.data() + written, data.size() - written);
+        if (n <= 0)
+            exit(2);
+        written += n;
+    }
+}
+
+}  // namespace
+
+/* Searches encrypted files for a pattern, decrypting them in parallel into
+ * locked memory with keys from ette-agent or a password typed once. Nothing
+ * decrypted is written anywhere but the matching lines to stdout, and those
+ * only when stdout is a terminal or with --text: otherwise just file:line. */
+int main(int argc, char* argv[]) {
+#ifdef __linux__
+    /* No core dumps and no ptrace by other processes of the same user. */
+    prctl(PR_SET_DUMPABLE, 0, 0, 0, 0);
+#endif
+    Options options;
+    int arg = 1;
+    for (; arg < argc && argv[arg][0] == '-' && argv[arg][1] != '\0'; arg++) {
+        const std::string flag = argv[arg];
+        if (flag == "--") {
+            arg++;
+            break;
+        }
+        if (flag == "--text") {
+            options.text = true;
+            continue;
+        }
+        for (size_t i = 1; i < flag.size(); i++) {
+            switch (flag[i]) {
+                case 'E':
+                    options.regex = true;
+                    break;
+                case 'F':
+                    options.regex = false;
+                    break;
+                case 'i':
+                    options.ignore_case = true;
+                    break;
+                case 'l':
+                    options.files_only = true;
+                    break;
+                case 'r':
+                    options.recursive = true;
+                    break;
+                default:
+                    Usage();
+            }
+        }
+    }
+    if (argc - arg < 2)
+        Usage();
+
+    const ette::Status<TextSearch> search =
+        TextSearch::Create(argv[arg], options.regex, options.ignore_case);
+    if (!search.ok())
+        Fail(search.error().message());
+    const ette::Status<std::vector<std::string>> listed = ListFiles(
+        std::vector<std::string>(argv + arg + 1, argv + argc),
+        options.recursive);
+    if (!listed.ok())
+        Fail(listed.error().message());
+    const std::vector<std::string>& files = listed.value();
+    const bool print_text = options.text || isatty(STDOUT_FILENO);
+
+    /* ette-agent's keys, by key ID, looked up before anything is read. */
+    std::vector<std::optional<std::string>> agent_keys(files.size());
+    std::map<std::string, std::optional<std::string>> agent_cache;
+    for (size_t i = 0; i < files.size(); i++) {
+        const std::string key_id = GetKeyIdFromCiphertext(ReadHeader(files[i]));
+        if (key_id.empty())
+            continue;
+        auto cached = agent_cache.find(key_id);
+        if (cached == agent_cache.end())
+            cached = agent_cache.emplace(key_id, AgentGetKey(key_id)).first;
+        agent_keys[i] = cached->second;
+    }
+
+    /* Files are searched in batches, printed in order after each. The first
+     * round tries ette-agent's keys and, if some file has none, a password.
+     * Files no key opens wait for another password, which is tried on them
+     * alone. */
+    std::vector<std::string> typed_keys;
+    std::vector<size_t> pending(files.size());
+    for (size_t i = 0; i < files.size(); i++)
+        pending[i] = i;
+    bool matched = false, failed = false;
+    int wrong_passwords = 0;
+    const size_t batch = 4 * ThreadPool::Global().WorkerCount() + 4;
+    for (bool first_round = true; !pending.empty(); first_round = false) {
+        const bool need_password =
+            !first_round ||
+            std::any_of(pending.begin(), pending.end(),
+                        [&](size_t i) { return !agent_keys[i]; });
+        std::vector<const std::string*> keys;
+        if (need_password) {
+            const std::string prompt =
+                first_round ? "Password: "
+                            : "Password for " + std::to_string(pending.size()) +
+                                  " more files: ";
+            std::optional<std::string> password = ReadPassword(prompt.c_str());
+            if (!password || password->empty())
+                break;
+            typed_keys.push_back(DeriveKey(*password));
+            WipeString(&*password);
+            keys.push_back(&typed_keys.back());
+        }
+
+        std::vector<size_t> locked_out;
+        for (size_t first = 0; first < pending.size(); first += batch) {
+            const size_t count = std::min(batch, pending.size() - first);
+            std::vector<FileResult> results(count);
+            ParallelFor(count, 1, [&](size_t begin, size_t end) {
+                for (size_t j = begin; j < end; j++) {
+                    const size_t i = pending[first + j];
+                    results[j] = SearchFile(
+                        files[i], first_round ? agent_keys[i] : std::nullopt,
+                        keys, search.value(), options, print_text);
+                }
+            });
+            for (size_t j = 0; j < count; j++) {
+                FileResult& result = results[j];
+                const size_t i = pending[first + j];
+                if (!result.error.empty()) {
+                    fprintf(stderr, "ette-grep: %s: %s\n", files[i].c_str(),
+                            result.error.c_str());
+                    failed = true;
+                } else if (!result.opened) {
+                    locked_out.push_back(i);
+                } else {
+                    WriteAll(result.output);
+                    matched = matched || result.matches > 0;
+                    /* The agent learns keys that had to be typed. */
+                    if (result.typed && !result.key_id.empty())
+                        AgentPutKey(result.key_id, typed_keys.back());
+                }
+                WipeString(&result.output);
+            }
+        }
+
+        if (need_password && locked_out.size() == pending.size()) {
+            fprintf(stderr, "Incorrect password.\n");
+            WipeString(&typed_keys.back());
+            typed_keys.pop_back();
+            if (++wrong_passwords >= kPasswordTries) {
+                pending = locked_out;
+                break;
+            }
+        } else {
+            wrong_passwords = 0;
+        }
+        pending = locked_out;
+    }
+    for (size_t i : pending) {
+        fprintf(stderr, "ette-grep: %s: no password opens it\n",
+                files[i].c_str());
+        failed = true;
+    }
+    for (std::string& key : typed_keys)
+        WipeString(&key);
+    return failed ? 2 : matched ? 0 : 1;
+}
@@ -0,0 +1,175 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "constants.h"
+#include "crypto.h"
+#include "crypto_registry.h"
+#include "history.h"
+#include "password_prompt.h"
+#include "secure_memory.h"
+#include "tool_files.h"
+
+using ::ette::CryptoAlgorithm;
+using ::ette::CryptoAlgorithmFromFilename;
+using ::ette::CryptoAlgorithmFromHeaderByte;
+using ::ette::CryptoState;
+using ::ette::DecryptWithDerivedKey;
+using ::ette::EncryptWithDerivedKey;
+using ::ette::GenerateRandomAsciiByteVector;
+using ::ette::GetKeyIdFromCiphertext;
+using ::ette::History;
+using ::ette::HistoryVersion;
+using ::ette::ReadFileToString;
+using ::ette::UnlockKey;
+using ::ette::WipeString;
+
+static void Usage() {
+    fprintf(stderr,
+            "Usage: ette-history init <file>\n"
+            "       ette-history list <file>\n"
+            "       ette-history restore <file> <version> <output>\n");
+    exit(1);
+}
+
+static void Fail(const std::string& message) {
+    fprintf(stderr, "ette-history: %s\n", message.c_str());
+    exit(1);
+}
+
+static std::vector<HistoryVersion> Versions(const std::string& path) {
+    ette::Status<std::vector<HistoryVersion>> versions =
+        History::Versions(path);
+    if (!versions.ok())
+        Fail(versions.error().message());
+    return *versions;
+}
+
+/* Start keeping the history of 'path', with its current text as the first
+ * version. */
+static void Init(const std::string& path) {
+    const CryptoAlgorithm algorithm = CryptoAlgorithmFromFilename(path);
+    if (algorithm == CryptoAlgorithm::kDefaultNone)
+        Fail("only encrypted files have a history");
+    std::optional<std::string> ciphertext = ReadFileToString(path);
+    const ette::Status<void> status = ette::InitHistory(path);
+    if (!status.ok())
+        Fail(status.error().message());
+    if (!ciphertext || ciphertext->empty())
+        return; /* Recorded on its first save. */
+
+    const std::string prompt = "Password for " + path + ": ";
+    std::optional<std::string> key =
+        UnlockKey(*ciphertext, algorithm, prompt.c_str());
+    if (!key)
+        exit(1);
+    CryptoState state = DecryptWithDerivedKey(*ciphertext, *key, algorithm);
+    {
+        History history(path, *key, GetKeyIdFromCiphertext(*ciphertext),
+                        algorithm);
+        const ette::Status<HistoryVersion> version =
+            history.Record(state.plaintext);
+        if (!version.ok())
+            Fail(version.error().message());
+    }
+    WipeString(&state.plaintext);
+    WipeString(&*key);
+}
+
+static void List(const std::string& path) {
+    const std::vector<HistoryVersion> versions = Versions(path);
+    for (size_t i = 0; i < versions.size(); i++) {
+        const time_t saved = versions[i].saved_ns / 1000000000;
+        char date[32];
+        strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S", localtime(&saved));
+        printf("%6zu  %s\n", i + 1, date);
+    }
+    const ette::HistoryUsage usage = History::Usage(path);
+    fprintf(stderr, "%zu versions in %llu chunks, %llu bytes\n",
+            versions.size(), (unsigned long long)usage.chunks,
+            (unsigned long long)usage.bytes);
+}
+
+/* Write version 'number' (as numbered by list) to 'output', encrypted under
+ * the version's key: the text never reaches the disk unencrypted. */
+static void Restore(const std::string& path, const std::string& number,
+                    const std::string& output) {
+    const CryptoAlgorithm output_algorithm =
+        CryptoAlgorithmFromFilename(output);
+    if (output_algorithm == CryptoAlgorithm::kDefaultNone)
+        Fail(output + " must have the extension of an encryption algorithm");
+    const std::vector<HistoryVersion> versions = Versions(path);
+    const size_t index = strtoul(number.c_str(), NULL, 10);
+    if (index < 1 || index > versions.size())
+        Fail("no version " + number);
+    const HistoryVersion& version = versions[index - 1];
+
+    const std::string manifest = History::Manifest(path, version);
+    if (manifest.size() <= sizeof(ette::kHeaderMagicNumber))
+        Fail("can't read version " + number);
+    const CryptoAlgorithm algorithm = CryptoAlgorithmFromHeaderByte(
+        manifest[sizeof(ette::kHeaderMagicNumber)]);
+    const std::string key_id = GetKeyIdFromCiphertext(manifest);
+    const std::string prompt = "Password for " + path + ": ";
+    std::optional<std::string> key =
+        UnlockKey(manifest, algorithm, prompt.c_str(), History::RecordKey);
+    if (!key)
+        exit(1);
+
+    std::string text;
+    {
+        History history(path, *key, key_id, algorithm);
+        ette::Status<std::string> restored = history.Restore(version);
+        if (!restored.ok())
+            Fail(restored.error().message());
+        text = *restored;
+    }
+    CryptoState state = EncryptWithDerivedKey(
+        text, *key, GenerateRandomAsciiByteVector(), key_id, output_algorithm);
+    WipeString(&text);
+    WipeString(&state.plaintext);
+    WipeString(&*key);
+    if (!state.status.ok())
+        Fail(state.status.error().message());
+
+    const int fd =
+        open(output.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    if (fd == -1)
+        Fail(output + ": " + strerror(errno));
+    const bool written =
+        write(fd, state.ciphertext.data(), state.ciphertext.size()) ==
+            static_cast<ssize_t>(state.ciphertext.size()) &&
+        fsync(fd) == 0;
+    close(fd);
+    if (!written) {
+        unlink(output.c_str());
+        Fail(output + ": " + strerror(errno));
+    }
+}
+
+/* Manages the version history of encrypted files (see history.h). Once a
+ * file has one, ette records every save in it. */
+int main(int argc, char* argv[]) {
+    if (argc < 3)
+        Usage();
+    const std::string command = argv[1];
+    const std::string path = argv[2];
+
+    if (command == "init" && argc == 3) {
+        Init(path);
+    } else if (command == "list" && argc == 3) {
+        List(path);
+    } else if (command == "restore" && argc == 5) {
+        Restore(path, argv[3], argv[4]);
+    } else {
+        Usage();
+    }
+    return 0;
+}
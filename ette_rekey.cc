@@ -0,0 +1,224 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/prctl.h>
+#include <algorithm>
+#include <filesystem>
+#include <map>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "constants.h"
+#include "crypto.h"
+#include "crypto_registry.h"
+#include "history.h"
+#include "key_agent.h"
+#include "password_prompt.h"
+#include "rekey.h"
+#include "secure_memory.h"
+#include "thread_pool.h"
+#include "tool_files.h"
+#include "vault.h"
+
+using ::ette::AgentGetKey;
+using ::ette::AgentPutKey;
+using ::ette::CryptoAlgorithm;
+using ::ette::CryptoAlgorithmFromFilename;
+using ::ette::CryptoAlgorithmFromHeaderByte;
+using ::ette::DeriveKey;
+using ::ette::GenerateKeyId;
+using ::ette::GetKeyIdFromCiphertext;
+using ::ette::ListFiles;
+using ::ette::ReadFileToString;
+using ::ette::ReadHeader;
+using ::ette::ReadNewPassword;
+using ::ette::RekeyFile;
+using ::ette::RekeyOldKey;
+using ::ette::StatusCode;
+using ::ette::TaskGroup;
+using ::ette::TaskPriority;
+using ::ette::ThreadPool;
+using ::ette::UnlockKey;
+using ::ette::WipeString;
+
+static void Usage() {
+    fprintf(stderr,
+            "Usage: ette-rekey [-r] [-f] [-j <jobs>] <file>...\n"
+            "  -r         re-key the encrypted files in directories\n"
+            "  -f         re-key AES-256-CBC files the password can't be "
+            "checked on\n"
+            "             too, keeping each original as <file>.rekey-old\n"
+            "  -j <jobs>  files re-keyed at once\n");
+    exit(2);
+}
+
+static void Fail(const std::string& message) {
+    fprintf(stderr, "ette-rekey: %s\n", message.c_str());
+    exit(2);
+}
+
+/* Re-encrypts files with a new password. Files are streamed through a piece
+ * at a time, so their size doesn't matter, and many are re-keyed at once:
+ * the work is mostly reading, writing and syncing, which overlaps well. The
+ * old keys come from ette-agent or the current password, typed once. The
+ * password may not be the one of every file, and AES-256-CBC files without a
+ * digest can't tell, so without -f those are left alone. */
+int main(int argc, char* argv[]) {
+#ifdef __linux__
+    /* No core dumps and no ptrace by other processes of the same user. */
+    prctl(PR_SET_DUMPABLE, 0, 0, 0, 0);
+#endif
+    bool recursive = false, keep_originals = false;
+    size_t jobs = std::max<size_t>(8, 2 * ThreadPool::DefaultWorkerCount());
+    int arg = 1;
+    for (; arg < argc && argv[arg][0] == '-'; arg++) {
+        const std::string flag = argv[arg];
+        if (flag == "-r") {
+            recursive = true;
+        } else if (flag == "-f") {
+            keep_originals = true;
+        } else if (flag == "-j" && arg + 1 < argc) {
+            jobs = std::max(1, atoi(argv[++arg]));
+        } else {
+            Usage();
+        }
+    }
+    if (arg == argc)
+        Usage();
+    /* With -r, vaults and what an interrupted ette-rekey left behind aren't
+     * re-keyed. */
+    const ette::Status<std::vector<std::string>> listed = ListFiles(
+        std::vector<std::string>(argv + arg, argv + argc), recursive,
+        [](const std::string& name) {
+            return name.find(ette::kVaultExtension) == std::string::npos &&
+                   name.find(ette::kRekeyTemporarySuffix) == std::string::npos;
+        });
+    if (!listed.ok())
+        Fail(listed.error().message());
+    const std::vector<std::string>& files = listed.value();
+
+    /* ette-agent's keys, by key ID. The current password is asked for (and
+     * checked on the smallest file that needs it) only if some file isn't
+     * covered. */
+    std::vector<std::optional<std::string>> agent_keys(files.size());
+    std::map<std::string, std::optional<std::string>> agent_cache;
+    std::optional<size_t> smallest;
+    std::error_code error;
+    for (size_t i = 0; i < files.size(); i++) {
+        const std::string key_id = GetKeyIdFromCiphertext(ReadHeader(files[i]));
+        if (!key_id.empty()) {
+            auto cached = agent_cache.find(key_id);
+            if (cached == agent_cache.end())
+                cached = agent_cache.emplace(key_id, AgentGetKey(key_id)).first;
+            agent_keys[i] = cached->second;
+        }
+        if (!agent_keys[i] &&
+            (!smallest || std::filesystem::file_size(files[i], error) <
+                              std::filesystem::file_size(files[*smallest],
+                                                         error)))
+            smallest = i;
+    }
+    std::optional<std::string> key;
+    if (smallest) {
+        std::optional<std::string> ciphertext =
+            ReadFileToString(files[*smallest]);
+        if (!ciphertext || ciphertext->size() <= ette::kHeaderSize)
+            Fail(files[*smallest] + ": not an encrypted file");
+        key = UnlockKey(
+            *ciphertext,
+            CryptoAlgorithmFromHeaderByte(
+                (*ciphertext)[sizeof(ette::kHeaderMagicNumber)]),
+            "Current password: ");
+        if (!key)
+            return 2;
+    }
+    std::optional<std::string> new_password = ReadNewPassword("New password: ");
+    if (!new_password || new_password->empty())
+        return 2;
+    std::string new_key = DeriveKey(*new_password);
+    WipeString(&*new_password);
+
+    /* Each file gets its own key ID, as a file saved by ette would. A key
+     * from ette-agent is the file's own; the password is only checked on
+     * one of them. */
+    std::vector<std::string> new_key_ids(files.size());
+    std::vector<std::string> errors(files.size());
+    std::vector<std::string> originals(files.size());
+    {
+        ThreadPool pool(std::min(jobs, std::max<size_t>(files.size(), 1)));
+        TaskGroup group(TaskPriority::kInteractive, pool);
+        for (size_t i = 0; i < files.size(); i++) {
+            group.Run([&, i] {
+                const std::string key_id = GenerateKeyId();
+                ette::Status<bool> status(StatusCode::kInvalidKey, "");
+                for (const std::optional<std::string>* old_key :
+                     {&agent_keys[i], &key}) {
+                    if (!*old_key)
+                        continue;
+                    const RekeyOldKey trust =
+                        old_key == &agent_keys[i] ? RekeyOldKey::kConfirmed
+                        : keep_originals ? RekeyOldKey::kUnconfirmedKeepOriginal
+                                         : RekeyOldKey::kUnconfirmed;
+                    status = RekeyFile(files[i], **old_key, new_key, key_id,
+                                       trust);
+                    if (status.ok() ||
+                        status.error().code() != StatusCode::kInvalidKey)
+                        break;
+                }
+                if (status.ok()) {
+                    new_key_ids[i] = key_id;
+                    std::error_code path_error;
+                    if (status.value())
+                        originals[i] = std::filesystem::weakly_canonical(
+                                           files[i], path_error)
+                                           .string() +
+                                       ette::kRekeyOriginalSuffix;
+                } else if (status.error().code() == StatusCode::kInvalidKey) {
+                    errors[i] = "the password doesn't open it";
+                } else if (status.error().code() == StatusCode::kUnverified) {
+                    errors[i] =
+                        "skipped, the password can't be checked on an "
+                        "AES-256-CBC file without a digest (-f re-keys it and "
+                        "keeps the original)";
+                } else {
+                    errors[i] = status.error().message();
+                }
+            });
+        }
+        group.Wait();
+    }
+
+    size_t rekeyed = 0;
+    for (size_t i = 0; i < files.size(); i++) {
+        if (!errors[i].empty()) {
+            fprintf(stderr, "ette-rekey: %s: %s\n", files[i].c_str(),
+                    errors[i].c_str());
+            continue;
+        }
+        rekeyed++;
+        AgentPutKey(new_key_ids[i], new_key);
+        if (!originals[i].empty())
+            fprintf(stderr,
+                    "ette-rekey: %s: check it opens with the new password, "
+                    "then delete the original, %s\n",
+                    files[i].c_str(), originals[i].c_str());
+        if (ette::HasHistory(files[i]))
+            fprintf(stderr,
+                    "ette-rekey: %s: its history keeps the old password\n",
+                    files[i].c_str());
+    }
+    fprintf(stderr, "Re-keyed %zu of %zu files.\n", rekeyed, files.size());
+
+    for (auto& [key_id, agent_key] : agent_cache) {
+        if (agent_key)
+            WipeString(&*agent_key);
+    }
+    for (std::optional<std::string>& agent_key : agent_keys) {
+        if (agent_key)
+            WipeString(&*agent_key);
+    }
+    if (key)
+        WipeString(&*key);
+    WipeString(&new_key);
+    return rekeyed == files.size() ? 0 : 1;
+}
@@ -0,0 +1,177 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <optional>
+#include <string>
+
+#include "crypto.h"
+#include "crypto_registry.h"
+#include "password_prompt.h"
+#include "secure_memory.h"
+#include "tool_files.h"
+#include "vault.h"
+
+using ::ette::CryptoAlgorithm;
+using ::ette::CryptoAlgorithmFromFilename;
+using ::ette::CryptoState;
+using ::ette::DecryptWithDerivedKey;
+using ::ette::DeriveKey;
+using ::ette::NewVaultAlgorithm;
+using ::ette::ReadFileToString;
+using ::ette::ReadNewPassword;
+using ::ette::StatusCode;
+using ::ette::UnlockKey;
+using ::ette::Vault;
+using ::ette::VaultEntry;
+using ::ette::WipeString;
+
+static void Usage() {
+    fprintf(stderr,
+            "Usage: ette-vault list <vault>\n"
+            "       ette-vault import <vault> <file>...\n"
+            "       ette-vault rm <vault> <entry>...\n"
+            "       ette-vault compact <vault>\n");
+    exit(1);
+}
+
+static void Fail(const std::string& message) {
+    fprintf(stderr, "ette-vault: %s\n", message.c_str());
+    exit(1);
+}
+
+/* The file name without its directory and encryption extension. */
+static std::string EntryName(const std::string& path) {
+    std::string name = path.substr(path.find_last_of('/') + 1);
+    const CryptoAlgorithm algorithm = CryptoAlgorithmFromFilename(name);
+    if (algorithm != CryptoAlgorithm::kDefaultNone) {
+        ette::CryptoAlgorithms::ForEach([&](auto policy) {
+            const size_t pos = name.rfind(decltype(policy)::kExtension);
+            if (decltype(policy)::kAlgorithm == algorithm &&
+                pos != std::string::npos) {
+                name.erase(pos);
+            }
+        });
+    }
+    return name;
+}
+
+/* Open and unlock the vault at 'path'. With 'create', a vault that doesn't
+ * exist yet is created under a new password. */
+static Vault UnlockVault(const std::string& path, bool create,
+                         std::string* key) {
+    ette::Status<Vault> opened = Vault::Open(path);
+    if (!opened.ok()) {
+        if (!create || opened.error().code() != StatusCode::kNotFound)
+            Fail(opened.error().message());
+        std::optional<std::string> password =
+            ReadNewPassword("New vault password: ");
+        if (!password)
+            exit(1);
+        *key = DeriveKey(*password);
+        WipeString(&*password);
+        return Vault::Create(path, NewVaultAlgorithm(path));
+    }
+
+    Vault vault = *opened;
+    std::optional<std::string> unlocked = UnlockKey(
+        vault.IndexRecord(), vault.algorithm(), "Vault password: ");
+    if (!unlocked)
+        exit(1);
+    *key = *unlocked;
+    WipeString(&*unlocked);
+    const ette::Status<void> status = vault.Unlock(*key);
+    if (!status.ok())
+        Fail(status.error().message());
+    return vault;
+}
+
+static void List(Vault& vault) {
+    for (const VaultEntry& entry : vault.Entries()) {
+        const time_t modified = entry.modified;
+        char date[32];
+        strftime(date, sizeof(date), "%Y-%m-%d %H:%M",
+                 localtime(&modified));
+        printf("%10llu  %s  %s\n", (unsigned long long)entry.size, date,
+               entry.name.c_str());
+    }
+    fprintf(stderr, "%zu entries, %llu bytes reclaimable by compact\n",
+            vault.Entries().size(),
+            (unsigned long long)vault.GarbageBytes());
+}
+
+/* Encrypted files are decrypted (with the vault's key if it opens them,
+ * else their own password) and reencrypted under the vault's key; other
+ * files are taken as they are. */
+static void Import(Vault& vault, const std::string& key, int count,
+                   char** paths) {
+    for (int i = 0; i < count; i++) {
+        const std::string path = paths[i];
+        std::optional<std::string> content = ReadFileToString(path);
+        if (!content)
+            Fail("can't read " + path);
+
+        const CryptoAlgorithm algorithm = CryptoAlgorithmFromFilename(path);
+        std::string text;
+        if (algorithm == CryptoAlgorithm::kDefaultNone) {
+            text = std::move(*content);
+        } else {
+            CryptoState state =
+                DecryptWithDerivedKey(*content, key, algorithm);
+            if (!state.status.ok()) {
+                const std::string prompt = "Password for " + path + ": ";
+                std::optional<std::string> file_key =
+                    UnlockKey(*content, algorithm, prompt.c_str());
+                if (!file_key)
+                    Fail("can't decrypt " + path);
+                state = DecryptWithDerivedKey(*content, *file_key, algorithm);
+                WipeString(&*file_key);
+            }
+            text = std::move(state.plaintext);
+        }
+
+        const std::string name = EntryName(path);
+        const ette::Status<void> status = vault.Write(name, text, key);
+        WipeString(&text);
+        if (!status.ok())
+            Fail(path + ": " + status.error().message());
+        printf("%s\n", name.c_str());
+    }
+}
+
+/* Manages vaults (see vault.h) from the command line. Entries are edited
+ * with ette <vault>:<entry>; their text is never printed. */
+int main(int argc, char* argv[]) {
+    if (argc < 3)
+        Usage();
+    const std::string command = argv[1];
+    const std::string path = argv[2];
+
+    std::string key;
+    if (command == "list" && argc == 3) {
+        Vault vault = UnlockVault(path, false, &key);
+        List(vault);
+    } else if (command == "import" && argc > 3) {
+        Vault vault = UnlockVault(path, true, &key);
+        Import(vault, key, argc - 3, argv + 3);
+    } else if (command == "rm" && argc > 3) {
+        Vault vault = UnlockVault(path, false, &key);
+        for (int i = 3; i < argc; i++) {
+            const ette::Status<void> status = vault.Remove(argv[i], key);
+            if (!status.ok())
+                Fail(status.error().message());
+        }
+    } else if (command == "compact" && argc == 3) {
+        Vault vault = UnlockVault(path, false, &key);
+        const uint64_t garbage = vault.GarbageBytes();
+        const ette::Status<void> status = vault.Compact(key);
+        if (!status.ok())
+            Fail(status.error().message());
+        fprintf(stderr, "%llu bytes reclaimed\n",
+                (unsigned long long)garbage);
+    } else {
+        Usage();
+    }
+    WipeString(&key);
+    return 0;
+}
@@ -0,0 +1,258 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/prctl.h>
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "constants.h"
+#include "crypto.h"
+#include "crypto_registry.h"
+#include "key_agent.h"
+#include "password_prompt.h"
+#include "secure_memory.h"
+#include "thread_pool.h"
+#include "tool_files.h"
+
+using ::ette::AgentGetKey;
+using ::ette::CryptoAlgorithm;
+using ::ette::CryptoAlgorithmFromFilename;
+using ::ette::CryptoAlgorithmIsAuthenticated;
+using ::ette::CryptoAlgorithmName;
+using ::ette::DeriveKey;
+using ::ette::FileLayout;
+using ::ette::GetKeyIdFromCiphertext;
+using ::ette::ListFiles;
+using ::ette::ParallelFor;
+using ::ette::ReadFileLayout;
+using ::ette::ReadHeader;
+using ::ette::ReadPassword;
+using ::ette::StatusCode;
+using ::ette::ThreadPool;
+using ::ette::VerifyWithDerivedKey;
+using ::ette::WipeString;
+
+namespace {
+
+/* What checking one file found, a line of the report. */
+struct Report {
+    /* "ok", "damaged", "unverified" (the password doesn't open it, which
+     * may be damage too), "unverifiable" (an AES-256-CBC file without a
+     * digest, whose damage may not show) or "error" (it can't be read). */
+    std::string result;
+    /* How far the check went: "header" (the sizes add up), "padding" (the
+     * key opens it, as far as AES-256-CBC can tell), "digest" (the
+     * AES-256-CBC file matches the digest in its footer) or "tag" (its MAC
+     * matches). */
+    std::string checked;
+    std::string algorithm;
+    uint64_t size = 0;
+    std::string message;
+};
+
+void Usage() {
+    fprintf(stderr,
+            "Usage: ette-verify [-r] [-p] <file>...\n"
+            "  -r  verify the encrypted files in directories\n"
+            "  -p  ask for a password for the files ette-agent has no key "
+            "for\n");
+    exit(2);
+}
+
+void Fail(const std::string& message) {
+    fprintf(stderr, "ette-verify: %s\n", message.c_str());
+    exit(2);
+}
+
+/* Check the header of 'path', then its MAC, digest or padding with the first of
+ * 'agent_key' and 'typed_key' there is. A key from ette-agent is the file's
+ * own (it has its key ID), so if it fails the file is damaged. */
+Report VerifyFile(const std::string& path,
+                  const std::optional<std::string>& agent_key,
+                  const std::optional<std::string>& typed_key) {
+    Report report;
+    std::error_code error;
+    report.size = std::filesystem::file_size(path, error);
+    std::ifstream in(path, std::ios::binary);
+    if (error || !in.is_open()) {
+        report.result = "error";
+        report.message = error ? error.message() : "can't open it";
+        return report;
+    }
+
+    report.checked = "header";
+    const ette::Status<FileLayout> layout = ReadFileLayout(in, report.size);
+    if (!layout.ok()) {
+        const bool io = layout.error().code() == StatusCode::kIoError;
+        report.result = io ? "error" : "damaged";
+        report.message = layout.error().message();
+        return report;
+    }
+    const CryptoAlgorithm algorithm = layout.value().algorithm;
+    report.algorithm = CryptoAlgorithmName(algorithm);
+    report.result = "ok";
+
+    for (const std::optional<std::string>* key : {&agent_key, &typed_key}) {
+        if (!*key)
+            continue;
+        in.clear();
+        in.seekg(0);
+        const ette::Status<bool> status =
+            VerifyWithDerivedKey(in, report.size, **key);
+        if (status.ok() && !status.value()) {
+            report.result = "unverifiable";
+            report.checked = "padding";
+            report.message = "it has no digest; save it with ette to add one";
+            return report;
+        }
+        if (status.ok()) {
+            report.result = "ok";
+            report.checked =
+                CryptoAlgorithmIsAuthenticated(algorithm) ? "tag" : "digest";
+            report.message = "";
+            return report;
+        }
+        if (status.error().code() != StatusCode::kInvalidKey) {
+            report.result = "error";
+            report.message = status.error().message();
+            return report;
+        }
+        if (key == &agent_key) {
+            report.result = "damaged";
+            report.message = "it doesn't match its key";
+            return report;
+        }
+        report.result = "unverified";
+        report.message = "the password doesn't open it";
+    }
+    return report;
+}
+
+/* 's' as a JSON string. */
+std::string JsonString(const std::string& s) {
+    std::string json = "\"";
+    for (unsigned char c : s) {
+        if (c == '"' || c == '\\') {
+            json += '\\';
+            json += c;
+        } else if (c < 0x20) {
+            char escaped[8];
+            snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+            json += escaped;
+        } else {
+            json += c;
+        }
+    }
+    return json + "\"";
+}
+
+std::string JsonLine(const std::string& path, const Report& report) {
+    std::string line = "{\"file\":" + JsonString(path) +
+                       ",\"result\":" + JsonString(report.result);
+    if (!report.checked.empty())
+        line += ",\"checked\":" + JsonString(report.checked);
+    if (!report.algorithm.empty())
+        line += ",\"algorithm\":" + JsonString(report.algorithm);
+    line += ",\"size\":" + std::to_string(report.size);
+    if (!report.message.empty())
+        line += ",\"message\":" + JsonString(report.message);
+    return line + "}\n";
+}
+
+}  // namespace
+
+/* Checks encrypted files for damage (bit rot, truncated or interrupted
+ * writes) and prints a JSON line per file. Without keys only the header is
+ * checked against the file's size; with a key from ette-agent, or the
+ * password with -p, the whole file is read and its MAC (or, for
+ * AES-256-CBC, the digest ette keeps in its footer) checked a piece at a
+ * time. Files are checked on every core. Exits with 1 if a file is damaged or
+ * can't be read. */
+int main(int argc, char* argv[]) {
+#ifdef __linux__
+    /* No core dumps and no ptrace by other processes of the same user. */
+    prctl(PR_SET_DUMPABLE, 0, 0, 0, 0);
+#endif
+    bool recursive = false, ask_password = false;
+    int arg = 1;
+    for (; arg < argc && argv[arg][0] == '-'; arg++) {
+        const std::string flag = argv[arg];
+        if (flag == "-r")
+            recursive = true;
+        else if (flag == "-p")
+            ask_password = true;
+        else
+            Usage();
+    }
+    if (arg == argc)
+        Usage();
+    const ette::Status<std::vector<std::string>> listed = ListFiles(
+        std::vector<std::string>(argv + arg, argv + argc), recursive);
+    if (!listed.ok())
+        Fail(listed.error().message());
+    const std::vector<std::string>& files = listed.value();
+
+    std::vector<std::optional<std::string>> agent_keys(files.size());
+    std::map<std::string, std::optional<std::string>> agent_cache;
+    bool all_have_keys = true;
+    for (size_t i = 0; i < files.size(); i++) {
+        const std::string key_id = GetKeyIdFromCiphertext(ReadHeader(files[i]));
+        if (!key_id.empty()) {
+            auto cached = agent_cache.find(key_id);
+            if (cached == agent_cache.end())
+                cached = agent_cache.emplace(key_id, AgentGetKey(key_id)).first;
+            agent_keys[i] = cached->second;
+        }
+        all_have_keys = all_have_keys && agent_keys[i];
+    }
+    std::optional<std::string> typed_key;
+    if (ask_password && !all_have_keys) {
+        std::optional<std::string> password = ReadPassword("Password: ");
+        if (password && !password->empty())
+            typed_key = DeriveKey(*password);
+        if (password)
+            WipeString(&*password);
+    }
+
+    /* In batches, so the report comes out in order as it goes. */
+    size_t counts[5] = {};
+    const char* kResults[] = {"ok", "damaged", "unverified", "unverifiable",
+                              "error"};
+    const size_t batch = 4 * ThreadPool::Global().WorkerCount() + 4;
+    for (size_t first = 0; first < files.size(); first += batch) {
+        const size_t count = std::min(batch, files.size() - first);
+        std::vector<Report> reports(count);
+        ParallelFor(count, 1, [&](size_t begin, size_t end) {
+            for (size_t j = begin; j < end; j++)
+                reports[j] = VerifyFile(files[first + j],
+                                        agent_keys[first + j], typed_key);
+        });
+        for (size_t j = 0; j < count; j++) {
+            fputs(JsonLine(files[first + j], reports[j]).c_str(), stdout);
+            for (int r = 0; r < 5; r++)
+                counts[r] += reports[j].result == kResults[r];
+        }
+        fflush(stdout);
+    }
+    fprintf(stderr,
+            "%zu files: %zu ok, %zu damaged, %zu unverified, %zu "
+            "unverifiable, %zu errors.\n",
+            files.size(), counts[0], counts[1], counts[2], counts[3],
+            counts[4]);
+
+    for (auto& [key_id, agent_key] : agent_cache) {
+        if (agent_key)
+            WipeString(&*agent_key);
+    }
+    for (std::optional<std::string>& agent_key : agent_keys) {
+        if (agent_key)
+            WipeString(&*agent_key);
+    }
+    if (typed_key)
+        WipeString(&*typed_key);
+    return counts[1] + counts[4] > 0 ? 1 : 0;
+}
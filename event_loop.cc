@@ -0,0 +1,267 @@
+#include "event_loop.h"
+
+#include <pthread.h>
+#include <signal.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+
+#include "spsc_queue.h"
+
+using ::ette::SpscQueue;
+
+namespace {
+
+/* Keys typed but not yet applied. Far more than a paste burst between two
+ * frames; when it is full anyway the input thread waits rather than drop. */
+constexpr size_t kKeyQueueCapacity = 4096;
+
+/* The editor thread wakes up at least this often so time based status
+ * messages expire even when nothing is typed. */
+constexpr auto kIdleRefreshInterval = std::chrono::seconds(1);
+
+/* Keystream for the next save is computed in pieces this big while idle
+ * (see PrepareNextSave()), checking for keys between pieces. */
+constexpr size_t kKeystreamStep = 256 * 1024;
+
+/* Rows highlighted at a time while idle (see HighlightNextRows()), a few
+ * milliseconds' worth. */
+constexpr int kHighlightStep = 256;
+
+/* A frame pointer with its low bit set in the mailbox hasn't been written to
+ * the terminal yet. */
+constexpr uintptr_t kFreshFrame = 1;
+
+SpscQueue<int, kKeyQueueCapacity> keys;
+std::mutex keys_mutex;
+std::condition_variable keys_ready;
+
+/* Triple buffering between the editor and the render thread: the editor
+ * draws into 'drawing' and swaps it with the mailbox, the render thread
+ * swaps its spare frame with the mailbox. Neither waits for the other. */
+std::atomic<uintptr_t> mailbox;
+Frame* drawing;
+std::atomic<bool> repaint_all(true);
+std::mutex render_mutex;
+std::condition_variable render_ready;
+
+/* Set by the follow thread when the followed file may have changed. */
+std::atomic<bool> file_changed(false);
+
+/* The editor, and when a key was last typed (or a prompt last got one), for
+ * the idle lock. Only the editor thread uses them. */
+State* editor_state;
+std::chrono::steady_clock::time_point last_key_time;
+
+/* Held by the render thread while it writes, so stopping it never cuts a
+ * frame in half. */
+std::mutex write_mutex;
+bool render_stopped = false;
+
+void BlockSignals() {
+    sigset_t set;
+    sigfillset(&set);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+}
+
+// SIDE EFFECTS
+/* Resizes come in as WINDOW_RESIZE keys, ReadKey() wakes up on them. */
+void InputLoop() {
+    while (true) {
+        int c = ReadKey(STDIN_FILENO);
+        if (c == KEY_NULL)
+            continue;
+        while (!keys.TryPush(c))
+            std::this_thread::yield();
+        std::lock_guard<std::mutex> lock(keys_mutex);
+        keys_ready.notify_one();
+    }
+}
+
+// SIDE EFFECTS
+/* Wakes the editor thread up when the followed file changes, see
+ * FollowFile(). Blocks on inotify in between. */
+void FollowLoop(ette::FileFollower* follower) {
+    BlockSignals();
+    while (follower->Wait()) {
+        file_changed = true;
+        std::lock_guard<std::mutex> lock(keys_mutex);
+        keys_ready.notify_one();
+    }
+}
+
+// SIDE EFFECTS
+void RenderLoop() {
+    BlockSignals();
+    Frame* spare = new Frame();
+    Frame* shown = new Frame();
+    bool has_shown = false;
+    Buffer out = {NULL, 0, 0};
+
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(render_mutex);
+            render_ready.wait(
+                lock, [] { return mailbox.load() & kFreshFrame; });
+        }
+        uintptr_t taken = mailbox.exchange(reinterpret_cast<uintptr_t>(spare));
+        Frame* next = reinterpret_cast<Frame*>(taken & ~kFreshFrame);
+        if (!(taken & kFreshFrame)) {
+            spare = next;
+            continue;
+        }
+
+        if (repaint_all.exchange(false))
+            has_shown = false;
+        out.len = 0;
+        RenderFrame(has_shown ? shown : NULL, next, &out);
+        if (out.len) {
+            std::lock_guard<std::mutex> lock(write_mutex);
+            if (render_stopped)
+                return;
+            WriteAll(STDOUT_FILENO, out.b, out.len);
+        }
+        spare = shown;
+        shown = next;
+        has_shown = true;
+    }
+}
+
+// SIDE EFFECTS
+/* Screen presenter: draw on the editor thread, write on the render thread. */
+void PublishFrame(State* state) {
+    if (ConsumeScreenInvalidation())
+        repaint_all = true;
+    DrawFrame(state, drawing);
+    uintptr_t old = mailbox.exchange(reinterpret_cast<uintptr_t>(drawing) |
+                                     kFreshFrame);
+    /* Either the render thread's spare or a frame it never got to. */
+    drawing = reinterpret_cast<Frame*>(old & ~kFreshFrame);
+    std::lock_guard<std::mutex> lock(render_mutex);
+    render_ready.notify_one();
+}
+
+// SIDE EFFECTS
+void StopRender() {
+    std::lock_guard<std::mutex> lock(write_mutex);
+    render_stopped = true;
+}
+
+// PURE
+/* Whether an encrypted buffer nobody typed in for long enough should lock. */
+bool IdleLockDue(std::chrono::steady_clock::time_point now) {
+    return editor_state->idle_lock_seconds > 0 &&
+           !editor_state->derived_key.empty() &&
+           now - last_key_time >=
+               std::chrono::seconds(editor_state->idle_lock_seconds);
+}
+
+// SIDE EFFECTS
+/* Key reader for modal prompts (e.g. Find) running on the editor thread.
+ * Gives IDLE_LOCK when the buffer should lock while one waits, so a prompt
+ * (or the diff view) left open doesn't keep the text on the screen. */
+int WaitForKey(int fd __attribute__((unused))) {
+    int c;
+    while (!keys.TryPop(&c)) {
+        if (IdleLockDue(std::chrono::steady_clock::now()))
+            return IDLE_LOCK;
+        std::unique_lock<std::mutex> lock(keys_mutex);
+        keys_ready.wait_for(lock, kIdleRefreshInterval,
+                            [] { return !keys.Empty(); });
+    }
+    last_key_time = std::chrono::steady_clock::now();
+    return c;
+}
+
+// SIDE EFFECTS
+/* Key poller for work on the editor thread that checks for a key to stop
+ * it (e.g. a filter command). */
+int TakeKey(int fd __attribute__((unused))) {
+    int c;
+    if (!keys.TryPop(&c))
+        return KEY_NULL;
+    last_key_time = std::chrono::steady_clock::now();
+    return c;
+}
+
+}  // namespace
+
+void RunEventLoop(State* state) {
+    editor_state = state;
+    drawing = new Frame();
+    mailbox = reinterpret_cast<uintptr_t>(new Frame());
+    SetScreenPresenter(PublishFrame, StopRender);
+    SetKeyReader(WaitForKey);
+    SetKeyPoller(TakeKey);
+
+    /* Threads are never joined: the editor leaves with exit(). */
+    std::thread(InputLoop).detach();
+    std::thread(RenderLoop).detach();
+    if (state->following)
+        std::thread(FollowLoop, &*state->follower).detach();
+
+    last_key_time = std::chrono::steady_clock::now();
+    while (true) {
+        RefreshScreen();
+
+        {
+            std::unique_lock<std::mutex> lock(keys_mutex);
+            keys_ready.wait_for(lock, kIdleRefreshInterval, [] {
+                return !keys.Empty() || file_changed.load();
+            });
+        }
+        /* Apply everything typed so far before drawing again, so a burst
+         * of keys costs one frame. Any number of resizes in the burst is
+         * applied once, with the latest size. */
+        int c;
+        bool resized = false;
+        bool typed = false;
+        while (keys.TryPop(&c)) {
+            if (c == WINDOW_RESIZE) {
+                resized = true;
+            } else {
+                /* Before the key, as it may open a prompt that waits. */
+                last_key_time = std::chrono::steady_clock::now();
+                ProcessKeyPress(STDIN_FILENO, state, c);
+                typed = true;
+            }
+        }
+        if (resized)
+            ProcessKeyPress(STDIN_FILENO, state, WINDOW_RESIZE);
+
+        /* Show what was appended to a followed file, a piece at a time when
+         * it is a lot. */
+        if (file_changed.exchange(false) && FollowFile(state))
+            file_changed = true;
+
+        /* A save's history is recorded in the background; tell if it
+         * failed. */
+        CheckHistoryRecorded(state);
+
+        /* Lock an encrypted buffer nobody is typing in. Unlocking takes the
+         * password from the same key queue. */
+        const auto now = std::chrono::steady_clock::now();
+        if (typed) {
+            last_key_time = now;
+        } else if (IdleLockDue(now)) {
+            HandleLockedEditor(state, {});
+            last_key_time = std::chrono::steady_clock::now();
+        }
+
+        /* Nothing typed for a whole refresh interval: tell if another
+         * program changed the file, get the next save ready and highlight
+         * the rest of the file until a key comes in. */
+        if (!typed && now - last_key_time >= kIdleRefreshInterval) {
+            CheckFileOnDisk(state);
+            while (keys.Empty() && !file_changed &&
+                   PrepareNextSave(state, kKeystreamStep)) {
+            }
+            while (keys.Empty() && !file_changed &&
+                   HighlightNextRows(state, kHighlightStep)) {
+            }
+        }
+    }
+}
@@ -0,0 +1,26 @@
+#ifndef __EVENT_LOOP_H__
+#define __EVENT_LOOP_H__
+
+#include "editor.h"
+
+/* Run the editor until it quits, with terminal I/O split across threads:
+ *
+ * - the input thread decodes keys from the terminal into a lock-free queue,
+ *   so typing is never held up by edits or by writes to a slow terminal.
+ *   Resizes are queued as WINDOW_RESIZE keys;
+ * - the editor thread (the calling one) applies every queued key, then
+ *   draws one frame from the editor state and publishes it. However many
+ *   resizes were queued, the new size is applied once per frame;
+ * - the render thread diffs the newest published frame against what is on
+ *   the screen and writes only the lines that changed. Frames published
+ *   while a write is in progress are coalesced into the latest one.
+ *
+ * In follow mode a thread of its own waits for the file to change and
+ * wakes the editor thread up, which reads what was appended between keys.
+ *
+ * An encrypted buffer left idle for state->idle_lock_seconds is locked, see
+ * HandleLockedEditor(). Only the editor thread touches 'state'. Never
+ * returns. */
+[[noreturn]] void RunEventLoop(State* state);
+
+#endif  // __EVENT_LOOP_H__
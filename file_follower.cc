@@ -0,0 +1,146 @@
+#include "file_follower.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <filesystem>
+
+#include "file_util.h"
+
+namespace ette {
+
+namespace {
+template <typename T, typename U>
+Status<T> ErrorOf(const Status<U>& status) {
+    return Status<T>(status.error().code(), status.error().message());
+}
+}  // namespace
+
+FileFollower::~FileFollower() {
+    if (fd_ != -1)
+        close(fd_);
+    if (inotify_fd_ != -1)
+        close(inotify_fd_);
+}
+
+Status<void> FileFollower::Start(const std::string& path) {
+    path_ = path;
+    const std::filesystem::path file(path);
+    name_ = file.filename().string();
+    const std::string directory =
+        file.has_parent_path() ? file.parent_path().string() : ".";
+
+    inotify_fd_ = inotify_init1(IN_CLOEXEC);
+    if (inotify_fd_ == -1)
+        return IoError<void>("inotify");
+    directory_watch_ = inotify_add_watch(inotify_fd_, directory.c_str(),
+                                         IN_CREATE | IN_MOVED_TO);
+    if (directory_watch_ == -1)
+        return IoError<void>(directory);
+    const Status<bool> opened = Reopen();
+    if (!opened.ok())
+        return ErrorOf<void>(opened);
+    return Status<void>(StatusCode::kOk, "");
+}
+
+Status<bool> FileFollower::Reopen() {
+    const int fd = open(path_.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return errno == ENOENT ? Status<bool>(false) : IoError<bool>(path_);
+    if (fd_ != -1)
+        close(fd_);
+    fd_ = fd;
+    offset_ = 0;
+    /* The old file may still be written to after it was rotated away. */
+    if (file_watch_ != -1)
+        inotify_rm_watch(inotify_fd_, file_watch_);
+    file_watch_ = inotify_add_watch(inotify_fd_, path_.c_str(),
+                                    IN_MODIFY | IN_MOVE_SELF | IN_DELETE_SELF);
+    return true;
+}
+
+bool FileFollower::Wait() {
+    alignas(struct inotify_event) char events[4096];
+    while (true) {
+        const ssize_t n = read(inotify_fd_, events, sizeof(events));
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        /* The directory's other files don't matter. */
+        bool changed = false;
+        for (ssize_t i = 0; i < n;) {
+            const struct inotify_event* event =
+                reinterpret_cast<const struct inotify_event*>(events + i);
+            if (event->wd != directory_watch_ ||
+                (event->len > 0 && name_ == event->name))
+                changed = true;
+            i += sizeof(struct inotify_event) + event->len;
+        }
+        if (changed)
+            return true;
+    }
+}
+
+Status<FileChange> FileFollower::Read(std::string* data) {
+    more_ = false;
+    FileChange change = FileChange::kAppended;
+    struct stat at_path, followed;
+    if (stat(path_.c_str(), &at_path) == 0 &&
+        (fd_ == -1 || fstat(fd_, &followed) == -1 ||
+         followed.st_ino != at_path.st_ino ||
+         followed.st_dev != at_path.st_dev)) {
+        const bool replaced = fd_ != -1;
+        const Status<bool> reopened = Reopen();
+        if (!reopened.ok())
+            return ErrorOf<FileChange>(reopened);
+        if (*reopened && replaced)
+            change = FileChange::kReplaced;
+    }
+    if (fd_ == -1)
+        return FileChange::kNone;
+    if (fstat(fd_, &followed) == -1)
+        return IoError<FileChange>(path_);
+    if (followed.st_size < offset_) {
+        offset_ = 0;
+        change = FileChange::kTruncated;
+    }
+
+    /* What is appended while reading waits for the next inotify event. */
+    const size_t available = followed.st_size - offset_;
+    const size_t wanted = std::min(available, kFollowReadLimit);
+    const size_t size = data->size();
+    data->resize(size + wanted);
+    size_t done = 0;
+    while (done < wanted) {
+        const ssize_t n =
+            pread(fd_, &(*data)[size + done], wanted - done, offset_);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n == -1) {
+            data->resize(size + done);
+            return IoError<FileChange>(path_);
+        }
+        if (n == 0)
+            break;
+        offset_ += n;
+        done += n;
+    }
+    data->resize(size + done);
+    more_ = available > kFollowReadLimit;
+    if (done == 0 && change == FileChange::kAppended)
+        return FileChange::kNone;
+    return change;
+}
+
+void FileFollower::SkipToEnd() {
+    struct stat followed;
+    if (fd_ != -1 && fstat(fd_, &followed) == 0)
+        offset_ = followed.st_size;
+}
+
+}  // namespace ette
@@ -0,0 +1,77 @@
+#ifndef __FILE_FOLLOWER_H__
+#define __FILE_FOLLOWER_H__
+
+#include <sys/types.h>
+#include <cstddef>
+#include <string>
+
+#include "status.h"
+
+namespace ette {
+
+/* Bytes a FileFollower reads at a time at most, so a burst of writes is
+ * shown a piece at a time rather than holding up the editor. */
+static constexpr size_t kFollowReadLimit = 16 * 1024 * 1024;
+
+/* What happened to a followed file since it was last read. */
+enum class FileChange {
+    kNone,
+    kAppended,  /* Bytes were added at its end. */
+    kTruncated, /* It got shorter, and is read again from its start. */
+    kReplaced,  /* Another file took its path, as when a log is rotated,
+                   and that one is read from its start. */
+};
+
+/* Follows a file as it grows, as "tail -F" does, for the editor's follow
+ * mode. inotify tells when it may have changed, so nothing runs while it
+ * doesn't, and only the bytes appended since the last read are read. The
+ * file is watched through its directory too: when another file is created
+ * or moved at its path, that one is followed from then on.
+ *
+ * Wait() blocks, so it usually runs on a thread of its own; it is safe to
+ * call while the rest runs on another one. */
+class FileFollower {
+   public:
+    FileFollower() = default;
+    ~FileFollower();
+
+    FileFollower(const FileFollower&) = delete;
+    FileFollower& operator=(const FileFollower&) = delete;
+
+    /* Start following 'path' from its start. It needn't exist yet. */
+    Status<void> Start(const std::string& path);
+
+    /* Wait until the file may have changed. Returns false if it can't be
+     * watched any more. */
+    bool Wait();
+
+    /* Append to 'data' what was written to the file since the last read,
+     * up to kFollowReadLimit bytes, or all of it from its start when it was
+     * truncated or replaced. */
+    Status<FileChange> Read(std::string* data);
+
+    /* Whether the last Read() stopped at kFollowReadLimit with more left. */
+    bool more() const { return more_; }
+
+    /* Carry on from the end of the file as it is now, after the editor
+     * wrote it itself. */
+    void SkipToEnd();
+
+   private:
+    /* Open the file at 'path_' in place of the one followed so far, and
+     * watch it. Returns false if there is none. */
+    Status<bool> Reopen();
+
+    std::string path_;
+    std::string name_; /* The last component of 'path_'. */
+    int inotify_fd_ = -1;
+    int directory_watch_ = -1;
+    int file_watch_ = -1;
+    int fd_ = -1;
+    off_t offset_ = 0;
+    bool more_ = false;
+};
+
+}  // namespace ette
+
+#endif  // __FILE_FOLLOWER_H__
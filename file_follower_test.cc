@@ -0,0 +1,107 @@
+#include <stdio.h>
+#include <fstream>
+#include <string>
+#include <thread>
+
+#include "file_follower.h"
+
+#include "gtest/gtest.h"
+
+using ::ette::FileChange;
+using ::ette::FileFollower;
+
+namespace {
+void WriteFile(const std::string& path, const std::string& content,
+               std::ios::openmode mode = std::ios::trunc) {
+    std::ofstream file(path, std::ios::binary | mode);
+    file << content;
+}
+}  // namespace
+
+TEST(FileFollower, ReadsAppends) {
+    const std::string path = "/tmp/FileFollower_ReadsAppends.log";
+    WriteFile(path, "one\ntw");
+    FileFollower follower;
+    ASSERT_TRUE(follower.Start(path).ok());
+
+    std::string data;
+    ASSERT_EQ(*follower.Read(&data), FileChange::kAppended);
+    EXPECT_EQ(data, "one\ntw");
+    EXPECT_EQ(*follower.Read(&data), FileChange::kNone);
+
+    // Only the new bytes are read, after an inotify event.
+    std::thread writer([&] { WriteFile(path, "o\nthree\n", std::ios::app); });
+    EXPECT_TRUE(follower.Wait());
+    writer.join();
+    data.clear();
+    ASSERT_EQ(*follower.Read(&data), FileChange::kAppended);
+    EXPECT_EQ(data, "o\nthree\n");
+    EXPECT_FALSE(follower.more());
+
+    // A file can be followed before it exists.
+    remove(path.c_str());
+    FileFollower early;
+    ASSERT_TRUE(early.Start(path).ok());
+    EXPECT_EQ(*early.Read(&data), FileChange::kNone);
+    WriteFile(path, "new\n");
+    EXPECT_TRUE(early.Wait());
+    data.clear();
+    ASSERT_EQ(*early.Read(&data), FileChange::kAppended);
+    EXPECT_EQ(data, "new\n");
+    remove(path.c_str());
+}
+
+TEST(FileFollower, TruncationAndRotation) {
+    const std::string path = "/tmp/FileFollower_Rotation.log";
+    const std::string rotated = path + ".1";
+    WriteFile(path, "old line\nanother old line\n");
+    FileFollower follower;
+    ASSERT_TRUE(follower.Start(path).ok());
+    std::string data;
+    ASSERT_EQ(*follower.Read(&data), FileChange::kAppended);
+
+    WriteFile(path, "short\n");
+    EXPECT_TRUE(follower.Wait());
+    data.clear();
+    ASSERT_EQ(*follower.Read(&data), FileChange::kTruncated);
+    EXPECT_EQ(data, "short\n");
+
+    // Writes to the rotated file are no longer followed, the new file is.
+    ASSERT_EQ(rename(path.c_str(), rotated.c_str()), 0);
+    WriteFile(path, "fresh\n");
+    EXPECT_TRUE(follower.Wait());
+    data.clear();
+    ASSERT_EQ(*follower.Read(&data), FileChange::kReplaced);
+    EXPECT_EQ(data, "fresh\n");
+    WriteFile(rotated, "late\n", std::ios::app);
+    EXPECT_EQ(*follower.Read(&data), FileChange::kNone);
+
+    // After the editor writes the file itself, only later writes are read.
+    WriteFile(path, "saved\n");
+    follower.SkipToEnd();
+    WriteFile(path, "next\n", std::ios::app);
+    data.clear();
+    ASSERT_EQ(*follower.Read(&data), FileChange::kAppended);
+    EXPECT_EQ(data, "next\n");
+    remove(path.c_str());
+    remove(rotated.c_str());
+}
+
+TEST(FileFollower, ReadsLargeAppendsInPieces) {
+    const std::string path = "/tmp/FileFollower_Large.log";
+    WriteFile(path, "");
+    FileFollower follower;
+    ASSERT_TRUE(follower.Start(path).ok());
+    std::string data;
+    EXPECT_EQ(*follower.Read(&data), FileChange::kNone);
+
+    const std::string text(ette::kFollowReadLimit + 100, 'x');
+    WriteFile(path, text, std::ios::app);
+    ASSERT_EQ(*follower.Read(&data), FileChange::kAppended);
+    EXPECT_EQ(data.size(), ette::kFollowReadLimit);
+    EXPECT_TRUE(follower.more());
+    ASSERT_EQ(*follower.Read(&data), FileChange::kAppended);
+    EXPECT_TRUE(data == text);
+    EXPECT_FALSE(follower.more());
+    remove(path.c_str());
+}
@@ -0,0 +1,33 @@
+#include "file_util.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace ette {
+
+Status<void> Ok() {
+    return Status<void>(StatusCode::kOk, "");
+}
+
+bool SyncDirectory(const std::string& path) {
+    const int fd = open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1)
+        return false;
+    const bool synced = fsync(fd) == 0;
+    close(fd);
+    return synced;
+}
+
+void AppendLe(std::string* out, uint64_t value, int bytes) {
+    for (int i = 0; i < bytes; i++)
+        *out += static_cast<char>((value >> (8 * i)) & 0xFF);
+}
+
+uint64_t LoadLe(const char* p, int bytes) {
+    uint64_t value = 0;
+    for (int i = bytes - 1; i >= 0; i--)
+        value = value << 8 | static_cast<unsigned char>(p[i]);
+    return value;
+}
+
+}  // namespace ette
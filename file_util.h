@@ -0,0 +1,37 @@
+#ifndef __FILE_UTIL_H__
+#define __FILE_UTIL_H__
+
+#include <errno.h>
+#include <string.h>
+#include <cstdint>
+#include <string>
+
+#include "status.h"
+
+namespace ette {
+
+/* Small helpers shared by the modules that keep their own files (vaults,
+ * histories, line indexes, re-keying). */
+
+/* A successful Status<void>. */
+Status<void> Ok();
+
+/* A kIoError status for 'what' failing with the current errno. */
+template <typename T = void>
+Status<T> IoError(const std::string& what) {
+    return Status<T>(StatusCode::kIoError, what + ": " + strerror(errno));
+}
+
+/* Sync the directory at 'path', so that a file renamed or created in it
+ * survives a crash. */
+bool SyncDirectory(const std::string& path);
+
+/* Append the low 'bytes' bytes of 'value' to 'out', little endian. */
+void AppendLe(std::string* out, uint64_t value, int bytes);
+
+/* The little endian number in the 'bytes' bytes at 'p'. */
+uint64_t LoadLe(const char* p, int bytes);
+
+}  // namespace ette
+
+#endif  // __FILE_UTIL_H__
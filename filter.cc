@@ -0,0 +1,158 @@
+#include "filter.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vector>
+
+#include "file_util.h"
+#include "secure_memory.h"
+
+extern char** environ;
+
+namespace ette {
+
+namespace {
+void CloseFd(int* fd) {
+    if (*fd != -1)
+        close(*fd);
+    *fd = -1;
+}
+
+/* Append what can be read from 'fd' to 'out' without blocking, up to a
+ * buffer at a time so a command writing without end is still stopped.
+ * Closes 'fd' at the end of the output, or on an error. */
+void ReadAvailable(int* fd, std::string* out) {
+    for (int i = 0; i < 16; i++) {
+        const size_t size = out->size();
+        out->resize(size + kFilterBufferSize);
+        const ssize_t n = read(*fd, &(*out)[size], kFilterBufferSize);
+        out->resize(size + (n > 0 ? n : 0));
+        if (n > 0)
+            continue;
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n == 0 || errno != EAGAIN)
+            CloseFd(fd);
+        return;
+    }
+}
+}  // namespace
+
+Status<int> RunFilter(const std::string& command, const FilterInput& read_input,
+                      std::string* output, std::string* error_output,
+                      const FilterCancelled& cancelled, size_t output_limit) {
+    int in[2], out[2] = {-1, -1}, err[2] = {-1, -1};
+    if (pipe2(in, O_CLOEXEC) == -1)
+        return IoError<int>("pipe");
+    if (pipe2(out, O_CLOEXEC) == -1 || pipe2(err, O_CLOEXEC) == -1) {
+        const Status<int> error = IoError<int>("pipe");
+        for (int* fd : {&in[0], &in[1], &out[0], &out[1], &err[0], &err[1]})
+            CloseFd(fd);
+        return error;
+    }
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, in[0], STDIN_FILENO);
+    posix_spawn_file_actions_adddup2(&actions, out[1], STDOUT_FILENO);
+    posix_spawn_file_actions_adddup2(&actions, err[1], STDERR_FILENO);
+    /* Its own process group, so the shell's children are stopped too. */
+    posix_spawnattr_t attributes;
+    posix_spawnattr_init(&attributes);
+    posix_spawnattr_setflags(&attributes, POSIX_SPAWN_SETPGROUP);
+    posix_spawnattr_setpgroup(&attributes, 0);
+    const char* argv[] = {"sh", "-c", command.c_str(), nullptr};
+    pid_t pid;
+    const int spawned =
+        posix_spawn(&pid, "/bin/sh", &actions, &attributes,
+                    const_cast<char* const*>(argv), environ);
+    posix_spawnattr_destroy(&attributes);
+    posix_spawn_file_actions_destroy(&actions);
+    CloseFd(&in[0]);
+    CloseFd(&out[1]);
+    CloseFd(&err[1]);
+    if (spawned != 0) {
+        errno = spawned;
+        const Status<int> error = IoError<int>("/bin/sh");
+        for (int* fd : {&in[1], &out[0], &err[0]})
+            CloseFd(fd);
+        return error;
+    }
+    for (int fd : {in[1], out[0], err[0]})
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+    /* A command that stops reading makes writes fail with EPIPE rather
+     * than kill the editor. */
+    struct sigaction ignore, saved;
+    memset(&ignore, 0, sizeof(ignore));
+    ignore.sa_handler = SIG_IGN;
+    sigaction(SIGPIPE, &ignore, &saved);
+
+    std::vector<char> pending(kFilterBufferSize);
+    size_t pending_begin = 0, pending_end = 0;
+    Status<int> stopped(0);
+    while (in[1] != -1 || out[0] != -1 || err[0] != -1) {
+        if (cancelled && cancelled()) {
+            stopped = Status<int>(StatusCode::kCancelled, "Stopped");
+            break;
+        }
+        if (output->size() + error_output->size() > output_limit) {
+            stopped = Status<int>(StatusCode::kInvalidDataSize,
+                                  "Output too large");
+            break;
+        }
+        if (in[1] != -1 && pending_begin == pending_end) {
+            pending_begin = 0;
+            pending_end = read_input(pending.data(), pending.size());
+            if (pending_end == 0) {
+                CloseFd(&in[1]);
+                continue;
+            }
+        }
+        struct pollfd fds[3] = {{in[1], POLLOUT, 0},
+                                {out[0], POLLIN, 0},
+                                {err[0], POLLIN, 0}};
+        if (poll(fds, 3, kFilterPollMilliseconds) == -1) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        if (fds[0].revents) {
+            const ssize_t n = write(in[1], pending.data() + pending_begin,
+                                    pending_end - pending_begin);
+            if (n > 0)
+                pending_begin += n;
+            else if (n == -1 && errno != EAGAIN && errno != EINTR)
+                CloseFd(&in[1]);
+        }
+        if (fds[1].revents)
+            ReadAvailable(&out[0], output);
+        if (fds[2].revents)
+            ReadAvailable(&err[0], error_output);
+    }
+    for (int* fd : {&in[1], &out[0], &err[0]})
+        CloseFd(fd);
+    sigaction(SIGPIPE, &saved, nullptr);
+    WipeMemory(pending.data(), pending.size());
+    if (!stopped.ok())
+        kill(-pid, SIGKILL);
+
+    int wstatus;
+    while (waitpid(pid, &wstatus, 0) == -1) {
+        if (errno != EINTR)
+            return IoError<int>("waitpid");
+    }
+    if (!stopped.ok())
+        return stopped;
+    if (WIFSIGNALED(wstatus))
+        return 128 + WTERMSIG(wstatus);
+    return WEXITSTATUS(wstatus);
+}
+
+}  // namespace ette
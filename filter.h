@@ -0,0 +1,50 @@
+#ifndef __FILTER_H__
+#define __FILTER_H__
+
+#include <cstddef>
+#include <functional>
+#include <string>
+
+#include "status.h"
+
+namespace ette {
+
+/* Bytes written to the command's standard input at a time. */
+static constexpr size_t kFilterBufferSize = 64 * 1024;
+
+/* Output (standard output and error together) a command may give at most,
+ * so one that never stops writing can't fill the memory. */
+static constexpr size_t kFilterOutputLimit = 256 * 1024 * 1024;
+
+/* How long a command is waited for at a time before asking whether to stop
+ * it. */
+static constexpr int kFilterPollMilliseconds = 100;
+
+/* Fills up to 'size' bytes at 'buffer' with the next piece of the command's
+ * input and returns how many it did, 0 at the end. */
+using FilterInput = std::function<size_t(char* buffer, size_t size)>;
+
+/* Whether to stop the command, asked at least every
+ * kFilterPollMilliseconds while it runs. */
+using FilterCancelled = std::function<bool()>;
+
+/* Runs 'command' with /bin/sh, as the editor's "!" command does: what
+ * 'read_input' gives is written to its standard input while its standard
+ * output is read into 'output' and its standard error into 'error_output',
+ * all at once over non-blocking pipes, so neither side waits for the other
+ * however much goes through. Only one input buffer is held at a time. A
+ * command that exits (or closes its input) before reading everything just
+ * gets no more. Returns the command's exit status, 128 + the signal number
+ * if a signal ended it.
+ *
+ * The command runs in a process group of its own, which is killed when
+ * 'cancelled' says so (kCancelled) or when it outputs more than
+ * 'output_limit' bytes (kInvalidDataSize). */
+Status<int> RunFilter(const std::string& command, const FilterInput& read_input,
+                      std::string* output, std::string* error_output,
+                      const FilterCancelled& cancelled = nullptr,
+                      size_t output_limit = kFilterOutputLimit);
+
+}  // namespace ette
+
+#endif  // __FILTER_H__
@@ -0,0 +1,83 @@
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <string>
+
+#include "filter.h"
+
+#include "gtest/gtest.h"
+
+using ::ette::FilterInput;
+using ::ette::RunFilter;
+
+/* Input that gives 'text' a piece at a time. */
+FilterInput InputOf(const std::string& text) {
+    return [&text, offset = size_t(0)](char* buffer, size_t size) mutable {
+        const size_t n = std::min(size, text.size() - offset);
+        memcpy(buffer, text.data() + offset, n);
+        offset += n;
+        return n;
+    };
+}
+
+TEST(Filter, RunsCommand) {
+    const std::string text = "pear\napple\nfig\n";
+    std::string output, error;
+    const ette::Status<int> status =
+        RunFilter("sort", InputOf(text), &output, &error);
+    ASSERT_TRUE(status.ok());
+    EXPECT_EQ(status.value(), 0);
+    EXPECT_EQ(output, "apple\nfig\npear\n");
+    EXPECT_EQ(error, "");
+
+    output.clear();
+    EXPECT_EQ(RunFilter("echo oops >&2; exit 3", InputOf(text), &output,
+                        &error)
+                  .value(),
+              3);
+    EXPECT_EQ(output, "");
+    EXPECT_EQ(error, "oops\n");
+}
+
+// Far more than a pipe holds goes both ways at once without deadlocking, and
+// a command that doesn't read its input is fine.
+TEST(Filter, StreamsLargeInput) {
+    std::string text;
+    for (int i = 0; text.size() < 8 * 1024 * 1024; i++)
+        text += "line " + std::to_string(i) + "\n";
+    std::string output, error;
+    ASSERT_EQ(RunFilter("cat", InputOf(text), &output, &error).value(), 0);
+    EXPECT_TRUE(output == text);
+
+    output.clear();
+    ASSERT_EQ(RunFilter("head -n 2", InputOf(text), &output, &error).value(),
+              0);
+    EXPECT_EQ(output, "line 0\nline 1\n");
+
+    output.clear();
+    ASSERT_EQ(RunFilter("echo hi", InputOf(text), &output, &error).value(), 0);
+    EXPECT_EQ(output, "hi\n");
+}
+
+// A command that never ends, or never stops writing, can be stopped: its
+// whole process group is killed.
+TEST(Filter, StopsCommands) {
+    const std::string text = "line\n";
+    std::string output, error;
+    int asked = 0;
+    const auto start = std::chrono::steady_clock::now();
+    const ette::Status<int> status =
+        RunFilter("sleep 600; echo late", InputOf(text), &output, &error,
+                  [&] { return ++asked == 3; });
+    EXPECT_EQ(status.error().code(), ette::StatusCode::kCancelled);
+    EXPECT_LT(std::chrono::steady_clock::now() - start,
+              std::chrono::seconds(10));
+    EXPECT_EQ(output, "");
+
+    output.clear();
+    const ette::Status<int> flood =
+        RunFilter("yes", InputOf(text), &output, &error, nullptr, 1 << 20);
+    EXPECT_EQ(flood.error().code(), ette::StatusCode::kInvalidDataSize);
+    EXPECT_GT(output.size(), 1u << 20);
+    EXPECT_LT(output.size(), 4u << 20);
+}
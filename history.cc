@@ -0,0 +1,520 @@
+#include "history.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <mutex>
+#include <set>
+
+#include "constants.h"
+#include "crypto_registry.h"
+#include "file_util.h"
+#include "secure_memory.h"
+#include "thread_pool.h"
+#include "third_party/picosha2/picosha2.h"
+
+namespace ette {
+
+namespace {
+/* A manifest is the text size (8 bytes), the depth of its list (1 byte) and
+ * the list: for every chunk its ID and size (4 bytes), little endian. At
+ * depth d > 0 the chunks of the list make up the list of depth d - 1, and
+ * at depth 0 they make up the text. */
+constexpr size_t kListEntrySize = kHistoryChunkIdSize + 4;
+constexpr size_t kManifestFixedSize = 8 + 1;
+/* Longer lists are chunked again, so that a manifest stays this small. */
+constexpr size_t kMaxManifestListSize = 4 * 1024;
+constexpr int kMaxManifestDepth = 8;
+constexpr size_t kVersionNameSize = 20;
+
+/* Normalized chunking (as in FastCDC): boundaries are rarer than average
+ * before kHistoryAverageChunkSize and more frequent after it, which keeps
+ * chunk sizes close to the average. The hash shifts left, so its top bits
+ * depend on the most bytes. */
+constexpr uint64_t kMaskBeforeAverage = ~0ULL << (64 - 15);
+constexpr uint64_t kMaskAfterAverage = ~0ULL << (64 - 11);
+constexpr size_t kChunkGrain = 8;
+static_assert(kHistoryAverageChunkSize == 1 << 13,
+              "The masks are two bits around the average");
+
+template <typename T>
+Status<T> Failure(StatusCode code, const std::string& message) {
+    return Status<T>(code, message);
+}
+
+std::string Sha256(const std::string& data) {
+    std::string digest(picosha2::k_digest_size, '\0');
+    picosha2::hash256(data.begin(), data.end(), digest.begin(), digest.end());
+    return digest;
+}
+
+std::string Hex(const std::string& bytes) {
+    static const char kDigits[] = "0123456789abcdef";
+    std::string hex;
+    for (unsigned char c : bytes) {
+        hex += kDigits[c >> 4];
+        hex += kDigits[c & 0xF];
+    }
+    return hex;
+}
+
+bool WriteAll(int fd, const std::string& data) {
+    size_t done = 0;
+    while (done < data.size()) {
+        const ssize_t n = write(fd, data.data() + done, data.size() - done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        done += n;
+    }
+    return true;
+}
+
+/* Write 'data' to a new temporary file in 'directory' and sync it. Returns
+ * the file's path, empty on failure. */
+std::string WriteTemporary(const std::string& directory,
+                           const std::string& data) {
+    std::string path = directory + "/.tmpXXXXXX";
+    const int fd = mkostemp(&path[0], O_CLOEXEC);
+    if (fd == -1)
+        return "";
+    const bool written = WriteAll(fd, data) && fsync(fd) == 0;
+    close(fd);
+    if (!written) {
+        unlink(path.c_str());
+        return "";
+    }
+    return path;
+}
+
+std::string VersionName(int64_t saved_ns) {
+    char name[kVersionNameSize + 1];
+    snprintf(name, sizeof(name), "%020lld", (long long)saved_ns);
+    return name;
+}
+}  // namespace
+
+std::string HistoryDirectory(const std::string& document_path) {
+    return document_path + kHistoryDirectorySuffix;
+}
+
+bool HasHistory(const std::string& document_path) {
+    struct stat st;
+    return stat(HistoryDirectory(document_path).c_str(), &st) == 0 &&
+           S_ISDIR(st.st_mode);
+}
+
+int64_t HistoryTimeNow() {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return static_cast<int64_t>(now.tv_sec) * 1000000000 + now.tv_nsec;
+}
+
+Status<void> InitHistory(const std::string& document_path) {
+    const std::string directory = HistoryDirectory(document_path);
+    for (const std::string& path :
+         {directory, directory + "/chunks", directory + "/versions"}) {
+        if (mkdir(path.c_str(), 0700) == -1 && errno != EEXIST)
+            return IoError(path);
+    }
+    return Ok();
+}
+
+History::History(const std::string& document_path,
+                 const std::string& derived_key, const std::string& key_id,
+                 CryptoAlgorithm algorithm)
+    : directory_(HistoryDirectory(document_path)),
+      record_key_(RecordKey(derived_key)),
+      key_id_(key_id),
+      algorithm_(algorithm) {
+    id_key_ = Sha256("ette history chunk ID\n" + derived_key);
+    iv_key_ = Sha256("ette history chunk IV\n" + derived_key);
+    /* 256 random looking 64 bit values, 4 per hash. */
+    gear_.reserve(256);
+    for (int i = 0; gear_.size() < 256; i++) {
+        std::string block =
+            Sha256("ette history gear\n" + derived_key + static_cast<char>(i));
+        for (size_t j = 0; j < block.size(); j += 8)
+            gear_.push_back(LoadLe(block.data() + j, 8));
+        WipeString(&block);
+    }
+}
+
+std::string History::RecordKey(const std::string& derived_key) {
+    return Sha256("ette history record\n" + derived_key);
+}
+
+History::~History() {
+    WipeString(&record_key_);
+    WipeString(&id_key_);
+    WipeString(&iv_key_);
+    WipeMemory(gear_.data(), gear_.size() * sizeof(gear_[0]));
+}
+
+std::vector<size_t> History::ChunkSizes(const std::string& text) const {
+    std::vector<size_t> sizes;
+    const unsigned char* p =
+        reinterpret_cast<const unsigned char*>(text.data());
+    size_t left = text.size();
+    while (left > 0) {
+        size_t size = left;
+        if (left > kHistoryMinChunkSize) {
+            const size_t end = std::min(left, kHistoryMaxChunkSize);
+            const size_t average = std::min(end, kHistoryAverageChunkSize);
+            uint64_t hash = 0;
+            size_t i = kHistoryMinChunkSize;
+            for (; i < average; i++) {
+                hash = (hash << 1) + gear_[p[i]];
+                if ((hash & kMaskBeforeAverage) == 0)
+                    break;
+            }
+            if (i == average) {
+                for (; i < end; i++) {
+                    hash = (hash << 1) + gear_[p[i]];
+                    if ((hash & kMaskAfterAverage) == 0)
+                        break;
+                }
+            }
+            size = std::min(end, i + 1);
+        }
+        sizes.push_back(size);
+        p += size;
+        left -= size;
+    }
+    return sizes;
+}
+
+/* HMAC-SHA-256 of the chunk with 'id_key_', cut to kHistoryChunkIdSize. */
+std::string History::ChunkId(const char* data, size_t size) const {
+    std::string mac = HmacSha256(id_key_, data, size);
+    const std::string id = mac.substr(0, kHistoryChunkIdSize);
+    WipeString(&mac);
+    return id;
+}
+
+/* The IV of the chunk 'id'. Chunks are encrypted by the thousand under the
+ * same key, so rather than trust random nonces not to repeat, each chunk's
+ * comes from its ID: different texts never share one, and the same text
+ * encrypts the same every time. */
+std::vector<unsigned char> History::ChunkIv(const std::string& id) const {
+    const std::string mac = HmacSha256(iv_key_, id.data(), id.size());
+    return std::vector<unsigned char>(mac.begin(),
+                                      mac.begin() + kHeaderIvSize);
+}
+
+std::string History::ChunkPath(const std::string& id) const {
+    const std::string hex = Hex(id);
+    return directory_ + "/chunks/" + hex.substr(0, 2) + "/" + hex;
+}
+
+Status<void> History::StoreChunk(const std::string& id, const char* data,
+                                 size_t size) const {
+    const std::string path = ChunkPath(id);
+    if (access(path.c_str(), F_OK) == 0)
+        return Ok(); /* Stored by an earlier version. */
+
+    const std::string directory = path.substr(0, path.rfind('/'));
+    if (mkdir(directory.c_str(), 0700) == -1 && errno != EEXIST)
+        return IoError(directory);
+    std::string chunk(data, size);
+    CryptoState state = EncryptWithDerivedKey(chunk, record_key_, ChunkIv(id),
+                                              key_id_, algorithm_);
+    WipeString(&chunk);
+    WipeString(&state.plaintext);
+    if (!state.status.ok())
+        return state.status;
+
+    /* Chunks with the same ID have the same text, so a concurrent save
+     * storing it too is harmless. */
+    const std::string temporary = WriteTemporary(directory, state.ciphertext);
+    if (temporary.empty())
+        return IoError(directory);
+    if (rename(temporary.c_str(), path.c_str()) == -1) {
+        const Status<void> error = IoError(path);
+        unlink(temporary.c_str());
+        return error;
+    }
+    return Ok();
+}
+
+/* Chunk 'data', store its chunks and return their list. Chunks are hashed,
+ * encrypted and written in parallel. */
+Status<std::string> History::StoreChunks(const std::string& data) {
+    const std::vector<size_t> sizes = ChunkSizes(data);
+    std::vector<size_t> offsets(sizes.size());
+    for (size_t i = 1; i < sizes.size(); i++)
+        offsets[i] = offsets[i - 1] + sizes[i - 1];
+
+    std::vector<std::string> ids(sizes.size());
+    std::mutex mutex;
+    Status<void> status = Ok();
+    std::set<std::string> directories;
+    ParallelFor(
+        sizes.size(), kChunkGrain,
+        [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; i++) {
+                ids[i] = ChunkId(data.data() + offsets[i], sizes[i]);
+                const Status<void> stored =
+                    StoreChunk(ids[i], data.data() + offsets[i], sizes[i]);
+                std::lock_guard<std::mutex> lock(mutex);
+                directories.insert(Hex(ids[i].substr(0, 1)));
+                if (!stored.ok() && status.ok())
+                    status = stored;
+            }
+        },
+        TaskPriority::kBackground);
+    if (!status.ok()) {
+        return Failure<std::string>(status.error().code(),
+                                    status.error().message());
+    }
+
+    /* The new chunks' names must be on disk before a manifest names them. */
+    for (const std::string& directory : directories) {
+        const std::string path = directory_ + "/chunks/" + directory;
+        if (!SyncDirectory(path)) {
+            return Failure<std::string>(StatusCode::kIoError,
+                                        path + ": " + strerror(errno));
+        }
+    }
+
+    std::string list;
+    list.reserve(sizes.size() * kListEntrySize);
+    for (size_t i = 0; i < sizes.size(); i++) {
+        list += ids[i];
+        AppendLe(&list, sizes[i], 4);
+    }
+    return list;
+}
+
+Status<HistoryVersion> History::Record(const std::string& text,
+                                       int64_t saved_ns) {
+    Status<std::string> list = StoreChunks(text);
+    int depth = 0;
+    while (list.ok() && list.value().size() > kMaxManifestListSize) {
+        list = StoreChunks(list.value());
+        depth++;
+    }
+    if (!list.ok()) {
+        return Failure<HistoryVersion>(list.error().code(),
+                                       list.error().message());
+    }
+
+    std::string manifest;
+    AppendLe(&manifest, text.size(), 8);
+    manifest += static_cast<char>(depth);
+    manifest += list.value();
+    const CryptoState state = EncryptWithDerivedKey(
+        manifest, record_key_, GenerateRandomAsciiByteVector(), key_id_,
+        algorithm_);
+    if (!state.status.ok()) {
+        return Failure<HistoryVersion>(state.status.error().code(),
+                                       state.status.error().message());
+    }
+
+    /* link(2) never replaces a version another editor saved in the same
+     * nanosecond. */
+    const std::string versions = directory_ + "/versions";
+    const std::string temporary = WriteTemporary(versions, state.ciphertext);
+    if (temporary.empty()) {
+        return Failure<HistoryVersion>(StatusCode::kIoError,
+                                       versions + ": " + strerror(errno));
+    }
+    HistoryVersion version;
+    version.saved_ns = saved_ns;
+    while (true) {
+        version.name = VersionName(version.saved_ns);
+        const std::string path = versions + "/" + version.name;
+        if (link(temporary.c_str(), path.c_str()) == 0)
+            break;
+        if (errno != EEXIST) {
+            const std::string error = strerror(errno);
+            unlink(temporary.c_str());
+            return Failure<HistoryVersion>(StatusCode::kIoError,
+                                           versions + ": " + error);
+        }
+        version.saved_ns++;
+    }
+    unlink(temporary.c_str());
+    if (!SyncDirectory(versions)) {
+        return Failure<HistoryVersion>(StatusCode::kIoError,
+                                       versions + ": " + strerror(errno));
+    }
+    return version;
+}
+
+Status<std::vector<HistoryVersion>> History::Versions(
+    const std::string& document_path) {
+    const std::string directory = HistoryDirectory(document_path);
+    std::vector<HistoryVersion> versions;
+    std::error_code error;
+    for (const auto& file : std::filesystem::directory_iterator(
+             directory + "/versions", error)) {
+        const std::string name = file.path().filename().string();
+        if (name.size() != kVersionNameSize ||
+            name.find_first_not_of("0123456789") != std::string::npos)
+            continue;
+        versions.push_back({name, strtoll(name.c_str(), NULL, 10)});
+    }
+    if (error) {
+        return Failure<std::vector<HistoryVersion>>(
+            StatusCode::kIoError, directory + ": " + error.message());
+    }
+    std::sort(versions.begin(), versions.end(),
+              [](const HistoryVersion& a, const HistoryVersion& b) {
+                  return a.name < b.name;
+              });
+    return versions;
+}
+
+/* Read and decrypt the chunk or manifest at 'path' into 'plaintext'. */
+Status<void> History::ReadRecord(const std::string& path,
+                                 std::string* plaintext) const {
+    const int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return Status<void>(
+            errno == ENOENT ? StatusCode::kNotFound : StatusCode::kIoError,
+            path + ": " + strerror(errno));
+    }
+    std::string record;
+    char buffer[16 * 1024];
+    ssize_t n;
+    while ((n = read(fd, buffer, sizeof(buffer))) > 0 ||
+           (n == -1 && errno == EINTR)) {
+        if (n > 0)
+            record.append(buffer, n);
+    }
+    close(fd);
+    if (n == -1)
+        return IoError(path);
+    if (record.size() <= sizeof(kHeaderMagicNumber))
+        return Status<void>(StatusCode::kInvalidDataSize, path + ": truncated");
+
+    CryptoState state = DecryptWithDerivedKey(
+        record, record_key_,
+        CryptoAlgorithmFromHeaderByte(record[sizeof(kHeaderMagicNumber)]));
+    if (!state.status.ok()) {
+        return Status<void>(state.status.error().code(),
+                            path + ": " + state.status.error().message());
+    }
+    *plaintext = std::move(state.plaintext);
+    return Ok();
+}
+
+/* The concatenated chunks of 'list' into 'data', read and decrypted in
+ * parallel. */
+Status<void> History::LoadChunks(const std::string& list,
+                                 std::string* data) const {
+    if (list.size() % kListEntrySize != 0) {
+        return Status<void>(StatusCode::kInvalidDataSize,
+                            "History is corrupt: bad chunk list");
+    }
+    const size_t count = list.size() / kListEntrySize;
+    std::vector<uint64_t> offsets(count + 1);
+    for (size_t i = 0; i < count; i++) {
+        offsets[i + 1] =
+            offsets[i] +
+            LoadLe(&list[i * kListEntrySize + kHistoryChunkIdSize], 4);
+    }
+
+    data->assign(offsets[count], '\0');
+    std::mutex mutex;
+    Status<void> status = Ok();
+    ParallelFor(
+        count, kChunkGrain,
+        [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; i++) {
+                const std::string id =
+                    list.substr(i * kListEntrySize, kHistoryChunkIdSize);
+                std::string chunk;
+                Status<void> loaded = ReadRecord(ChunkPath(id), &chunk);
+                if (loaded.ok() &&
+                    (chunk.size() != offsets[i + 1] - offsets[i] ||
+                     ChunkId(chunk.data(), chunk.size()) != id)) {
+                    loaded = Status<void>(StatusCode::kInvalidDataSize,
+                                          "History is corrupt: chunk " +
+                                              Hex(id) + " doesn't match");
+                }
+                if (loaded.ok())
+                    memcpy(&(*data)[offsets[i]], chunk.data(), chunk.size());
+                WipeString(&chunk);
+                if (!loaded.ok()) {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    if (status.ok())
+                        status = loaded;
+                }
+            }
+        },
+        TaskPriority::kInteractive);
+    if (!status.ok())
+        WipeString(data);
+    return status;
+}
+
+Status<std::string> History::Restore(const HistoryVersion& version) const {
+    std::string manifest;
+    Status<void> status =
+        ReadRecord(directory_ + "/versions/" + version.name, &manifest);
+    if (!status.ok()) {
+        return Failure<std::string>(status.error().code(),
+                                    status.error().message());
+    }
+    if (manifest.size() < kManifestFixedSize ||
+        static_cast<unsigned char>(manifest[8]) > kMaxManifestDepth) {
+        return Failure<std::string>(StatusCode::kInvalidDataSize,
+                                    "History is corrupt: bad manifest");
+    }
+    const uint64_t size = LoadLe(manifest.data(), 8);
+
+    /* Every level of lists is the list of the next one down. */
+    std::string list = manifest.substr(kManifestFixedSize);
+    std::string data;
+    for (int depth = manifest[8]; status.ok() && depth >= 0; depth--) {
+        status = LoadChunks(list, &data);
+        list.swap(data);
+    }
+    if (!status.ok()) {
+        return Failure<std::string>(status.error().code(),
+                                    status.error().message());
+    }
+    if (list.size() != size) {
+        WipeString(&list);
+        return Failure<std::string>(StatusCode::kInvalidDataSize,
+                                    "History is corrupt: wrong text size");
+    }
+    return list;
+}
+
+std::string History::Manifest(const std::string& document_path,
+                              const HistoryVersion& version) {
+    std::ifstream file(
+        HistoryDirectory(document_path) + "/versions/" + version.name,
+        std::ios::binary);
+    return std::string((std::istreambuf_iterator<char>(file)),
+                       std::istreambuf_iterator<char>());
+}
+
+HistoryUsage History::Usage(const std::string& document_path) {
+    HistoryUsage usage{0, 0};
+    const std::string directory = HistoryDirectory(document_path);
+    std::error_code error;
+    for (const auto& file :
+         std::filesystem::recursive_directory_iterator(directory, error)) {
+        if (!file.is_regular_file(error))
+            continue;
+        usage.bytes += file.file_size(error);
+        if (file.path().parent_path().parent_path().filename() == "chunks")
+            usage.chunks++;
+    }
+    return usage;
+}
+
+}  // namespace ette
@@ -0,0 +1,133 @@
+#ifndef __HISTORY_H__
+#define __HISTORY_H__
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "crypto.h"
+#include "status.h"
+
+namespace ette {
+
+/* The saved versions of a document, kept in "<document>.history/" when that
+ * directory exists (see InitHistory()).
+ *
+ * Every version is cut into chunks where a rolling hash of the text says so
+ * ("content-defined chunking"): an edit only changes the chunks around it,
+ * and the chunks after it keep their boundaries even when text is inserted
+ * or deleted. Each chunk is stored once, as an ordinary encrypted file named
+ * after a keyed hash of its text, and a version is a small encrypted
+ * manifest listing its chunks. A version that changes a few lines costs
+ * about a chunk per changed place plus the manifest.
+ *
+ *   chunks/ab/ab01...   one chunk, named by its ID in hex
+ *   versions/<time>     one manifest, named by the save time in nanoseconds
+ *
+ * Chunk IDs and boundaries are keyed with the document's key, so neither
+ * tells anything about the text to someone without it. Chunks and manifests
+ * are encrypted with a key of their own, derived from the document's: they
+ * are far more numerous than the document's other records, and don't share
+ * a key (nor the nonces under it) with them. The list of chunks of
+ * a large document is itself chunked the same way, so the manifest stays
+ * small and an edit only adds a few chunks of list. */
+
+static constexpr char kHistoryDirectorySuffix[] = ".history";
+
+/* Chunks are kHistoryAverageChunkSize bytes on average, and never smaller
+ * than kHistoryMinChunkSize (but for the last) nor larger than
+ * kHistoryMaxChunkSize. */
+static constexpr size_t kHistoryMinChunkSize = 2 * 1024;
+static constexpr size_t kHistoryAverageChunkSize = 8 * 1024;
+static constexpr size_t kHistoryMaxChunkSize = 64 * 1024;
+static constexpr size_t kHistoryChunkIdSize = 16;
+
+/* "<document>.history" */
+std::string HistoryDirectory(const std::string& document_path);
+
+/* Whether saves of the document are recorded: its history directory
+ * exists. */
+bool HasHistory(const std::string& document_path);
+
+/* Create the history directory of the document (fine if it exists). */
+Status<void> InitHistory(const std::string& document_path);
+
+struct HistoryVersion {
+    std::string name;  /* Of the manifest in versions/. */
+    int64_t saved_ns;  /* Unix time of the save, in nanoseconds. */
+};
+
+/* Unix time in nanoseconds, which versions are named and sorted by. */
+int64_t HistoryTimeNow();
+
+struct HistoryUsage {
+    uint64_t chunks;
+    uint64_t bytes; /* Chunks and manifests, as stored. */
+};
+
+class History {
+   public:
+    /* The history of the document at 'document_path', whose versions are
+     * encrypted with 'derived_key' in 'algorithm' under 'key_id'. */
+    History(const std::string& document_path, const std::string& derived_key,
+            const std::string& key_id, CryptoAlgorithm algorithm);
+    ~History();
+
+    History(const History&) = delete;
+    History& operator=(const History&) = delete;
+
+    /* Store 'text' as the version saved at 'saved_ns'. Only chunks the
+     * history doesn't have yet are encrypted and written; the manifest is
+     * written last, so an interrupted Record() leaves no version behind. */
+    Status<HistoryVersion> Record(const std::string& text,
+                                  int64_t saved_ns = HistoryTimeNow());
+
+
+    /* The text of 'version'. Every chunk is checked against its ID, so a
+     * damaged history fails instead of returning the wrong text. */
+    Status<std::string> Restore(const HistoryVersion& version) const;
+
+    /* Every version of the document, oldest first. Takes no key. */
+    static Status<std::vector<HistoryVersion>> Versions(
+        const std::string& document_path);
+
+    /* The encrypted manifest of 'version', to check a password against (or
+     * look its key ID up in ette-agent). Empty if it can't be read. */
+    static std::string Manifest(const std::string& document_path,
+                                const HistoryVersion& version);
+
+    static HistoryUsage Usage(const std::string& document_path);
+
+    /* The key the chunks and manifests of a document whose key is
+     * 'derived_key' are encrypted with. */
+    static std::string RecordKey(const std::string& derived_key);
+
+    /* The sizes of the chunks 'text' is cut into, in order. */
+    std::vector<size_t> ChunkSizes(const std::string& text) const;
+
+   private:
+    std::string ChunkId(const char* data, size_t size) const;
+    std::vector<unsigned char> ChunkIv(const std::string& id) const;
+    std::string ChunkPath(const std::string& id) const;
+    Status<std::string> StoreChunks(const std::string& data);
+    Status<void> StoreChunk(const std::string& id, const char* data,
+                            size_t size) const;
+    Status<void> LoadChunks(const std::string& list, std::string* data) const;
+    Status<void> ReadRecord(const std::string& path,
+                            std::string* plaintext) const;
+
+    std::string directory_;
+    std::string record_key_; /* See RecordKey(). */
+    std::string key_id_;
+    CryptoAlgorithm algorithm_;
+    /* Keys of the chunk IDs, their IVs and of the rolling hash, derived from
+     * the document's key. */
+    std::string id_key_;
+    std::string iv_key_;
+    std::vector<uint64_t> gear_;
+};
+
+}  // namespace ette
+
+#endif  // __HISTORY_H__
@@ -0,0 +1,183 @@
+#include <stdio.h>
+#include <filesystem>
+#include <random>
+#include <set>
+#include <string>
+
+#include "crypto.h"
+#include "history.h"
+
+#include "gtest/gtest.h"
+
+using ::ette::CryptoAlgorithm;
+using ::ette::DeriveKey;
+using ::ette::GenerateKeyId;
+using ::ette::History;
+using ::ette::HistoryVersion;
+using ::ette::InitHistory;
+
+const std::string kKey = DeriveKey("test");
+const std::string kKeyId = GenerateKeyId();
+
+/* 'lines' lines of random words, the same for the same seed. */
+std::string RandomText(size_t lines, unsigned seed) {
+    std::mt19937 random(seed);
+    std::string text;
+    for (size_t i = 0; i < lines; i++) {
+        const int words = 1 + random() % 12;
+        for (int w = 0; w < words; w++) {
+            const int letters = 1 + random() % 9;
+            for (int l = 0; l < letters; l++)
+                text += static_cast<char>('a' + random() % 26);
+            text += ' ';
+        }
+        text += '\n';
+    }
+    return text;
+}
+
+void RemoveHistory(const std::string& document) {
+    std::filesystem::remove_all(ette::HistoryDirectory(document));
+}
+
+TEST(History, ChunkingIsContentDefined) {
+    History history("/tmp/History_Chunks.chacha20", kKey, kKeyId,
+                    CryptoAlgorithm::kChaCha20Poly1305);
+    const std::string text = RandomText(50000, 1);
+    const std::vector<size_t> sizes = history.ChunkSizes(text);
+    size_t total = 0;
+    for (size_t i = 0; i < sizes.size(); i++) {
+        total += sizes[i];
+        EXPECT_LE(sizes[i], ette::kHistoryMaxChunkSize);
+        if (i + 1 < sizes.size()) {
+            EXPECT_GE(sizes[i], ette::kHistoryMinChunkSize);
+        }
+    }
+    EXPECT_EQ(total, text.size());
+    EXPECT_NEAR(text.size() / sizes.size(), ette::kHistoryAverageChunkSize,
+                ette::kHistoryAverageChunkSize / 2);
+
+    // Inserting a line moves the boundaries after it along with the text;
+    // only the chunk it lands in changes.
+    const std::string line = "inserted line\n";
+    const size_t position = text.find('\n', text.size() / 2) + 1;
+    std::string edited = text;
+    edited.insert(position, line);
+    std::set<size_t> boundaries, edited_boundaries;
+    size_t offset = 0;
+    for (size_t size : sizes)
+        boundaries.insert(offset += size);
+    offset = 0;
+    for (size_t size : history.ChunkSizes(edited)) {
+        offset += size;
+        edited_boundaries.insert(offset > position ? offset - line.size()
+                                                   : offset);
+    }
+    size_t moved = 0;
+    for (size_t boundary : boundaries)
+        moved += edited_boundaries.count(boundary) == 0;
+    EXPECT_LE(moved, 2u);
+
+    // Another key cuts elsewhere.
+    History other("/tmp/History_Chunks.chacha20", DeriveKey("other"), kKeyId,
+                  CryptoAlgorithm::kChaCha20Poly1305);
+    EXPECT_NE(other.ChunkSizes(text), sizes);
+}
+
+TEST(History, VersionsRoundTrip) {
+    for (CryptoAlgorithm algorithm : {CryptoAlgorithm::kChaCha20Poly1305,
+                                      CryptoAlgorithm::kAES256CBC}) {
+        const std::string document = "/tmp/History_RoundTrip";
+        RemoveHistory(document);
+        ASSERT_TRUE(InitHistory(document).ok());
+        History history(document, kKey, kKeyId, algorithm);
+
+        // Long enough for a list of lists.
+        const std::vector<std::string> texts = {"", "short\n",
+                                                RandomText(100000, 2)};
+        for (const std::string& text : texts)
+            ASSERT_TRUE(history.Record(text).ok());
+
+        auto versions = History::Versions(document);
+        ASSERT_TRUE(versions.ok());
+        ASSERT_EQ(versions.value().size(), texts.size());
+        for (size_t i = 0; i < texts.size(); i++) {
+            auto text = history.Restore(versions.value()[i]);
+            ASSERT_TRUE(text.ok()) << text.error().message();
+            EXPECT_EQ(*text, texts[i]);
+        }
+        const std::string manifest =
+            History::Manifest(document, versions.value().back());
+        EXPECT_EQ(ette::GetKeyIdFromCiphertext(manifest), kKeyId);
+
+        // Records have a key of their own, not the document's. (A wrong
+        // AES-CBC key is only caught by its padding, most of the time.)
+        if (algorithm == CryptoAlgorithm::kChaCha20Poly1305) {
+            EXPECT_FALSE(ette::DecryptWithDerivedKey(manifest, kKey, algorithm)
+                             .status.ok());
+        }
+        EXPECT_TRUE(ette::DecryptWithDerivedKey(
+                        manifest, History::RecordKey(kKey), algorithm)
+                        .status.ok());
+        RemoveHistory(document);
+    }
+}
+
+// 20 versions of a 5 MB document with a line changed in each cost a few
+// chunks per version, not the document.
+TEST(History, SmallEditsCostAboutTheEdit) {
+    const std::string document = "/tmp/History_Edits";
+    RemoveHistory(document);
+    ASSERT_TRUE(InitHistory(document).ok());
+    History history(document, kKey, kKeyId,
+                    CryptoAlgorithm::kChaCha20Poly1305);
+
+    std::string text = RandomText(150000, 3);
+    ASSERT_TRUE(history.Record(text).ok());
+    const uint64_t first = History::Usage(document).bytes;
+    EXPECT_LT(first, text.size() * 11 / 10);
+
+    std::mt19937 random(4);
+    for (int i = 0; i < 20; i++) {
+        const size_t line = text.find('\n', random() % text.size());
+        text.insert(line + 1, "edit " + std::to_string(i) + "\n");
+        ASSERT_TRUE(history.Record(text).ok());
+    }
+    const uint64_t per_version =
+        (History::Usage(document).bytes - first) / 20;
+    EXPECT_LT(per_version, 4 * ette::kHistoryAverageChunkSize);
+
+    auto versions = History::Versions(document);
+    ASSERT_TRUE(versions.ok());
+    EXPECT_EQ(*history.Restore(versions.value().back()), text);
+    RemoveHistory(document);
+}
+
+TEST(History, WrongKeyAndDamageFail) {
+    const std::string document = "/tmp/History_Damage";
+    RemoveHistory(document);
+    ASSERT_TRUE(InitHistory(document).ok());
+    History history(document, kKey, kKeyId, CryptoAlgorithm::kAES256CBC);
+    ASSERT_TRUE(history.Record(RandomText(2000, 5)).ok());
+    const HistoryVersion version = History::Versions(document).value()[0];
+
+    History stranger(document, DeriveKey("nope"), kKeyId,
+                     CryptoAlgorithm::kAES256CBC);
+    EXPECT_FALSE(stranger.Restore(version).ok());
+
+    // Swap two chunks: each decrypts, but not to the text of its ID.
+    std::vector<std::string> chunks;
+    for (const auto& file : std::filesystem::recursive_directory_iterator(
+             ette::HistoryDirectory(document) + "/chunks")) {
+        if (file.is_regular_file())
+            chunks.push_back(file.path().string());
+    }
+    ASSERT_GE(chunks.size(), 2u);
+    std::filesystem::rename(chunks[0], "/tmp/History_Damage.swap");
+    std::filesystem::rename(chunks[1], chunks[0]);
+    std::filesystem::rename("/tmp/History_Damage.swap", chunks[1]);
+    auto restored = history.Restore(version);
+    ASSERT_FALSE(restored.ok());
+    EXPECT_EQ(restored.error().code(), ette::StatusCode::kInvalidDataSize);
+    RemoveHistory(document);
+}
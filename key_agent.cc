@@ -0,0 +1,421 @@
+#include "key_agent.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/prctl.h>
+#endif
+
+#include "constants.h"
+#include "secure_memory.h"
+
+namespace ette {
+
+namespace {
+/* Requests are a single message per connection: an opcode, the key ID and,
+ * for kOpPut, the key length and the key. Replies to kOpGet are kReplyFound,
+ * the key length and the key, or kReplyNotFound. */
+constexpr char kOpGet = 'G';
+constexpr char kOpPut = 'P';
+constexpr char kOpClear = 'C';
+constexpr char kReplyFound = '+';
+constexpr char kReplyNotFound = '-';
+
+constexpr size_t kMaxMessageSize = 1 + kHeaderKeyIdSize + 1 + kAgentMaxKeySize;
+
+/* Neither side waits longer than this on the other. */
+constexpr int kIoTimeoutMs = 1000;
+
+void SetIoTimeout(int fd) {
+    struct timeval tv;
+    tv.tv_sec = kIoTimeoutMs / 1000;
+    tv.tv_usec = (kIoTimeoutMs % 1000) * 1000;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+/* True if the process at the other end of 'fd' runs as our user. */
+bool PeerIsSameUser(int fd) {
+#ifdef __linux__
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == -1)
+        return false;
+    return cred.uid == getuid();
+#else
+    uid_t uid;
+    gid_t gid;
+    if (getpeereid(fd, &uid, &gid) == -1)
+        return false;
+    return uid == getuid();
+#endif
+}
+
+/* True if 'dir' is a directory owned by us that nobody else can enter. */
+bool IsPrivateDirectory(const std::string& dir) {
+    struct stat st;
+    if (lstat(dir.c_str(), &st) == -1)
+        return false;
+    return S_ISDIR(st.st_mode) && st.st_uid == getuid() &&
+           (st.st_mode & 077) == 0;
+}
+
+std::string DirectoryOf(const std::string& path) {
+    const size_t slash = path.rfind('/');
+    if (slash == std::string::npos)
+        return ".";
+    return slash == 0 ? "/" : path.substr(0, slash);
+}
+
+bool WriteFully(int fd, const char* buf, size_t len) {
+    while (len > 0) {
+        const ssize_t written = send(fd, buf, len, MSG_NOSIGNAL);
+        if (written == -1) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        buf += written;
+        len -= written;
+    }
+    return true;
+}
+
+bool ReadFully(int fd, char* buf, size_t len) {
+    while (len > 0) {
+        const ssize_t got = read(fd, buf, len);
+        if (got == -1 && errno == EINTR)
+            continue;
+        if (got <= 0)
+            return false;
+        buf += got;
+        len -= got;
+    }
+    return true;
+}
+
+/* Connect to the agent, or -1 if there is none we can trust. */
+int ConnectToAgent() {
+    const std::string path = GetAgentSocketPath();
+    if (path.empty() || path.size() >= sizeof(sockaddr_un::sun_path))
+        return -1;
+    if (!IsPrivateDirectory(DirectoryOf(path)))
+        return -1;
+
+    const int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1)
+        return -1;
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path, path.c_str(), path.size());
+    if (connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == -1 ||
+        !PeerIsSameUser(fd)) {
+        close(fd);
+        return -1;
+    }
+    SetIoTimeout(fd);
+    return fd;
+}
+
+bool SendRequest(int fd, char op, const std::string& key_id,
+                 const std::string& key) {
+    char message[kMaxMessageSize];
+    size_t len = 0;
+    message[len++] = op;
+    memcpy(message + len, key_id.data(), kHeaderKeyIdSize);
+    len += kHeaderKeyIdSize;
+    if (op == kOpPut) {
+        message[len++] = static_cast<char>(key.size());
+        memcpy(message + len, key.data(), key.size());
+        len += key.size();
+    }
+    const bool sent = WriteFully(fd, message, len);
+    WipeMemory(message, sizeof(message));
+    return sent;
+}
+}  // namespace
+
+std::string GetAgentSocketPath() {
+    const char* explicit_path = getenv("ETTE_AGENT_SOCK");
+    if (explicit_path != NULL)
+        return explicit_path;
+    const char* runtime_dir = getenv("XDG_RUNTIME_DIR");
+    if (runtime_dir != NULL && runtime_dir[0] != '\0')
+        return std::string(runtime_dir) + "/ette-agent/socket";
+    return "/tmp/ette-agent-" + std::to_string(getuid()) + "/socket";
+}
+
+std::optional<std::string> AgentGetKey(const std::string& key_id) {
+    if (key_id.size() != kHeaderKeyIdSize)
+        return std::nullopt;
+    const int fd = ConnectToAgent();
+    if (fd == -1)
+        return std::nullopt;
+
+    std::optional<std::string> key;
+    char reply[1 + 1 + kAgentMaxKeySize];
+    if (SendRequest(fd, kOpGet, key_id, "") && ReadFully(fd, reply, 1) &&
+        reply[0] == kReplyFound && ReadFully(fd, reply + 1, 1)) {
+        const size_t len = static_cast<unsigned char>(reply[1]);
+        if (len <= kAgentMaxKeySize && ReadFully(fd, reply + 2, len))
+            key = std::string(reply + 2, len);
+    }
+    WipeMemory(reply, sizeof(reply));
+    close(fd);
+    return key;
+}
+
+bool AgentPutKey(const std::string& key_id, const std::string& derived_key) {
+    if (key_id.size() != kHeaderKeyIdSize || derived_key.empty() ||
+        derived_key.size() > kAgentMaxKeySize) {
+        return false;
+    }
+    const int fd = ConnectToAgent();
+    if (fd == -1)
+        return false;
+    const bool sent = SendRequest(fd, kOpPut, key_id, derived_key);
+    close(fd);
+    return sent;
+}
+
+bool AgentClearKeys() {
+    const int fd = ConnectToAgent();
+    if (fd == -1)
+        return false;
+    const bool sent =
+        SendRequest(fd, kOpClear, std::string(kHeaderKeyIdSize, '\0'), "");
+    close(fd);
+    return sent;
+}
+
+struct KeyCache::Entry {
+    char key_id[kHeaderKeyIdSize];
+    char key[kAgentMaxKeySize];
+    size_t key_size;
+    time_t expires;
+    bool used;
+};
+
+KeyCache::KeyCache(int ttl_seconds)
+    : entries_(nullptr), mapped_size_(0), locked_(false),
+      ttl_seconds_(ttl_seconds) {
+    mapped_size_ = sizeof(Entry) * kAgentMaxKeys;
+    void* memory = mmap(NULL, mapped_size_, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) {
+        mapped_size_ = 0;
+        return;
+    }
+    entries_ = static_cast<Entry*>(memory);
+#ifdef MADV_DONTDUMP
+    madvise(memory, mapped_size_, MADV_DONTDUMP);
+#endif
+    locked_ = mlock(memory, mapped_size_) == 0;
+}
+
+KeyCache::~KeyCache() {
+    if (entries_ == nullptr)
+        return;
+    Clear();
+    if (locked_)
+        munlock(entries_, mapped_size_);
+    munmap(entries_, mapped_size_);
+}
+
+void KeyCache::Wipe(Entry* entry) {
+    WipeMemory(entry, sizeof(*entry));
+}
+
+bool KeyCache::Put(const std::string& key_id, const std::string& key,
+                   time_t now) {
+    if (!locked_ || key_id.size() != kHeaderKeyIdSize || key.empty() ||
+        key.size() > kAgentMaxKeySize) {
+        return false;
+    }
+    Expire(now);
+
+    Entry* slot = nullptr;
+    for (size_t i = 0; i < kAgentMaxKeys; i++) {
+        Entry* entry = &entries_[i];
+        if (entry->used &&
+            memcmp(entry->key_id, key_id.data(), kHeaderKeyIdSize) == 0) {
+            slot = entry;
+            break;
+        }
+        if (slot == nullptr || (slot->used && !entry->used) ||
+            (slot->used && entry->used && entry->expires < slot->expires)) {
+            slot = entry;
+        }
+    }
+
+    Wipe(slot);
+    memcpy(slot->key_id, key_id.data(), kHeaderKeyIdSize);
+    memcpy(slot->key, key.data(), key.size());
+    slot->key_size = key.size();
+    slot->expires = now + ttl_seconds_;
+    slot->used = true;
+    return true;
+}
+
+std::optional<std::string> KeyCache::Get(const std::string& key_id,
+                                         time_t now) {
+    if (!locked_ || key_id.size() != kHeaderKeyIdSize)
+        return std::nullopt;
+    Expire(now);
+    for (size_t i = 0; i < kAgentMaxKeys; i++) {
+        const Entry& entry = entries_[i];
+        if (entry.used &&
+            memcmp(entry.key_id, key_id.data(), kHeaderKeyIdSize) == 0) {
+            return std::string(entry.key, entry.key_size);
+        }
+    }
+    return std::nullopt;
+}
+
+void KeyCache::Expire(time_t now) {
+    for (size_t i = 0; i < kAgentMaxKeys && locked_; i++) {
+        if (entries_[i].used && entries_[i].expires <= now)
+            Wipe(&entries_[i]);
+    }
+}
+
+void KeyCache::Clear() {
+    for (size_t i = 0; i < kAgentMaxKeys && entries_ != nullptr; i++)
+        Wipe(&entries_[i]);
+}
+
+size_t KeyCache::Size() const {
+    size_t size = 0;
+    for (size_t i = 0; i < kAgentMaxKeys && locked_; i++)
+        size += entries_[i].used;
+    return size;
+}
+
+int ListenAgentSocket(const std::string& socket_path, std::string* error) {
+    struct sockaddr_un addr;
+    if (socket_path.empty() || socket_path.size() >= sizeof(addr.sun_path)) {
+        *error = "Invalid socket path: " + socket_path;
+        return -1;
+    }
+
+    const std::string dir = DirectoryOf(socket_path);
+    if (mkdir(dir.c_str(), 0700) == -1 && errno != EEXIST) {
+        *error = "Can't create " + dir + ": " + strerror(errno);
+        return -1;
+    }
+    if (!IsPrivateDirectory(dir)) {
+        *error = dir + " must be a directory owned by you with mode 0700";
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path, socket_path.c_str(), socket_path.size());
+
+    /* A socket left behind by an agent that died is replaced, a live agent
+     * is not. */
+    const int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (probe != -1) {
+        const bool alive = connect(probe, reinterpret_cast<sockaddr*>(&addr),
+                                   sizeof(addr)) == 0;
+        close(probe);
+        if (alive) {
+            *error = "ette-agent is already running on " + socket_path;
+            return -1;
+        }
+    }
+    unlink(socket_path.c_str());
+
+    const int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        *error = std::string("socket: ") + strerror(errno);
+        return -1;
+    }
+    const mode_t old_umask = umask(077);
+    const int bound =
+        bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr));
+    umask(old_umask);
+    if (bound == -1 || listen(fd, 16) == -1) {
+        *error = "Can't listen on " + socket_path + ": " + strerror(errno);
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+void ServeKeyAgent(int listen_fd, int ttl_seconds,
+                   const std::atomic<bool>& stop) {
+#ifdef __linux__
+    /* No core dumps and no ptrace by other processes of the same user. */
+    prctl(PR_SET_DUMPABLE, 0, 0, 0, 0);
+#endif
+    KeyCache cache(ttl_seconds);
+    if (!cache.Locked()) {
+        fprintf(stderr,
+                "ette-agent: can't lock memory, keys will not be cached\n");
+    }
+
+    char message[kMaxMessageSize];
+    while (!stop.load()) {
+        struct pollfd pfd = {listen_fd, POLLIN, 0};
+        const int ready = poll(&pfd, 1, 500);
+        cache.Expire(time(NULL));
+        if (ready <= 0)
+            continue;
+
+        const int fd = accept(listen_fd, NULL, NULL);
+        if (fd == -1)
+            continue;
+        if (!PeerIsSameUser(fd)) {
+            close(fd);
+            continue;
+        }
+        SetIoTimeout(fd);
+
+        const char* key_id = message + 1;
+        if (ReadFully(fd, message, 1 + kHeaderKeyIdSize)) {
+            const time_t now = time(NULL);
+            if (message[0] == kOpGet) {
+                std::optional<std::string> key =
+                    cache.Get(std::string(key_id, kHeaderKeyIdSize), now);
+                std::string reply(1, key ? kReplyFound : kReplyNotFound);
+                if (key) {
+                    reply += static_cast<char>(key->size());
+                    reply += *key;
+                    WipeMemory(&(*key)[0], key->size());
+                }
+                WriteFully(fd, reply.data(), reply.size());
+                WipeMemory(&reply[0], reply.size());
+            } else if (message[0] == kOpPut) {
+                char* len = message + 1 + kHeaderKeyIdSize;
+                if (ReadFully(fd, len, 1)) {
+                    const size_t size = static_cast<unsigned char>(*len);
+                    if (size > 0 && size <= kAgentMaxKeySize &&
+                        ReadFully(fd, len + 1, size)) {
+                        std::string key(len + 1, size);
+                        cache.Put(std::string(key_id, kHeaderKeyIdSize), key,
+                                  now);
+                        WipeMemory(&key[0], key.size());
+                    }
+                }
+            } else if (message[0] == kOpClear) {
+                cache.Clear();
+            }
+        }
+        WipeMemory(message, sizeof(message));
+        close(fd);
+    }
+}
+
+}  // namespace ette
@@ -0,0 +1,73 @@
+#ifndef __KEY_AGENT_H__
+#define __KEY_AGENT_H__
+
+#include <time.h>
+#include <atomic>
+#include <cstddef>
+#include <optional>
+#include <string>
+
+namespace ette {
+
+/* ette-agent keeps derived keys (see DeriveKey() in crypto.h) in locked
+ * memory for a limited time, so reopening a recently unlocked file skips both
+ * the password prompt and the key derivation. Keys are addressed by the key
+ * ID in the file header. The agent listens on a Unix domain socket in a
+ * directory only its user can enter, and only answers that same user. */
+
+static constexpr size_t kAgentMaxKeys = 256;
+static constexpr size_t kAgentMaxKeySize = 64;
+static constexpr int kAgentDefaultTtlSeconds = 15 * 60;
+
+/* $ETTE_AGENT_SOCK, else $XDG_RUNTIME_DIR/ette-agent/socket, else
+ * /tmp/ette-agent-<uid>/socket. An empty $ETTE_AGENT_SOCK disables the
+ * agent and "" is returned. */
+std::string GetAgentSocketPath();
+
+/* Client side. Both fail quietly when no agent is running. */
+std::optional<std::string> AgentGetKey(const std::string& key_id);
+bool AgentPutKey(const std::string& key_id, const std::string& derived_key);
+bool AgentClearKeys();
+
+/* Fixed size table of keys in memory that is locked (never swapped out),
+ * excluded from core dumps and wiped when a key expires or is replaced.
+ * When full, the key closest to expiring makes room. */
+class KeyCache {
+   public:
+    explicit KeyCache(int ttl_seconds);
+    ~KeyCache();
+
+    KeyCache(const KeyCache&) = delete;
+    KeyCache& operator=(const KeyCache&) = delete;
+
+    /* False if the memory couldn't be locked: the cache then stores
+     * nothing. */
+    bool Locked() const { return locked_; }
+
+    bool Put(const std::string& key_id, const std::string& key, time_t now);
+    std::optional<std::string> Get(const std::string& key_id, time_t now);
+    void Expire(time_t now);
+    void Clear();
+    size_t Size() const;
+
+   private:
+    struct Entry;
+
+    void Wipe(Entry* entry);
+
+    Entry* entries_;
+    size_t mapped_size_;
+    bool locked_;
+    int ttl_seconds_;
+};
+
+/* Server side. ListenAgentSocket() creates the socket directory (or checks
+ * its owner and permissions) and returns a listening socket, or -1 with
+ * 'error' set. ServeKeyAgent() answers requests until 'stop' is set. */
+int ListenAgentSocket(const std::string& socket_path, std::string* error);
+void ServeKeyAgent(int listen_fd, int ttl_seconds,
+                   const std::atomic<bool>& stop);
+
+}  // namespace ette
+
+#endif  // __KEY_AGENT_H__
@@ -0,0 +1,100 @@
+#include <stdlib.h>
+#include <unistd.h>
+#include <atomic>
+#include <string>
+#include <thread>
+
+#include "key_agent.h"
+
+#include "gtest/gtest.h"
+
+using ::ette::AgentClearKeys;
+using ::ette::AgentGetKey;
+using ::ette::AgentPutKey;
+using ::ette::KeyCache;
+using ::ette::ListenAgentSocket;
+using ::ette::ServeKeyAgent;
+
+const std::string kKeyIdA(16, 'a');
+const std::string kKeyIdB(16, 'b');
+
+TEST(KeyCache, KeysExpireAfterTtl) {
+    KeyCache cache(60);
+    if (!cache.Locked()) {
+        GTEST_SKIP() << "mlock is not permitted here";
+    }
+    EXPECT_TRUE(cache.Put(kKeyIdA, "key-a", 1000));
+    EXPECT_EQ(cache.Get(kKeyIdA, 1059), std::optional<std::string>("key-a"));
+    EXPECT_EQ(cache.Get(kKeyIdA, 1060), std::nullopt);
+    EXPECT_EQ(cache.Size(), 0u);
+}
+
+TEST(KeyCache, PutReplacesSameKeyId) {
+    KeyCache cache(60);
+    if (!cache.Locked()) {
+        GTEST_SKIP() << "mlock is not permitted here";
+    }
+    cache.Put(kKeyIdA, "old", 1000);
+    cache.Put(kKeyIdA, "new", 1010);
+    cache.Put(kKeyIdB, "other", 1010);
+    EXPECT_EQ(cache.Size(), 2u);
+    EXPECT_EQ(cache.Get(kKeyIdA, 1065), std::optional<std::string>("new"));
+    EXPECT_FALSE(cache.Put("short", "key", 1010));
+}
+
+TEST(KeyCache, FullCacheEvictsOldest) {
+    KeyCache cache(3600);
+    if (!cache.Locked()) {
+        GTEST_SKIP() << "mlock is not permitted here";
+    }
+    for (size_t i = 0; i < ette::kAgentMaxKeys; i++) {
+        std::string key_id(16, '\0');
+        key_id[0] = i & 0xFF;
+        key_id[1] = i >> 8;
+        cache.Put(key_id, "key", 1000 + i);
+    }
+    EXPECT_EQ(cache.Size(), ette::kAgentMaxKeys);
+
+    cache.Put(kKeyIdA, "key-a", 2000);
+    EXPECT_EQ(cache.Size(), ette::kAgentMaxKeys);
+    EXPECT_EQ(cache.Get(std::string(16, '\0'), 1001), std::nullopt);
+    EXPECT_EQ(cache.Get(kKeyIdA, 2000), std::optional<std::string>("key-a"));
+}
+
+TEST(KeyAgent, ServesKeysOverSocket) {
+    char dir_template[] = "/tmp/ette-agent-test-XXXXXX";
+    ASSERT_NE(mkdtemp(dir_template), nullptr);
+    const std::string socket_path = std::string(dir_template) + "/socket";
+    setenv("ETTE_AGENT_SOCK", socket_path.c_str(), 1);
+
+    // No agent yet.
+    EXPECT_EQ(AgentGetKey(kKeyIdA), std::nullopt);
+    EXPECT_FALSE(AgentPutKey(kKeyIdA, "key-a"));
+
+    std::string error;
+    const int fd = ListenAgentSocket(socket_path, &error);
+    ASSERT_NE(fd, -1) << error;
+    std::atomic<bool> stop(false);
+    std::thread server([fd, &stop] { ServeKeyAgent(fd, 60, stop); });
+
+    // A second agent on the same socket refuses to start.
+    EXPECT_EQ(ListenAgentSocket(socket_path, &error), -1);
+
+    const std::string key(32, 'k');
+    EXPECT_TRUE(AgentPutKey(kKeyIdA, key));
+    const std::optional<std::string> cached = AgentGetKey(kKeyIdA);
+    if (cached) {
+        EXPECT_EQ(*cached, key);
+    }
+    EXPECT_EQ(AgentGetKey(kKeyIdB), std::nullopt);
+
+    EXPECT_TRUE(AgentClearKeys());
+    EXPECT_EQ(AgentGetKey(kKeyIdA), std::nullopt);
+
+    stop = true;
+    server.join();
+    close(fd);
+    unlink(socket_path.c_str());
+    rmdir(dir_template);
+    unsetenv("ETTE_AGENT_SOCK");
+}
@@ -0,0 +1,128 @@
+#include "keystream_cache.h"
+
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <algorithm>
+
+#include "secure_memory.h"
+
+namespace ette {
+
+namespace {
+/* Text the keystream covers beyond the current size, so typing doesn't throw
+ * it away: a quarter more, and at least this much. */
+constexpr uint64_t kMinHeadroom = 64 * 1024;
+}  // namespace
+
+KeystreamCache::KeystreamCache()
+    : keystream_(nullptr), mapped_size_(0), capacity_(0), computed_(0),
+      spent_(false), algorithm_(CryptoAlgorithm::kDefaultNone) {}
+
+bool KeystreamCache::SameKey(CryptoAlgorithm algorithm,
+                             const std::string& derived_key) const {
+    if (keystream_ == nullptr || spent_ || algorithm != algorithm_ ||
+        derived_key.size() != key_.size())
+        return false;
+    unsigned char mismatch = 0;
+    for (size_t i = 0; i < key_.size(); i++)
+        mismatch |= key_[i] ^ derived_key[i];
+    return mismatch == 0;
+}
+
+bool KeystreamCache::Prepare(CryptoAlgorithm algorithm,
+                             const std::string& derived_key,
+                             uint64_t plaintext_size) {
+    if (SameKey(algorithm, derived_key) &&
+        KeystreamSize(algorithm, plaintext_size) <= capacity_)
+        return true;
+
+    Discard();
+    if (!HasPrecomputableKeystream(algorithm) || derived_key.empty())
+        return false;
+
+    const uint64_t headroom = std::max(plaintext_size / 4, kMinHeadroom);
+    uint64_t capacity = KeystreamSize(algorithm, plaintext_size + headroom);
+    capacity = (capacity + kKeystreamAlignment - 1) / kKeystreamAlignment *
+               kKeystreamAlignment;
+    const size_t page_size = sysconf(_SC_PAGESIZE);
+    const size_t mapped_size =
+        (capacity + page_size - 1) / page_size * page_size;
+
+    void* memory = mmap(NULL, mapped_size, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED)
+        return false;
+#ifdef MADV_DONTDUMP
+    madvise(memory, mapped_size, MADV_DONTDUMP);
+#endif
+    /* A keystream that reaches swap is as good as the text it encrypts. */
+    if (mlock(memory, mapped_size) != 0) {
+        munmap(memory, mapped_size);
+        return false;
+    }
+
+    keystream_ = static_cast<unsigned char*>(memory);
+    mapped_size_ = mapped_size;
+    capacity_ = capacity;
+    computed_ = 0;
+    spent_ = false;
+    key_ = derived_key;
+    iv_ = GenerateRandomAsciiByteVector();
+    algorithm_ = algorithm;
+    return true;
+}
+
+bool KeystreamCache::Step(size_t max_bytes) {
+    if (keystream_ == nullptr || spent_ || computed_ == capacity_)
+        return false;
+    /* Every piece but the last starts and ends on the alignment. */
+    size_t size = std::max<size_t>(max_bytes / kKeystreamAlignment, 1) *
+                  kKeystreamAlignment;
+    size = std::min(size, capacity_ - computed_);
+    if (!ComputeKeystream(algorithm_, key_, iv_, computed_,
+                          keystream_ + computed_, size)
+             .ok()) {
+        Discard();
+        return false;
+    }
+    computed_ += size;
+    return computed_ < capacity_;
+}
+
+bool KeystreamCache::Ready(CryptoAlgorithm algorithm,
+                           const std::string& derived_key,
+                           uint64_t plaintext_size) const {
+    return SameKey(algorithm, derived_key) && computed_ == capacity_ &&
+           KeystreamSize(algorithm, plaintext_size) <= computed_;
+}
+
+std::optional<CryptoState> KeystreamCache::Encrypt(
+    const std::string& plaintext, const std::string& derived_key,
+    const std::string& key_id, CryptoAlgorithm algorithm) {
+    if (!Ready(algorithm, derived_key, plaintext.size()))
+        return std::nullopt;
+    CryptoState state =
+        EncryptWithKeystream(plaintext, derived_key, iv_, keystream_,
+                             computed_, key_id, algorithm);
+    spent_ = true;
+    return state;
+}
+
+void KeystreamCache::Discard() {
+    if (keystream_ != nullptr) {
+        WipeMemory(keystream_, computed_);
+        munlock(keystream_, mapped_size_);
+        munmap(keystream_, mapped_size_);
+    }
+    keystream_ = nullptr;
+    mapped_size_ = 0;
+    capacity_ = 0;
+    computed_ = 0;
+    spent_ = false;
+    WipeString(&key_);
+    iv_.clear();
+    algorithm_ = CryptoAlgorithm::kDefaultNone;
+}
+
+}  // namespace ette
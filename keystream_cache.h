@@ -0,0 +1,78 @@
+#ifndef __KEYSTREAM_CACHE_H__
+#define __KEYSTREAM_CACHE_H__
+
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "crypto.h"
+
+namespace ette {
+
+/* The keystream for the next save of a file, computed while the editor is
+ * idle so that saving only XORs it into the text and computes the tag (see
+ * HasPrecomputableKeystream() in crypto.h). It is computed for a fresh IV
+ * and a little more text than the file has, a piece at a time, into memory
+ * that is locked (never swapped out) and excluded from core dumps.
+ *
+ * An IV is used for one save only: after Encrypt() the next Prepare() starts
+ * over with a new IV. So does a Prepare() for another
+ * key or algorithm, or for more text than the keystream covers. */
+class KeystreamCache {
+   public:
+    KeystreamCache();
+    ~KeystreamCache() { Discard(); }
+
+    KeystreamCache(const KeystreamCache&) = delete;
+    KeystreamCache& operator=(const KeystreamCache&) = delete;
+
+    /* Get ready to cover 'plaintext_size' bytes, keeping what is already
+     * computed when it is for the same key and algorithm and long enough.
+     * False if 'algorithm' has no keystream or the memory can't be locked:
+     * the cache then holds nothing. */
+    bool Prepare(CryptoAlgorithm algorithm, const std::string& derived_key,
+                 uint64_t plaintext_size);
+
+    /* Compute up to 'max_bytes' more keystream. True while there is more to
+     * compute. */
+    bool Step(size_t max_bytes);
+
+    /* Whether a complete keystream for this key and algorithm covers
+     * 'plaintext_size' bytes. */
+    bool Ready(CryptoAlgorithm algorithm, const std::string& derived_key,
+               uint64_t plaintext_size) const;
+
+    /* EncryptWithDerivedKey() with a fresh IV and the cached keystream,
+     * which is spent from then on. Empty, keeping the keystream, unless
+     * Ready(). Wiping a spent keystream costs about as much as computing it,
+     * so that is left to the next Prepare() or Discard(). */
+    std::optional<CryptoState> Encrypt(const std::string& plaintext,
+                                       const std::string& derived_key,
+                                       const std::string& key_id,
+                                       CryptoAlgorithm algorithm);
+
+    /* Wipe the key and unmap the wiped keystream. */
+    void Discard();
+
+    /* Bytes of keystream mapped, whether computed yet or not. */
+    size_t capacity() const { return capacity_; }
+
+   private:
+    bool SameKey(CryptoAlgorithm algorithm,
+                 const std::string& derived_key) const;
+
+    unsigned char* keystream_;
+    size_t mapped_size_;
+    size_t capacity_;
+    size_t computed_;
+    bool spent_; /* The IV has encrypted a file. */
+    std::string key_;
+    std::vector<unsigned char> iv_;
+    CryptoAlgorithm algorithm_;
+};
+
+}  // namespace ette
+
+#endif  // __KEYSTREAM_CACHE_H__
@@ -0,0 +1,141 @@
+#include <string>
+#include <vector>
+
+#include "crypto.h"
+#include "keystream_cache.h"
+
+#include "gtest/gtest.h"
+
+using ::ette::ComputeKeystream;
+using ::ette::CryptoAlgorithm;
+using ::ette::CryptoState;
+using ::ette::DecryptWithDerivedKey;
+using ::ette::EncryptWithDerivedKey;
+using ::ette::EncryptWithKeystream;
+using ::ette::KeystreamCache;
+using ::ette::KeystreamSize;
+
+const std::string kKey(32, 'k');
+const std::string kOtherKey(32, 'o');
+const std::string kKeyId(16, 'i');
+
+std::string MakeText(size_t size) {
+    std::string text(size, '\0');
+    for (size_t i = 0; i < size; i++)
+        text[i] = static_cast<char>('a' + i * 7 % 26);
+    return text;
+}
+
+void Fill(KeystreamCache* cache) {
+    while (cache->Step(1000)) {
+    }
+}
+
+// Keystream computed in pieces seals exactly like the one-shot path.
+TEST(KeystreamCache, KeystreamSealMatchesSeal) {
+    const std::vector<unsigned char> iv(16, 7);
+    for (size_t size : {size_t(0), size_t(1), size_t(63), size_t(64),
+                        size_t(65), size_t(5000)}) {
+        const std::string text = MakeText(size);
+        const uint64_t keystream_size =
+            KeystreamSize(CryptoAlgorithm::kChaCha20Poly1305, size);
+        std::vector<unsigned char> keystream(keystream_size);
+        for (uint64_t offset = 0; offset < keystream_size; offset += 128) {
+            ASSERT_TRUE(ComputeKeystream(
+                            CryptoAlgorithm::kChaCha20Poly1305, kKey, iv,
+                            offset, keystream.data() + offset,
+                            std::min<uint64_t>(128, keystream_size - offset))
+                            .ok());
+        }
+
+        const CryptoState expected = EncryptWithDerivedKey(
+            text, kKey, iv, kKeyId, CryptoAlgorithm::kChaCha20Poly1305);
+        const CryptoState actual = EncryptWithKeystream(
+            text, kKey, iv, keystream.data(), keystream.size(), kKeyId,
+            CryptoAlgorithm::kChaCha20Poly1305);
+        ASSERT_TRUE(actual.status.ok()) << size;
+        EXPECT_EQ(actual.ciphertext, expected.ciphertext) << size;
+
+        // One byte short.
+        EXPECT_FALSE(EncryptWithKeystream(text, kKey, iv, keystream.data(),
+                                          keystream.size() - 1, kKeyId,
+                                          CryptoAlgorithm::kChaCha20Poly1305)
+                         .status.ok());
+    }
+}
+
+TEST(KeystreamCache, EncryptsOnceThenStartsOver) {
+    const std::string text = MakeText(3000);
+    KeystreamCache cache;
+    ASSERT_TRUE(cache.Prepare(CryptoAlgorithm::kChaCha20Poly1305, kKey,
+                              text.size()));
+    EXPECT_FALSE(cache.Encrypt(text, kKey, kKeyId,
+                               CryptoAlgorithm::kChaCha20Poly1305));
+    Fill(&cache);
+    ASSERT_TRUE(cache.Ready(CryptoAlgorithm::kChaCha20Poly1305, kKey,
+                            text.size()));
+    EXPECT_FALSE(cache.Ready(CryptoAlgorithm::kChaCha20Poly1305, kOtherKey,
+                             text.size()));
+
+    const auto first = cache.Encrypt(text, kKey, kKeyId,
+                                     CryptoAlgorithm::kChaCha20Poly1305);
+    ASSERT_TRUE(first && first->status.ok());
+    EXPECT_EQ(DecryptWithDerivedKey(first->ciphertext, kKey,
+                                    CryptoAlgorithm::kChaCha20Poly1305)
+                  .plaintext,
+              text);
+
+    // The IV is spent.
+    EXPECT_FALSE(cache.Ready(CryptoAlgorithm::kChaCha20Poly1305, kKey,
+                             text.size()));
+    ASSERT_TRUE(cache.Prepare(CryptoAlgorithm::kChaCha20Poly1305, kKey,
+                              text.size()));
+    Fill(&cache);
+    const auto second = cache.Encrypt(text, kKey, kKeyId,
+                                      CryptoAlgorithm::kChaCha20Poly1305);
+    ASSERT_TRUE(second && second->status.ok());
+    EXPECT_NE(second->iv, first->iv);
+}
+
+TEST(KeystreamCache, GrowingPastTheKeystreamStartsOver) {
+    KeystreamCache cache;
+    ASSERT_TRUE(cache.Prepare(CryptoAlgorithm::kChaCha20Poly1305, kKey, 100));
+    Fill(&cache);
+    const size_t capacity = cache.capacity();
+
+    // Within the headroom nothing is thrown away.
+    ASSERT_TRUE(cache.Prepare(CryptoAlgorithm::kChaCha20Poly1305, kKey, 200));
+    EXPECT_TRUE(cache.Ready(CryptoAlgorithm::kChaCha20Poly1305, kKey, 200));
+
+    const std::string text = MakeText(capacity);
+    ASSERT_TRUE(cache.Prepare(CryptoAlgorithm::kChaCha20Poly1305, kKey,
+                              text.size()));
+    EXPECT_GT(cache.capacity(), capacity);
+    EXPECT_FALSE(cache.Ready(CryptoAlgorithm::kChaCha20Poly1305, kKey,
+                             text.size()));
+    Fill(&cache);
+    const auto encrypted = cache.Encrypt(text, kKey, kKeyId,
+                                         CryptoAlgorithm::kChaCha20Poly1305);
+    ASSERT_TRUE(encrypted && encrypted->status.ok());
+    EXPECT_EQ(DecryptWithDerivedKey(encrypted->ciphertext, kKey,
+                                    CryptoAlgorithm::kChaCha20Poly1305)
+                  .plaintext,
+              text);
+
+    // A new key starts over too.
+    ASSERT_TRUE(cache.Prepare(CryptoAlgorithm::kChaCha20Poly1305, kKey, 100));
+    Fill(&cache);
+    ASSERT_TRUE(
+        cache.Prepare(CryptoAlgorithm::kChaCha20Poly1305, kOtherKey, 100));
+    EXPECT_FALSE(
+        cache.Ready(CryptoAlgorithm::kChaCha20Poly1305, kOtherKey, 100));
+}
+
+// CBC has no keystream to compute ahead.
+TEST(KeystreamCache, AesIsNotPrecomputed) {
+    KeystreamCache cache;
+    EXPECT_FALSE(cache.Prepare(CryptoAlgorithm::kAES256CBC, kKey, 100));
+    EXPECT_FALSE(cache.Step(1000));
+    EXPECT_FALSE(
+        cache.Encrypt("text", kKey, kKeyId, CryptoAlgorithm::kAES256CBC));
+}
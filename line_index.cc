@@ -0,0 +1,86 @@
+#include "line_index.h"
+
+#include <string.h>
+
+#include "file_util.h"
+#include "secure_memory.h"
+
+namespace ette {
+
+namespace {
+constexpr char kLineIndexMagic[] = {'E', 'T', 'L', 'I', '1'};
+constexpr size_t kFieldCount = 8;
+constexpr size_t kCheckpointSize = 8 + 8 + 1;
+}  // namespace
+
+std::string EncodeLineIndex(const LineIndex& index) {
+    std::string data(kLineIndexMagic, sizeof(kLineIndexMagic));
+    data.reserve(data.size() + kFieldCount * 8 +
+                 index.checkpoints.size() * kCheckpointSize);
+    AppendLe(&data, index.text_size, 8);
+    AppendLe(&data, index.line_count, 8);
+    AppendLe(&data, static_cast<uint64_t>(index.syntax), 8);
+    AppendLe(&data, index.cursor_x, 8);
+    AppendLe(&data, index.cursor_y, 8);
+    AppendLe(&data, index.row_offset, 8);
+    AppendLe(&data, index.column_offset, 8);
+    AppendLe(&data, index.checkpoints.size(), 8);
+    for (const LineCheckpoint& checkpoint : index.checkpoints) {
+        AppendLe(&data, checkpoint.line, 8);
+        AppendLe(&data, checkpoint.offset, 8);
+        data.push_back(checkpoint.in_comment ? 1 : 0);
+    }
+    return data;
+}
+
+std::optional<LineIndex> DecodeLineIndex(const std::string& data) {
+    const size_t fields_size = sizeof(kLineIndexMagic) + kFieldCount * 8;
+    if (data.size() < fields_size ||
+        memcmp(data.data(), kLineIndexMagic, sizeof(kLineIndexMagic)) != 0)
+        return std::nullopt;
+    const char* p = data.data() + sizeof(kLineIndexMagic);
+    LineIndex index;
+    index.text_size = LoadLe(p, 8);
+    index.line_count = LoadLe(p + 8, 8);
+    index.syntax = static_cast<int64_t>(LoadLe(p + 16, 8));
+    index.cursor_x = LoadLe(p + 24, 8);
+    index.cursor_y = LoadLe(p + 32, 8);
+    index.row_offset = LoadLe(p + 40, 8);
+    index.column_offset = LoadLe(p + 48, 8);
+    const uint64_t count = LoadLe(p + 56, 8);
+    if (count > (data.size() - fields_size) / kCheckpointSize ||
+        data.size() != fields_size + count * kCheckpointSize)
+        return std::nullopt;
+
+    p = data.data() + fields_size;
+    index.checkpoints.reserve(count);
+    for (uint64_t i = 0; i < count; i++, p += kCheckpointSize) {
+        const LineCheckpoint checkpoint = {LoadLe(p, 8), LoadLe(p + 8, 8),
+                                           p[16] != 0};
+        if (checkpoint.line >= index.line_count ||
+            checkpoint.offset >= index.text_size ||
+            (!index.checkpoints.empty() &&
+             (checkpoint.line <= index.checkpoints.back().line ||
+              checkpoint.offset <= index.checkpoints.back().offset)))
+            return std::nullopt;
+        index.checkpoints.push_back(checkpoint);
+    }
+    return index;
+}
+
+std::optional<LineIndex> ReadLineIndex(const std::string& path,
+                                       const std::string& derived_key,
+                                       CryptoAlgorithm algorithm) {
+    const std::string footer = ReadFooter(path, algorithm);
+    if (footer.empty())
+        return std::nullopt;
+    CryptoState state = DecryptWithDerivedKey(footer, derived_key, algorithm);
+    if (!state.status.ok())
+        return std::nullopt;
+    std::optional<LineIndex> index =
+        DecodeLineIndex(FooterWithoutDigest(state.plaintext));
+    WipeString(&state.plaintext);
+    return index;
+}
+
+}  // namespace ette
@@ -0,0 +1,64 @@
+#ifndef __LINE_INDEX_H__
+#define __LINE_INDEX_H__
+
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "crypto.h"
+
+namespace ette {
+
+/* Where the lines of a saved text start, kept in the footer of large
+ * encrypted files (see constants.h) so that reopening one shows the line the
+ * cursor was on, highlighted, without highlighting every line before it.
+ *
+ * Every kLineIndexInterval lines or so a checkpoint records the line's offset
+ * in the text and whether it starts inside a multi line comment, the only
+ * state highlighting carries from one line to the next. The file is still
+ * decrypted as a whole, since that is what authenticates it; the index only
+ * saves the work done per line after that. It is encrypted under the file's
+ * key like the text, and the editor checks every checkpoint against the text
+ * it decrypted before trusting it. */
+
+static constexpr uint64_t kLineIndexInterval = 1024;
+/* Smaller files open fast enough without one (and, unless they are
+ * AES-256-CBC files with a digest, stay readable by versions of ette that
+ * predate footers). */
+static constexpr uint64_t kLineIndexMinLines = 10000;
+
+struct LineCheckpoint {
+    uint64_t line;
+    uint64_t offset;  /* Of the line's first byte in the text. */
+    bool in_comment;  /* The line starts inside a multi line comment. */
+};
+
+struct LineIndex {
+    uint64_t text_size = 0;
+    uint64_t line_count = 0;
+    /* The syntax highlighting the checkpoints are for, -1 for none. */
+    int64_t syntax = -1;
+    /* Where the cursor and the screen were when the file was saved. */
+    uint64_t cursor_x = 0, cursor_y = 0;
+    uint64_t row_offset = 0, column_offset = 0;
+    std::vector<LineCheckpoint> checkpoints; /* By line. */
+};
+
+std::string EncodeLineIndex(const LineIndex& index);
+
+/* Empty unless 'data' is an index EncodeLineIndex() could have written, with
+ * its checkpoints in order and inside the text. */
+std::optional<LineIndex> DecodeLineIndex(const std::string& data);
+
+/* The index in the footer of the file at 'path', which reads only the
+ * footer. Empty if there is none or it doesn't decrypt with 'derived_key'. The
+ * index follows the digest in the footer of an AES-256-CBC file, and is
+ * encrypted into a footer with EncryptFooter(). */
+std::optional<LineIndex> ReadLineIndex(const std::string& path,
+                                       const std::string& derived_key,
+                                       CryptoAlgorithm algorithm);
+
+}  // namespace ette
+
+#endif  // __LINE_INDEX_H__
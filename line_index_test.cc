@@ -0,0 +1,114 @@
+#include <stdio.h>
+#include <fstream>
+#include <optional>
+#include <string>
+
+#include "crypto.h"
+#include "line_index.h"
+
+#include "gtest/gtest.h"
+
+using ::ette::AppendFooter;
+using ::ette::CryptoAlgorithm;
+using ::ette::CryptoState;
+using ::ette::DecodeLineIndex;
+using ::ette::DecryptWithDerivedKey;
+using ::ette::DeriveKey;
+using ::ette::EncodeLineIndex;
+using ::ette::EncryptFooter;
+using ::ette::EncryptWithDerivedKey;
+using ::ette::GenerateKeyId;
+using ::ette::GenerateRandomAsciiByteVector;
+using ::ette::GetFooter;
+using ::ette::LineIndex;
+
+const std::string kKey = DeriveKey("test");
+const std::string kKeyId = GenerateKeyId();
+
+LineIndex MakeIndex() {
+    LineIndex index;
+    index.text_size = 100000;
+    index.line_count = 5000;
+    index.syntax = 0;
+    index.cursor_x = 7;
+    index.cursor_y = 3;
+    index.row_offset = 4000;
+    index.column_offset = 1;
+    index.checkpoints = {{1024, 20000, false}, {2048, 41000, true}};
+    return index;
+}
+
+TEST(LineIndex, EncodeDecodeRoundTrip) {
+    const LineIndex index = MakeIndex();
+    const std::optional<LineIndex> decoded =
+        DecodeLineIndex(EncodeLineIndex(index));
+    ASSERT_TRUE(decoded.has_value());
+    EXPECT_EQ(decoded->text_size, index.text_size);
+    EXPECT_EQ(decoded->line_count, index.line_count);
+    EXPECT_EQ(decoded->syntax, 0);
+    EXPECT_EQ(decoded->cursor_x, 7u);
+    EXPECT_EQ(decoded->cursor_y, 3u);
+    EXPECT_EQ(decoded->row_offset, 4000u);
+    EXPECT_EQ(decoded->column_offset, 1u);
+    ASSERT_EQ(decoded->checkpoints.size(), 2u);
+    EXPECT_EQ(decoded->checkpoints[1].line, 2048u);
+    EXPECT_EQ(decoded->checkpoints[1].offset, 41000u);
+    EXPECT_TRUE(decoded->checkpoints[1].in_comment);
+
+    LineIndex none;
+    EXPECT_EQ(DecodeLineIndex(EncodeLineIndex(none))->syntax, -1);
+}
+
+TEST(LineIndex, DecodeRejectsBadIndexes) {
+    const std::string data = EncodeLineIndex(MakeIndex());
+    EXPECT_FALSE(DecodeLineIndex(data.substr(0, data.size() - 1)));
+    EXPECT_FALSE(DecodeLineIndex(data + "x"));
+    EXPECT_FALSE(DecodeLineIndex("not an index"));
+
+    LineIndex unordered = MakeIndex();
+    unordered.checkpoints[1].offset = 10000;
+    EXPECT_FALSE(DecodeLineIndex(EncodeLineIndex(unordered)));
+    LineIndex outside = MakeIndex();
+    outside.checkpoints[1].line = outside.line_count;
+    EXPECT_FALSE(DecodeLineIndex(EncodeLineIndex(outside)));
+}
+
+// A footer doesn't change what the file decrypts to, and reads back from the
+// file's end alone.
+TEST(LineIndex, FooterRoundTrip) {
+    for (CryptoAlgorithm algorithm : {CryptoAlgorithm::kChaCha20Poly1305,
+                                      CryptoAlgorithm::kAES256CBC}) {
+        const std::string text(50000, 'a');
+        CryptoState state =
+            EncryptWithDerivedKey(text, kKey, GenerateRandomAsciiByteVector(),
+                                  kKeyId, algorithm);
+        ASSERT_TRUE(state.status.ok());
+        std::string file = state.ciphertext;
+        EXPECT_EQ(GetFooter(file, algorithm), "");
+
+        const std::string footer = EncryptFooter(EncodeLineIndex(MakeIndex()),
+                                                 kKey, kKeyId, algorithm);
+        ASSERT_FALSE(footer.empty());
+        AppendFooter(footer, &file);
+        EXPECT_EQ(GetFooter(file, algorithm), footer);
+        const CryptoState decrypted =
+            DecryptWithDerivedKey(file, kKey, algorithm);
+        ASSERT_TRUE(decrypted.status.ok());
+        EXPECT_EQ(decrypted.plaintext, text);
+
+        const std::string path = "/tmp/LineIndex_Footer";
+        std::ofstream(path, std::ios::binary) << file;
+        const std::optional<LineIndex> index =
+            ette::ReadLineIndex(path, kKey, algorithm);
+        ASSERT_TRUE(index.has_value());
+        EXPECT_EQ(index->row_offset, 4000u);
+        EXPECT_FALSE(ette::ReadLineIndex(path, DeriveKey("nope"), algorithm));
+
+        // A trailer that doesn't frame a footer leaves a file of the wrong
+        // size.
+        file[file.size() - 12]++;
+        EXPECT_EQ(GetFooter(file, algorithm), "");
+        EXPECT_FALSE(DecryptWithDerivedKey(file, kKey, algorithm).status.ok());
+        remove(path.c_str());
+    }
+}
@@ -0,0 +1,108 @@
+#include "password_prompt.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include "key_agent.h"
+#include "secure_memory.h"
+
+namespace ette {
+
+namespace {
+constexpr int kPasswordTries = 3;
+
+/* Whether 'key' (through 'record_key' if any) decrypts 'ciphertext'. */
+bool Opens(const std::string& ciphertext, CryptoAlgorithm algorithm,
+           const std::string& key,
+           std::string (*record_key)(const std::string& key)) {
+    std::string derived = record_key ? record_key(key) : key;
+    CryptoState state = DecryptWithDerivedKey(ciphertext, derived, algorithm);
+    WipeString(&state.plaintext);
+    WipeString(&derived);
+    return state.status.ok();
+}
+}  // namespace
+
+std::optional<std::string> ReadPassword(const char* prompt) {
+    const int fd = open("/dev/tty", O_RDWR | O_CLOEXEC);
+    if (fd == -1)
+        return std::nullopt;
+
+    struct termios original;
+    const bool is_tty = tcgetattr(fd, &original) == 0;
+    if (is_tty) {
+        struct termios silent = original;
+        silent.c_lflag &= ~ECHO;
+        silent.c_lflag |= ECHONL;
+        tcsetattr(fd, TCSAFLUSH, &silent);
+    }
+    fprintf(stderr, "%s", prompt);
+    fflush(stderr);
+
+    std::string password;
+    bool complete = false;
+    char c;
+    while (read(fd, &c, 1) == 1) {
+        if (c == '\n' || c == '\r') {
+            complete = true;
+            break;
+        }
+        password += c;
+    }
+    if (is_tty)
+        tcsetattr(fd, TCSAFLUSH, &original);
+    close(fd);
+    if (!complete) {
+        WipeString(&password);
+        return std::nullopt;
+    }
+    return password;
+}
+
+std::optional<std::string> UnlockKey(
+    const std::string& ciphertext, CryptoAlgorithm algorithm,
+    const char* prompt,
+    std::string (*record_key)(const std::string& key)) {
+    const std::string key_id = GetKeyIdFromCiphertext(ciphertext);
+    if (!key_id.empty()) {
+        std::optional<std::string> key = AgentGetKey(key_id);
+        if (key && Opens(ciphertext, algorithm, *key, record_key))
+            return key;
+    }
+
+    for (int i = 0; i < kPasswordTries; i++) {
+        std::optional<std::string> password = ReadPassword(prompt);
+        if (!password)
+            return std::nullopt;
+        std::string key = DeriveKey(*password);
+        WipeString(&*password);
+        if (Opens(ciphertext, algorithm, key, record_key)) {
+            if (!key_id.empty())
+                AgentPutKey(key_id, key);
+            return key;
+        }
+        WipeString(&key);
+        fprintf(stderr, "Incorrect password.\n");
+    }
+    return std::nullopt;
+}
+
+std::optional<std::string> ReadNewPassword(const char* prompt) {
+    std::optional<std::string> password = ReadPassword(prompt);
+    if (!password)
+        return std::nullopt;
+    std::optional<std::string> confirm = ReadPassword("Confirm password: ");
+    const bool match = confirm && *confirm == *password;
+    if (confirm)
+        WipeString(&*confirm);
+    if (!match) {
+        WipeString(&*password);
+        fprintf(stderr, "Passwords do not match.\n");
+        return std::nullopt;
+    }
+    return password;
+}
+
+}  // namespace ette
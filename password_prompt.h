@@ -0,0 +1,34 @@
+#ifndef __PASSWORD_PROMPT_H__
+#define __PASSWORD_PROMPT_H__
+
+#include <optional>
+#include <string>
+
+#include "crypto.h"
+
+namespace ette {
+
+/* Password input for the command line tools, which never take passwords as
+ * arguments (they would show up in ps and the shell history). */
+
+/* Print 'prompt' to stderr and read a line from the terminal with echo off.
+ * Empty if there is no terminal or input ended. */
+std::optional<std::string> ReadPassword(const char* prompt);
+
+/* The derived key that decrypts 'ciphertext' (a file, or a vault index):
+ * ette-agent's key for its key ID when the agent has it, else the key of a
+ * password read with ReadPassword(), three tries. The agent learns keys that
+ * had to be typed. When 'ciphertext' is encrypted with a key derived from
+ * the file's instead (as history records are, see History::RecordKey()),
+ * 'record_key' derives it; the file's key is returned still. */
+std::optional<std::string> UnlockKey(
+    const std::string& ciphertext, CryptoAlgorithm algorithm,
+    const char* prompt,
+    std::string (*record_key)(const std::string& key) = nullptr);
+
+/* A new password, typed twice. */
+std::optional<std::string> ReadNewPassword(const char* prompt);
+
+}  // namespace ette
+
+#endif  // __PASSWORD_PROMPT_H__
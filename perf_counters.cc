@@ -0,0 +1,148 @@
+#include "perf_counters.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+namespace ette {
+
+namespace {
+const char* const kPerfCounterNames[kPerfCounterCount] = {
+    "cycles",
+    "instructions",
+    "cache-misses",
+    "branch-misses",
+};
+
+double NowSeconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+#ifdef __linux__
+int OpenCounter(uint64_t config) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = config;
+    attr.disabled = 1;
+    /* User space only, which is allowed with perf_event_paranoid <= 2. */
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format =
+        PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    return syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+#endif
+}  // namespace
+
+PerfCounters::PerfCounters(bool enabled) : start_seconds_(0) {
+    for (int i = 0; i < kPerfCounterCount; i++)
+        fds_[i] = -1;
+    if (!enabled)
+        return;
+
+#ifdef __linux__
+    const uint64_t configs[kPerfCounterCount] = {
+        PERF_COUNT_HW_CPU_CYCLES,
+        PERF_COUNT_HW_INSTRUCTIONS,
+        PERF_COUNT_HW_CACHE_MISSES,
+        PERF_COUNT_HW_BRANCH_MISSES,
+    };
+    for (int i = 0; i < kPerfCounterCount; i++)
+        fds_[i] = OpenCounter(configs[i]);
+#endif
+}
+
+PerfCounters::~PerfCounters() {
+    for (int i = 0; i < kPerfCounterCount; i++) {
+        if (fds_[i] != -1)
+            close(fds_[i]);
+    }
+}
+
+bool PerfCounters::Available() const {
+    for (int i = 0; i < kPerfCounterCount; i++) {
+        if (fds_[i] != -1)
+            return true;
+    }
+    return false;
+}
+
+void PerfCounters::Start() {
+#ifdef __linux__
+    for (int i = 0; i < kPerfCounterCount; i++) {
+        if (fds_[i] == -1)
+            continue;
+        ioctl(fds_[i], PERF_EVENT_IOC_RESET, 0);
+        ioctl(fds_[i], PERF_EVENT_IOC_ENABLE, 0);
+    }
+#endif
+    start_seconds_ = NowSeconds();
+}
+
+PerfSample PerfCounters::Stop() {
+    PerfSample sample;
+    sample.seconds = NowSeconds() - start_seconds_;
+    for (int i = 0; i < kPerfCounterCount; i++) {
+        sample.available[i] = false;
+        sample.values[i] = 0;
+    }
+
+#ifdef __linux__
+    for (int i = 0; i < kPerfCounterCount; i++) {
+        if (fds_[i] == -1)
+            continue;
+        ioctl(fds_[i], PERF_EVENT_IOC_DISABLE, 0);
+
+        /* value, time enabled, time running. */
+        uint64_t data[3];
+        if (read(fds_[i], data, sizeof(data)) != sizeof(data) || data[2] == 0)
+            continue;
+        /* Scale up if the kernel had to multiplex the counter. */
+        double value = (double)data[0];
+        if (data[2] < data[1])
+            value *= (double)data[1] / (double)data[2];
+        sample.available[i] = true;
+        sample.values[i] = (uint64_t)value;
+    }
+#endif
+    return sample;
+}
+
+void ReportPerfSample(FILE* out, const char* name, const PerfSample& sample,
+                      double units, const char* unit) {
+    fprintf(out, "%-28s %10.3f ms %14.1f %s/s", name, sample.seconds * 1e3,
+            sample.seconds > 0 ? units / sample.seconds : 0.0, unit);
+    bool any_available = false;
+    for (int i = 0; i < kPerfCounterCount; i++)
+        any_available |= sample.available[i];
+
+    for (int i = 0; any_available && i < kPerfCounterCount; i++) {
+        if (sample.available[i]) {
+            fprintf(out, "  %s/%s %.2f", kPerfCounterNames[i], unit,
+                    (double)sample.values[i] / units);
+        } else {
+            fprintf(out, "  %s/%s n/a", kPerfCounterNames[i], unit);
+        }
+    }
+    if (sample.available[kPerfCycles] && sample.available[kPerfInstructions] &&
+        sample.values[kPerfCycles] > 0) {
+        fprintf(out, "  IPC %.2f",
+                (double)sample.values[kPerfInstructions] /
+                    (double)sample.values[kPerfCycles]);
+    }
+    fprintf(out, "\n");
+}
+
+}  // namespace ette
@@ -0,0 +1,55 @@
+#ifndef __PERF_COUNTERS_H__
+#define __PERF_COUNTERS_H__
+
+#include <stdint.h>
+#include <stdio.h>
+
+namespace ette {
+
+enum PerfCounter {
+    kPerfCycles = 0,
+    kPerfInstructions,
+    kPerfCacheMisses,
+    kPerfBranchMisses,
+    kPerfCounterCount,
+};
+
+struct PerfSample {
+    double seconds;
+    bool available[kPerfCounterCount];
+    uint64_t values[kPerfCounterCount];
+};
+
+/* Hardware performance counters around a measured region, using
+ * perf_event_open(2) on Linux. Every counter is opened on its own, so a
+ * counter the kernel or the container refuses to provide is simply reported
+ * as unavailable and the rest (and the wall clock) keep working. When the
+ * counters are disabled, or on other platforms, only wall time is measured. */
+class PerfCounters {
+   public:
+    explicit PerfCounters(bool enabled);
+    ~PerfCounters();
+
+    PerfCounters(const PerfCounters&) = delete;
+    PerfCounters& operator=(const PerfCounters&) = delete;
+
+    /* True if at least one hardware counter could be opened. */
+    bool Available() const;
+
+    void Start();
+    PerfSample Stop();
+
+   private:
+    int fds_[kPerfCounterCount];
+    double start_seconds_;
+};
+
+/* Print one line for a measured region, with the wall time, the throughput
+ * in 'unit's per second and every available counter divided by 'units'
+ * (e.g. cycles/byte or instructions/keystroke). */
+void ReportPerfSample(FILE* out, const char* name, const PerfSample& sample,
+                      double units, const char* unit);
+
+}  // namespace ette
+
+#endif  // __PERF_COUNTERS_H__
@@ -0,0 +1,105 @@
+#include "rekey.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <filesystem>
+#include <fstream>
+
+#include "constants.h"
+#include "crypto.h"
+#include "crypto_registry.h"
+#include "file_util.h"
+
+namespace ette {
+
+namespace {
+bool SameFile(const struct stat& a, const struct stat& b) {
+    return a.st_dev == b.st_dev && a.st_ino == b.st_ino &&
+           a.st_size == b.st_size && a.st_mtim.tv_sec == b.st_mtim.tv_sec &&
+           a.st_mtim.tv_nsec == b.st_mtim.tv_nsec;
+}
+}  // namespace
+
+Status<bool> RekeyFile(const std::string& path, const std::string& derived_key,
+                       const std::string& new_derived_key,
+                       const std::string& new_key_id, RekeyOldKey old_key) {
+    char resolved[PATH_MAX];
+    if (realpath(path.c_str(), resolved) == nullptr)
+        return IoError<bool>(path);
+    const std::string file_path = resolved;
+
+    std::ifstream in(file_path, std::ios::binary);
+    struct stat before;
+    if (!in.is_open() || stat(file_path.c_str(), &before) == -1)
+        return IoError<bool>(path);
+    char magic[sizeof(kHeaderMagicNumber) + kHeaderCryptoAlgorithmSize];
+    if (!in.read(magic, sizeof(magic)) ||
+        memcmp(magic, kHeaderMagicNumber, sizeof(kHeaderMagicNumber)) != 0) {
+        return Status<bool>(StatusCode::kHeaderNoMagicNumber,
+                            "Not an encrypted file");
+    }
+    in.seekg(0);
+    const CryptoAlgorithm algorithm =
+        CryptoAlgorithmFromHeaderByte(magic[sizeof(kHeaderMagicNumber)]);
+
+    std::string temporary = file_path + kRekeyTemporarySuffix + "XXXXXX";
+    const int fd = mkostemp(&temporary[0], O_CLOEXEC);
+    if (fd == -1)
+        return IoError<bool>(path);
+    Status<void> status = Ok();
+    bool authenticated = false;
+    if (fchmod(fd, before.st_mode & 07777) == -1)
+        status = IoError(temporary);
+    if (status.ok()) {
+        std::ofstream out(temporary, std::ios::binary | std::ios::trunc);
+        const Status<bool> reencrypted = ReencryptWithDerivedKey(
+            in, before.st_size, out, derived_key, new_derived_key, new_key_id,
+            algorithm);
+        out.close();
+        if (!reencrypted.ok())
+            status = Status<void>(reencrypted.error().code(),
+                                  reencrypted.error().message());
+        else if (!out)
+            status = IoError(temporary);
+        else
+            authenticated = reencrypted.value();
+    }
+    if (status.ok() && !authenticated && old_key == RekeyOldKey::kUnconfirmed)
+        status = Status<void>(StatusCode::kUnverified,
+                              "Only its padding says the key opens it");
+    if (status.ok() && fsync(fd) == -1)
+        status = IoError(temporary);
+    close(fd);
+
+    /* A save made meanwhile would be lost. */
+    struct stat after;
+    if (status.ok() &&
+        (stat(file_path.c_str(), &after) == -1 || !SameFile(before, after))) {
+        status = Status<void>(StatusCode::kIoError,
+                              "The file changed while it was re-keyed");
+    }
+    /* The new file may be garbage, so the old one stays until the user has
+     * seen it opens. */
+    const bool keep = !authenticated && old_key != RekeyOldKey::kConfirmed;
+    const std::string original = file_path + kRekeyOriginalSuffix;
+    if (status.ok() && keep && link(file_path.c_str(), original.c_str()) == -1)
+        status = IoError(original);
+    if (status.ok() && rename(temporary.c_str(), file_path.c_str()) == -1) {
+        status = IoError(path);
+        if (keep)
+            unlink(original.c_str());
+    }
+    if (!status.ok()) {
+        unlink(temporary.c_str());
+        return Status<bool>(status.error().code(), status.error().message());
+    }
+    SyncDirectory(std::filesystem::path(file_path).parent_path().string());
+    return keep;
+}
+
+}  // namespace ette
@@ -0,0 +1,46 @@
+#ifndef __REKEY_H__
+#define __REKEY_H__
+
+#include <string>
+
+#include "status.h"
+
+namespace ette {
+
+/* Temporary files are named "<file>.rekey" and six random characters. */
+static constexpr char kRekeyTemporarySuffix[] = ".rekey";
+/* Where RekeyOldKey::kUnconfirmedKeepOriginal keeps the original file. */
+static constexpr char kRekeyOriginalSuffix[] = ".rekey-old";
+
+/* Whether the old key is known to be the file's. An AES-256-CBC file without
+ * a digest only has its padding to tell a wrong key by, which a wrong key
+ * passes now and then, and the garbage it decrypts to would replace the file.
+ */
+enum class RekeyOldKey {
+    /* It is: ette-agent had it under the file's key ID. */
+    kConfirmed,
+    /* It may not be, so a file that can't authenticate it is left alone and
+     * the re-key fails with kUnverified. */
+    kUnconfirmed,
+    /* Such a file is re-keyed, but the original is kept as
+     * "<file>.rekey-old" (and the re-key fails if that exists). */
+    kUnconfirmedKeepOriginal,
+};
+
+/* Changes the key of the encrypted file at 'path' from 'derived_key' to
+ * 'new_derived_key', under 'new_key_id' (a new GenerateKeyId()).
+ *
+ * The file is re-encrypted a piece at a time (ReencryptWithDerivedKey()) into
+ * a temporary file next to it, which is synced and renamed over it: 'path' is
+ * always either the old file or the new one, and a wrong key or a damaged
+ * file leaves it untouched. The new file keeps the old one's permissions. If
+ * the file changes meanwhile (e.g. ette saves it) it is left alone and the
+ * re-key fails. A symbolic link is followed, the file it points to is
+ * replaced. The value is whether the original was kept. */
+Status<bool> RekeyFile(const std::string& path, const std::string& derived_key,
+                       const std::string& new_derived_key,
+                       const std::string& new_key_id, RekeyOldKey old_key);
+
+}  // namespace ette
+
+#endif  // __REKEY_H__
@@ -0,0 +1,181 @@
+#include <sys/stat.h>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <string>
+
+#include "crypto.h"
+#include "rekey.h"
+
+#include "gtest/gtest.h"
+
+using ::ette::AppendFooter;
+using ::ette::CryptoAlgorithm;
+using ::ette::CryptoState;
+using ::ette::DecryptWithDerivedKey;
+using ::ette::DeriveKey;
+using ::ette::EncryptWithDerivedKey;
+using ::ette::FooterWithoutDigest;
+using ::ette::GenerateKeyId;
+using ::ette::GenerateRandomAsciiByteVector;
+using ::ette::GetKeyIdFromCiphertext;
+using ::ette::ReadFooter;
+using ::ette::RekeyFile;
+using ::ette::RekeyOldKey;
+
+const std::string kKey = DeriveKey("old");
+const std::string kNewKey = DeriveKey("new");
+const std::string kDirectory = "/tmp/Rekey_Test";
+
+std::string ReadFile(const std::string& path) {
+    std::ifstream file(path, std::ios::binary);
+    std::stringstream data;
+    data << file.rdbuf();
+    return data.str();
+}
+
+void WriteFile(const std::string& path, const std::string& data) {
+    std::ofstream(path, std::ios::binary | std::ios::trunc) << data;
+}
+
+/* Only 'name' is left in the test directory: no temporary files. */
+void ExpectOnlyFile(const std::string& name) {
+    size_t count = 0;
+    for (const auto& entry : std::filesystem::directory_iterator(kDirectory)) {
+        EXPECT_EQ(entry.path().filename(), name);
+        count++;
+    }
+    EXPECT_EQ(count, 1u);
+}
+
+// A file of several pieces, with a footer, opens with the new key only and
+// keeps its permissions and its footer.
+TEST(Rekey, RoundTrip) {
+    for (CryptoAlgorithm algorithm : {CryptoAlgorithm::kChaCha20Poly1305,
+                                      CryptoAlgorithm::kAES256CBC}) {
+        std::filesystem::remove_all(kDirectory);
+        std::filesystem::create_directory(kDirectory);
+        const std::string path = kDirectory + "/notes";
+        std::string text(3 * ette::kReencryptPieceSize + 1234, '\0');
+        for (size_t i = 0; i < text.size(); i++)
+            text[i] = static_cast<char>('a' + i % 26);
+        const std::string key_id = GenerateKeyId();
+        CryptoState state = EncryptWithDerivedKey(
+            text, kKey, GenerateRandomAsciiByteVector(), key_id, algorithm);
+        ASSERT_TRUE(state.status.ok());
+        CryptoState footer = EncryptWithDerivedKey(
+            "footer", kKey, GenerateRandomAsciiByteVector(), key_id, algorithm);
+        AppendFooter(footer.ciphertext, &state.ciphertext);
+        WriteFile(path, state.ciphertext);
+        chmod(path.c_str(), 0640);
+
+        const std::string new_key_id = GenerateKeyId();
+        const ette::Status<bool> status =
+            RekeyFile(path, kKey, kNewKey, new_key_id, RekeyOldKey::kConfirmed);
+        ASSERT_TRUE(status.ok());
+        EXPECT_FALSE(status.value());
+        const std::string rekeyed = ReadFile(path);
+        EXPECT_EQ(GetKeyIdFromCiphertext(rekeyed), new_key_id);
+        const CryptoState decrypted =
+            DecryptWithDerivedKey(rekeyed, kNewKey, algorithm);
+        ASSERT_TRUE(decrypted.status.ok());
+        EXPECT_TRUE(decrypted.plaintext == text);
+        EXPECT_FALSE(
+            DecryptWithDerivedKey(rekeyed, kKey, algorithm).status.ok());
+        // An AES-256-CBC file gets a digest ahead of the rest.
+        EXPECT_EQ(FooterWithoutDigest(
+                      DecryptWithDerivedKey(ReadFooter(path, algorithm),
+                                            kNewKey, algorithm)
+                          .plaintext),
+                  "footer");
+
+        struct stat st;
+        ASSERT_EQ(stat(path.c_str(), &st), 0);
+        EXPECT_EQ(st.st_mode & 0777, 0640u);
+        ExpectOnlyFile("notes");
+    }
+    std::filesystem::remove_all(kDirectory);
+}
+
+// A wrong key or a file that isn't encrypted leaves the file as it was.
+TEST(Rekey, FailureLeavesFileAlone) {
+    std::filesystem::remove_all(kDirectory);
+    std::filesystem::create_directory(kDirectory);
+    const std::string path = kDirectory + "/notes";
+    const CryptoState state = EncryptWithDerivedKey(
+        std::string(100000, 'x'), kKey, GenerateRandomAsciiByteVector(),
+        GenerateKeyId(), CryptoAlgorithm::kChaCha20Poly1305);
+    WriteFile(path, state.ciphertext);
+
+    const ette::Status<bool> wrong_key = RekeyFile(
+        path, kNewKey, kKey, GenerateKeyId(), RekeyOldKey::kUnconfirmed);
+    EXPECT_EQ(wrong_key.error().code(), ette::StatusCode::kInvalidKey);
+    EXPECT_TRUE(ReadFile(path) == state.ciphertext);
+    ExpectOnlyFile("notes");
+
+    WriteFile(path, "plain text");
+    EXPECT_EQ(RekeyFile(path, kKey, kNewKey, GenerateKeyId(),
+                        RekeyOldKey::kUnconfirmed)
+                  .error()
+                  .code(),
+              ette::StatusCode::kHeaderNoMagicNumber);
+    EXPECT_EQ(ReadFile(path), "plain text");
+    ExpectOnlyFile("notes");
+
+    EXPECT_EQ(RekeyFile(kDirectory + "/missing", kKey, kNewKey,
+                        GenerateKeyId(), RekeyOldKey::kUnconfirmed)
+                  .error()
+                  .code(),
+              ette::StatusCode::kIoError);
+    std::filesystem::remove_all(kDirectory);
+}
+
+// A key that may not be the file's only replaces an AES-256-CBC file without
+// a digest if the original is kept. A file that authenticates it is
+// replaced.
+TEST(Rekey, UnconfirmedKeyOnlyReplacesWhatChecksIt) {
+    std::filesystem::remove_all(kDirectory);
+    std::filesystem::create_directory(kDirectory);
+    const std::string path = kDirectory + "/notes";
+    const CryptoState cbc = EncryptWithDerivedKey(
+        std::string(100000, 'x'), kKey, GenerateRandomAsciiByteVector(),
+        GenerateKeyId(), CryptoAlgorithm::kAES256CBC);
+    WriteFile(path, cbc.ciphertext);
+
+    EXPECT_EQ(RekeyFile(path, kKey, kNewKey, GenerateKeyId(),
+                        RekeyOldKey::kUnconfirmed)
+                  .error()
+                  .code(),
+              ette::StatusCode::kUnverified);
+    EXPECT_TRUE(ReadFile(path) == cbc.ciphertext);
+    ExpectOnlyFile("notes");
+
+    const ette::Status<bool> kept =
+        RekeyFile(path, kKey, kNewKey, GenerateKeyId(),
+                  RekeyOldKey::kUnconfirmedKeepOriginal);
+    ASSERT_TRUE(kept.ok());
+    EXPECT_TRUE(kept.value());
+    const std::string original = path + ette::kRekeyOriginalSuffix;
+    EXPECT_TRUE(ReadFile(original) == cbc.ciphertext);
+    EXPECT_TRUE(DecryptWithDerivedKey(ReadFile(path), kNewKey,
+                                      CryptoAlgorithm::kAES256CBC)
+                    .status.ok());
+    // Again, now that it has a digest; the original isn't touched.
+    const ette::Status<bool> again = RekeyFile(
+        path, kNewKey, kKey, GenerateKeyId(), RekeyOldKey::kUnconfirmed);
+    ASSERT_TRUE(again.ok());
+    EXPECT_FALSE(again.value());
+    EXPECT_TRUE(ReadFile(original) == cbc.ciphertext);
+    std::filesystem::remove(original);
+
+    const CryptoState chacha = EncryptWithDerivedKey(
+        std::string(100000, 'x'), kKey, GenerateRandomAsciiByteVector(),
+        GenerateKeyId(), CryptoAlgorithm::kChaCha20Poly1305);
+    WriteFile(path, chacha.ciphertext);
+    const ette::Status<bool> replaced = RekeyFile(
+        path, kKey, kNewKey, GenerateKeyId(), RekeyOldKey::kUnconfirmed);
+    ASSERT_TRUE(replaced.ok());
+    EXPECT_FALSE(replaced.value());
+    ExpectOnlyFile("notes");
+    std::filesystem::remove_all(kDirectory);
+}
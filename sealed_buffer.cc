@@ -0,0 +1,125 @@
+#include "sealed_buffer.h"
+#include "aes_bitsliced.h"
+#include "secure_memory.h"
+#include "third_party/picosha2/picosha2.h"
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace ette {
+namespace {
+
+constexpr size_t kBlockSize = kAesBlockSize;
+constexpr size_t kSessionKeySize = kAes256KeySize;
+
+void FillRandom(std::random_device& random, unsigned char* data, size_t size) {
+    for (size_t i = 0; i < size; i++)
+        data[i] = static_cast<unsigned char>(random() & 0xFF);
+}
+
+std::string KeyCheck(const unsigned char* session_key) {
+    return picosha2::hash256_hex_string(session_key,
+                                        session_key + kSessionKeySize);
+}
+
+}  // namespace
+
+Status<void> SealedBuffer::Seal(const char* data, size_t size,
+                                const std::string& derived_key) {
+    if (derived_key.size() != kSessionKeySize) {
+        return Status<void>(StatusCode::kInvalidKeySize,
+                            "Key is not 256 bits");
+    }
+    Clear();
+
+    std::random_device random;
+    unsigned char session_key[kSessionKeySize];
+    FillRandom(random, session_key, sizeof(session_key));
+
+    // Every chunk gets its own counter so the chunks can be processed in any
+    // order, by any thread. CTR needs no padding, and runs 8 blocks at a time.
+    const size_t chunk_count = (size + kChunkSize - 1) / kChunkSize;
+    chunks_.resize(chunk_count);
+    for (size_t i = 0; i < chunk_count; i++) {
+        const size_t chunk_size = std::min(kChunkSize, size - i * kChunkSize);
+        FillRandom(random, chunks_[i].iv, kBlockSize);
+        chunks_[i].ciphertext.resize(chunk_size);
+    }
+
+    const Aes256 aes(session_key);
+    ParallelFor(chunk_count, 1, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++) {
+            Chunk& chunk = chunks_[i];
+            Aes256CtrXor(
+                aes, chunk.iv,
+                reinterpret_cast<const unsigned char*>(data) + i * kChunkSize,
+                chunk.ciphertext.data(), chunk.ciphertext.size());
+        }
+    });
+
+    FillRandom(random, wrapped_key_.iv, kBlockSize);
+    wrapped_key_.ciphertext.resize(kSessionKeySize);
+    const Aes256 key_wrap(
+        reinterpret_cast<const unsigned char*>(derived_key.data()));
+    Aes256CbcEncrypt(key_wrap, wrapped_key_.iv, session_key,
+                     wrapped_key_.ciphertext.data(), kSessionKeySize);
+    key_check_ = KeyCheck(session_key);
+    WipeMemory(session_key, sizeof(session_key));
+
+    plaintext_size_ = size;
+    sealed_ = true;
+    return Status<void>(StatusCode::kOk, "");
+}
+
+Status<void> SealedBuffer::Unseal(const std::string& derived_key,
+                                  std::string* out) const {
+    if (!sealed_) {
+        return Status<void>(StatusCode::kInvalidDataSize, "Nothing is sealed");
+    }
+    if (derived_key.size() != kSessionKeySize) {
+        return Status<void>(StatusCode::kInvalidKeySize,
+                            "Key is not 256 bits");
+    }
+
+    unsigned char session_key[kSessionKeySize];
+    const Aes256 key_wrap(
+        reinterpret_cast<const unsigned char*>(derived_key.data()));
+    Aes256CbcDecrypt(key_wrap, wrapped_key_.iv, wrapped_key_.ciphertext.data(),
+                     session_key, kSessionKeySize);
+    if (KeyCheck(session_key) != key_check_) {
+        WipeMemory(session_key, sizeof(session_key));
+        return Status<void>(StatusCode::kInvalidKey, "Key is incorrect");
+    }
+    const Aes256 aes(session_key);
+    WipeMemory(session_key, sizeof(session_key));
+
+    // Decrypt straight into the result.
+    std::string plaintext(plaintext_size_, '\0');
+    ParallelFor(chunks_.size(), 1, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++) {
+            const Chunk& chunk = chunks_[i];
+            Aes256CtrXor(
+                aes, chunk.iv, chunk.ciphertext.data(),
+                reinterpret_cast<unsigned char*>(&plaintext[i * kChunkSize]),
+                chunk.ciphertext.size());
+        }
+    });
+
+    WipeString(out);
+    out->swap(plaintext);
+    return Status<void>(StatusCode::kOk, "");
+}
+
+void SealedBuffer::Clear() {
+    chunks_.clear();
+    chunks_.shrink_to_fit();
+    wrapped_key_.ciphertext.clear();
+    WipeString(&key_check_);
+    plaintext_size_ = 0;
+    sealed_ = false;
+}
+
+}  // namespace ette
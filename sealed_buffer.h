@@ -0,0 +1,55 @@
+#ifndef __SEALED_BUFFER_H__
+#define __SEALED_BUFFER_H__
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+#include "status.h"
+
+namespace ette {
+
+/* Text kept in memory while the editor is locked. It is encrypted with
+ * AES-256-CTR in independent chunks under a random session key, and the
+ * session key is itself encrypted under the file's derived key, so nothing in
+ * here is readable without the password. Chunks are encrypted and decrypted
+ * in parallel on the thread pool. */
+class SealedBuffer {
+   public:
+    static constexpr size_t kChunkSize = 64 * 1024;
+
+    SealedBuffer() : plaintext_size_(0), sealed_(false) {}
+    ~SealedBuffer() { Clear(); }
+
+    SealedBuffer(const SealedBuffer&) = delete;
+    SealedBuffer& operator=(const SealedBuffer&) = delete;
+
+    /* Replace the contents with 'size' bytes of 'data'. The caller wipes its
+     * own copy. */
+    Status<void> Seal(const char* data, size_t size,
+                      const std::string& derived_key);
+
+    /* Decrypt the contents into 'out'. Fails with kInvalidKey, leaving 'out'
+     * untouched, if 'derived_key' isn't the one the text was sealed with. */
+    Status<void> Unseal(const std::string& derived_key, std::string* out) const;
+
+    bool Sealed() const { return sealed_; }
+    size_t size() const { return plaintext_size_; }
+    void Clear();
+
+   private:
+    struct Chunk {
+        unsigned char iv[16]; /* The first counter block for chunks. */
+        std::vector<unsigned char> ciphertext;
+    };
+
+    std::vector<Chunk> chunks_;
+    Chunk wrapped_key_;
+    std::string key_check_; /* SHA-256 of the session key. */
+    size_t plaintext_size_;
+    bool sealed_;
+};
+
+}  // namespace ette
+
+#endif  // __SEALED_BUFFER_H__
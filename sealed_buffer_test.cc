@@ -0,0 +1,60 @@
+#include <string>
+
+#include "sealed_buffer.h"
+
+#include "gtest/gtest.h"
+
+using ::ette::SealedBuffer;
+using ::ette::StatusCode;
+
+const std::string kKey(32, 'k');
+const std::string kOtherKey(32, 'o');
+
+std::string MakeText(size_t size) {
+    std::string text(size, '\0');
+    for (size_t i = 0; i < size; i++)
+        text[i] = static_cast<char>('a' + i * 7 % 26);
+    return text;
+}
+
+TEST(SealedBuffer, RoundTripAcrossChunkBoundaries) {
+    const size_t chunk = SealedBuffer::kChunkSize;
+    for (size_t size : {size_t(0), size_t(1), size_t(15), size_t(16),
+                        chunk - 1, chunk, chunk + 1, 3 * chunk + 17}) {
+        const std::string text = MakeText(size);
+        SealedBuffer sealed;
+        ASSERT_TRUE(sealed.Seal(text.data(), text.size(), kKey).ok());
+        EXPECT_TRUE(sealed.Sealed());
+        EXPECT_EQ(sealed.size(), size);
+
+        std::string unsealed;
+        ASSERT_TRUE(sealed.Unseal(kKey, &unsealed).ok()) << size;
+        EXPECT_EQ(unsealed, text) << size;
+    }
+}
+
+TEST(SealedBuffer, WrongKeyIsRejected) {
+    const std::string text = MakeText(1000);
+    SealedBuffer sealed;
+    ASSERT_TRUE(sealed.Seal(text.data(), text.size(), kKey).ok());
+
+    std::string unsealed = "untouched";
+    const auto status = sealed.Unseal(kOtherKey, &unsealed);
+    ASSERT_FALSE(status.ok());
+    EXPECT_EQ(status.error().code(), StatusCode::kInvalidKey);
+    EXPECT_EQ(unsealed, "untouched");
+
+    EXPECT_EQ(sealed.Seal(text.data(), text.size(), "short").error().code(),
+              StatusCode::kInvalidKeySize);
+}
+
+TEST(SealedBuffer, ClearForgetsText) {
+    const std::string text = MakeText(100);
+    SealedBuffer sealed;
+    ASSERT_TRUE(sealed.Seal(text.data(), text.size(), kKey).ok());
+    sealed.Clear();
+    EXPECT_FALSE(sealed.Sealed());
+
+    std::string unsealed;
+    EXPECT_FALSE(sealed.Unseal(kKey, &unsealed).ok());
+}
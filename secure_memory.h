@@ -0,0 +1,26 @@
+#ifndef __SECURE_MEMORY_H__
+#define __SECURE_MEMORY_H__
+
+#include <cstddef>
+#include <string>
+
+namespace ette {
+
+/* memset() to zero that the compiler can't drop, for secrets in memory that
+ * is about to be freed or reused. */
+inline void WipeMemory(void* data, size_t size) {
+    volatile unsigned char* p = static_cast<volatile unsigned char*>(data);
+    while (size--)
+        *p++ = 0;
+}
+
+/* Wipe and empty 's'. */
+inline void WipeString(std::string* s) {
+    if (!s->empty())
+        WipeMemory(&(*s)[0], s->size());
+    s->clear();
+}
+
+}  // namespace ette
+
+#endif  // __SECURE_MEMORY_H__
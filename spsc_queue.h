@@ -0,0 +1,59 @@
+#ifndef __SPSC_QUEUE_H__
+#define __SPSC_QUEUE_H__
+
+#include <atomic>
+#include <cstddef>
+
+namespace ette {
+
+/* Bounded lock-free queue for exactly one producer thread and one consumer
+ * thread. Neither side ever blocks or allocates: TryPush() fails when the
+ * queue is full and TryPop() when it is empty. Capacity must be a power of
+ * two. */
+template <typename T, size_t Capacity>
+class SpscQueue {
+    static_assert(Capacity > 0 && (Capacity & (Capacity - 1)) == 0,
+                  "Capacity must be a power of two");
+
+   public:
+    SpscQueue() : head_(0), tail_(0) {}
+
+    SpscQueue(const SpscQueue&) = delete;
+    SpscQueue& operator=(const SpscQueue&) = delete;
+
+    /* Producer side. */
+    bool TryPush(const T& value) {
+        const size_t tail = tail_.load(std::memory_order_relaxed);
+        if (tail - head_.load(std::memory_order_acquire) == Capacity)
+            return false;
+        items_[tail & (Capacity - 1)] = value;
+        tail_.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    /* Consumer side. */
+    bool TryPop(T* value) {
+        const size_t head = head_.load(std::memory_order_relaxed);
+        if (tail_.load(std::memory_order_acquire) == head)
+            return false;
+        *value = items_[head & (Capacity - 1)];
+        head_.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool Empty() const {
+        return head_.load(std::memory_order_acquire) ==
+               tail_.load(std::memory_order_acquire);
+    }
+
+   private:
+    /* Head and tail live on their own cache lines so the two threads don't
+     * keep stealing the line from each other. */
+    alignas(64) std::atomic<size_t> head_;
+    alignas(64) std::atomic<size_t> tail_;
+    alignas(64) T items_[Capacity];
+};
+
+}  // namespace ette
+
+#endif  // __SPSC_QUEUE_H__
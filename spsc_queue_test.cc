@@ -0,0 +1,49 @@
+#include <thread>
+
+#include "spsc_queue.h"
+
+#include "gtest/gtest.h"
+
+using ::ette::SpscQueue;
+
+TEST(SpscQueue, PopsInPushOrder) {
+    SpscQueue<int, 4> queue;
+    int value;
+    EXPECT_TRUE(queue.Empty());
+    EXPECT_FALSE(queue.TryPop(&value));
+
+    for (int i = 0; i < 4; i++)
+        EXPECT_TRUE(queue.TryPush(i));
+    EXPECT_FALSE(queue.TryPush(4));
+
+    for (int i = 0; i < 4; i++) {
+        ASSERT_TRUE(queue.TryPop(&value));
+        EXPECT_EQ(value, i);
+    }
+    EXPECT_TRUE(queue.Empty());
+}
+
+TEST(SpscQueue, NothingLostAcrossThreads) {
+    SpscQueue<int, 64> queue;
+    const int count = 200000;
+
+    std::thread producer([&queue] {
+        for (int i = 0; i < count; i++) {
+            while (!queue.TryPush(i))
+                std::this_thread::yield();
+        }
+    });
+
+    int expected = 0;
+    while (expected < count) {
+        int value;
+        if (!queue.TryPop(&value)) {
+            std::this_thread::yield();
+            continue;
+        }
+        ASSERT_EQ(value, expected);
+        expected++;
+    }
+    producer.join();
+    EXPECT_TRUE(queue.Empty());
+}
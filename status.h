@@ -18,6 +18,10 @@ enum class StatusCode {
     kInvalidKey,
     kInvalidDataSize,
     kInvalidIvSize,
+    kNotFound,
+    kIoError,
+    kCancelled,
+    kUnverified,
     kUnknownError,
 };
 
@@ -0,0 +1,135 @@
+#include "text_search.h"
+
+#include <regex.h>
+#include <string.h>
+#include <algorithm>
+#include <optional>
+
+namespace ette {
+
+namespace {
+/* ASCII case folding, by table so the search loop doesn't call into the
+ * locale. */
+struct FoldTable {
+    unsigned char fold[256];
+    FoldTable() {
+        for (int c = 0; c < 256; c++)
+            fold[c] = c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c;
+    }
+};
+const FoldTable kFold;
+
+unsigned char Fold(char c) {
+    return kFold.fold[static_cast<unsigned char>(c)];
+}
+
+/* Horspool's search for the folded 'pattern' in the folded text. */
+class FoldedFinder {
+   public:
+    explicit FoldedFinder(const std::string& pattern) : pattern_(pattern) {
+        for (char& c : pattern_)
+            c = Fold(c);
+        const size_t m = pattern_.size();
+        std::fill(skip_, skip_ + 256, m);
+        for (size_t i = 0; i + 1 < m; i++)
+            skip_[static_cast<unsigned char>(pattern_[i])] = m - 1 - i;
+    }
+
+    size_t Find(const char* text, size_t from, size_t size) const {
+        const size_t m = pattern_.size();
+        for (size_t i = from; i + m <= size;) {
+            size_t j = m;
+            while (j > 0 && Fold(text[i + j - 1]) ==
+                                static_cast<unsigned char>(pattern_[j - 1]))
+                j--;
+            if (j == 0)
+                return i;
+            i += skip_[Fold(text[i + m - 1])];
+        }
+        return size;
+    }
+
+   private:
+    std::string pattern_;
+    size_t skip_[256];
+};
+}  // namespace
+
+Status<TextSearch> TextSearch::Create(const std::string& pattern, bool regex,
+                                      bool ignore_case) {
+    if (pattern.empty() || pattern.find('\n') != std::string::npos)
+        return Status<TextSearch>(StatusCode::kUnknownError,
+                                  "The pattern must be one non-empty line");
+    const TextSearch search(pattern, regex, ignore_case);
+    if (regex) {
+        regex_t compiled;
+        const int error =
+            regcomp(&compiled, pattern.c_str(), search.RegexFlags());
+        if (error != 0) {
+            char message[256];
+            regerror(error, &compiled, message, sizeof(message));
+            return Status<TextSearch>(StatusCode::kUnknownError, message);
+        }
+        regfree(&compiled);
+    }
+    return search;
+}
+
+int TextSearch::RegexFlags() const {
+    /* '^', '$' and '.' work per line, as if each line was searched alone. */
+    return REG_EXTENDED | REG_NEWLINE | (ignore_case_ ? REG_ICASE : 0);
+}
+
+uint64_t TextSearch::ForEachMatchingLine(const char* text, size_t size,
+                                         const LineCallback& callback) const {
+    regex_t compiled;
+    if (regex_ && regcomp(&compiled, pattern_.c_str(), RegexFlags()) != 0)
+        return 0;
+    std::optional<FoldedFinder> folded;
+    if (!regex_ && ignore_case_)
+        folded.emplace(pattern_);
+
+    /* The offset of the next match at or after 'from', 'size' if none. */
+    auto find = [&](size_t from) -> size_t {
+        if (regex_) {
+            regmatch_t match;
+            match.rm_so = from;
+            match.rm_eo = size;
+            return regexec(&compiled, text, 1, &match, REG_STARTEND) == 0
+                       ? match.rm_so
+                       : size;
+        }
+        if (folded)
+            return folded->Find(text, from, size);
+        const void* match = memmem(text + from, size - from, pattern_.data(),
+                                   pattern_.size());
+        return match ? static_cast<const char*>(match) - text : size;
+    };
+
+    uint64_t line_number = 1, matches = 0;
+    size_t counted = 0; /* Newlines before it are in 'line_number'. */
+    size_t from = 0;    /* Always the start of a line. */
+    while (from < size) {
+        const size_t match = find(from);
+        if (match >= size)
+            break;
+        const char* newline_before = static_cast<const char*>(
+            memrchr(text + from, '\n', match - from));
+        const size_t start = newline_before ? newline_before + 1 - text : from;
+        const char* newline_after =
+            static_cast<const char*>(memchr(text + match, '\n', size - match));
+        const size_t end = newline_after ? newline_after - text : size;
+
+        line_number += std::count(text + counted, text + start, '\n');
+        counted = start;
+        callback(line_number, text + start, end - start);
+        matches++;
+        from = end + 1;
+    }
+
+    if (regex_)
+        regfree(&compiled);
+    return matches;
+}
+
+}  // namespace ette
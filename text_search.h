@@ -0,0 +1,54 @@
+#ifndef __TEXT_SEARCH_H__
+#define __TEXT_SEARCH_H__
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+
+#include "status.h"
+
+namespace ette {
+
+/* Finds the lines of a text that match a pattern, for ette-grep. The search
+ * runs over the whole text at once rather than line by line: a literal with
+ * memmem() (or a Horspool search on folded bytes when ignoring case), a
+ * regular expression (POSIX extended) with '^' and '$' matching at every
+ * line. After a match it skips to the next line, so each line is reported
+ * once.
+ *
+ * A TextSearch is a small value and its search is const and thread-safe: a
+ * regular expression is compiled for each search, since a compiled one takes
+ * a lock in regexec() and would serialize the threads sharing it. */
+class TextSearch {
+   public:
+    /* The line 'number' (from 1) spanning 'size' bytes at 'line', without
+     * its newline. */
+    using LineCallback =
+        std::function<void(uint64_t number, const char* line, size_t size)>;
+
+    /* A search for 'pattern', which must not be empty and, with 'regex',
+     * must compile. */
+    static Status<TextSearch> Create(const std::string& pattern, bool regex,
+                                     bool ignore_case);
+
+    /* Call 'callback' for each line of the 'size' bytes at 'text' that
+     * matches, in order. Returns how many did. */
+    uint64_t ForEachMatchingLine(const char* text, size_t size,
+                                 const LineCallback& callback) const;
+
+   private:
+    TextSearch(const std::string& pattern, bool regex, bool ignore_case)
+        : pattern_(pattern), regex_(regex), ignore_case_(ignore_case) {}
+
+    /* regcomp() flags. */
+    int RegexFlags() const;
+
+    std::string pattern_;
+    bool regex_;
+    bool ignore_case_;
+};
+
+}  // namespace ette
+
+#endif  // __TEXT_SEARCH_H__
@@ -0,0 +1,68 @@
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "text_search.h"
+
+#include "gtest/gtest.h"
+
+using ::ette::TextSearch;
+
+/* "number:line" for each matching line. */
+std::vector<std::string> Matches(const std::string& pattern, bool regex,
+                                 bool ignore_case, const std::string& text) {
+    auto search = TextSearch::Create(pattern, regex, ignore_case);
+    EXPECT_TRUE(search.ok());
+    std::vector<std::string> lines;
+    const uint64_t count = search.value().ForEachMatchingLine(
+        text.data(), text.size(),
+        [&](uint64_t number, const char* line, size_t size) {
+            lines.push_back(std::to_string(number) + ":" +
+                            std::string(line, size));
+        });
+    EXPECT_EQ(count, lines.size());
+    return lines;
+}
+
+const std::string kText =
+    "alpha beta\n"
+    "Gamma\n"
+    "\n"
+    "beta beta gamma\n"
+    "delta";
+
+TEST(TextSearch, Literal) {
+    EXPECT_EQ(Matches("beta", false, false, kText),
+              (std::vector<std::string>{"1:alpha beta", "4:beta beta gamma"}));
+    EXPECT_EQ(Matches("gamma", false, false, kText),
+              (std::vector<std::string>{"4:beta beta gamma"}));
+    EXPECT_EQ(Matches("GAMMA", false, true, kText),
+              (std::vector<std::string>{"2:Gamma", "4:beta beta gamma"}));
+    EXPECT_EQ(Matches("delta", false, false, kText),
+              (std::vector<std::string>{"5:delta"}));
+    EXPECT_TRUE(Matches("epsilon", false, true, kText).empty());
+    // Text may hold NUL bytes.
+    EXPECT_EQ(Matches("b", false, false, std::string("a\0b\nc", 5)),
+              (std::vector<std::string>{"1:" + std::string("a\0b", 3)}));
+}
+
+TEST(TextSearch, Regex) {
+    EXPECT_EQ(Matches("^beta", true, false, kText),
+              (std::vector<std::string>{"4:beta beta gamma"}));
+    EXPECT_EQ(Matches("a$", true, false, kText),
+              (std::vector<std::string>{"1:alpha beta", "2:Gamma",
+                                        "4:beta beta gamma", "5:delta"}));
+    EXPECT_EQ(Matches("^$", true, false, kText),
+              (std::vector<std::string>{"3:"}));
+    EXPECT_EQ(Matches("g(a|m)+A", true, true, kText),
+              (std::vector<std::string>{"2:Gamma", "4:beta beta gamma"}));
+    // '.' doesn't cross lines.
+    EXPECT_TRUE(Matches("beta.Gamma", true, false, kText).empty());
+}
+
+TEST(TextSearch, BadPatterns) {
+    EXPECT_FALSE(TextSearch::Create("", false, false).ok());
+    EXPECT_FALSE(TextSearch::Create("a\nb", false, false).ok());
+    EXPECT_FALSE(TextSearch::Create("(", true, false).ok());
+    EXPECT_TRUE(TextSearch::Create("(", false, false).ok());
+}
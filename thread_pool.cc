@@ -0,0 +1,260 @@
+#include "thread_pool.h"
+
+#include <sched.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <string>
+
+namespace ette {
+
+namespace {
+/* The pool the current thread is a worker of, and its index. */
+thread_local ThreadPool* tls_pool = nullptr;
+thread_local size_t tls_index = 0;
+
+constexpr int kInteractive = static_cast<int>(TaskPriority::kInteractive);
+constexpr int kBackground = static_cast<int>(TaskPriority::kBackground);
+
+/* CPU limit from the cgroup CPU quota, or 0 if there is none. */
+size_t GetCgroupCpuLimit() {
+    long quota = -1;
+    long period = 0;
+
+    /* cgroup v2: "<quota> <period>" or "max <period>". */
+    std::ifstream v2("/sys/fs/cgroup/cpu.max");
+    std::string quota_str;
+    if (v2 >> quota_str >> period) {
+        if (quota_str != "max")
+            quota = strtol(quota_str.c_str(), NULL, 10);
+    } else {
+        /* cgroup v1, a quota of -1 means unlimited. */
+        std::ifstream quota_file("/sys/fs/cgroup/cpu/cpu.cfs_quota_us");
+        std::ifstream period_file("/sys/fs/cgroup/cpu/cpu.cfs_period_us");
+        if (!(quota_file >> quota) || !(period_file >> period))
+            return 0;
+    }
+
+    if (quota <= 0 || period <= 0)
+        return 0;
+    return std::max<long>(1, (quota + period - 1) / period);
+}
+}  // namespace
+
+ThreadPool::ThreadPool(size_t worker_count)
+    : running_background_(0), stopping_(false) {
+    worker_count = std::max<size_t>(1, worker_count);
+    /* Keep a worker free for interactive work whenever there's more than
+     * one. With a single worker, interactive waiters run their own tasks. */
+    max_background_ = worker_count > 1 ? worker_count - 1 : 1;
+    for (int p = 0; p < kPriorityCount; p++)
+        queued_[p] = 0;
+
+    for (size_t i = 0; i < worker_count + 1; i++)
+        queues_.push_back(std::make_unique<WorkerQueues>());
+    for (size_t i = 0; i < worker_count; i++)
+        threads_.emplace_back(&ThreadPool::WorkerLoop, this, i);
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> lock(sleep_mutex_);
+        stopping_ = true;
+    }
+    wake_.notify_all();
+    for (std::thread& thread : threads_)
+        thread.join();
+}
+
+ThreadPool& ThreadPool::Global() {
+    /* Never destroyed: the editor exits with exit(), and joining workers
+     * that may be in the middle of a background task would block it. */
+    static ThreadPool* pool = new ThreadPool(DefaultWorkerCount());
+    return *pool;
+}
+
+size_t ThreadPool::DefaultWorkerCount() {
+    const char* env = getenv("ETTE_THREADS");
+    if (env != NULL && atoi(env) > 0)
+        return atoi(env);
+
+    size_t cores = std::thread::hardware_concurrency();
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set) == 0)
+        cores = CPU_COUNT(&set);
+#endif
+    const size_t cgroup_limit = GetCgroupCpuLimit();
+    if (cgroup_limit > 0)
+        cores = std::min(cores, cgroup_limit);
+    return std::max<size_t>(1, cores);
+}
+
+void ThreadPool::Submit(std::function<void()> task, TaskPriority priority) {
+    const int p = static_cast<int>(priority);
+    /* Workers push to their own deque, everybody else to the injection
+     * queue. */
+    WorkerQueues& queue =
+        tls_pool == this ? *queues_[tls_index] : *queues_.back();
+    {
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        queue.tasks[p].push_back(std::move(task));
+    }
+    queued_[p]++;
+    {
+        std::lock_guard<std::mutex> lock(sleep_mutex_);
+    }
+    wake_.notify_one();
+}
+
+bool ThreadPool::TryTake(int priority, std::function<void()>* task) {
+    if (queued_[priority].load() == 0)
+        return false;
+
+    const size_t count = queues_.size();
+    const bool is_worker = tls_pool == this;
+    const size_t self = is_worker ? tls_index : count - 1;
+
+    /* Our own deque first, newest task first for cache locality. */
+    if (is_worker) {
+        WorkerQueues& own = *queues_[self];
+        std::lock_guard<std::mutex> lock(own.mutex);
+        if (!own.tasks[priority].empty()) {
+            *task = std::move(own.tasks[priority].back());
+            own.tasks[priority].pop_back();
+            queued_[priority]--;
+            return true;
+        }
+    }
+
+    /* Then steal the oldest task of the others, injection queue included. */
+    for (size_t i = is_worker ? 1 : 0; i < count; i++) {
+        WorkerQueues& victim = *queues_[(self + i) % count];
+        std::lock_guard<std::mutex> lock(victim.mutex);
+        if (!victim.tasks[priority].empty()) {
+            *task = std::move(victim.tasks[priority].front());
+            victim.tasks[priority].pop_front();
+            queued_[priority]--;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool ThreadPool::RunPendingTask(TaskPriority lowest) {
+    std::function<void()> task;
+    for (int p = 0; p <= static_cast<int>(lowest); p++) {
+        if (TryTake(p, &task)) {
+            task();
+            return true;
+        }
+    }
+    return false;
+}
+
+void ThreadPool::WorkerLoop(size_t index) {
+    tls_pool = this;
+    tls_index = index;
+
+    /* Signals are handled by the editor threads. */
+    sigset_t all;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, NULL);
+
+    std::function<void()> task;
+    while (true) {
+        if (TryTake(kInteractive, &task)) {
+            task();
+            task = nullptr;
+            continue;
+        }
+
+        if (running_background_.fetch_add(1) < max_background_) {
+            if (TryTake(kBackground, &task)) {
+                task();
+                task = nullptr;
+                running_background_--;
+                if (queued_[kBackground].load() > 0) {
+                    std::lock_guard<std::mutex> lock(sleep_mutex_);
+                    wake_.notify_one();
+                }
+                continue;
+            }
+        }
+        running_background_--;
+
+        std::unique_lock<std::mutex> lock(sleep_mutex_);
+        wake_.wait(lock, [this] {
+            return stopping_ || queued_[kInteractive].load() > 0 ||
+                   (queued_[kBackground].load() > 0 &&
+                    running_background_.load() < max_background_);
+        });
+        if (stopping_)
+            return;
+    }
+}
+
+TaskGroup::TaskGroup(TaskPriority priority, ThreadPool& pool)
+    : pool_(pool), priority_(priority), shared_(std::make_shared<Shared>()) {}
+
+TaskGroup::~TaskGroup() {
+    Wait();
+}
+
+void TaskGroup::Run(std::function<void()> task) {
+    shared_->outstanding++;
+    std::shared_ptr<Shared> shared = shared_;
+    CancellationToken token = token_;
+    pool_.Submit(
+        [shared, token, task = std::move(task)] {
+            if (!token.IsCancelled())
+                task();
+            if (shared->outstanding.fetch_sub(1) == 1) {
+                std::lock_guard<std::mutex> lock(shared->mutex);
+                shared->done.notify_all();
+            }
+        },
+        priority_);
+}
+
+void TaskGroup::Wait() {
+    while (shared_->outstanding.load() > 0) {
+        /* Help with work of our priority or higher, never lower: an
+         * interactive waiter must not end up running a background search. */
+        if (pool_.RunPendingTask(priority_))
+            continue;
+        std::unique_lock<std::mutex> lock(shared_->mutex);
+        shared_->done.wait_for(lock, std::chrono::milliseconds(1), [this] {
+            return shared_->outstanding.load() == 0;
+        });
+    }
+}
+
+void ParallelFor(size_t count, size_t grain,
+                 const std::function<void(size_t, size_t)>& fn,
+                 TaskPriority priority) {
+    if (count == 0)
+        return;
+    ThreadPool& pool = ThreadPool::Global();
+    grain = std::max<size_t>(1, grain);
+    const size_t max_chunks = pool.WorkerCount() * 4 + 1;
+    const size_t chunks = std::min(max_chunks, (count + grain - 1) / grain);
+    if (chunks <= 1) {
+        fn(0, count);
+        return;
+    }
+
+    const size_t chunk_size = (count + chunks - 1) / chunks;
+    TaskGroup group(priority, pool);
+    for (size_t begin = chunk_size; begin < count; begin += chunk_size) {
+        const size_t end = std::min(count, begin + chunk_size);
+        group.Run([&fn, begin, end] { fn(begin, end); });
+    }
+    fn(0, std::min(count, chunk_size));
+    group.Wait();
+}
+
+}  // namespace ette
@@ -0,0 +1,127 @@
+#ifndef __THREAD_POOL_H__
+#define __THREAD_POOL_H__
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace ette {
+
+/* Interactive work (e.g. highlighting the viewport, decrypting what is about
+ * to be shown) always runs before background work (e.g. searching the whole
+ * file), and background work never occupies every worker. */
+enum class TaskPriority { kInteractive = 0, kBackground = 1 };
+
+/* Cooperative cancellation: long running tasks poll IsCancelled() and return
+ * early. Copies share the same flag. */
+class CancellationToken {
+   public:
+    CancellationToken() : flag_(std::make_shared<std::atomic<bool>>(false)) {}
+
+    bool IsCancelled() const {
+        return flag_->load(std::memory_order_relaxed);
+    }
+    void Cancel() const { flag_->store(true, std::memory_order_relaxed); }
+
+   private:
+    std::shared_ptr<std::atomic<bool>> flag_;
+};
+
+/* Work-stealing task scheduler. Every worker owns one deque per priority:
+ * it pushes and pops its own tasks at the back and steals from the front of
+ * the other workers' deques. Tasks submitted from outside the pool go to a
+ * shared injection deque that every worker steals from. */
+class ThreadPool {
+   public:
+    explicit ThreadPool(size_t worker_count);
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    /* The process-wide pool, sized with DefaultWorkerCount(). */
+    static ThreadPool& Global();
+
+    /* Usable cores: the CPU affinity mask capped by the cgroup CPU quota
+     * (v1 or v2). ETTE_THREADS overrides it. Always at least 1. */
+    static size_t DefaultWorkerCount();
+
+    size_t WorkerCount() const { return threads_.size(); }
+
+    void Submit(std::function<void()> task,
+                TaskPriority priority = TaskPriority::kBackground);
+
+    /* Run one queued task of at most 'lowest' priority on the calling thread.
+     * Returns false if there was none. Used by waiters to help out. */
+    bool RunPendingTask(TaskPriority lowest);
+
+   private:
+    static constexpr int kPriorityCount = 2;
+
+    struct WorkerQueues {
+        std::mutex mutex;
+        std::deque<std::function<void()>> tasks[kPriorityCount];
+    };
+
+    bool TryTake(int priority, std::function<void()>* task);
+    void WorkerLoop(size_t index);
+
+    /* One entry per worker plus the injection queue at the end. */
+    std::vector<std::unique_ptr<WorkerQueues>> queues_;
+    std::vector<std::thread> threads_;
+    std::atomic<size_t> queued_[kPriorityCount];
+    std::atomic<size_t> running_background_;
+    size_t max_background_;
+
+    std::mutex sleep_mutex_;
+    std::condition_variable wake_;
+    bool stopping_;
+};
+
+/* A set of tasks that can be waited for and cancelled together. Waiting
+ * threads help run queued tasks, so waiting from a worker can't deadlock and
+ * interactive work makes progress even when every worker is busy. */
+class TaskGroup {
+   public:
+    explicit TaskGroup(TaskPriority priority = TaskPriority::kBackground,
+                       ThreadPool& pool = ThreadPool::Global());
+    ~TaskGroup();
+
+    TaskGroup(const TaskGroup&) = delete;
+    TaskGroup& operator=(const TaskGroup&) = delete;
+
+    /* Tasks that haven't started when the group is cancelled are skipped. */
+    void Run(std::function<void()> task);
+    void Wait();
+    void Cancel() { token_.Cancel(); }
+
+    const CancellationToken& token() const { return token_; }
+
+   private:
+    struct Shared {
+        std::atomic<size_t> outstanding{0};
+        std::mutex mutex;
+        std::condition_variable done;
+    };
+
+    ThreadPool& pool_;
+    TaskPriority priority_;
+    CancellationToken token_;
+    std::shared_ptr<Shared> shared_;
+};
+
+/* Call fn(begin, end) over [0, count) in chunks of at least 'grain' items,
+ * on the pool and the calling thread, and wait for all of them. */
+void ParallelFor(size_t count, size_t grain,
+                 const std::function<void(size_t, size_t)>& fn,
+                 TaskPriority priority = TaskPriority::kInteractive);
+
+}  // namespace ette
+
+#endif  // __THREAD_POOL_H__
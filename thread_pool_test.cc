@@ -0,0 +1,102 @@
+#include <atomic>
+#include <chrono>
+#include <numeric>
+#include <thread>
+#include <vector>
+
+#include "thread_pool.h"
+
+#include "gtest/gtest.h"
+
+using ::ette::ParallelFor;
+using ::ette::TaskGroup;
+using ::ette::TaskPriority;
+using ::ette::ThreadPool;
+
+TEST(ThreadPool, DefaultWorkerCountIsPositive) {
+    EXPECT_GE(ThreadPool::DefaultWorkerCount(), 1u);
+}
+
+TEST(ThreadPool, RunsAllTasks) {
+    ThreadPool pool(4);
+    std::atomic<int> ran{0};
+    {
+        TaskGroup group(TaskPriority::kBackground, pool);
+        for (int i = 0; i < 1000; i++)
+            group.Run([&ran] { ran++; });
+    }
+    EXPECT_EQ(ran.load(), 1000);
+}
+
+TEST(ThreadPool, NestedTasksDoNotDeadlock) {
+    ThreadPool pool(2);
+    std::atomic<int> ran{0};
+    TaskGroup outer(TaskPriority::kInteractive, pool);
+    for (int i = 0; i < 8; i++) {
+        outer.Run([&pool, &ran] {
+            TaskGroup inner(TaskPriority::kInteractive, pool);
+            for (int j = 0; j < 8; j++)
+                inner.Run([&ran] { ran++; });
+            inner.Wait();
+        });
+    }
+    outer.Wait();
+    EXPECT_EQ(ran.load(), 64);
+}
+
+TEST(ThreadPool, CancelledTasksAreSkipped) {
+    ThreadPool pool(1);
+    std::atomic<bool> release{false};
+    std::atomic<int> ran{0};
+
+    // Occupy the only worker so the rest of the tasks stay queued.
+    TaskGroup blocker(TaskPriority::kBackground, pool);
+    blocker.Run([&release] {
+        while (!release.load())
+            std::this_thread::yield();
+    });
+
+    TaskGroup group(TaskPriority::kBackground, pool);
+    for (int i = 0; i < 100; i++)
+        group.Run([&ran] { ran++; });
+    group.Cancel();
+    release = true;
+    group.Wait();
+    blocker.Wait();
+
+    EXPECT_TRUE(group.token().IsCancelled());
+    EXPECT_LT(ran.load(), 100);
+}
+
+TEST(ThreadPool, InteractiveWorkDoesNotWaitForBackgroundWork) {
+    ThreadPool pool(2);
+    std::atomic<bool> release{false};
+
+    // A long background job on every worker it is allowed to use.
+    TaskGroup background(TaskPriority::kBackground, pool);
+    for (size_t i = 0; i < pool.WorkerCount(); i++) {
+        background.Run([&release] {
+            while (!release.load())
+                std::this_thread::yield();
+        });
+    }
+
+    std::atomic<int> ran{0};
+    TaskGroup interactive(TaskPriority::kInteractive, pool);
+    for (int i = 0; i < 10; i++)
+        interactive.Run([&ran] { ran++; });
+    interactive.Wait();
+    EXPECT_EQ(ran.load(), 10);
+
+    release = true;
+    background.Wait();
+}
+
+TEST(ThreadPool, ParallelForCoversRange) {
+    std::vector<int> values(100000, 0);
+    ParallelFor(values.size(), 1000, [&values](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++)
+            values[i] += 1;
+    });
+    EXPECT_EQ(std::accumulate(values.begin(), values.end(), 0), 100000);
+}
@@ -0,0 +1,61 @@
+#include "tool_files.h"
+
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+
+#include "constants.h"
+#include "crypto_registry.h"
+
+namespace ette {
+
+std::optional<std::string> ReadFileToString(const std::string& path) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file.is_open())
+        return std::nullopt;
+    return std::string((std::istreambuf_iterator<char>(file)),
+                       std::istreambuf_iterator<char>());
+}
+
+std::string ReadHeader(const std::string& path) {
+    std::ifstream file(path, std::ios::binary);
+    std::string header(kHeaderSize + kHeaderKeyIdSize, '\0');
+    file.read(&header[0], header.size());
+    header.resize(file ? header.size() : file.gcount());
+    return header;
+}
+
+Status<std::vector<std::string>> ListFiles(
+    const std::vector<std::string>& paths, bool recursive,
+    const std::function<bool(const std::string& name)>& wanted) {
+    std::vector<std::string> files;
+    for (const std::string& path : paths) {
+        std::error_code error;
+        if (!std::filesystem::is_directory(path, error)) {
+            files.push_back(path);
+            continue;
+        }
+        if (!recursive) {
+            return Status<std::vector<std::string>>(
+                StatusCode::kIoError, path + " is a directory (use -r)");
+        }
+        std::vector<std::string> found;
+        for (auto it = std::filesystem::recursive_directory_iterator(path,
+                                                                     error);
+             it != std::filesystem::recursive_directory_iterator();
+             it.increment(error)) {
+            const std::string name = it->path().filename().string();
+            if (it->is_regular_file(error) &&
+                CryptoAlgorithmFromFilename(name) !=
+                    CryptoAlgorithm::kDefaultNone &&
+                (!wanted || wanted(name)))
+                found.push_back(it->path().string());
+        }
+        std::sort(found.begin(), found.end());
+        files.insert(files.end(), found.begin(), found.end());
+    }
+    return files;
+}
+
+}  // namespace ette
@@ -0,0 +1,32 @@
+#ifndef __TOOL_FILES_H__
+#define __TOOL_FILES_H__
+
+#include <functional>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "status.h"
+
+namespace ette {
+
+/* Reading the files the command line tools are given. */
+
+/* The whole file at 'path', or empty if it can't be opened. */
+std::optional<std::string> ReadFileToString(const std::string& path);
+
+/* The start of the file at 'path', enough for its key ID (see
+ * GetKeyIdFromCiphertext()). */
+std::string ReadHeader(const std::string& path);
+
+/* The files named in 'paths', and with 'recursive' the files of the named
+ * directories that have the extension of an encryption algorithm (and whose
+ * name 'wanted' accepts, if given), in order. Fails if a directory is named
+ * without 'recursive'. */
+Status<std::vector<std::string>> ListFiles(
+    const std::vector<std::string>& paths, bool recursive,
+    const std::function<bool(const std::string& name)>& wanted = nullptr);
+
+}  // namespace ette
+
+#endif  // __TOOL_FILES_H__
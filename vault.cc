@@ -0,0 +1,577 @@
+#include "vault.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+
+#include "constants.h"
+#include "crypto_registry.h"
+#include "file_util.h"
+#include "secure_memory.h"
+
+namespace ette {
+
+namespace {
+constexpr char kVaultVersion[] = {'0', '0', '1'};
+static_assert(sizeof(kVaultMagicNumber) + kHeaderCryptoAlgorithmSize +
+                      sizeof(kVaultVersion) + kHeaderKeyIdSize ==
+                  kVaultHeaderSize,
+              "Vault header size");
+static_assert(8 + 8 + sizeof(kVaultTrailerMagicNumber) == kVaultTrailerSize,
+              "Vault trailer size");
+
+/* The index plaintext: an entry count (4 bytes), then for every entry the
+ * name size (2 bytes), the name, its record offset, size and modification
+ * time (8 bytes each). Little endian. */
+constexpr size_t kMaxEntryNameSize = 0xFFFF;
+constexpr size_t kIndexEntryFixedSize = 2 + 8 + 8 + 8;
+
+Status<void> Corrupt(const std::string& what) {
+    return Status<void>(StatusCode::kInvalidDataSize,
+                        "Vault is corrupt: " + what);
+}
+
+bool ReadAt(int fd, uint64_t offset, size_t size, std::string* out) {
+    out->resize(size);
+    size_t done = 0;
+    while (done < size) {
+        const ssize_t n = pread(fd, &(*out)[done], size - done, offset + done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        done += n;
+    }
+    return true;
+}
+
+bool WriteAt(int fd, uint64_t offset, const std::string& data) {
+    size_t done = 0;
+    while (done < data.size()) {
+        const ssize_t n =
+            pwrite(fd, data.data() + done, data.size() - done, offset + done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        done += n;
+    }
+    return true;
+}
+
+std::string EncodeHeader(CryptoAlgorithm algorithm, const std::string& key_id) {
+    std::string header(kVaultMagicNumber, sizeof(kVaultMagicNumber));
+    header += CryptoAlgorithmHeaderByte(algorithm);
+    header.append(kVaultVersion, sizeof(kVaultVersion));
+    header += key_id;
+    return header;
+}
+
+std::string EncodeTrailer(uint64_t index_offset, uint64_t index_size) {
+    std::string trailer;
+    AppendLe(&trailer, index_offset, 8);
+    AppendLe(&trailer, index_size, 8);
+    trailer.append(kVaultTrailerMagicNumber, sizeof(kVaultTrailerMagicNumber));
+    return trailer;
+}
+
+/* What a vault file says without the key: its header and newest index. */
+struct VaultFile {
+    CryptoAlgorithm algorithm = CryptoAlgorithm::kDefaultNone;
+    std::string key_id;
+    std::string index_record;
+    uint64_t size = 0;
+    dev_t device = 0;
+    ino_t inode = 0;
+};
+
+/* An empty file is a vault whose first save never got written. */
+Status<VaultFile> ReadVaultFile(int fd) {
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        return Status<VaultFile>(StatusCode::kIoError,
+                                 std::string("stat: ") + strerror(errno));
+    }
+    VaultFile file;
+    file.size = st.st_size;
+    file.device = st.st_dev;
+    file.inode = st.st_ino;
+    if (file.size == 0)
+        return file;
+
+    std::string header, trailer;
+    if (file.size < kVaultHeaderSize + kVaultTrailerSize ||
+        !ReadAt(fd, 0, kVaultHeaderSize, &header) ||
+        memcmp(header.data(), kVaultMagicNumber, sizeof(kVaultMagicNumber)) !=
+            0) {
+        return Status<VaultFile>(StatusCode::kHeaderNoMagicNumber,
+                                 "Not a vault");
+    }
+    file.algorithm =
+        CryptoAlgorithmFromHeaderByte(header[sizeof(kVaultMagicNumber)]);
+    if (file.algorithm == CryptoAlgorithm::kDefaultNone) {
+        return Status<VaultFile>(StatusCode::kHeaderInvalidAlgorithm,
+                                 "Unknown vault algorithm");
+    }
+    file.key_id = header.substr(kVaultHeaderSize - kHeaderKeyIdSize);
+
+    if (!ReadAt(fd, file.size - kVaultTrailerSize, kVaultTrailerSize,
+                &trailer) ||
+        memcmp(trailer.data() + 16, kVaultTrailerMagicNumber,
+               sizeof(kVaultTrailerMagicNumber)) != 0) {
+        return Status<VaultFile>(StatusCode::kInvalidDataSize,
+                                 "Vault is corrupt: no trailer");
+    }
+    const uint64_t index_offset = LoadLe(trailer.data(), 8);
+    const uint64_t index_size = LoadLe(trailer.data() + 8, 8);
+    if (index_offset < kVaultHeaderSize ||
+        index_offset > file.size - kVaultTrailerSize ||
+        index_size > file.size - kVaultTrailerSize - index_offset ||
+        !ReadAt(fd, index_offset, index_size, &file.index_record)) {
+        return Status<VaultFile>(StatusCode::kInvalidDataSize,
+                                 "Vault is corrupt: bad index position");
+    }
+    return file;
+}
+
+Status<void> DecodeIndex(const std::string& index, uint64_t file_size,
+                         std::vector<VaultEntry>* entries) {
+    entries->clear();
+    if (index.size() < 4)
+        return Corrupt("short index");
+    const uint64_t count = LoadLe(index.data(), 4);
+    size_t pos = 4;
+    for (uint64_t i = 0; i < count; i++) {
+        if (index.size() - pos < kIndexEntryFixedSize)
+            return Corrupt("short index");
+        const size_t name_size = LoadLe(index.data() + pos, 2);
+        pos += 2;
+        if (index.size() - pos < name_size + kIndexEntryFixedSize - 2)
+            return Corrupt("short index");
+        VaultEntry entry;
+        entry.name = index.substr(pos, name_size);
+        pos += name_size;
+        entry.offset = LoadLe(index.data() + pos, 8);
+        entry.size = LoadLe(index.data() + pos + 8, 8);
+        entry.modified =
+            static_cast<int64_t>(LoadLe(index.data() + pos + 16, 8));
+        pos += 24;
+        if (entry.offset < kVaultHeaderSize || entry.offset > file_size ||
+            entry.size > file_size - entry.offset) {
+            return Corrupt("entry out of bounds");
+        }
+        entries->push_back(std::move(entry));
+    }
+    std::sort(entries->begin(), entries->end(),
+              [](const VaultEntry& a, const VaultEntry& b) {
+                  return a.name < b.name;
+              });
+    return Ok();
+}
+}  // namespace
+
+bool ParseVaultSpec(const std::string& spec, std::string* vault_path,
+                    std::string* entry) {
+    const std::string marker = std::string(kVaultExtension) + ":";
+    const size_t pos = spec.find(marker);
+    if (pos == std::string::npos || pos + marker.size() == spec.size())
+        return false;
+    *vault_path = spec.substr(0, pos + marker.size() - 1);
+    *entry = spec.substr(pos + marker.size());
+    return true;
+}
+
+CryptoAlgorithm NewVaultAlgorithm(const std::string& vault_path) {
+    const CryptoAlgorithm algorithm = CryptoAlgorithmFromFilename(vault_path);
+    return algorithm == CryptoAlgorithm::kDefaultNone
+               ? CryptoAlgorithm::kChaCha20Poly1305
+               : algorithm;
+}
+
+Status<Vault> Vault::Open(const std::string& path) {
+    const int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return Status<Vault>(
+            errno == ENOENT ? StatusCode::kNotFound : StatusCode::kIoError,
+            path + ": " + strerror(errno));
+    }
+    /* Writers hold an exclusive lock until the trailer is written. */
+    flock(fd, LOCK_SH);
+    Status<VaultFile> file = ReadVaultFile(fd);
+    close(fd);
+    if (!file.ok())
+        return Status<Vault>(file.error().code(), file.error().message());
+    if (file.value().size == 0) {
+        return Status<Vault>(StatusCode::kNotFound,
+                             path + ": vault was never written");
+    }
+
+    Vault vault;
+    vault.path_ = path;
+    vault.algorithm_ = file.value().algorithm;
+    vault.key_id_ = file.value().key_id;
+    vault.index_record_ = file.value().index_record;
+    vault.file_size_ = file.value().size;
+    vault.device_ = file.value().device;
+    vault.inode_ = file.value().inode;
+    return vault;
+}
+
+Vault Vault::Create(const std::string& path, CryptoAlgorithm algorithm) {
+    Vault vault;
+    vault.path_ = path;
+    vault.algorithm_ = algorithm;
+    return vault;
+}
+
+Status<void> Vault::Unlock(const std::string& derived_key) {
+    if (index_record_.empty()) {
+        entries_.clear();
+        return Ok();
+    }
+    CryptoState index =
+        DecryptWithDerivedKey(index_record_, derived_key, algorithm_);
+    if (!index.status.ok())
+        return index.status;
+    const Status<void> status =
+        DecodeIndex(index.plaintext, file_size_, &entries_);
+    WipeString(&index.plaintext);
+    return status;
+}
+
+const VaultEntry* Vault::Find(const std::string& name) const {
+    const auto it = std::lower_bound(
+        entries_.begin(), entries_.end(), name,
+        [](const VaultEntry& entry, const std::string& n) {
+            return entry.name < n;
+        });
+    if (it == entries_.end() || it->name != name)
+        return nullptr;
+    return &*it;
+}
+
+/* Open the vault and lock it exclusively. A compaction may rename a new file
+ * over it while we wait for the lock; then the lock is on a file nobody
+ * reads anymore, so try again. */
+Status<int> Vault::LockFile(bool create) const {
+    while (true) {
+        const int fd = open(path_.c_str(),
+                            O_RDWR | O_CLOEXEC | (create ? O_CREAT : 0), 0600);
+        if (fd == -1) {
+            return Status<int>(
+                errno == ENOENT ? StatusCode::kNotFound : StatusCode::kIoError,
+                path_ + ": " + strerror(errno));
+        }
+        if (flock(fd, LOCK_EX) == -1) {
+            close(fd);
+            return Status<int>(StatusCode::kIoError,
+                               path_ + ": " + strerror(errno));
+        }
+        struct stat locked, current;
+        if (fstat(fd, &locked) == 0 && stat(path_.c_str(), &current) == 0 &&
+            locked.st_dev == current.st_dev &&
+            locked.st_ino == current.st_ino) {
+            return fd;
+        }
+        close(fd);
+    }
+}
+
+/* Reread the index from the locked 'fd', for the changes other writers
+ * made since Open(). */
+Status<void> Vault::Reload(int fd, const std::string& derived_key) {
+    Status<VaultFile> file = ReadVaultFile(fd);
+    if (!file.ok())
+        return Status<void>(file.error().code(), file.error().message());
+    if (file.value().size > 0) {
+        if (file.value().algorithm != algorithm_) {
+            return Status<void>(StatusCode::kHeaderInvalidAlgorithm,
+                                "Vault uses another algorithm");
+        }
+        if (!key_id_.empty() && file.value().key_id != key_id_) {
+            return Status<void>(StatusCode::kInvalidKey,
+                                "Vault has another key ID");
+        }
+        key_id_ = file.value().key_id;
+    }
+    index_record_ = file.value().index_record;
+    file_size_ = file.value().size;
+    device_ = file.value().device;
+    inode_ = file.value().inode;
+    return Unlock(derived_key);
+}
+
+Status<std::string> Vault::Read(const std::string& name,
+                                const std::string& derived_key) {
+    const int fd = open(path_.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return Status<std::string>(StatusCode::kIoError,
+                                   path_ + ": " + strerror(errno));
+    }
+    flock(fd, LOCK_SH);
+    struct stat st;
+    if (fstat(fd, &st) == 0 &&
+        (st.st_dev != device_ || st.st_ino != inode_ ||
+         static_cast<uint64_t>(st.st_size) != file_size_)) {
+        /* Saved to or compacted since the index was read. */
+        const Status<void> status = Reload(fd, derived_key);
+        if (!status.ok()) {
+            close(fd);
+            return Status<std::string>(status.error().code(),
+                                       status.error().message());
+        }
+    }
+
+    const VaultEntry* entry = Find(name);
+    if (entry == nullptr) {
+        close(fd);
+        return Status<std::string>(StatusCode::kNotFound,
+                                   "No entry named " + name);
+    }
+    std::string record;
+    const bool read = ReadAt(fd, entry->offset, entry->size, &record);
+    close(fd);
+    if (!read) {
+        return Status<std::string>(StatusCode::kIoError,
+                                   path_ + ": short read");
+    }
+
+    CryptoState state =
+        DecryptWithDerivedKey(record, derived_key, algorithm_);
+    if (!state.status.ok()) {
+        return Status<std::string>(state.status.error().code(),
+                                   state.status.error().message());
+    }
+    return std::move(state.plaintext);
+}
+
+std::string Vault::EncodeIndex() const {
+    std::string index;
+    AppendLe(&index, entries_.size(), 4);
+    for (const VaultEntry& entry : entries_) {
+        AppendLe(&index, entry.name.size(), 2);
+        index += entry.name;
+        AppendLe(&index, entry.offset, 8);
+        AppendLe(&index, entry.size, 8);
+        AppendLe(&index, static_cast<uint64_t>(entry.modified), 8);
+    }
+    return index;
+}
+
+/* Write 'record' (if any), the index of 'entries_' and the trailer at the
+ * end of the locked 'fd' in a single write. On failure the file is cut back
+ * to its old size. */
+Status<void> Vault::Append(int fd, const std::string& record,
+                           const std::string& derived_key) {
+    std::string data;
+    if (file_size_ == 0)
+        data = EncodeHeader(algorithm_, key_id_);
+    const uint64_t base = file_size_ + data.size();
+    data += record;
+
+    std::string index = EncodeIndex();
+    const CryptoState index_state = EncryptWithDerivedKey(
+        index, derived_key, GenerateRandomAsciiByteVector(), key_id_,
+        algorithm_);
+    WipeString(&index);
+    if (!index_state.status.ok())
+        return index_state.status;
+    const uint64_t index_offset = base + record.size();
+    data += index_state.ciphertext;
+    data += EncodeTrailer(index_offset, index_state.ciphertext.size());
+
+    if (!WriteAt(fd, file_size_, data) || fsync(fd) == -1) {
+        const Status<void> error = IoError(path_);
+        if (ftruncate(fd, file_size_) == -1) {
+            /* The partial record has no valid trailer after it, so the vault
+             * can't be opened again until it is cut back by hand. */
+            return Status<void>(
+                StatusCode::kIoError,
+                error.error().message() + "; cutting it back to " +
+                    std::to_string(file_size_) +
+                    " bytes failed too: " + strerror(errno));
+        }
+        return error;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == 0) {
+        device_ = st.st_dev;
+        inode_ = st.st_ino;
+    }
+    file_size_ += data.size();
+    index_record_ = index_state.ciphertext;
+    return Ok();
+}
+
+Status<void> Vault::WriteRecord(const std::string& name,
+                                const std::string& record,
+                                const std::string& derived_key) {
+    if (name.empty() || name.size() > kMaxEntryNameSize) {
+        return Status<void>(StatusCode::kInvalidDataSize,
+                            "Entry names are 1 to 65535 bytes");
+    }
+    if (record.size() <= sizeof(kHeaderMagicNumber) ||
+        CryptoAlgorithmFromHeaderByte(record[sizeof(kHeaderMagicNumber)]) !=
+            algorithm_) {
+        return Status<void>(StatusCode::kHeaderInvalidAlgorithm,
+                            "Record is not in the vault's algorithm");
+    }
+    const std::string record_key_id = GetKeyIdFromCiphertext(record);
+    if (record_key_id.empty() ||
+        (!key_id_.empty() && record_key_id != key_id_)) {
+        return Status<void>(StatusCode::kInvalidKey,
+                            "Record is not under the vault's key ID");
+    }
+
+    const Status<int> fd = LockFile(true);
+    if (!fd.ok())
+        return Status<void>(fd.error().code(), fd.error().message());
+    Status<void> status = Reload(*fd, derived_key);
+    if (status.ok() && key_id_.empty())
+        key_id_ = record_key_id; /* The first record of a new vault. */
+    if (status.ok() && record_key_id != key_id_) {
+        status = Status<void>(StatusCode::kInvalidKey,
+                              "Record is not under the vault's key ID");
+    }
+    if (!status.ok()) {
+        close(*fd);
+        return status;
+    }
+
+    const std::vector<VaultEntry> old_entries = entries_;
+    VaultEntry entry;
+    entry.name = name;
+    entry.offset = file_size_ == 0 ? kVaultHeaderSize : file_size_;
+    entry.size = record.size();
+    entry.modified = time(NULL);
+    auto it = std::lower_bound(entries_.begin(), entries_.end(), entry,
+                               [](const VaultEntry& a, const VaultEntry& b) {
+                                   return a.name < b.name;
+                               });
+    if (it != entries_.end() && it->name == name)
+        *it = entry;
+    else
+        entries_.insert(it, entry);
+
+    status = Append(*fd, record, derived_key);
+    if (!status.ok())
+        entries_ = old_entries;
+    close(*fd);
+    return status;
+}
+
+Status<void> Vault::Write(const std::string& name, const std::string& text,
+                         const std::string& derived_key) {
+    if (key_id_.empty())
+        key_id_ = GenerateKeyId();
+    CryptoState state = EncryptWithDerivedKey(
+        text, derived_key, GenerateRandomAsciiByteVector(), key_id_,
+        algorithm_);
+    WipeString(&state.plaintext);
+    if (!state.status.ok())
+        return state.status;
+    return WriteRecord(name, state.ciphertext, derived_key);
+}
+
+Status<void> Vault::Remove(const std::string& name,
+                           const std::string& derived_key) {
+    const Status<int> fd = LockFile(false);
+    if (!fd.ok())
+        return Status<void>(fd.error().code(), fd.error().message());
+    Status<void> status = Reload(*fd, derived_key);
+    if (status.ok() && Find(name) == nullptr) {
+        status =
+            Status<void>(StatusCode::kNotFound, "No entry named " + name);
+    }
+    if (status.ok()) {
+        const std::vector<VaultEntry> old_entries = entries_;
+        entries_.erase(entries_.begin() + (Find(name) - entries_.data()));
+        status = Append(*fd, "", derived_key);
+        if (!status.ok())
+            entries_ = old_entries;
+    }
+    close(*fd);
+    return status;
+}
+
+uint64_t Vault::GarbageBytes() const {
+    if (file_size_ == 0)
+        return 0;
+    uint64_t live = kVaultHeaderSize + index_record_.size() + kVaultTrailerSize;
+    for (const VaultEntry& entry : entries_)
+        live += entry.size;
+    return file_size_ > live ? file_size_ - live : 0;
+}
+
+bool Vault::NeedsCompaction() const {
+    const uint64_t garbage = GarbageBytes();
+    return garbage >= kVaultMinGarbageToCompact && garbage * 2 > file_size_;
+}
+
+Status<void> Vault::Compact(const std::string& derived_key) {
+    const Status<int> fd = LockFile(false);
+    if (!fd.ok())
+        return Status<void>(fd.error().code(), fd.error().message());
+    Status<void> status = Reload(*fd, derived_key);
+    if (!status.ok() || GarbageBytes() == 0) {
+        close(*fd);
+        return status;
+    }
+
+    struct stat st;
+    const mode_t mode = fstat(*fd, &st) == 0 ? (st.st_mode & 0777) : 0600;
+    const std::string temp_path = path_ + ".compact";
+    const int temp_fd =
+        open(temp_path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, mode);
+    if (temp_fd == -1) {
+        status = IoError(temp_path);
+        close(*fd);
+        return status;
+    }
+
+    /* Copy the newest records back to back, then write the index for their
+     * new offsets the way a save would. */
+    const std::vector<VaultEntry> old_entries = entries_;
+    const uint64_t old_size = file_size_;
+    const std::string old_index_record = index_record_;
+    const dev_t old_device = device_;
+    const ino_t old_inode = inode_;
+    std::string record;
+    uint64_t offset = kVaultHeaderSize;
+    bool copied = WriteAt(temp_fd, 0, EncodeHeader(algorithm_, key_id_));
+    for (VaultEntry& entry : entries_) {
+        if (!copied)
+            break;
+        copied = ReadAt(*fd, entry.offset, entry.size, &record) &&
+                 WriteAt(temp_fd, offset, record);
+        entry.offset = offset;
+        offset += entry.size;
+    }
+    if (copied) {
+        file_size_ = offset;
+        status = Append(temp_fd, "", derived_key);
+    } else {
+        status = IoError(temp_path);
+    }
+    close(temp_fd);
+    if (status.ok() && rename(temp_path.c_str(), path_.c_str()) == -1)
+        status = IoError(path_);
+
+    if (!status.ok()) {
+        unlink(temp_path.c_str());
+        entries_ = old_entries;
+        file_size_ = old_size;
+        index_record_ = old_index_record;
+        device_ = old_device;
+        inode_ = old_inode;
+    }
+    close(*fd);
+    return status;
+}
+
+}  // namespace ette
@@ -0,0 +1,147 @@
+#ifndef __VAULT_H__
+#define __VAULT_H__
+
+#include <sys/types.h>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "crypto.h"
+#include "status.h"
+
+namespace ette {
+
+/* A vault is one file holding many encrypted documents ("entries"), opened
+ * in ette as "<name>.ettevault:<entry>". Every record in it is an ordinary
+ * encrypted file under the vault's key, with a random IV of its own (from
+ * GenerateRandomAsciiByteVector(), never a counter or a seeded generator:
+ * a vault saved for years holds a great many records under the one key):
+ *
+ *   vault header     kVaultHeaderSize bytes, see below
+ *   records          entry versions and indexes, in the order they were saved
+ *   trailer          kVaultTrailerSize bytes: where the newest index is
+ *
+ * The index maps entry names to the offset and size of their newest record.
+ * Saving appends the new record, a new index and a new trailer, so the
+ * records already written never change; Compact() drops the versions and
+ * indexes nothing points to anymore.
+ *
+ * Vault header:
+ * 4 bytes:  magic number (ETTV)
+ * 1 byte:   crypto algorithm, as in the file header
+ * 3 bytes:  encoded version
+ * 16 bytes: key ID of every record
+ *
+ * Trailer:
+ * 8 bytes:  offset of the newest index record
+ * 8 bytes:  its size
+ * 4 bytes:  magic number (ETVI) */
+
+static constexpr char kVaultExtension[] = ".ettevault";
+static constexpr char kVaultMagicNumber[] = {0x45, 0x54, 0x54, 0x56};  // ETTV
+static constexpr char kVaultTrailerMagicNumber[] = {0x45, 0x54, 0x56,
+                                                    0x49};  // ETVI
+static constexpr uint64_t kVaultHeaderSize = 24;
+static constexpr uint64_t kVaultTrailerSize = 20;
+
+/* Appending leaves the old versions behind; they are compacted away once
+ * they outweigh the live records and this many bytes. */
+static constexpr uint64_t kVaultMinGarbageToCompact = 64 * 1024;
+
+struct VaultEntry {
+    std::string name;
+    uint64_t offset; /* Of the newest record, from the start of the vault. */
+    uint64_t size;
+    int64_t modified; /* Unix time of the save. */
+};
+
+/* Splits "<vault>.ettevault:<entry>" at the colon after the extension.
+ * False for anything else, including an empty entry name. */
+bool ParseVaultSpec(const std::string& spec, std::string* vault_path,
+                    std::string* entry);
+
+/* The algorithm of a new vault: the one its name has the extension of (as in
+ * "notes.aes256cbc.ettevault"), else ChaCha20-Poly1305, which also
+ * authenticates the index. */
+CryptoAlgorithm NewVaultAlgorithm(const std::string& vault_path);
+
+/* The index is read when the vault is opened and decrypted by Unlock():
+ * from then on listing entries takes no disk reads and reading one takes a
+ * single read of its record. Writers take an exclusive lock on the file and
+ * reread the index first, so several editors (and Compact()) can share a
+ * vault without losing each other's saves. */
+class Vault {
+   public:
+    /* The header, the trailer and the encrypted index: three reads. */
+    static Status<Vault> Open(const std::string& path);
+
+    /* A vault nothing is written to until the first Write(). Its key ID is
+     * that of its first record. */
+    static Vault Create(const std::string& path, CryptoAlgorithm algorithm);
+
+    const std::string& path() const { return path_; }
+    CryptoAlgorithm algorithm() const { return algorithm_; }
+    const std::string& key_id() const { return key_id_; }
+
+    /* The encrypted index, to check a password against (or look its key ID
+     * up in ette-agent) before Unlock(). Empty for a new vault. */
+    const std::string& IndexRecord() const { return index_record_; }
+
+    /* Decrypt the index. Fails with kInvalidKey for the wrong key. */
+    Status<void> Unlock(const std::string& derived_key);
+
+    /* Sorted by name. Empty until Unlock(). */
+    const std::vector<VaultEntry>& Entries() const { return entries_; }
+    const VaultEntry* Find(const std::string& name) const;
+
+    /* The text of entry 'name', kNotFound if there is none. The index is
+     * read again first if someone else saved to the vault since. */
+    Status<std::string> Read(const std::string& name,
+                             const std::string& derived_key);
+
+    /* Append 'record', an EncryptWithDerivedKey() ciphertext under this
+     * vault's key, algorithm and key ID, as the newest version of 'name'. */
+    Status<void> WriteRecord(const std::string& name, const std::string& record,
+                             const std::string& derived_key);
+
+    /* Encrypt 'text' and WriteRecord() it. */
+    Status<void> Write(const std::string& name, const std::string& text,
+                       const std::string& derived_key);
+
+    Status<void> Remove(const std::string& name,
+                        const std::string& derived_key);
+
+    /* Bytes of old versions and indexes nothing points to anymore. */
+    uint64_t GarbageBytes() const;
+    bool NeedsCompaction() const;
+
+    /* Rewrite the vault with only the newest record of every entry, into a
+     * temporary file renamed over the vault. Records are copied as they
+     * are, not decrypted. */
+    Status<void> Compact(const std::string& derived_key);
+
+   private:
+    Vault() = default;
+
+    Status<int> LockFile(bool create) const;
+    Status<void> Reload(int fd, const std::string& derived_key);
+    Status<void> Append(int fd, const std::string& record,
+                        const std::string& derived_key);
+    std::string EncodeIndex() const;
+
+    std::string path_;
+    CryptoAlgorithm algorithm_{CryptoAlgorithm::kDefaultNone};
+    std::string key_id_;
+    std::string index_record_;
+    std::vector<VaultEntry> entries_;
+    uint64_t file_size_{0};
+    /* The file the index was read from; a compaction replaces it and a save
+     * grows it. */
+    dev_t device_{0};
+    ino_t inode_{0};
+};
+
+}  // namespace ette
+
+#endif  // __VAULT_H__
@@ -0,0 +1,169 @@
+#include <stdio.h>
+#include <sys/stat.h>
+#include <fstream>
+#include <set>
+#include <sstream>
+#include <string>
+
+#include "chacha20_poly1305.h"
+#include "constants.h"
+#include "crypto.h"
+#include "vault.h"
+
+#include "gtest/gtest.h"
+
+using ::ette::CryptoAlgorithm;
+using ::ette::DeriveKey;
+using ::ette::ParseVaultSpec;
+using ::ette::StatusCode;
+using ::ette::Vault;
+
+const std::string kKey = DeriveKey("test");
+const std::string kOtherKey = DeriveKey("nope");
+
+uint64_t FileSize(const std::string& path) {
+    struct stat st;
+    return stat(path.c_str(), &st) == 0 ? st.st_size : 0;
+}
+
+TEST(Vault, ParseVaultSpec) {
+    std::string path, entry;
+    ASSERT_TRUE(ParseVaultSpec("/tmp/notes.ettevault:todo", &path, &entry));
+    EXPECT_EQ(path, "/tmp/notes.ettevault");
+    EXPECT_EQ(entry, "todo");
+    ASSERT_TRUE(ParseVaultSpec("a.ettevault:b:c", &path, &entry));
+    EXPECT_EQ(entry, "b:c");
+    EXPECT_FALSE(ParseVaultSpec("notes.ettevault:", &path, &entry));
+    EXPECT_FALSE(ParseVaultSpec("notes.ettevault", &path, &entry));
+    EXPECT_FALSE(ParseVaultSpec("notes.chacha20", &path, &entry));
+}
+
+TEST(Vault, EntriesRoundTripThroughReopen) {
+    const std::string path = "/tmp/Vault_RoundTrip.ettevault";
+    remove(path.c_str());
+
+    for (CryptoAlgorithm algorithm : {CryptoAlgorithm::kChaCha20Poly1305,
+                                      CryptoAlgorithm::kAES256CBC}) {
+        remove(path.c_str());
+        Vault vault = Vault::Create(path, algorithm);
+        ASSERT_TRUE(vault.Write("b", "second\n", kKey).ok());
+        ASSERT_TRUE(vault.Write("a", "first\n", kKey).ok());
+        ASSERT_TRUE(vault.Write("empty", "", kKey).ok());
+
+        auto reopened = Vault::Open(path);
+        ASSERT_TRUE(reopened.ok());
+        Vault other = *reopened;
+        EXPECT_EQ(other.algorithm(), algorithm);
+        EXPECT_EQ(other.key_id(), vault.key_id());
+        EXPECT_TRUE(other.Entries().empty());
+        EXPECT_EQ(other.Unlock(kOtherKey).error().code(),
+                  StatusCode::kInvalidKey);
+        ASSERT_TRUE(other.Unlock(kKey).ok());
+        ASSERT_EQ(other.Entries().size(), 3u);
+        EXPECT_EQ(other.Entries()[0].name, "a");
+        EXPECT_EQ(other.Entries()[1].name, "b");
+
+        EXPECT_EQ(*other.Read("a", kKey), "first\n");
+        EXPECT_EQ(*other.Read("b", kKey), "second\n");
+        EXPECT_EQ(*other.Read("empty", kKey), "");
+        EXPECT_EQ(other.Read("c", kKey).error().code(), StatusCode::kNotFound);
+    }
+    remove(path.c_str());
+}
+
+// A second writer rereads the index, so neither loses the other's entries.
+TEST(Vault, WritersShareTheVault) {
+    const std::string path = "/tmp/Vault_Writers.ettevault";
+    remove(path.c_str());
+    Vault first = Vault::Create(path, CryptoAlgorithm::kChaCha20Poly1305);
+    ASSERT_TRUE(first.Write("one", "1", kKey).ok());
+
+    Vault second = *Vault::Open(path);
+    ASSERT_TRUE(second.Unlock(kKey).ok());
+    ASSERT_TRUE(second.Write("two", "2", kKey).ok());
+    ASSERT_TRUE(first.Write("one", "1 again", kKey).ok());
+    EXPECT_EQ(first.Entries().size(), 2u);
+
+    EXPECT_EQ(*second.Read("one", kKey), "1 again");
+    EXPECT_EQ(*first.Read("two", kKey), "2");
+
+    ASSERT_TRUE(first.Remove("two", kKey).ok());
+    EXPECT_EQ(first.Remove("two", kKey).error().code(), StatusCode::kNotFound);
+    Vault third = *Vault::Open(path);
+    ASSERT_TRUE(third.Unlock(kKey).ok());
+    ASSERT_EQ(third.Entries().size(), 1u);
+    EXPECT_EQ(third.Entries()[0].name, "one");
+
+    // A vault only takes records under its own key ID.
+    Vault stranger = Vault::Create(path, CryptoAlgorithm::kChaCha20Poly1305);
+    EXPECT_FALSE(stranger.Write("three", "3", kKey).ok());
+    remove(path.c_str());
+}
+
+// Every save encrypts an entry and a whole index under the vault's one key,
+// so each record must draw an IV of its own, never sharing the entry's with
+// the index or reusing one from an earlier save. (That the draws themselves
+// don't repeat is Crypto.ChaCha20Poly1305_NoncesDontRepeat.)
+TEST(Vault, EveryRecordDrawsItsOwnNonce) {
+    const std::string path = "/tmp/Vault_Nonces.ettevault";
+    remove(path.c_str());
+    Vault vault = Vault::Create(path, CryptoAlgorithm::kChaCha20Poly1305);
+    constexpr size_t kIvOffset = sizeof(ette::kHeaderMagicNumber) +
+                                 ette::kHeaderCryptoAlgorithmSize +
+                                 ette::kHeaderVersionSize +
+                                 ette::kHeaderPlaintextSize;
+    std::set<std::string> nonces;
+    for (int i = 0; i < 50; i++) {
+        ASSERT_TRUE(vault.Write("entry", std::to_string(i), kKey).ok());
+        std::stringstream file;
+        file << std::ifstream(path, std::ios::binary).rdbuf();
+        const std::string data = file.str();
+
+        // The entry's newest record, and the index the trailer points to.
+        const char* trailer = &data[data.size() - ette::kVaultTrailerSize];
+        uint64_t index_offset = 0;
+        for (int b = 7; b >= 0; b--)
+            index_offset = index_offset << 8 | (unsigned char)trailer[b];
+        for (uint64_t offset : {vault.Find("entry")->offset, index_offset}) {
+            const std::string nonce =
+                data.substr(offset + kIvOffset, ette::kChaCha20NonceSize);
+            EXPECT_TRUE(nonces.insert(nonce).second) << i;
+        }
+    }
+    EXPECT_EQ(nonces.size(), 100u);
+    remove(path.c_str());
+}
+
+TEST(Vault, CompactionKeepsOnlyNewestVersions) {
+    const std::string path = "/tmp/Vault_Compact.ettevault";
+    remove(path.c_str());
+    Vault vault = Vault::Create(path, CryptoAlgorithm::kChaCha20Poly1305);
+    const std::string big(10000, 'x');
+    ASSERT_TRUE(vault.Write("kept", "kept", kKey).ok());
+    for (int i = 0; i < 20; i++)
+        ASSERT_TRUE(vault.Write("edited", big + std::to_string(i), kKey).ok());
+    EXPECT_TRUE(vault.NeedsCompaction());
+    const uint64_t before = FileSize(path);
+
+    // A reader that opened the vault before the compaction.
+    Vault reader = *Vault::Open(path);
+    ASSERT_TRUE(reader.Unlock(kKey).ok());
+
+    ASSERT_TRUE(vault.Compact(kKey).ok());
+    EXPECT_EQ(vault.GarbageBytes(), 0u);
+    EXPECT_FALSE(vault.NeedsCompaction());
+    EXPECT_LT(FileSize(path), before / 10);
+    EXPECT_EQ(FileSize(path + ".compact"), 0u);
+
+    EXPECT_EQ(*vault.Read("edited", kKey), big + "19");
+    EXPECT_EQ(*reader.Read("edited", kKey), big + "19");
+    EXPECT_EQ(*reader.Read("kept", kKey), "kept");
+
+    // Writers that opened it before go on appending to the new file.
+    ASSERT_TRUE(reader.Write("after", "after", kKey).ok());
+    Vault reopened = *Vault::Open(path);
+    ASSERT_TRUE(reopened.Unlock(kKey).ok());
+    EXPECT_EQ(reopened.Entries().size(), 3u);
+    EXPECT_EQ(*reopened.Read("kept", kKey), "kept");
+    remove(path.c_str());
+}